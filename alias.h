@@ -0,0 +1,24 @@
+/**
+ * Contains the definition of the alias_t struct.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+
+
+/**
+ * An alias, split into words when it's defined so that expanding it is only
+ * a matter of splicing the words into a command.
+ */
+struct alias_t {
+  /**
+   * The value the alias was defined with, as alias lists it.
+   */
+  std::string value;
+
+  /**
+   * The value split into words.
+   */
+  std::vector<std::string> words;
+};
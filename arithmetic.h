@@ -0,0 +1,115 @@
+/**
+ * Contains the definition of the arith_expr_t struct, the pre-parsed form of
+ * an arithmetic expansion ($(( expr ))).
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+
+
+/**
+ * Enum representing the operations that can appear in an arithmetic
+ * expression.
+ */
+enum ArithOp {
+  // operands
+  ARITH_NUMBER,
+  ARITH_VARIABLE,
+
+  // unary operators
+  ARITH_NEGATE,
+  ARITH_UNARY_PLUS,
+  ARITH_NOT,
+  ARITH_COMPLEMENT,
+  ARITH_PRE_INCREMENT,
+  ARITH_PRE_DECREMENT,
+  ARITH_POST_INCREMENT,
+  ARITH_POST_DECREMENT,
+
+  // binary operators
+  ARITH_POWER,
+  ARITH_MULTIPLY,
+  ARITH_DIVIDE,
+  ARITH_MODULO,
+  ARITH_ADD,
+  ARITH_SUBTRACT,
+  ARITH_SHIFT_LEFT,
+  ARITH_SHIFT_RIGHT,
+  ARITH_LESS,
+  ARITH_LESS_EQUAL,
+  ARITH_GREATER,
+  ARITH_GREATER_EQUAL,
+  ARITH_EQUAL,
+  ARITH_NOT_EQUAL,
+  ARITH_BIT_AND,
+  ARITH_BIT_XOR,
+  ARITH_BIT_OR,
+  ARITH_LOGICAL_AND,
+  ARITH_LOGICAL_OR,
+
+  // everything else
+  ARITH_CONDITIONAL,
+  ARITH_ASSIGN,
+  ARITH_COMMA
+};
+
+
+/**
+ * A single node of a parsed arithmetic expression. Children are referred to
+ * by their index in arith_expr_t::nodes.
+ */
+struct arith_node_t {
+  /**
+   * The operation this node performs.
+   */
+  ArithOp op;
+
+  /**
+   * For ARITH_ASSIGN, the binary operation applied before storing the result
+   * (e.g. ARITH_ADD for +=), or ARITH_ASSIGN for a plain '='.
+   */
+  ArithOp assign_op;
+
+  /**
+   * The value of an ARITH_NUMBER.
+   */
+  long value;
+
+  /**
+   * The variable read or written by ARITH_VARIABLE, ARITH_ASSIGN and the
+   * increment/decrement operators.
+   */
+  std::string name;
+
+  /**
+   * The operands, or -1 if unused.
+   */
+  int left;
+  int right;
+  int third;
+
+  /**
+   * Constructor.
+   */
+  arith_node_t(ArithOp op)
+    : op(op), assign_op(op), value(0), left(-1), right(-1), third(-1) {}
+};
+
+
+/**
+ * A parsed arithmetic expression. Evaluating one reads and writes variables
+ * by name but never allocates nodes, so cached expressions can be evaluated
+ * repeatedly (e.g. in a loop) at little cost.
+ */
+struct arith_expr_t {
+  /**
+   * All of the expression's nodes.
+   */
+  std::vector<arith_node_t> nodes;
+
+  /**
+   * The index of the root node.
+   */
+  int root;
+};
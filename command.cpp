@@ -11,26 +11,39 @@
 using namespace std;
 
 
-bool Shell::partition_tokens(vector<string> tokens, vector<command_t>& commands) {
-  vector<string> delims = { "|", "<", ">", ">>" };
-  // declare these once at the beginning
-  const vector<string>::iterator begin = delims.begin();
-  const vector<string>::iterator end = delims.end();
+/**
+ * Returns whether a token is a redirection that is followed by a file name.
+ */
+bool is_file_redirect(const string& token) {
+  return token == "<" || token == ">" || token == ">>" || token == ">|" ||
+         token == "2>" || token == "2>>" || token == "&>";
+}
+
+
+/**
+ * Returns whether a token is a pipe or a redirection.
+ */
+bool is_redirect_or_pipe(const string& token) {
+  return token == "|" || token == "2>&1" || is_file_redirect(token);
+}
+
 
+bool Shell::partition_tokens(vector<string> tokens, vector<command_t>& commands) {
   // check for delimeters at the beginning of the command
-  if (find(begin, end, tokens[0]) != end) {
+  if (is_redirect_or_pipe(tokens[0])) {
     cerr << "Pipe or redirect at beginning of command" << endl;
     return false;
   }
-  // check for delimeters at the end of the command
-  if (find(begin, end, tokens[tokens.size()-1]) != end) {
+  // check for delimeters at the end of the command (2>&1 needs no file)
+  if (tokens.back() == "|" || is_file_redirect(tokens.back())) {
     cerr << "Pipe or redirect at end of command" << endl;
     return false;
   }
 
   // check for multiple delimeters next to each other
   for (unsigned int i = 0; i < tokens.size()-1; i++) {
-    if ((find(begin, end, tokens[i]) != end) && (find(begin, end, tokens[i+1]) != end)) {
+    if ((tokens[i] == "|" || is_file_redirect(tokens[i])) &&
+        is_redirect_or_pipe(tokens[i+1])) {
       cerr << "Two pipes or redirects in a row" << endl;
       return false;
     }
@@ -39,10 +52,10 @@ bool Shell::partition_tokens(vector<string> tokens, vector<command_t>& commands)
   // create temporaty command to use for all commands in the tokens vector
   command_t cmd;
   for (unsigned int i = 0; i < tokens.size(); i++) {
-    if (find(begin, end, tokens[i]) == end) {
-      // if it's not |, <, >, or >>, add it to a new command
+    if (!is_redirect_or_pipe(tokens[i])) {
+      // if it's not a pipe or a redirect, add it to a new command
       cmd.argv.push_back(tokens[i]);
-    } else if (tokens[i] == delims[0]) { // found a pipe `|`
+    } else if (tokens[i] == "|") { // found a pipe `|`
       if (cmd.output_type != OutputType::WRITE_TO_STDOUT) { // already have an output
         cerr << "Too many outputs" << endl;
         return false;
@@ -51,22 +64,43 @@ bool Shell::partition_tokens(vector<string> tokens, vector<command_t>& commands)
       commands.push_back(cmd);                       // add command to vector of commands
       cmd = command_t();                             // set cmd back to default
       cmd.input_type = InputType::READ_FROM_PIPE;    // set input based on pipe
-    } else if (tokens[i] == delims[1]) { // found an input file `<`
+    } else if (tokens[i] == "<") { // found an input file `<`
       if (cmd.input_type != InputType::READ_FROM_STDIN) { // already have an input
         cerr << "Too many inputs" << endl;
         return false;
       }
       cmd.input_type = InputType::READ_FROM_FILE;    // set input to read from file
       cmd.infile = tokens[++i];                      // set input file and skip next token
+    } else if (tokens[i] == ">|") { // found a fan-out sink `>|`
+      cmd.sinks.push_back(tokens[++i]);             // copy the output there too
+    } else if (tokens[i] == "2>" || tokens[i] == "2>>" || tokens[i] == "2>&1") {
+      if (cmd.error_type != ErrorType::WRITE_ERR_TO_STDERR) { // already have an error output
+        cerr << "Too many error outputs" << endl;
+        return false;
+      }
+      if (tokens[i] == "2>&1") {    // found error output to output `2>&1`
+        cmd.error_type = ErrorType::WRITE_ERR_TO_OUTPUT;
+      } else {                      // found error output to file `2>` or `2>>`
+        cmd.error_type = tokens[i] == "2>" ? ErrorType::WRITE_ERR_TO_FILE
+                                           : ErrorType::APPEND_ERR_TO_FILE;
+        cmd.errfile = tokens[++i];  // set error file and skip next token
+      }
     } else { // writing or appending to file
       if (cmd.output_type != OutputType::WRITE_TO_STDOUT) { // already have an output
         cout << "Too many output files" << endl;
         return false;
       }
-      if (tokens[i] == delims[2]) { // found output to file `>`
-        cmd.output_type = OutputType::WRITE_TO_FILE;  // set output to write to file
-      } else {                      // found append to file `>>`
+      if (tokens[i] == ">>") {      // found append to file `>>`
         cmd.output_type = OutputType::APPEND_TO_FILE; // set output to append to file
+      } else {                      // found output to file `>` or `&>`
+        cmd.output_type = OutputType::WRITE_TO_FILE;  // set output to write to file
+      }
+      if (tokens[i] == "&>") {      // `&>` also sends the error output there
+        if (cmd.error_type != ErrorType::WRITE_ERR_TO_STDERR) {
+          cerr << "Too many error outputs" << endl;
+          return false;
+        }
+        cmd.error_type = ErrorType::WRITE_ERR_TO_OUTPUT;
       }
       cmd.outfile = tokens[++i];                      // set output file and skip next token
     }
@@ -96,13 +130,25 @@ const char* output_types[] = {
 };
 
 
+const char* error_types[] = {
+  "WRITE_ERR_TO_STDERR",
+  "WRITE_ERR_TO_FILE",
+  "APPEND_ERR_TO_FILE",
+  "WRITE_ERR_TO_OUTPUT"
+};
+
+
 ostream& operator <<(ostream& out, const command_t& cmd) {
   copy(cmd.argv.begin(), cmd.argv.end(), ostream_iterator<string>(out, " "));
 
   out << "\n    input:   " << input_types[cmd.input_type]
       << "\n    output:  " << output_types[cmd.output_type]
+      << "\n    error:   " << error_types[cmd.error_type]
       << "\n    infile:  " << cmd.infile
-      << "\n    outfile: " << cmd.outfile;
+      << "\n    outfile: " << cmd.outfile
+      << "\n    errfile: " << cmd.errfile
+      << "\n    sinks:   ";
+  copy(cmd.sinks.begin(), cmd.sinks.end(), ostream_iterator<string>(out, " "));
 
   return out;
 }
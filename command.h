@@ -6,6 +6,7 @@
 #include <vector>
 #include <string>
 #include <ostream>
+#include <sys/types.h>
 
 
 /**
@@ -29,6 +30,36 @@ enum OutputType {
 };
 
 
+/**
+ * Enum representing the possible destinations of error output.
+ */
+enum ErrorType {
+  WRITE_ERR_TO_STDERR,
+  WRITE_ERR_TO_FILE,
+  APPEND_ERR_TO_FILE,
+  WRITE_ERR_TO_OUTPUT
+};
+
+
+/**
+ * Special values for command_t::pipe_size and the shell's pipe size setting.
+ * A size of 0 leaves pipes at the kernel's default capacity.
+ */
+const long PIPE_SIZE_DEFAULT = 0;
+const long PIPE_SIZE_AUTO = -1;
+const long PIPE_SIZE_SESSION = -2;
+
+
+/**
+ * The statuses of timeout when its command ran out of time (and was sent
+ * SIGTERM), when the command had to be sent SIGKILL as well, and when
+ * timeout itself failed; the same as GNU timeout's.
+ */
+const int TIMEOUT_EXPIRED = 124;
+const int TIMEOUT_KILLED = 128 + 9;
+const int TIMEOUT_FAILED = 125;
+
+
 /**
  * Simple representation of a command to execute. Includes the command's
  * arguments as well as information about its input and output types.
@@ -49,6 +80,12 @@ struct command_t {
    */
   OutputType output_type;
 
+  /**
+   * Where this command should write its error output. WRITE_ERR_TO_OUTPUT
+   * (2>&1 or &>) sends it wherever the output goes, pipe or file.
+   */
+  ErrorType error_type;
+
   /**
    * The file from which this command should read its input. May be empty.
    */
@@ -60,10 +97,157 @@ struct command_t {
   std::string outfile;
 
   /**
-   * Constructor. Defaults input_type and output_type to READ_FROM_STDIN and
-   * WRITE_TO_STDOUT, respectively.
+   * The file to which this command should write its error output. May be
+   * empty.
+   */
+  std::string errfile;
+
+  /**
+   * The files given with >|, each of which gets a copy of this command's
+   * output as well as wherever output_type sends it. May be empty.
+   */
+  std::vector<std::string> sinks;
+
+  /**
+   * If greater than 0, the arguments are split into batches that each fit
+   * within the kernel's ARG_MAX limit, running up to this many batches at
+   * once. If 0, the command is run once with all of its arguments.
+   */
+  int batch_jobs;
+
+  /**
+   * The CPUs this command should be pinned to, and the NUMA node its memory
+   * should preferably come from (-1 for none). When both are unset, placement
+   * is left to the scheduler.
+   */
+  std::vector<int> cpus;
+  int numa_node;
+
+  /**
+   * The capacity to give the pipe this command writes to: a size in bytes,
+   * PIPE_SIZE_AUTO, or PIPE_SIZE_SESSION to use the shell's current setting.
+   */
+  long pipe_size;
+
+  /**
+   * Whether to collect the pipeline's byte and context switch counts even
+   * if no pipe in it is sized automatically (pipesize -v).
+   */
+  bool measure;
+
+  /**
+   * Constructor. Defaults input_type, output_type and error_type to
+   * READ_FROM_STDIN, WRITE_TO_STDOUT and WRITE_ERR_TO_STDERR, respectively.
+   */
+  command_t()
+    : input_type(READ_FROM_STDIN), output_type(WRITE_TO_STDOUT),
+      error_type(WRITE_ERR_TO_STDERR), batch_jobs(0), numa_node(-1),
+      pipe_size(PIPE_SIZE_SESSION), measure(false) {}
+};
+
+
+/**
+ * The files a pipeline stage's streams are redirected to, opened by the shell
+ * before the stage is forked. Each is an open descriptor, or -1 if the stream
+ * isn't redirected to a file.
+ */
+struct redirect_fds_t {
+  int input;
+  int output;
+  int error;
+
+  /**
+   * The files opened for the >| sinks, in order; -1 for a FIFO that nobody
+   * was reading.
+   */
+  std::vector<int> sinks;
+
+  /**
+   * Constructor.
+   */
+  redirect_fds_t() : input(-1), output(-1), error(-1) {}
+};
+
+
+/**
+ * A descriptor kept open by the shell for a file that is repeatedly appended
+ * to or read from with a redirection.
+ */
+struct cached_fd_t {
+  /**
+   * The open descriptor (close-on-exec, so only the stages it's given to see
+   * it).
+   */
+  int fd;
+
+  /**
+   * The file it was opened on, used to check that the path still names the
+   * same file when an inotify event arrives for it.
+   */
+  dev_t device;
+  ino_t inode;
+  mode_t mode;
+
+  /**
+   * The inotify watch on the file.
+   */
+  int watch;
+
+  /**
+   * When the descriptor was last handed to a redirection, as a count of the
+   * cache's lookups; the least recently used one is evicted when it's full.
+   */
+  unsigned long last_use;
+};
+
+
+/**
+ * Statistics collected for the most recent pipeline, as reported by
+ * 'pipesize -v'.
+ */
+struct pipeline_stats_t {
+  /**
+   * Whether the bytes piped and context switches were collected: they cost
+   * a read of /proc/<pid>/io and wait4's rusage per stage, so they only are
+   * for a pipeline with an automatically sized pipe, or run by pipesize -v.
+   */
+  bool measured;
+
+  /**
+   * The capacity the pipeline's pipes actually got (0 if none were created).
+   */
+  long pipe_size;
+
+  /**
+   * The bytes written by the stages that write to a pipe.
+   */
+  long bytes_piped;
+
+  /**
+   * The bytes copied to >| sinks, and the number of sinks dropped because
+   * they failed or stayed full.
+   */
+  long bytes_fanned_out;
+  int sinks_dropped;
+
+  /**
+   * Context switches summed over all of the stages.
+   */
+  long voluntary_switches;
+  long involuntary_switches;
+
+  /**
+   * The wall-clock time from starting the first stage to reaping the last.
+   */
+  double seconds;
+
+  /**
+   * Constructor.
    */
-  command_t() : input_type(READ_FROM_STDIN), output_type(WRITE_TO_STDOUT) {}
+  pipeline_stats_t()
+    : measured(false), pipe_size(0), bytes_piped(0), bytes_fanned_out(0),
+      sinks_dropped(0), voluntary_switches(0), involuntary_switches(0),
+      seconds(0) {}
 };
 
 
@@ -0,0 +1,71 @@
+/**
+ * Contains the definitions of the completion_spec_t struct, registered by the
+ * complete builtin for a command, and the completion_cache_t struct holding
+ * the output of a spec's generator.
+ */
+
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+/**
+ * How long a generator's output is used for by default, in milliseconds.
+ */
+const uint64_t COMPLETION_DEFAULT_TTL_MS = 30000;
+
+
+/**
+ * Where the candidates for a command's arguments come from. Any of the
+ * sources may be used together.
+ */
+struct completion_spec_t {
+  /**
+   * A fixed list of words (-W), sorted.
+   */
+  std::vector<std::string> words;
+
+  /**
+   * A shell function (-F) and an external command (-C) whose output lines
+   * are candidates.
+   */
+  std::string function;
+  std::string command;
+
+  /**
+   * How long the output of the function or command is used for before
+   * they're run again (-t), in milliseconds.
+   */
+  uint64_t ttl_ms;
+
+  /**
+   * Constructor.
+   */
+  completion_spec_t() : ttl_ms(COMPLETION_DEFAULT_TTL_MS) {}
+};
+
+
+/**
+ * The output of a spec's generators for one command and previous word.
+ */
+struct completion_cache_t {
+  /**
+   * The candidates, sorted and without duplicates, so that the ones
+   * matching a prefix are a contiguous range.
+   */
+  std::vector<std::string> candidates;
+
+  /**
+   * When the generators ran (on the monotonic clock, in milliseconds), and
+   * the working directory they ran in; the output is stale once either the
+   * TTL passes or the directory changes.
+   */
+  uint64_t generated_ms;
+  std::string cwd;
+
+  /**
+   * Constructor.
+   */
+  completion_cache_t() : generated_ms(0) {}
+};
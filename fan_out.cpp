@@ -0,0 +1,275 @@
+/**
+ * This file contains the implementation of the fan-out of a stage's output
+ * to the files named with >| (see fan_out.h).
+ *
+ * Each round, the data waiting in the stage's pipe is copied with tee(2)
+ * into a private pipe per sink, which doesn't consume it, and spliced from
+ * there into the sink's file; the round is then spliced on to the stage's
+ * real output, which consumes it. The data is never copied into the shell's
+ * memory, except for a destination splice can't write to. A sink that fails
+ * or stays full for FAN_OUT_STALL_MS is dropped and the others carry on; if
+ * the output itself goes away, the fan-out stops and closes the stage's pipe,
+ * so the stage sees the same EPIPE it would without the fan-out.
+ */
+
+#include "fan_out.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * The size of the buffer used for a destination splice can't write to.
+ */
+const size_t FAN_OUT_BUFFER_SIZE = 64 * 1024;
+
+
+/**
+ * Waits for a full descriptor to take more data. Returns 0 once it can, or
+ * ETIMEDOUT if it's still full after FAN_OUT_STALL_MS.
+ */
+int wait_writable(int fd) {
+  struct pollfd entry = { fd, POLLOUT, 0 };
+  int ready;
+  do {
+    ready = poll(&entry, 1, FAN_OUT_STALL_MS);
+  } while (ready < 0 && errno == EINTR);
+  return ready > 0 ? 0 : ETIMEDOUT;
+}
+
+
+/**
+ * Writes all of a buffer to a descriptor. Returns 0, or the error that
+ * stopped it.
+ */
+int write_all(int fd, const char* data, size_t length) {
+  while (length > 0) {
+    ssize_t count = write(fd, data, length);
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0 && errno == EAGAIN) {
+      int error = wait_writable(fd);
+      if (error) return error;
+      continue;
+    }
+    if (count < 0) return errno;
+    data += count;
+    length -= count;
+  }
+  return 0;
+}
+
+
+/**
+ * Moves up to length bytes from a pipe to a descriptor, setting moved to the
+ * number moved (0 at the end of the input). Uses splice(2) unless it has
+ * already failed for the descriptor, and a buffer after that. Returns 0, or
+ * the error that stopped it.
+ */
+int move_some(int from, int to, size_t length, bool& spliceable,
+              vector<char>& buffer, size_t& moved) {
+  moved = 0;
+  while (spliceable) {
+    ssize_t count = syscall(SYS_splice, from, NULL, to, NULL, length, 0);
+    if (count >= 0) {
+      moved = count;
+      return 0;
+    }
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN) {
+      int error = wait_writable(to);
+      if (error) return error;
+      continue;
+    }
+    if (errno != EINVAL) return errno;
+    spliceable = false;
+  }
+
+  buffer.resize(FAN_OUT_BUFFER_SIZE);
+  ssize_t count;
+  do {
+    count = read(from, buffer.data(), min(length, buffer.size()));
+  } while (count < 0 && errno == EINTR);
+  if (count < 0) return errno;
+  moved = count;
+  return write_all(to, buffer.data(), count);
+}
+
+
+/**
+ * Moves exactly length bytes, which are known to be in the pipe, from it to
+ * a descriptor. Returns 0, or the error that stopped it.
+ */
+int move_bytes(int from, int to, size_t length, bool& spliceable,
+               vector<char>& buffer) {
+  while (length > 0) {
+    size_t moved;
+    int error = move_some(from, to, length, spliceable, buffer, moved);
+    if (error) return error;
+    if (moved == 0) return EIO;
+    length -= moved;
+  }
+  return 0;
+}
+
+
+/**
+ * Reads and throws away length bytes from a pipe.
+ */
+void discard_bytes(int fd, size_t length, vector<char>& buffer) {
+  buffer.resize(FAN_OUT_BUFFER_SIZE);
+  while (length > 0) {
+    ssize_t count = read(fd, buffer.data(), min(length, buffer.size()));
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return;
+    length -= count;
+  }
+}
+
+
+/**
+ * Closes a sink's pipe, throwing away whatever it holds. The sink's file is
+ * closed with the pipeline's other files.
+ */
+void close_copy(fan_out_sink_t& sink) {
+  for (int side = 0; side < 2; side++) {
+    if (sink.copy[side] >= 0) close(sink.copy[side]);
+    sink.copy[side] = -1;
+  }
+}
+
+
+/**
+ * Drops a sink for the given error.
+ */
+void drop_sink(fan_out_sink_t& sink, int error) {
+  sink.error = error;
+  close_copy(sink);
+}
+
+
+/**
+ * Copies the data waiting in the stage's pipe into every live sink's pipe,
+ * without consuming it. Returns the length of the round, the same for each
+ * sink (0 at the end of the input), or -1 if every sink has been dropped.
+ */
+ssize_t copy_round(fan_out_t& fan_out, vector<size_t>& copied,
+                   vector<char>& buffer) {
+  ssize_t length = -1;
+  copied.assign(fan_out.sinks.size(), 0);
+  for (size_t s = 0; s < fan_out.sinks.size(); s++) {
+    fan_out_sink_t& sink = fan_out.sinks[s];
+    if (sink.error) continue;
+
+    // a later copy is never asked for more than an earlier one got
+    ssize_t count;
+    size_t limit = length < 0 ? FAN_OUT_ROUND_SIZE : length;
+    do {
+      count = syscall(SYS_tee, fan_out.source, sink.copy[1], limit, 0);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0 || (count == 0 && length > 0)) {
+      drop_sink(sink, count < 0 ? errno : EIO);
+      continue;
+    }
+    copied[s] = count;
+    length = count;
+    if (length == 0) return 0;
+  }
+
+  // the pipes normally take the same amount, but one created while the
+  // user's pipe quota was used up is smaller, and copies more than the
+  // round gets are the start of the next round, which copies them again
+  for (size_t s = 0; s < fan_out.sinks.size(); s++) {
+    fan_out_sink_t& sink = fan_out.sinks[s];
+    if (!sink.error && copied[s] > (size_t)length) {
+      discard_bytes(sink.copy[0], copied[s] - length, buffer);
+    }
+  }
+  return length;
+}
+
+
+void run_fan_out(fan_out_t* fan_out) {
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  for (size_t s = 0; s < fan_out->sinks.size(); s++) {
+    if (fan_out->sinks[s].fd < 0) drop_sink(fan_out->sinks[s], ENXIO);
+  }
+
+  vector<size_t> copied;
+  vector<char> buffer;
+  while (true) {
+    ssize_t length = copy_round(*fan_out, copied, buffer);
+    if (length == 0) break;
+
+    // the sinks write their copies out before the round moves on
+    for (size_t s = 0; s < fan_out->sinks.size(); s++) {
+      fan_out_sink_t& sink = fan_out->sinks[s];
+      if (sink.error) continue;
+      int error = move_bytes(sink.copy[0], sink.fd, length, sink.spliceable, buffer);
+      if (error) {
+        drop_sink(sink, error);
+      } else {
+        sink.bytes += length;
+      }
+    }
+
+    // with no sink left, the data is just passed on as it comes
+    size_t moved = length;
+    int error;
+    if (length < 0) {
+      error = move_some(fan_out->source, fan_out->output, FAN_OUT_ROUND_SIZE,
+                        fan_out->spliceable, buffer, moved);
+      if (!error && moved == 0) break;
+    } else {
+      error = move_bytes(fan_out->source, fan_out->output, length,
+                         fan_out->spliceable, buffer);
+    }
+    if (error) {
+      fan_out->error = error;
+      break;
+    }
+    fan_out->bytes += moved;
+  }
+
+  close(fan_out->source);
+  if (fan_out->owns_output) close(fan_out->output);
+  for (size_t s = 0; s < fan_out->sinks.size(); s++) {
+    close_copy(fan_out->sinks[s]);
+  }
+}
+
+
+int report_fan_out(const fan_out_t& fan_out) {
+  int dropped = 0;
+  for (size_t s = 0; s < fan_out.sinks.size(); s++) {
+    const fan_out_sink_t& sink = fan_out.sinks[s];
+    if (!sink.error) continue;
+    dropped++;
+
+    cerr << "fan-out: " << sink.path << ": dropped after " << sink.bytes
+         << " bytes: ";
+    if (sink.error == ETIMEDOUT) {
+      cerr << "blocked for " << FAN_OUT_STALL_MS << " ms";
+    } else if (sink.error == ENXIO) {
+      cerr << "no reader";
+    } else {
+      cerr << strerror(sink.error);
+    }
+    cerr << endl;
+  }
+
+  // the next stage going away is how a pipeline normally ends early
+  if (fan_out.error && fan_out.error != EPIPE) {
+    cerr << "fan-out: " << strerror(fan_out.error) << endl;
+  }
+  return dropped;
+}
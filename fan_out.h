@@ -0,0 +1,123 @@
+/**
+ * Contains the definitions of the fan_out_t struct, which copies a pipeline
+ * stage's output to the files named with >| as well as passing it on, and
+ * the fan_out_sink_t struct, one of those files.
+ */
+
+#pragma once
+#include <cstddef>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+/**
+ * The most a fan-out copies in one round; in practice a round is bounded by
+ * the capacity of the sinks' pipes.
+ */
+const size_t FAN_OUT_ROUND_SIZE = 1 << 20;
+
+/**
+ * How long a sink may stay full (a FIFO whose reader has stopped reading)
+ * before it's dropped, so that it doesn't hold up the whole pipeline.
+ */
+const int FAN_OUT_STALL_MS = 1000;
+
+
+/**
+ * A file that gets a copy of a stage's output.
+ */
+struct fan_out_sink_t {
+  /**
+   * The file as it was named, and its descriptor (non-blocking, so that a
+   * full sink can be noticed), or -1 if it's a FIFO nobody was reading.
+   */
+  std::string path;
+  int fd;
+
+  /**
+   * The pipe each round is copied into with tee(2), and then spliced from
+   * into the file.
+   */
+  int copy[2];
+
+  /**
+   * Whether splice(2) can write to the file; if not (a terminal, or a file
+   * opened for appending), the data goes through a buffer.
+   */
+  bool spliceable;
+
+  /**
+   * The bytes written to the sink, and the error it was dropped for
+   * (ETIMEDOUT if it stayed full, ENXIO if it had no reader), or 0.
+   */
+  long bytes;
+  int error;
+
+  /**
+   * Constructor.
+   */
+  fan_out_sink_t() : fd(-1), spliceable(true), bytes(0), error(0) {
+    copy[0] = copy[1] = -1;
+  }
+};
+
+
+/**
+ * The fan-out of one stage: the stage writes into a pipe of its own, and a
+ * thread of the shell copies each round of data from it into every sink,
+ * then moves the round on to where the stage's output was going (the next
+ * stage's pipe, a > file, or the shell's standard output).
+ */
+struct fan_out_t {
+  /**
+   * The read side of the pipe the stage writes to.
+   */
+  int source;
+
+  /**
+   * Where the output goes on, whether the fan-out closes it when it's done
+   * (the next stage's pipe), and whether splice(2) can write to it.
+   */
+  int output;
+  bool owns_output;
+  bool spliceable;
+
+  /**
+   * The sinks, in the order they were given.
+   */
+  std::vector<fan_out_sink_t> sinks;
+
+  /**
+   * The bytes passed on, and the error that stopped them (EPIPE if the next
+   * stage went away), or 0.
+   */
+  long bytes;
+  int error;
+
+  /**
+   * The thread running the fan-out.
+   */
+  std::thread thread;
+
+  /**
+   * Constructor.
+   */
+  fan_out_t()
+    : source(-1), output(-1), owns_output(false), spliceable(true),
+      bytes(0), error(0) {}
+};
+
+
+/**
+ * The body of a fan-out's thread: copies the stage's output to the sinks
+ * and passes it on until the stage is done (or the output goes away), with
+ * every signal blocked, then closes the descriptors it owns.
+ */
+void run_fan_out(fan_out_t* fan_out);
+
+/**
+ * Reports the sinks a fan-out dropped, and why, on standard error. Returns
+ * the number dropped.
+ */
+int report_fan_out(const fan_out_t& fan_out);
@@ -0,0 +1,210 @@
+/**
+ * Contains the definitions for the find builtin: the find_options_t struct,
+ * its parsed expression, and the find_walk_t struct, the state of one walk
+ * shared by its worker threads, each of which has a find_worker_t.
+ *
+ * Only the forms described at find_builtin_supported are handled here;
+ * anything else runs the external find as before.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "pattern.h"
+
+
+/**
+ * The size of each worker's getdents64 buffer, and how much output a worker
+ * collects before handing it to the writer.
+ */
+const size_t FIND_DIRENT_BUFFER_SIZE = 256 * 1024;
+const size_t FIND_OUTPUT_BATCH_SIZE = 64 * 1024;
+
+/**
+ * The longest an idle worker sleeps before looking for work again, in
+ * microseconds. Workers are woken as soon as there's work; this only bounds
+ * a wakeup that's missed.
+ */
+const long FIND_IDLE_WAIT_US = 1000;
+
+
+/**
+ * The comparisons -size can make, from its +N, -N or N form.
+ */
+enum FindSizeTest {
+  FIND_SIZE_ANY,
+  FIND_SIZE_LESS,
+  FIND_SIZE_EQUAL,
+  FIND_SIZE_GREATER
+};
+
+
+/**
+ * The starting points and the expression given to find. Every test given
+ * must pass for a path to be printed.
+ */
+struct find_options_t {
+  /**
+   * The directories (or files) to start from.
+   */
+  std::vector<std::string> paths;
+
+  /**
+   * -name: the compiled pattern the last component must match.
+   */
+  bool has_name;
+  glob_pattern_t name;
+
+  /**
+   * -type: the d_type an entry must have (DT_REG, DT_DIR, ...), or 0.
+   */
+  unsigned char type;
+
+  /**
+   * -newer: the file whose modification time an entry must be newer than,
+   * and that time once it's been looked up.
+   */
+  std::string newer_path;
+  struct timespec newer;
+
+  /**
+   * -size: the comparison, and the size to compare against in units of
+   * size_unit bytes (the file's size is rounded up to whole units first).
+   */
+  FindSizeTest size_test;
+  uint64_t size;
+  uint64_t size_unit;
+
+  /**
+   * Whether each path ends in a NUL rather than a newline (-print0).
+   */
+  bool print0;
+
+  /**
+   * Whether any test needs statx (-newer or -size).
+   */
+  bool needs_stat() const { return !newer_path.empty() || size_test != FIND_SIZE_ANY; }
+
+  /**
+   * Constructor.
+   */
+  find_options_t()
+    : has_name(false), type(0), newer(), size_test(FIND_SIZE_ANY), size(0),
+      size_unit(512), print0(false) {}
+};
+
+
+/**
+ * One worker of a walk: its deque of directories still to be read, which
+ * other workers steal from when theirs runs dry, and its own buffers.
+ */
+struct find_worker_t {
+  /**
+   * Guards dirs. The worker pushes and pops at the back (so it walks depth
+   * first and its deque stays short), and thieves take from the front, where
+   * the directories closest to the top of the tree (and so with the most
+   * work below them) are. (A pthread type since <mutex> needs _GNU_SOURCE,
+   * which shell.h undefines.)
+   */
+  pthread_mutex_t lock;
+  std::deque<std::string> dirs;
+
+  /**
+   * The getdents64 buffer, and the output not yet handed to the writer.
+   */
+  std::vector<char> buffer;
+  std::string output;
+
+  /**
+   * The thread running the worker (the first worker runs on the shell's
+   * own thread).
+   */
+  std::thread thread;
+
+  /**
+   * Constructor.
+   */
+  find_worker_t() { pthread_mutex_init(&lock, NULL); }
+
+  /**
+   * Destructor.
+   */
+  ~find_worker_t() { pthread_mutex_destroy(&lock); }
+
+  /**
+   * Workers are only ever used in place.
+   */
+  find_worker_t(const find_worker_t&) = delete;
+  find_worker_t& operator=(const find_worker_t&) = delete;
+};
+
+
+/**
+ * The state of one walk, shared by its workers.
+ */
+struct find_walk_t {
+  /**
+   * What to look for.
+   */
+  const find_options_t* options;
+
+  /**
+   * The workers, one per thread.
+   */
+  std::vector<std::unique_ptr<find_worker_t> > workers;
+
+  /**
+   * The directories pushed onto a deque and not yet finished. The walk is
+   * over when this drops to 0.
+   */
+  std::atomic<long> pending;
+
+  /**
+   * The futex word idle workers sleep on, bumped when there's new work (or
+   * the walk is over), and the number of workers asleep on it (or about to
+   * be), so that pushing a directory only wakes anyone when someone's idle.
+   */
+  std::atomic<uint32_t> work_events;
+  std::atomic<int> idle;
+
+  /**
+   * Guards the output stream and standard error, so that batches and error
+   * messages are written whole.
+   */
+  pthread_mutex_t output_lock;
+
+  /**
+   * Whether any directory or file couldn't be read (find's status is 1).
+   */
+  std::atomic<bool> failed;
+
+  /**
+   * Constructor.
+   */
+  find_walk_t()
+    : options(NULL), pending(0), work_events(0), idle(0), failed(false) {
+    pthread_mutex_init(&output_lock, NULL);
+  }
+
+  /**
+   * Destructor.
+   */
+  ~find_walk_t() { pthread_mutex_destroy(&output_lock); }
+};
+
+
+/**
+ * Returns whether the given find command only uses what the builtin
+ * handles: starting points followed by -name PATTERN, -type f|d|l|p|s|b|c,
+ * -newer FILE, -size [+-]N[bckwMG], -print and -print0. Everything else is
+ * left to the external find.
+ */
+bool find_builtin_supported(const std::vector<std::string>& argv);
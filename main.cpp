@@ -7,11 +7,16 @@
  */
 
 #include "shell.h"
+#include <string>
 
 
 /**
- * The entry point to the shell.
+ * The entry point to the shell. With "--serve SOCKET", runs as a server for
+ * automation clients instead of reading commands from the terminal.
  */
-int main() {
+int main(int argc, char** argv) {
+  if (argc == 3 && std::string(argv[1]) == "--serve") {
+    return Shell::getInstance().serve(argv[2]);
+  }
   return Shell::getInstance().loop_and_handle_input();
 }
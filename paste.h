@@ -0,0 +1,48 @@
+/**
+ * Contains the definition of the paste_block_t struct, a block of pasted
+ * lines that the shell runs as one script rather than a line at a time.
+ */
+
+#pragma once
+#include <cstddef>
+#include <string>
+
+
+/**
+ * How long the shell waits for more of a burst of input once it has read
+ * the lines already waiting; a terminal hands a big paste over in chunks.
+ */
+const int PASTE_BURST_GAP_MS = 20;
+
+/**
+ * The most read from the terminal at a time while collecting a burst.
+ */
+const size_t PASTE_READ_SIZE = 64 * 1024;
+
+
+/**
+ * A block of pasted lines.
+ */
+struct paste_block_t {
+  /**
+   * The lines, joined by newlines, and how many there are.
+   */
+  std::string text;
+  size_t lines;
+
+  /**
+   * Whether it came as a bracketed paste, which readline returns whole,
+   * rather than as a burst of lines read by the shell.
+   */
+  bool bracketed;
+
+  /**
+   * Whether the end of input (ctrl-d) was read along with the burst.
+   */
+  bool eof;
+
+  /**
+   * Constructor.
+   */
+  paste_block_t() : lines(0), bracketed(false), eof(false) {}
+};
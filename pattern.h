@@ -0,0 +1,83 @@
+/**
+ * Contains the definition of the glob_pattern_t struct, the compiled form of
+ * one path component of a glob pattern (e.g. "*.log").
+ */
+
+#pragma once
+#include <bitset>
+#include <string>
+#include <vector>
+
+
+/**
+ * Enum representing the kinds of elements in a compiled pattern.
+ */
+enum PatternElement {
+  PATTERN_LITERAL,   // a single character
+  PATTERN_ANY_CHAR,  // ?
+  PATTERN_STAR,      // *
+  PATTERN_CLASS      // [...], [!...] or [^...]
+};
+
+
+/**
+ * A single element of a compiled pattern.
+ */
+struct pattern_element_t {
+  PatternElement type;
+
+  /**
+   * The character matched by a PATTERN_LITERAL.
+   */
+  unsigned char literal;
+
+  /**
+   * The index in glob_pattern_t::classes of a PATTERN_CLASS's character set.
+   */
+  int class_index;
+};
+
+
+/**
+ * A compiled path component of a glob pattern. The literal prefix and suffix
+ * are kept separately so that directory entries can be rejected with a cheap
+ * comparison before running the full matcher.
+ */
+struct glob_pattern_t {
+  /**
+   * The pattern's elements, in order.
+   */
+  std::vector<pattern_element_t> elements;
+
+  /**
+   * The character sets of the pattern's PATTERN_CLASS elements.
+   */
+  std::vector<std::bitset<256> > classes;
+
+  /**
+   * The literal characters before the first wildcard and after the last.
+   */
+  std::string prefix;
+  std::string suffix;
+
+  /**
+   * The component without its escapes, used when it has no wildcards.
+   */
+  std::string literal;
+
+  /**
+   * Whether the component contains any wildcards at all.
+   */
+  bool has_wildcards;
+
+  /**
+   * Whether the component starts with a literal '.'. Hidden files are only
+   * matched by such components.
+   */
+  bool matches_hidden;
+
+  /**
+   * Whether the component is "**", which matches any number of directories.
+   */
+  bool is_globstar;
+};
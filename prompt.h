@@ -0,0 +1,133 @@
+/**
+ * Contains the definitions for the prompt template's background segments
+ * (see $PROMPT): the cached git state of each directory, and the worker
+ * thread that computes it while the shell waits for input.
+ */
+
+#pragma once
+#include <atomic>
+#include <csignal>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <thread>
+#include <sys/types.h>
+#include <time.h>
+
+
+/**
+ * The signal the worker sends the shell's main thread when a segment has
+ * changed, interrupting readline so that it redraws the prompt.
+ */
+const int PROMPT_REDRAW_SIGNAL = SIGUSR2;
+
+/**
+ * The most directories whose git state is kept; the cache is emptied when it
+ * grows past this.
+ */
+const size_t PROMPT_CACHE_SIZE = 256;
+
+
+/**
+ * The git state of a directory, as shown by the \g escape.
+ */
+struct git_state_t {
+  /**
+   * The repository's git directory, or empty outside of a repository.
+   */
+  std::string git_dir;
+
+  /**
+   * The branch that is checked out, or the commit's short hash when HEAD is
+   * detached, and whether any tracked file differs from the index or HEAD.
+   */
+  std::string branch;
+  bool dirty;
+
+  /**
+   * What the state was computed from: the mtimes of the index and HEAD, and
+   * the number of external commands the shell had run (any of which could
+   * have changed a tracked file).
+   */
+  timespec index_mtime;
+  timespec head_mtime;
+  long commands_run;
+
+  /**
+   * Constructor.
+   */
+  git_state_t() : dirty(false), index_mtime(), head_mtime(), commands_run(-1) {}
+};
+
+
+/**
+ * The worker that computes the expensive prompt segments. Rendering the
+ * prompt only ever reads the cache and posts a request, so it never waits on
+ * git; the worker checks the request against the cache, recomputes the state
+ * if it's out of date, and asks for a redraw if what the prompt shows has
+ * changed.
+ */
+struct prompt_worker_t {
+  /**
+   * Guards everything below except redraw, and wakes the worker for a
+   * request. (These are pthread types since <mutex> needs _GNU_SOURCE, which
+   * shell.h undefines.)
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+
+  /**
+   * The directory waiting to be refreshed (empty for none), and the number of
+   * external commands run when it was requested. Only the latest request is
+   * kept.
+   */
+  std::string request;
+  long request_commands;
+
+  /**
+   * The $PATH to find git in, copied from the main thread with each request.
+   */
+  std::string search_path;
+
+  /**
+   * The git state of each directory seen, keyed by directory.
+   */
+  std::map<std::string, git_state_t> git_cache;
+
+  /**
+   * Whether readline is waiting for input in the main thread (so it may be
+   * interrupted), and whether the worker should exit.
+   */
+  bool in_readline;
+  bool stopping;
+
+  /**
+   * Set by the worker when the prompt should be rendered again.
+   */
+  std::atomic<bool> redraw;
+
+  /**
+   * The thread to signal for a redraw, the process that started the worker
+   * (a forked copy of the shell has no worker thread), and the worker.
+   */
+  pthread_t main_thread;
+  pid_t owner;
+  std::thread thread;
+
+  /**
+   * Constructor.
+   */
+  prompt_worker_t()
+    : request_commands(0), in_readline(false), stopping(false), redraw(false) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wake, NULL);
+  }
+
+  /**
+   * Destructor.
+   */
+  ~prompt_worker_t() {
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&lock);
+  }
+};
@@ -0,0 +1,79 @@
+/**
+ * Contains the definitions of the read_buffer_t struct, the read-ahead buffer
+ * the read builtin keeps for each descriptor it reads from, and the
+ * read_file_t struct, a file read opened itself.
+ */
+
+#pragma once
+#include <cstddef>
+#include <vector>
+
+
+/**
+ * How much the read builtin reads (or peeks) ahead at a time.
+ */
+const size_t READ_AHEAD_SIZE = 256 * 1024;
+
+
+/**
+ * How a descriptor's read-ahead is kept safe for the other readers of the
+ * same file (external commands, and readline reading the shell's input).
+ */
+enum ReadMode {
+  READ_SEEKABLE,  // read ahead, and lseek back over what wasn't used
+  READ_PEEK,      // a pipe: copy the data with tee, consume only what was used
+  READ_OWNED,     // a file only read opened, so nobody else reads from it
+  READ_BYTEWISE   // anything else (a terminal): one byte at a time
+};
+
+
+/**
+ * The bytes read (or peeked) from a descriptor but not yet used by read.
+ */
+struct read_buffer_t {
+  /**
+   * The descriptor and how its read-ahead is made safe.
+   */
+  int fd;
+  ReadMode mode;
+
+  /**
+   * The data, of which [start, end) hasn't been used yet.
+   */
+  std::vector<char> data;
+  size_t start;
+  size_t end;
+
+  /**
+   * For READ_PEEK, the bytes that have been used but are still in the pipe,
+   * and the private pipe that tee copies the data into.
+   */
+  size_t used;
+  int peek[2];
+
+  /**
+   * Constructor.
+   */
+  read_buffer_t()
+    : fd(-1), mode(READ_BYTEWISE), start(0), end(0), used(0) {
+    peek[0] = peek[1] = -1;
+  }
+};
+
+
+/**
+ * A file opened by read's own <. Inside a loop it stays open, so each
+ * iteration's read takes the next record, until the loop that opened it
+ * ends; outside one, it's closed again after the read.
+ */
+struct read_file_t {
+  /**
+   * The descriptor.
+   */
+  int fd;
+
+  /**
+   * The loop depth it was opened at; the loop at that depth owns it.
+   */
+  int loop_depth;
+};
@@ -0,0 +1,101 @@
+/**
+ * Contains the definition of the script_node_t struct, which is the parsed
+ * (abstract syntax tree) form of a line of shell input.
+ */
+
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+
+
+/**
+ * Enum representing the kinds of nodes in a parsed script.
+ */
+enum NodeType {
+  NODE_SIMPLE,      // A single command line (may still contain pipes/redirects)
+  NODE_SEQUENCE,    // Children separated by ';' or newlines
+  NODE_AND,         // children[0] && children[1]
+  NODE_OR,          // children[0] || children[1]
+  NODE_IF,          // cond, body, [cond, body]..., [else body]
+  NODE_WHILE,       // cond, body
+  NODE_UNTIL,       // cond, body
+  NODE_FOR,         // body; iterates name over words
+  NODE_FUNCTION     // body; defines a function called name
+};
+
+
+/**
+ * Enum representing what expanding a word found in it, in increasing order:
+ * a word with a $(command) in it is split into words afterwards.
+ */
+enum Expansion {
+  EXPANDED_NOTHING,
+  EXPANDED_PARAMETERS,
+  EXPANDED_COMMANDS,
+  EXPANSION_FAILED  // a command couldn't be parsed or run
+};
+
+
+/**
+ * Enum representing the result of parsing a line of input.
+ */
+enum ParseStatus {
+  PARSE_OK,
+  PARSE_INCOMPLETE, // more input is needed to close an if/while/for/{ ... }
+  PARSE_ERROR
+};
+
+
+struct script_node_t;
+typedef std::shared_ptr<script_node_t> script_ptr;
+
+
+/**
+ * A single node of a parsed script. Nodes are built once by the parser and
+ * can then be executed any number of times (loop bodies, function calls)
+ * without tokenizing the text again.
+ */
+struct script_node_t {
+  /**
+   * What kind of node this is.
+   */
+  NodeType type;
+
+  /**
+   * The command's tokens for NODE_SIMPLE, or the word list for NODE_FOR.
+   */
+  std::vector<std::string> words;
+
+  /**
+   * The loop variable for NODE_FOR, or the function name for NODE_FUNCTION.
+   */
+  std::string name;
+
+  /**
+   * The child nodes. Their meaning depends on type (see NodeType).
+   */
+  std::vector<script_ptr> children;
+
+  /**
+   * Resolved by the parser so that execution can skip the matching stages:
+   * whether the first word is a key=value assignment, whether any word
+   * references a variable, and whether any word contains a glob wildcard.
+   */
+  bool has_assignment;
+  bool has_variable;
+  bool has_glob;
+
+  /**
+   * For NODE_FOR, whether an explicit "in" list was given. Without one, the
+   * loop iterates over the positional parameters.
+   */
+  bool has_word_list;
+
+  /**
+   * Constructor.
+   */
+  script_node_t(NodeType type)
+    : type(type), has_assignment(false), has_variable(false),
+      has_glob(false), has_word_list(false) {}
+};
@@ -0,0 +1,135 @@
+/**
+ * Contains the framing used between the shell's server mode (MyShell --serve)
+ * and its clients (see tools/).
+ *
+ * Every message in either direction is a frame: a one-byte type, the length
+ * of the payload as a 32-bit big-endian number, and the payload. A client
+ * sends FRAME_COMMAND frames, each holding one or more lines of input. For
+ * each one, the server sends back any number of FRAME_STDOUT and
+ * FRAME_STDERR frames as the output is produced, and then a FRAME_STATUS
+ * frame holding the exit status as a 32-bit big-endian number.
+ */
+
+#pragma once
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+/**
+ * Enum representing the types of frames.
+ */
+enum FrameType {
+  FRAME_COMMAND = 'C',  // client to server: input to run
+  FRAME_STDOUT = 'O',   // server to client: output of the command
+  FRAME_STDERR = 'E',   // server to client: error output of the command
+  FRAME_STATUS = 'S'    // server to client: the command has finished
+};
+
+/**
+ * The size of a frame's header, and the largest payload a reader accepts.
+ */
+const size_t FRAME_HEADER_SIZE = 5;
+const uint32_t FRAME_MAX_LENGTH = 16 << 20;
+
+
+/**
+ * Writes a whole frame to a socket, retrying short writes. A client that has
+ * gone away is reported as a failure rather than raising SIGPIPE.
+ *
+ * @return Whether the frame was written (false if the other end has gone)
+ */
+inline bool write_frame(int fd, char type, const void* data, uint32_t length) {
+  unsigned char header[FRAME_HEADER_SIZE];
+  uint32_t network_length = htonl(length);
+  header[0] = type;
+  memcpy(header + 1, &network_length, sizeof(network_length));
+
+  struct iovec parts[2] = { { header, FRAME_HEADER_SIZE },
+                            { const_cast<void*>(data), length } };
+  struct iovec* part = parts;
+  int count = 2;
+  while (count > 0) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = part;
+    message.msg_iovlen = count;
+    ssize_t written = sendmsg(fd, &message, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+
+    // skip past what was written, which may end part way through a part
+    while (count > 0 && (size_t)written >= part->iov_len) {
+      written -= part->iov_len;
+      part++;
+      count--;
+    }
+    if (count > 0) {
+      part->iov_base = (char*)part->iov_base + written;
+      part->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+
+/**
+ * Writes a FRAME_STATUS frame holding the given status.
+ */
+inline bool write_status_frame(int fd, int status) {
+  uint32_t network_status = htonl((uint32_t)status);
+  return write_frame(fd, FRAME_STATUS, &network_status, sizeof(network_status));
+}
+
+
+/**
+ * Reads exactly size bytes from fd.
+ *
+ * @return Whether they were read (false at end of file or on an error)
+ */
+inline bool read_fully(int fd, void* data, size_t size) {
+  while (size > 0) {
+    ssize_t result = read(fd, data, size);
+    if (result < 0 && errno == EINTR) continue;
+    if (result <= 0) return false;
+    data = (char*)data + result;
+    size -= result;
+  }
+  return true;
+}
+
+
+/**
+ * Reads a whole frame from fd.
+ *
+ * @return Whether a frame was read (false at end of file, on an error, or if
+ *         the frame is too large)
+ */
+inline bool read_frame(int fd, char& type, std::string& payload) {
+  unsigned char header[FRAME_HEADER_SIZE];
+  uint32_t length;
+  if (!read_fully(fd, header, FRAME_HEADER_SIZE)) return false;
+  type = header[0];
+  memcpy(&length, header + 1, sizeof(length));
+  length = ntohl(length);
+  if (length > FRAME_MAX_LENGTH) return false;
+
+  payload.resize(length);
+  return length == 0 || read_fully(fd, &payload[0], length);
+}
+
+
+/**
+ * Returns the exit status held by a FRAME_STATUS frame's payload.
+ */
+inline int frame_status(const std::string& payload) {
+  uint32_t network_status = 0;
+  if (payload.size() == sizeof(network_status)) {
+    memcpy(&network_status, payload.data(), sizeof(network_status));
+  }
+  return (int)ntohl(network_status);
+}
@@ -27,10 +27,25 @@
 
 #pragma once
 #undef _GNU_SOURCE
+#include <cstdint>
 #include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
+#include "alias.h"
+#include "arithmetic.h"
 #include "command.h"
+#include "completion.h"
+#include "paste.h"
+#include "pattern.h"
+#include "prompt.h"
+#include "read_buffer.h"
+#include "script.h"
+#include "snapshot.h"
+#include "trace.h"
 
 
 /**
@@ -56,6 +71,17 @@ public:
    */
   int loop_and_handle_input();
 
+  /**
+   * Runs the shell as a server for automation clients (MyShell --serve),
+   * accepting connections on a Unix domain socket and running a separate
+   * session for each client (see session.h for the protocol). Only returns
+   * if the socket can't be set up or accepting fails.
+   *
+   * @param path Where to create the socket
+   * @return The exit status for the server
+   */
+  int serve(const std::string& path);
+
 // Constructor (shell_core.cpp)
 private:
 
@@ -70,6 +96,11 @@ private:
   Shell(const Shell&);
   void operator =(const Shell&);
 
+  /**
+   * Destructor. Writes out and closes the trace, if one is open.
+   */
+  ~Shell();
+
 // SHELL UTILITY FUNCTIONS (shell_core.cpp)
 private:
 
@@ -83,7 +114,9 @@ private:
   std::string get_prompt(int return_value);
 
   /**
-   * Attempts to parse and execute the given line.
+   * Attempts to parse and execute the given line. If the line opens a
+   * construct that it doesn't close (e.g. a while without a done), further
+   * lines are read until the construct is complete.
    *
    * @param line The command entered by the user
    * @return The return value from running the command, as an integer
@@ -91,7 +124,10 @@ private:
   int execute_line(char* line);
 
   /**
-   * Tokenizes the user input (splits it into strings on whitespace).
+   * Tokenizes the user input (splits it into strings on whitespace). The
+   * operators ;, &&, ||, ( and ) and newlines always form tokens of their own,
+   * even when they aren't surrounded by whitespace. Everything between a $(
+   * and its matching ) stays in a single token, spaces included.
    *
    * @param line The string to tokenize
    * @return The resulting tokens (argv)
@@ -100,30 +136,84 @@ private:
 
   /**
    * Examines each token and sets an env variable for any that are in the form
-   * of key=value. Stops at the first token not in the form of key=value.
+   * of key=value, expanding any parameters and $(command)s in the value.
+   * Stops at the first token not in the form of key=value.
    *
    * @param argv The vector of arguments
+   * @return true on success; false if a command couldn't be parsed or run
    */
-  void local_variable_assignment(std::vector<std::string>& argv);
+  bool local_variable_assignment(std::vector<std::string>& argv);
 
   /**
-   * Replaces any command token that matches an alias with that alias' value.
+   * Replaces the command name of each stage of a pipeline with the words of
+   * its alias, if it has one. The first word of an alias's value is expanded
+   * again, unless it names an alias already being expanded.
    *
    * @param argv The vector of arguments
+   * @return Whether any alias was expanded
    */
-  void alias_substitution(std::vector<std::string>& argv);
+  bool alias_substitution(std::vector<std::string>& argv);
 
   /**
-   * Substitutes any tokens that start with a '$' with their appropriate value,
-   * or erases the token if there is no corresponding variable.
+   * Defines (or redefines) an alias, splitting its value into words.
+   *
+   * @param name The alias's name
+   * @param value The alias's value
+   */
+  void define_alias(const std::string& name, const std::string& value);
+
+  /**
+   * Expands the parameters ($VAR, ${VAR}, ${VAR:-x}, ${#VAR}, ${VAR%x} and
+   * ${VAR%%x}) and $(command)s anywhere in each token, erasing a token that
+   * expands to nothing. Unless the token is an assignment, one with a
+   * $(command) in it is then split into separate tokens on whitespace. A
+   * token that is just $@ or $* is replaced by one token per positional
+   * parameter. Tokens without a '$' aren't touched.
    *
    * @param argv The vector of arguments
+   * @return true on success; false if a command couldn't be parsed or run
+   */
+  bool variable_substitution(std::vector<std::string>& argv);
+
+  /**
+   * Appends text to result with its parameters and $(command)s expanded,
+   * scanning it once, so that nothing they expand to is expanded again. A
+   * command is replaced by its output, minus any trailing newlines. A '$'
+   * that doesn't start either is kept as it is.
+   *
+   * @param text The text to expand
+   * @param length Its length
+   * @param result The string to append the expansion to
+   * @return What text had in it, or EXPANSION_FAILED if a command couldn't
+   *         be parsed or run
    */
-  void variable_substitution(std::vector<std::string>& argv);
+  Expansion expand_parameters(const char* text, size_t length, std::string& result);
 
   /**
-   * Executes a line of input by either calling execute_external_command or
-   * directly invoking the built-in command.
+   * Appends the expansion of a ${...} parameter to result, given the text
+   * between the braces.
+   *
+   * @param body The text between the braces
+   * @param length Its length
+   * @param result The string to append the expansion to
+   * @return What the parameter expanded, as for expand_parameters
+   */
+  Expansion expand_braced_parameter(const char* body, size_t length, std::string& result);
+
+  /**
+   * Looks up the value of a variable. Special parameters ($?, $#, $0-$9, and
+   * $@ and $*, joined by spaces) are checked first, then the environment,
+   * then the local variables.
+   *
+   * @param name The name of the variable, without the '$'
+   * @param value Set to the variable's value if it exists
+   * @return true if the variable exists; false otherwise
+   */
+  bool lookup_variable(const std::string& name, std::string& value);
+
+  /**
+   * Executes a line of input by either calling a shell function,
+   * execute_external_command or directly invoking the built-in command.
    *
    * @param argv The vector of arguments
    * @return The return code of the operation
@@ -164,8 +254,9 @@ private:
 
   /**
    * If called without an argument, then any existing aliases are displayed.
-   * Otherwise, the argument is assumed to be a new alias and an entry is made
-   * in the alias map.
+   * Otherwise, each argument in the form name=value is a new alias, and any
+   * arguments after it without an '=' (or starting with '-') are further
+   * words of its value, e.g. alias ll=ls -l --color=auto.
    *
    * @param argv The vector of arguments
    * @return The return code of the operation
@@ -175,8 +266,8 @@ private:
 
   /**
    * Removes aliases. If "-a" is provided as an argument, then all existing
-   * aliases are removed. Otherwise, the argument is assumed to be a specific
-   * alias to remove and if it exists, that alias is deleted.
+   * aliases are removed. Otherwise, each argument is the name of an alias to
+   * remove, and it's an error if one doesn't exist.
    *
    * @param argv The vector of arguments
    * @return The return code of the operation
@@ -204,13 +295,706 @@ private:
 
 
   /**
-   * Exits the program.
+   * Does nothing, successfully.
+   *
+   * @param argv The vector of arguments
+   * @return The return code of the operation
+   */
+  int com_true(std::vector<std::string>& argv);
+
+
+  /**
+   * Does nothing, unsuccessfully.
+   *
+   * @param argv The vector of arguments
+   * @return The return code of the operation
+   */
+  int com_false(std::vector<std::string>& argv);
+
+
+  /**
+   * Evaluates a conditional expression (also available as '[ ... ]'). Supports
+   * string tests (-z, -n, =, !=), integer comparisons (-eq, -ne, -lt, -le,
+   * -gt, -ge), file tests (-e, -f, -d, -r, -w, -x, -s) and negation with '!'.
+   *
+   * @param argv The vector of arguments
+   * @return 0 if the expression is true, 1 if false, 2 on error
+   */
+  int com_test(std::vector<std::string>& argv);
+
+
+  /**
+   * Exits from the innermost (or the Nth enclosing, if argv[1] is given)
+   * while, until or for loop.
+   *
+   * @param argv The vector of arguments
+   * @return The return code of the operation
+   */
+  int com_break(std::vector<std::string>& argv);
+
+
+  /**
+   * Skips to the next iteration of the innermost (or the Nth enclosing, if
+   * argv[1] is given) while, until or for loop.
+   *
+   * @param argv The vector of arguments
+   * @return The return code of the operation
+   */
+  int com_continue(std::vector<std::string>& argv);
+
+
+  /**
+   * Returns from the current shell function with the status given in argv[1],
+   * or with the status of the last command if no argument is given.
+   *
+   * @param argv The vector of arguments
+   * @return The return code of the operation
+   */
+  int com_return(std::vector<std::string>& argv);
+
+
+  /**
+   * Runs the command in argv[1..] (which may include pipes and redirects),
+   * splitting the arguments of any external command that would exceed the
+   * kernel's ARG_MAX limit into as few batches as possible, like xargs. With
+   * "-P N", up to N batches run at once. The command and its leading options
+   * (up to and including a "--") are repeated in every batch.
+   *
+   * @param argv The vector of arguments
+   * @return The largest exit status of any batch
+   */
+  int com_batch(std::vector<std::string>& argv);
+
+
+  /**
+   * Runs the command in argv (which may include pipes and redirects) with
+   * each stage pinned to a set of CPUs and/or a NUMA node:
+   *   pin [--cpus LIST[:LIST...]] [--node N[:N...]] [--spread] command...
+   * LIST is a CPU list like "0-3,8". Colon-separated values apply to
+   * successive stages, and stages past the last value reuse it. --spread
+   * gives each stage a single CPU, placing adjacent stages on cores that
+   * share a cache. Each stage reports the placement it actually got on stderr.
+   *
+   * @param argv The vector of arguments
+   * @return The return code of the final stage
+   */
+  int com_pin(std::vector<std::string>& argv);
+
+
+  /**
+   * Sets the capacity of the pipes the shell creates. With no arguments,
+   * shows the current setting; with "-v" and no command, shows statistics
+   * for the last pipeline.
+   *   pipesize SIZE|auto|default             sets it for the session
+   *   pipesize [-v] SIZE|auto|default cmd... sets it for one pipeline
+   * SIZE is in bytes and may end in K or M. "auto" sizes pipes from the
+   * throughput of previous runs of the same pipeline. With -v, the pipe size,
+   * bytes moved and context switches of the pipeline are shown afterwards.
+   *
+   * @param argv The vector of arguments
+   * @return The return code of the operation (or of the pipeline)
+   */
+  int com_pipesize(std::vector<std::string>& argv);
+
+
+  /**
+   * Records every line the shell runs, and every external pipeline it starts,
+   * as JSON lines appended to FILE. With "off", stops tracing; with no
+   * arguments, shows where the trace is going.
+   *   trace [FILE|off]
+   *
+   * @param argv The vector of arguments
+   * @return The return code of the operation
+   */
+  int com_trace(std::vector<std::string>& argv);
+
+
+  /**
+   * Runs a command repeatedly, at a fixed interval, until it has run COUNT
+   * times or Ctrl-C is pressed:
+   *   every [-d] [-n COUNT] INTERVAL command...
+   * INTERVAL is in seconds or ends in ms, s, m or h. Runs are scheduled on
+   * an absolute timer, so they don't drift; a tick that passes while the
+   * previous run is still going is skipped. The command is parsed once, and
+   * its words are expanded again for each run (execute_simple_command leaves
+   * them unexpanded). With -d, a run's output is only shown if it differs
+   * from the previous run's.
+   * The number of runs, skipped ticks and overruns and the jitter of the
+   * start times are reported on stderr at the end.
+   *
+   * @param argv The vector of arguments
+   * @return The return code of the last run
+   */
+  int com_every(std::vector<std::string>& argv);
+
+
+  /**
+   * Registers where the arguments of the named commands are completed from:
+   *   complete [-W WORDS] [-F FUNCTION] [-C COMMAND] [-t TTL] NAME...
+   * WORDS is a list of words separated by commas or blanks. FUNCTION and
+   * COMMAND are run with the command's name and the word before the one
+   * being completed, and each line they print is a candidate; their output
+   * is kept for TTL (30s by default) or until the working directory
+   * changes. With -r, removes the specs of the named commands; with no
+   * arguments (or -p), lists the specs.
+   *
+   * @param argv The vector of arguments
+   * @return The return code of the operation
+   */
+  int com_complete(std::vector<std::string>& argv);
+
+
+  /**
+   * Reads a record (a line, or up to DELIM with -d) from standard input, or
+   * from FILE, and assigns its fields to the variables:
+   *   read [-r] [-d DELIM] VAR... [< FILE]
+   * The fields are split on blanks, and the last variable gets the rest of
+   * the record; with no variables, REPLY gets all of it. Without -r, a
+   * backslash quotes the next character (a backslash before the delimiter
+   * continues the record). Inside a loop, a FILE stays open from one read to
+   * the next, so each read takes the next record, until its end or the end
+   * of the loop; outside one, each read starts at the top of the file.
+   *
+   * @param argv The vector of arguments
+   * @return 0, or 1 at the end of the input
+   */
+  int com_read(std::vector<std::string>& argv);
+
+
+  /**
+   * Runs a command, sending SIGTERM to it and everything it started (its
+   * process group) if it's still running after DURATION, and SIGKILL after
+   * a further GRACE if given:
+   *   timeout DURATION [-k GRACE] command...
+   * Durations are as for every; 0 means no limit. The child is waited for
+   * on its pidfd and the deadline on a timerfd, in a single poll. On a
+   * terminal, the command's group is the foreground group while it runs, so
+   * it can read the terminal; otherwise Ctrl-C is passed on to it.
+   *
+   * @param argv The vector of arguments
+   * @return The command's status, or TIMEOUT_EXPIRED, TIMEOUT_KILLED or
+   *         TIMEOUT_FAILED
+   */
+  int com_timeout(std::vector<std::string>& argv);
+
+
+  /**
+   * Prints the paths under the starting points that pass every test:
+   *   find [PATH...] [-name PATTERN] [-type C] [-newer FILE] [-size [+-]N[U]]
+   *        [-print | -print0]
+   * The trees are walked by a pool of threads (MYSHELL_FIND_THREADS, or one
+   * per CPU) stealing directories from each other, so the output isn't in
+   * directory order. Any other form runs the external find.
+   *
+   * @param argv The vector of arguments
+   * @return 0, or 1 if anything couldn't be read
+   */
+  int com_find(std::vector<std::string>& argv);
+
+
+  /**
+   * Exits the program. In a server session, ends the session instead.
    *
    * @param argv The vector of arguments
    * @return The return code of the operation
    */
   int com_exit(std::vector<std::string>& argv);
 
+// SCRIPTING (shell_scripting.cpp)
+private:
+
+  /**
+   * Parses the given text into a script tree. Trees for previously parsed
+   * lines are kept in a cache and returned without parsing again.
+   *
+   * @param text The text to parse (may contain newlines)
+   * @param script Set to the root of the parsed tree
+   * @return PARSE_OK on success, PARSE_INCOMPLETE if the text ends in the
+   *         middle of a construct, PARSE_ERROR on a syntax error
+   */
+  ParseStatus parse_script(const std::string& text, script_ptr& script);
+
+  /**
+   * Executes a parsed script node (and, recursively, its children).
+   *
+   * @param node The node to execute
+   * @return The return code of the last command executed
+   */
+  int execute_script(const script_node_t& node);
+
+  /**
+   * Performs arithmetic expansion, variable assignment, alias and variable
+   * substitution on a copy of a NODE_SIMPLE's words and dispatches the
+   * result.
+   *
+   * @param node The node to execute
+   * @return The return code of the command
+   */
+  int execute_simple_command(const script_node_t& node);
+
+  /**
+   * Executes a NODE_IF: runs the first body whose condition succeeds, or the
+   * else body if none does.
+   *
+   * @param node The node to execute
+   * @return The return code of the body executed, or 0 if none was
+   */
+  int execute_if(const script_node_t& node);
+
+  /**
+   * Executes a NODE_WHILE or NODE_UNTIL.
+   *
+   * @param node The node to execute
+   * @return The return code of the last execution of the body
+   */
+  int execute_loop(const script_node_t& node);
+
+  /**
+   * Executes a NODE_FOR, setting the loop variable to each word in turn.
+   *
+   * @param node The node to execute
+   * @return The return code of the last execution of the body
+   */
+  int execute_for(const script_node_t& node);
+
+  /**
+   * Calls a shell function, making argv available as $0, $1, ...
+   *
+   * @param body The body of the function
+   * @param argv The vector of arguments
+   * @return The return code of the function
+   */
+  int call_function(const script_node_t& body, std::vector<std::string>& argv);
+
+  /**
+   * Returns true if a break, continue or return is waiting to unwind the
+   * commands that are currently executing.
+   */
+  bool control_flow_pending();
+
+  /**
+   * Called by a loop when control_flow_pending() after running its condition
+   * or body. Consumes one level of a pending break or continue.
+   *
+   * @return true if the loop should stop; false to continue iterating
+   */
+  bool finish_loop_iteration();
+
+// ARITHMETIC EXPANSION (shell_arithmetic.cpp)
+private:
+
+  /**
+   * Replaces every $(( expr )) in the given tokens with the value of expr.
+   *
+   * @param argv The vector of arguments
+   * @return true on success; false if an expression was invalid
+   */
+  bool arithmetic_substitution(std::vector<std::string>& argv);
+
+  /**
+   * Returns the parsed form of the given expression, parsing it and adding it
+   * to the cache if it hasn't been seen before.
+   *
+   * @param text The expression, without the surrounding $(( and ))
+   * @return The parsed expression, or NULL on a syntax error
+   */
+  const arith_expr_t* parse_arithmetic(std::string_view text);
+
+  /**
+   * Evaluates a node of a parsed expression, assigning to local variables as
+   * the expression requires.
+   *
+   * @param expr The parsed expression
+   * @param index The index of the node to evaluate
+   * @param result Set to the value of the node
+   * @return true on success; false on an error such as division by zero
+   */
+  bool evaluate_arithmetic(const arith_expr_t& expr, int index, long& result);
+
+  /**
+   * Returns the integer value of a variable (or positional parameter) for use
+   * in an expression. Unset and non-numeric variables are 0.
+   *
+   * @param name The name of the variable
+   * @return The variable's value
+   */
+  long arithmetic_variable(const std::string& name);
+
+  /**
+   * Stores the result of an assignment operator in a local variable.
+   *
+   * @param name The name of the variable
+   * @param value The value to store
+   */
+  void set_arithmetic_variable(const std::string& name, long value);
+
+// CPU AND NUMA PLACEMENT (shell_placement.cpp)
+private:
+
+  /**
+   * Works out the CPUs and NUMA node of every stage of a pipeline from the
+   * options given to pin, storing them in the commands.
+   *
+   * @param commands The stages of the pipeline
+   * @param cpu_spec The --cpus option ("" if not given)
+   * @param node_spec The --node option ("" if not given)
+   * @param spread Whether --spread was given
+   * @return true on success; false if an option was invalid
+   */
+  bool assign_placements(
+      std::vector<command_t>& commands,
+      const std::string& cpu_spec,
+      const std::string& node_spec,
+      bool spread);
+
+  /**
+   * Called in a forked child before it sets up its redirections: pins the
+   * process to the command's CPUs and NUMA node, then reports the placement
+   * it got on the shell's stderr.
+   *
+   * @param command The command being run
+   * @param stage The index of the command within its pipeline
+   */
+  void apply_placement(const command_t& command, size_t stage);
+
+// STARTUP FILE AND COMMAND HASH (shell_startup.cpp)
+private:
+
+  /**
+   * Sets up the shell's state from ~/.myshellrc before the first prompt: from
+   * its snapshot if that is still valid, and otherwise by running it (writing
+   * a new snapshot if it only set up state). Sets STARTUP_US to the time from
+   * the shell starting to its first prompt, and STARTUP_SOURCE to where the
+   * state came from ("snapshot", "rc" or "none").
+   */
+  void run_startup_file();
+
+  /**
+   * Maps the given snapshot into memory and, if it was made from the same rc
+   * file, $PATH and environment, copies its state into the shell.
+   *
+   * @param path The snapshot file
+   * @param expected A header filled in from the current rc file and $PATH
+   * @return Whether the snapshot was valid and loaded
+   */
+  bool load_snapshot(const std::string& path, const snapshot_header_t& expected);
+
+  /**
+   * Writes the shell's current aliases, variables, functions, pipe size and
+   * command hash, and the environment variables the rc file read, to the
+   * given snapshot file.
+   *
+   * @param path The snapshot file
+   * @param header A header filled in from the current rc file and $PATH
+   */
+  void write_snapshot(const std::string& path, snapshot_header_t header);
+
+  /**
+   * Returns the given environment variable, like getenv(). While the rc file
+   * runs, also records the value, since the snapshot depends on it.
+   *
+   * @param name The variable's name
+   * @return Its value, or NULL if it isn't set
+   */
+  const char* read_environment(const std::string& name);
+
+  /**
+   * Rebuilds the command hash: the full path of every executable on $PATH,
+   * keyed by its name (the first one found, in $PATH order).
+   */
+  void hash_commands();
+
+  /**
+   * Rebuilds the command hash if $PATH has changed, or a command has been
+   * added to or removed from one of its directories, since it was built.
+   */
+  void refresh_command_hash();
+
+  /**
+   * Looks a command up in the command hash, so that it can be exec'd without
+   * searching $PATH. Names containing a '/' are never hashed.
+   *
+   * @param name The command's name
+   * @return Its full path, or NULL if it isn't in the hash
+   */
+  const char* hashed_command(const std::string& name);
+
+// PROMPT (shell_prompt.cpp)
+private:
+
+  /**
+   * Finds the prompt template: $PROMPT, as a local or environment variable.
+   *
+   * @param format Set to the template
+   * @return Whether there is one (if not, the default prompt is used)
+   */
+  bool prompt_format(std::string& format);
+
+  /**
+   * Renders a prompt template. Escapes: \u user, \h host, \w directory
+   * (with ~ for $HOME), \W its last component, \g git branch (with '*' if
+   * dirty), \d duration of the last command, \? its status, \m :) or :(,
+   * \_ space, \n newline and \\ backslash. The git segment comes from the
+   * prompt worker's cache and never waits for git.
+   *
+   * @param format The template
+   * @param refresh Whether to ask the worker to bring the git segment for
+   *        the current directory up to date
+   * @return The prompt
+   */
+  std::string render_prompt(const std::string& format, bool refresh);
+
+  /**
+   * Asks the prompt worker to bring the git state of a directory up to date,
+   * starting the worker (and installing readline's redraw hooks) if it isn't
+   * running.
+   *
+   * @param dir The directory
+   */
+  void request_prompt_refresh(const std::string& dir);
+
+  /**
+   * Stops and joins the prompt worker. Does nothing if there is none.
+   */
+  void stop_prompt_worker();
+
+  /**
+   * Tells the prompt worker whether readline is waiting for input, and so
+   * whether it may be interrupted to redraw the prompt.
+   *
+   * @param waiting Whether readline is about to wait (or has finished)
+   */
+  void set_in_readline(bool waiting);
+
+  /**
+   * Renders the prompt again if the worker has asked for it, and hands it to
+   * readline.
+   *
+   * @return Whether the prompt was replaced
+   */
+  bool update_prompt();
+
+  /**
+   * Registered as rl_startup_hook: picks up a segment that finished after
+   * the prompt was rendered but before readline started.
+   */
+  static int refresh_prompt_hook();
+
+  /**
+   * Registered as rl_signal_event_hook: when PROMPT_REDRAW_SIGNAL interrupts
+   * readline, redraws the prompt in place with the new segments.
+   */
+  static int redraw_prompt_hook();
+
+// REDIRECTION (shell_redirection.cpp)
+private:
+
+  /**
+   * Opens the files a pipeline stage's streams are redirected to. Appends
+   * and reads use the descriptor cache; anything else is opened afresh and
+   * added to owned, for the caller to close once the stages are forked.
+   * Prints an error if a file can't be opened.
+   *
+   * @param command The stage
+   * @param earlier The redirections of the stages before it
+   * @param fds Set to the stage's descriptors
+   * @param owned The descriptors the caller must close
+   * @return Whether every file could be opened
+   */
+  bool open_redirections(
+      const command_t& command,
+      const std::vector<redirect_fds_t>& earlier,
+      redirect_fds_t& fds,
+      std::vector<int>& owned);
+
+  /**
+   * Opens a file for a redirection, close-on-exec. A file opened for
+   * appending or reading is returned from the cache if it's there, and added
+   * to it if not; input files are rewound and read ahead.
+   *
+   * @param path The file's path
+   * @param flags The flags to open it with
+   * @param owned The descriptors the caller must close; uncached ones are
+   *        added to it
+   * @return The descriptor, or -1 (with errno set) if it couldn't be opened
+   */
+  int open_redirect(const std::string& path, int flags, std::vector<int>& owned);
+
+  /**
+   * Adds a newly opened descriptor to the cache and starts watching its file,
+   * evicting the least recently used entry if the cache is full. Leaves it
+   * out if the file can't be watched.
+   *
+   * @param key The cache key: 'a' (append) or 'r' (read) and the absolute path
+   * @param fd The descriptor
+   */
+  void cache_redirect_fd(const std::string& key, int fd);
+
+  /**
+   * Reads the pending inotify events and drops every cached descriptor whose
+   * path no longer names the file it was opened on.
+   */
+  void process_redirect_events();
+
+  /**
+   * Closes a cached descriptor and removes it from the cache, along with its
+   * watch unless another entry shares it.
+   *
+   * @param key The cache key
+   */
+  void drop_cached_fd(const std::string& key);
+
+  /**
+   * Removes an inotify watch unless a cached descriptor still uses it (hard
+   * links to the same file share a watch).
+   *
+   * @param watch The watch
+   */
+  void release_redirect_watch(int watch);
+
+  /**
+   * Closes every cached descriptor and the inotify descriptor.
+   */
+  void clear_redirect_cache();
+
+// SERVER MODE (shell_server.cpp)
+private:
+
+  /**
+   * Runs a server session in a forked copy of the shell: runs each command
+   * the client sends, forwarding its output and then its exit status.
+   *
+   * @param client The client's socket
+   * @return The exit status for the session's process
+   */
+  int run_session(int client);
+
+// EXECUTION TRACE (shell_trace.cpp)
+private:
+
+  /**
+   * Opens (appending to) the given trace file and starts the thread that
+   * writes records to it, closing any trace that was already open.
+   *
+   * @param path The file to write the trace to
+   * @return Whether the file could be opened
+   */
+  bool start_trace(const std::string& path);
+
+  /**
+   * Writes out any records that are still queued, stops the writer thread and
+   * closes the trace file. Does nothing if there is no trace.
+   */
+  void stop_trace();
+
+  /**
+   * Claims the next record in the trace's ring buffer. The caller fills it in
+   * and then publishes it with commit_trace_event(); only one record can be
+   * claimed at a time.
+   *
+   * @param type The kind of record
+   * @return The record, or NULL if tracing is off or the ring is full
+   */
+  trace_event_t* begin_trace_event(TraceEventType type);
+
+  /**
+   * Publishes the record claimed by begin_trace_event() to the writer thread.
+   */
+  void commit_trace_event();
+
+// READ BUILTIN (shell_read.cpp)
+private:
+
+  /**
+   * Returns the read-ahead buffer for a descriptor, setting one up (and
+   * working out how it can read ahead safely) the first time.
+   *
+   * @param fd The descriptor
+   * @return Its buffer
+   */
+  read_buffer_t& read_buffer(int fd);
+
+  /**
+   * Puts every descriptor read has read ahead on back where the last read
+   * stopped. Called before anything else may read from them: before
+   * forking, and before readline reads the next line.
+   */
+  void settle_read_buffers();
+
+  /**
+   * Closes a file opened by read, dropping its buffer.
+   *
+   * @param key The file's absolute path
+   */
+  void close_read_file(const std::string& key);
+
+  /**
+   * Closes the files read opened inside the loop that just ended, called
+   * once loop_depth has been decremented.
+   */
+  void close_loop_read_files();
+
+// PASTED INPUT (shell_paste.cpp)
+private:
+
+  /**
+   * Works out whether a line readline returned starts a paste: a bracketed
+   * paste, which readline returns whole with its newlines, or a burst of
+   * lines already waiting on the terminal, the rest of which is read here
+   * (without echo) until the terminal goes quiet. A partial last line is
+   * left for the next readline.
+   *
+   * @param line The line readline returned
+   * @param block Set to the pasted lines, starting with line
+   * @return Whether line started a paste
+   */
+  bool read_paste(const char* line, paste_block_t& block);
+
+  /**
+   * Runs a pasted block through execute_line, so that it's parsed at once,
+   * run without a prompt between its lines, and added to the history as one
+   * entry, then prints a summary of it on standard error.
+   *
+   * @param block The block
+   * @return The return value of the block
+   */
+  int execute_paste(paste_block_t& block);
+
+  /**
+   * Registered as rl_pre_input_hook: puts the partial line left over from a
+   * burst into readline's buffer, to be finished there.
+   */
+  static int insert_paste_leftover_hook();
+
+// GLOB EXPANSION (shell_glob.cpp)
+private:
+
+  /**
+   * Replaces every token containing *, ? or [...] with the sorted list of
+   * paths that it matches. Tokens that match nothing are left as they are.
+   *
+   * @param argv The vector of arguments
+   */
+  void glob_expansion(std::vector<std::string>& argv);
+
+  /**
+   * Finds all of the paths matching a single glob pattern.
+   *
+   * @param word The pattern to expand
+   * @param matches The vector to fill with the sorted matching paths
+   * @return true if the pattern had wildcards and matched at least one path
+   */
+  bool expand_glob(const std::string& word, std::vector<std::string>& matches);
+
+  /**
+   * Returns the compiled form of one path component of a pattern, compiling
+   * it and adding it to the cache if it hasn't been seen before.
+   *
+   * @param text The path component
+   * @return The compiled component
+   */
+  const glob_pattern_t* compile_glob_component(std::string_view text);
+
 // TAB COMPLETION (shell_tab_completion.cpp)
 private:
 
@@ -235,9 +1019,34 @@ private:
       const char* text,
       std::vector<std::string>& matches);
 
+  /**
+   * Populates the given matches vector with the candidates from the
+   * completion spec of the command being completed (completing_command)
+   * that match the given text.
+   *
+   * @param text The text against which to match
+   * @param matches The vector to fill with matching candidates
+   */
+  void get_argument_completions(const char* text, std::vector<std::string>& matches);
+
+  /**
+   * Returns the output of the spec's function and command for the given
+   * command and previous word, from the cache unless it's stale.
+   *
+   * @param spec The command's completion spec
+   * @param command The command being completed
+   * @param previous The word before the one being completed
+   * @return The candidates, sorted
+   */
+  const std::vector<std::string>& generated_completions(
+      const completion_spec_t& spec,
+      const std::string& command,
+      const std::string& previous);
+
   /**
    * This is the function we registered as rl_attempted_completion_function. It
-   * attempts to complete with a command, variable name, or filename.
+   * attempts to complete with a command, variable name, a candidate from the
+   * command's completion spec, or filename.
    *
    * @param text The string for which to suggest completion values
    * @param start The start index of text within rl_line_buffer
@@ -270,6 +1079,19 @@ private:
    */
   static char* command_completion_generator(const char* text, int state);
 
+  /**
+   * Generates a command's argument candidates for readline completion. This
+   * function will be called multiple times by readline and will return a
+   * single cstring each time. Delegates the actual completion logic to
+   * get_argument_completions, which is an instance method and gets called
+   * only once per completion attempt.
+   *
+   * @param text The text entered by the user
+   * @param state 0 the first time this function is called; otherwise, non-0
+   * @return A single matching candidate
+   */
+  static char* argument_completion_generator(const char* text, int state);
+
   /**
    * Pops the last value off the given vector and returns the result.
    *
@@ -293,6 +1115,99 @@ private:
    */
   int execute_external_command(std::vector<std::string>& argv);
 
+  /**
+   * Runs a partitioned pipeline: forks every stage, connects them with pipes
+   * and sets up their redirections, then waits for all of them (and only
+   * them) in the order they exit.
+   *
+   * @param commands The stages of the pipeline
+   * @return The return code of the final stage
+   */
+  int run_pipeline(std::vector<command_t>& commands);
+
+  /**
+   * Returns the largest pipe capacity an unprivileged process may set, from
+   * /proc/sys/fs/pipe-max-size (read once).
+   */
+  long max_pipe_size();
+
+  /**
+   * Works out the capacity to give a pipe in the given pipeline. In the
+   * adaptive mode, this is the smallest power of two that holds about a
+   * millisecond of data at the throughput previous runs of the same pipeline
+   * achieved.
+   *
+   * @param requested A size in bytes, PIPE_SIZE_AUTO or PIPE_SIZE_SESSION
+   * @param key The pipeline's key (its commands, e.g. "gzip | wc")
+   * @return The size in bytes, or PIPE_SIZE_DEFAULT to leave the pipe alone
+   */
+  long resolve_pipe_size(long requested, const std::string& key);
+
+  /**
+   * Sets the capacity of a pipe with F_SETPIPE_SZ, clamped to
+   * max_pipe_size(). Does nothing for sizes of 0 or less.
+   *
+   * @param fd Either end of the pipe
+   * @param size The capacity in bytes
+   */
+  void set_pipe_size(int fd, long size);
+
+  /**
+   * Called in a forked child: runs argv, split into batches that each fit
+   * within the kernel's argument size limit (ARG_MAX, minus the space taken
+   * by the environment). If everything fits at once, argv is exec'd directly
+   * and this method doesn't return.
+   *
+   * @param argv The command and all of its arguments
+   * @param jobs The maximum number of batches to run at once
+   * @return The largest exit status of any batch
+   */
+  int execute_in_batches(std::vector<std::string>& argv, int jobs);
+
+  /**
+   * Runs the given command line and collects everything it writes to stdout.
+   * A lone builtin from pure_builtins runs in-process, writing straight into
+   * the output buffer; anything else runs in a forked copy of the shell whose
+   * stdout is a pipe.
+   *
+   * @param text The command line to run
+   * @param output Set to the command's output
+   * @return true if the command was run; false if it couldn't be parsed or
+   *         the process couldn't be created
+   */
+  bool capture_command_output(const std::string& text, std::string& output);
+
+  /**
+   * Runs an already parsed command and collects everything it writes to
+   * stdout, as capture_command_output() does. Its status is left in
+   * last_status.
+   *
+   * @param node The parsed command
+   * @param output Set to the command's output
+   * @return true if the command was run; false if the process couldn't be
+   *         created
+   */
+  bool capture_script_output(const script_node_t& node, std::string& output);
+
+  /**
+   * Returns whether a pipeline's first command is a builtin that runs in the
+   * shell, with only its output passed on to the next stage: one from
+   * pure_builtins (that isn't shadowed by a function) writing to a pipe.
+   *
+   * @param command The pipeline's first command
+   * @return true if the command runs as a builtin stage
+   */
+  bool runs_as_builtin_stage(const command_t& command);
+
+  /**
+   * Runs a builtin in the shell and collects everything it writes to stdout.
+   *
+   * @param argv The builtin and its arguments
+   * @param output Set to the builtin's output
+   * @return The builtin's status
+   */
+  int capture_builtin_output(std::vector<std::string>& argv, std::string& output);
+
   /**
    * Partitions the given vector of tokens into one or more commands based on
    * the position of pipes or file redirects.
@@ -322,13 +1237,179 @@ private:
    */
   std::map<std::string, builtin_t> builtins;
 
+  /**
+   * The builtins that only write output and never change the shell's state,
+   * so capturing their output doesn't require a separate process.
+   */
+  std::set<std::string> pure_builtins;
+
   /**
    * A mapping of variables (local to the shell) and their corresponding values.
    */
   std::map<std::string, std::string> localvars;
 
+  /**
+   * The buffer variable_substitution builds each expanded word in (except
+   * those with a $(command), which may run variable_substitution itself).
+   */
+  std::string expansion_buffer;
+
+  /**
+   * The partial line read with the last burst of pasted input, which the
+   * next readline starts with.
+   */
+  std::string paste_leftover;
+
   /**
    * A mapping of aliases and their corresponding values.
    */
-  std::map<std::string, std::string> aliases;
+  std::unordered_map<std::string, alias_t> aliases;
+
+  /**
+   * A mapping of shell function names and their parsed bodies.
+   */
+  std::map<std::string, script_ptr> functions;
+
+  /**
+   * The capacity given to the pipes the shell creates: a size in bytes,
+   * PIPE_SIZE_DEFAULT or PIPE_SIZE_AUTO.
+   */
+  long pipe_size;
+
+  /**
+   * The throughput (bytes per second) of the last run of each pipeline, keyed
+   * by pipeline_key(), for the adaptive pipe size.
+   */
+  std::map<std::string, double> pipeline_throughput;
+
+  /**
+   * Statistics for the most recent pipeline.
+   */
+  pipeline_stats_t last_pipeline;
+
+  /**
+   * Descriptors kept open for files that redirections append to or read
+   * from, keyed by 'a' or 'r' and the file's absolute path; the inotify
+   * descriptor watching those files; the number of lookups made in the
+   * cache, which orders its entries by last use; and the process the cache
+   * belongs to (a forked copy of the shell starts a cache of its own).
+   */
+  std::map<std::string, cached_fd_t> redirect_cache;
+  int redirect_watch_fd;
+  unsigned long redirect_uses;
+  pid_t redirect_cache_owner;
+
+  /**
+   * The worker computing the prompt's git segment, if it has been needed;
+   * the number of external commands run so far (any of which may change the
+   * git state); the duration of the last line in microseconds; and the
+   * status the prompt shows.
+   */
+  std::unique_ptr<prompt_worker_t> prompt_worker;
+  long commands_run;
+  double last_duration_us;
+  int prompt_status;
+
+  /**
+   * Whether this process is running a server session, and whether the
+   * session's client has asked it to exit.
+   */
+  bool in_session;
+  bool exit_requested;
+
+  /**
+   * The builtins whose only effects are on the state that the startup
+   * snapshot records. An rc file that runs anything else isn't snapshotted.
+   */
+  std::set<std::string> state_builtins;
+
+  /**
+   * When the shell started, for STARTUP_US.
+   */
+  timespec started;
+
+  /**
+   * Whether the rc file is running, whether it has done anything the
+   * snapshot can't reproduce, and the environment variables it has read.
+   */
+  bool running_startup;
+  bool startup_side_effects;
+  std::map<std::string, std::string> startup_environment;
+
+  /**
+   * The command hash (see hash_commands()), the $PATH it was built from, and
+   * the signature of the directories in that $PATH when it was built.
+   */
+  std::map<std::string, std::string> command_hash;
+  std::string command_hash_path;
+  uint64_t command_hash_signature;
+
+  /**
+   * The completion specs registered with complete, keyed by command name;
+   * their generators' output, keyed by the command and the previous word
+   * (separated by a NUL); and the command and previous word of the
+   * completion in progress.
+   */
+  std::map<std::string, completion_spec_t> completion_specs;
+  std::map<std::string, completion_cache_t> completion_cache;
+  std::string completing_command;
+  std::string completing_previous;
+
+  /**
+   * The read-ahead buffers of the descriptors read has read from, and the
+   * files it has opened itself inside loops, keyed by their absolute paths.
+   */
+  std::map<int, read_buffer_t> read_buffers;
+  std::map<std::string, read_file_t> read_files;
+
+  /**
+   * The open execution trace, if any.
+   */
+  std::unique_ptr<trace_log_t> trace_log;
+
+  /**
+   * Parsed arithmetic expressions, keyed by their text. The transparent
+   * comparator allows lookups by string_view without building a string.
+   */
+  std::map<std::string, arith_expr_t, std::less<> > arithmetic_cache;
+
+  /**
+   * Compiled glob pattern components, keyed by their text, and the buffer
+   * glob expansion reads directories into, allocated the first time it's
+   * needed.
+   */
+  std::map<std::string, glob_pattern_t, std::less<> > glob_cache;
+  std::unique_ptr<char[]> dirent_buffer;
+
+  /**
+   * Parsed trees of recently executed lines, keyed by the line's text.
+   */
+  std::map<std::string, script_ptr> script_cache;
+
+  /**
+   * A stack of positional parameters ($0, $1, ...), one entry per active
+   * function call. The bottom entry holds the shell's own name.
+   */
+  std::vector<std::vector<std::string> > positional_params;
+
+  /**
+   * The return value of the last command executed ($?).
+   */
+  int last_status;
+
+  /**
+   * The number of loops and function calls currently executing, used to
+   * validate break, continue and return.
+   */
+  int loop_depth;
+  int function_depth;
+
+  /**
+   * Control flow waiting to unwind the executing commands: the number of
+   * loops left to break out of or continue, and whether a function is
+   * returning.
+   */
+  int pending_breaks;
+  int pending_continues;
+  bool pending_return;
 };
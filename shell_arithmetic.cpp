@@ -0,0 +1,573 @@
+/**
+ * This file contains the implementation of arithmetic expansion: $(( expr )).
+ *
+ * Expressions use C's integer operators and precedence. Each distinct
+ * expression is parsed once into an arith_expr_t (see arithmetic.h) and
+ * cached, so evaluating the same expression again (e.g. a counter in a loop)
+ * only walks the already-built tree.
+ */
+
+#include "shell.h"
+#include "arithmetic.h"
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+
+/**
+ * The maximum number of parsed expressions to keep in the cache.
+ */
+const size_t ARITHMETIC_CACHE_SIZE = 256;
+
+
+/**
+ * The state of the parser while it walks over an expression's text.
+ */
+struct arith_parser_t {
+  const char* c;
+  arith_expr_t& expr;
+  bool ok;
+
+  arith_parser_t(const char* text, arith_expr_t& expr)
+    : c(text), expr(expr), ok(true) {}
+};
+
+
+/**
+ * A binary operator, its spelling and its precedence (higher binds tighter).
+ */
+struct binary_op_t {
+  const char* text;
+  ArithOp op;
+  int precedence;
+};
+
+
+// Longer spellings come first so that e.g. "<<" isn't read as "<".
+const binary_op_t binary_ops[] = {
+  { "**", ARITH_POWER,         11 },
+  { "<<", ARITH_SHIFT_LEFT,     8 },
+  { ">>", ARITH_SHIFT_RIGHT,    8 },
+  { "<=", ARITH_LESS_EQUAL,     7 },
+  { ">=", ARITH_GREATER_EQUAL,  7 },
+  { "==", ARITH_EQUAL,          6 },
+  { "!=", ARITH_NOT_EQUAL,      6 },
+  { "&&", ARITH_LOGICAL_AND,    2 },
+  { "||", ARITH_LOGICAL_OR,     1 },
+  { "*",  ARITH_MULTIPLY,      10 },
+  { "/",  ARITH_DIVIDE,        10 },
+  { "%",  ARITH_MODULO,        10 },
+  { "+",  ARITH_ADD,            9 },
+  { "-",  ARITH_SUBTRACT,       9 },
+  { "<",  ARITH_LESS,           7 },
+  { ">",  ARITH_GREATER,        7 },
+  { "&",  ARITH_BIT_AND,        5 },
+  { "^",  ARITH_BIT_XOR,        4 },
+  { "|",  ARITH_BIT_OR,         3 }
+};
+
+
+void skip_spaces(arith_parser_t& p) {
+  while (isspace(*p.c)) p.c++;
+}
+
+
+int add_node(arith_parser_t& p, const arith_node_t& node) {
+  p.expr.nodes.push_back(node);
+  return p.expr.nodes.size() - 1;
+}
+
+
+void arith_error(arith_parser_t& p) {
+  if (p.ok) {
+    cerr << "arithmetic: syntax error near `" << p.c << "'" << endl;
+  }
+  p.ok = false;
+}
+
+
+/**
+ * Returns the binary operator at the parser's position, or NULL if there is
+ * none (compound assignments like += are not binary operators).
+ */
+const binary_op_t* match_binary(arith_parser_t& p) {
+  for (size_t i = 0; i < sizeof(binary_ops) / sizeof(binary_ops[0]); i++) {
+    size_t length = strlen(binary_ops[i].text);
+    if (strncmp(p.c, binary_ops[i].text, length) != 0) continue;
+    if (p.c[length] == '=' && binary_ops[i].text[length - 1] != '=') {
+      return NULL;
+    }
+    return &binary_ops[i];
+  }
+  return NULL;
+}
+
+
+/**
+ * Returns the length of the assignment operator at the parser's position (0
+ * if there is none) and sets op to the binary operation it applies.
+ */
+size_t match_assignment(arith_parser_t& p, ArithOp& op) {
+  if (p.c[0] == '=' && p.c[1] != '=') {
+    op = ARITH_ASSIGN;
+    return 1;
+  }
+  const binary_op_t* binary = NULL;
+  for (size_t i = 0; i < sizeof(binary_ops) / sizeof(binary_ops[0]); i++) {
+    size_t length = strlen(binary_ops[i].text);
+    if (strncmp(p.c, binary_ops[i].text, length) == 0 && p.c[length] == '=') {
+      binary = &binary_ops[i];
+      break;
+    }
+  }
+  // comparisons and logical operators have no assignment form
+  if (binary == NULL || binary->precedence <= 2 || binary->precedence == 6 ||
+      binary->precedence == 7) {
+    return 0;
+  }
+  op = binary->op;
+  return strlen(binary->text) + 1;
+}
+
+
+int parse_arith_comma(arith_parser_t& p);
+int parse_arith_assignment(arith_parser_t& p);
+int parse_arith_unary(arith_parser_t& p);
+
+
+int parse_arith_primary(arith_parser_t& p) {
+  skip_spaces(p);
+
+  if (*p.c == '(') {
+    p.c++;
+    int node = parse_arith_comma(p);
+    skip_spaces(p);
+    if (*p.c != ')') {
+      arith_error(p);
+      return -1;
+    }
+    p.c++;
+    return node;
+  }
+
+  if (isdigit(*p.c)) {
+    arith_node_t number(ARITH_NUMBER);
+    char* end;
+    number.value = strtol(p.c, &end, 0);
+    if (isalnum(*end) || *end == '_') {
+      arith_error(p);
+      return -1;
+    }
+    p.c = end;
+    return add_node(p, number);
+  }
+
+  // variables may be written as name, $name, ${name} or $1
+  bool dollar = *p.c == '$';
+  bool brace = dollar && p.c[1] == '{';
+  if (dollar) p.c += brace ? 2 : 1;
+
+  arith_node_t variable(ARITH_VARIABLE);
+  if (dollar && isdigit(*p.c)) {
+    while (isdigit(*p.c)) variable.name += *p.c++;
+  } else if (isalpha(*p.c) || *p.c == '_') {
+    while (isalnum(*p.c) || *p.c == '_') variable.name += *p.c++;
+  } else if (dollar && (*p.c == '#' || *p.c == '?')) {
+    variable.name += *p.c++;
+  } else {
+    arith_error(p);
+    return -1;
+  }
+  if (brace) {
+    if (*p.c != '}') {
+      arith_error(p);
+      return -1;
+    }
+    p.c++;
+  }
+
+  int node = add_node(p, variable);
+
+  // postfix increment and decrement
+  skip_spaces(p);
+  if ((p.c[0] == '+' && p.c[1] == '+') || (p.c[0] == '-' && p.c[1] == '-')) {
+    arith_node_t post(p.c[0] == '+' ? ARITH_POST_INCREMENT
+                                    : ARITH_POST_DECREMENT);
+    post.name = variable.name;
+    p.c += 2;
+    node = add_node(p, post);
+  }
+  return node;
+}
+
+
+int parse_arith_unary(arith_parser_t& p) {
+  skip_spaces(p);
+
+  if ((p.c[0] == '+' && p.c[1] == '+') || (p.c[0] == '-' && p.c[1] == '-')) {
+    arith_node_t pre(p.c[0] == '+' ? ARITH_PRE_INCREMENT
+                                   : ARITH_PRE_DECREMENT);
+    p.c += 2;
+    int operand = parse_arith_unary(p);
+    // only a variable can be incremented
+    if (!p.ok || p.expr.nodes[operand].op != ARITH_VARIABLE) {
+      arith_error(p);
+      return -1;
+    }
+    pre.name = p.expr.nodes[operand].name;
+    return add_node(p, pre);
+  }
+
+  ArithOp op;
+  switch (*p.c) {
+    case '-': op = ARITH_NEGATE; break;
+    case '+': op = ARITH_UNARY_PLUS; break;
+    case '!': op = ARITH_NOT; break;
+    case '~': op = ARITH_COMPLEMENT; break;
+    default: return parse_arith_primary(p);
+  }
+  p.c++;
+  arith_node_t unary(op);
+  unary.left = parse_arith_unary(p);
+  return add_node(p, unary);
+}
+
+
+int parse_arith_binary(arith_parser_t& p, int min_precedence) {
+  int left = parse_arith_unary(p);
+
+  while (p.ok) {
+    skip_spaces(p);
+    const binary_op_t* binary = match_binary(p);
+    if (binary == NULL || binary->precedence < min_precedence) break;
+    p.c += strlen(binary->text);
+
+    // ** is right-associative; everything else is left-associative
+    int next = binary->op == ARITH_POWER ? binary->precedence
+                                         : binary->precedence + 1;
+    arith_node_t node(binary->op);
+    node.left = left;
+    node.right = parse_arith_binary(p, next);
+    left = add_node(p, node);
+  }
+  return left;
+}
+
+
+int parse_arith_conditional(arith_parser_t& p) {
+  int condition = parse_arith_binary(p, 1);
+  skip_spaces(p);
+  if (!p.ok || *p.c != '?') return condition;
+  p.c++;
+
+  arith_node_t node(ARITH_CONDITIONAL);
+  node.left = condition;
+  node.right = parse_arith_comma(p);
+  skip_spaces(p);
+  if (*p.c != ':') {
+    arith_error(p);
+    return -1;
+  }
+  p.c++;
+  node.third = parse_arith_conditional(p);
+  return add_node(p, node);
+}
+
+
+int parse_arith_assignment(arith_parser_t& p) {
+  int left = parse_arith_conditional(p);
+  skip_spaces(p);
+  if (!p.ok) return left;
+
+  ArithOp op;
+  size_t length = match_assignment(p, op);
+  if (length == 0) return left;
+  if (p.expr.nodes[left].op != ARITH_VARIABLE) {
+    arith_error(p);
+    return -1;
+  }
+  p.c += length;
+
+  arith_node_t node(ARITH_ASSIGN);
+  node.assign_op = op;
+  node.name = p.expr.nodes[left].name;
+  node.right = parse_arith_assignment(p);
+  return add_node(p, node);
+}
+
+
+int parse_arith_comma(arith_parser_t& p) {
+  int left = parse_arith_assignment(p);
+  skip_spaces(p);
+  while (p.ok && *p.c == ',') {
+    p.c++;
+    arith_node_t node(ARITH_COMMA);
+    node.left = left;
+    node.right = parse_arith_assignment(p);
+    left = add_node(p, node);
+    skip_spaces(p);
+  }
+  return left;
+}
+
+
+/**
+ * Adds, subtracts and multiplies in unsigned arithmetic, so that a result
+ * too big for a long wraps around (as in bash) rather than overflowing.
+ */
+long wrapping_add(long left, long right) {
+  return (long)((unsigned long)left + (unsigned long)right);
+}
+
+long wrapping_subtract(long left, long right) {
+  return (long)((unsigned long)left - (unsigned long)right);
+}
+
+long wrapping_multiply(long left, long right) {
+  return (long)((unsigned long)left * (unsigned long)right);
+}
+
+
+/**
+ * Applies a binary operator. Fails on division by zero, a negative
+ * exponent, and a shift count outside 0 to 63.
+ */
+bool apply_binary(ArithOp op, long left, long right, long& result) {
+  switch (op) {
+    case ARITH_POWER:
+      if (right < 0) {
+        cerr << "arithmetic: exponent less than 0" << endl;
+        return false;
+      }
+      // exponentiation by squaring
+      for (result = 1; right > 0; right >>= 1) {
+        if (right & 1) result = wrapping_multiply(result, left);
+        left = wrapping_multiply(left, left);
+      }
+      break;
+    case ARITH_MULTIPLY: result = wrapping_multiply(left, right); break;
+    case ARITH_DIVIDE:
+    case ARITH_MODULO:
+      if (right == 0) {
+        cerr << "arithmetic: division by 0" << endl;
+        return false;
+      }
+      if (right == -1) {
+        // the smallest long divided by -1 doesn't fit, and traps; it wraps
+        // back to itself, and the remainder is always 0
+        result = op == ARITH_DIVIDE ? wrapping_subtract(0, left) : 0;
+      } else {
+        result = op == ARITH_DIVIDE ? left / right : left % right;
+      }
+      break;
+    case ARITH_ADD: result = wrapping_add(left, right); break;
+    case ARITH_SUBTRACT: result = wrapping_subtract(left, right); break;
+    case ARITH_SHIFT_LEFT:
+    case ARITH_SHIFT_RIGHT:
+      if (right < 0 || right >= 64) {
+        cerr << "arithmetic: shift count out of range" << endl;
+        return false;
+      }
+      result = op == ARITH_SHIFT_LEFT ? (long)((unsigned long)left << right)
+                                      : left >> right;
+      break;
+    case ARITH_LESS: result = left < right; break;
+    case ARITH_LESS_EQUAL: result = left <= right; break;
+    case ARITH_GREATER: result = left > right; break;
+    case ARITH_GREATER_EQUAL: result = left >= right; break;
+    case ARITH_EQUAL: result = left == right; break;
+    case ARITH_NOT_EQUAL: result = left != right; break;
+    case ARITH_BIT_AND: result = left & right; break;
+    case ARITH_BIT_XOR: result = left ^ right; break;
+    case ARITH_BIT_OR: result = left | right; break;
+    default: result = right; break;
+  }
+  return true;
+}
+
+
+long Shell::arithmetic_variable(const string& name) {
+  const char* text = NULL;
+  const vector<string>& params = positional_params.back();
+
+  if (isdigit(name[0])) {
+    size_t index = strtoul(name.c_str(), NULL, 10);
+    if (index < params.size()) text = params[index].c_str();
+  } else if (name == "#") {
+    return params.size() - 1;
+  } else if (name == "?") {
+    return last_status;
+  } else if ((text = read_environment(name)) == NULL) {
+    map<string, string>::iterator var = localvars.find(name);
+    if (var != localvars.end()) text = var->second.c_str();
+  }
+
+  // unset and non-numeric variables count as 0
+  return text ? strtol(text, NULL, 10) : 0;
+}
+
+
+void Shell::set_arithmetic_variable(const string& name, long value) {
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "%ld", value);
+
+  // assign into the existing string so its buffer gets reused
+  map<string, string>::iterator var = localvars.find(name);
+  if (var != localvars.end()) {
+    var->second.assign(buffer, length);
+  } else {
+    localvars[name] = string(buffer, length);
+  }
+}
+
+
+bool Shell::evaluate_arithmetic(
+    const arith_expr_t& expr, int index, long& result) {
+  const arith_node_t& node = expr.nodes[index];
+  long left, right;
+
+  switch (node.op) {
+    case ARITH_NUMBER:
+      result = node.value;
+      return true;
+
+    case ARITH_VARIABLE:
+      result = arithmetic_variable(node.name);
+      return true;
+
+    case ARITH_NEGATE:
+    case ARITH_UNARY_PLUS:
+    case ARITH_NOT:
+    case ARITH_COMPLEMENT:
+      if (!evaluate_arithmetic(expr, node.left, left)) return false;
+      if (node.op == ARITH_NEGATE) result = wrapping_subtract(0, left);
+      else if (node.op == ARITH_UNARY_PLUS) result = left;
+      else if (node.op == ARITH_NOT) result = !left;
+      else result = ~left;
+      return true;
+
+    case ARITH_PRE_INCREMENT:
+    case ARITH_PRE_DECREMENT:
+    case ARITH_POST_INCREMENT:
+    case ARITH_POST_DECREMENT:
+      left = arithmetic_variable(node.name);
+      right = (node.op == ARITH_PRE_INCREMENT ||
+               node.op == ARITH_POST_INCREMENT) ? wrapping_add(left, 1)
+                                                : wrapping_subtract(left, 1);
+      set_arithmetic_variable(node.name, right);
+      // prefix forms yield the new value, postfix forms the old one
+      result = (node.op == ARITH_PRE_INCREMENT ||
+                node.op == ARITH_PRE_DECREMENT) ? right : left;
+      return true;
+
+    case ARITH_LOGICAL_AND:
+    case ARITH_LOGICAL_OR:
+      // only evaluate the right side when it decides the result
+      if (!evaluate_arithmetic(expr, node.left, left)) return false;
+      if ((left != 0) == (node.op == ARITH_LOGICAL_OR)) {
+        result = node.op == ARITH_LOGICAL_OR;
+        return true;
+      }
+      if (!evaluate_arithmetic(expr, node.right, right)) return false;
+      result = right != 0;
+      return true;
+
+    case ARITH_CONDITIONAL:
+      if (!evaluate_arithmetic(expr, node.left, left)) return false;
+      return evaluate_arithmetic(expr, left ? node.right : node.third, result);
+
+    case ARITH_ASSIGN:
+      if (!evaluate_arithmetic(expr, node.right, right)) return false;
+      if (node.assign_op == ARITH_ASSIGN) {
+        result = right;
+      } else if (!apply_binary(node.assign_op,
+            arithmetic_variable(node.name), right, result)) {
+        return false;
+      }
+      set_arithmetic_variable(node.name, result);
+      return true;
+
+    case ARITH_COMMA:
+      if (!evaluate_arithmetic(expr, node.left, left)) return false;
+      return evaluate_arithmetic(expr, node.right, result);
+
+    default:
+      if (!evaluate_arithmetic(expr, node.left, left)) return false;
+      if (!evaluate_arithmetic(expr, node.right, right)) return false;
+      return apply_binary(node.op, left, right, result);
+  }
+}
+
+
+const arith_expr_t* Shell::parse_arithmetic(string_view text) {
+  // reuse the parsed expression if this text has been seen before
+  map<string, arith_expr_t, less<> >::iterator cached =
+      arithmetic_cache.find(text);
+  if (cached != arithmetic_cache.end()) return &cached->second;
+
+  string source(text);
+  arith_expr_t expr;
+  arith_parser_t p(source.c_str(), expr);
+  skip_spaces(p);
+  if (*p.c == '\0') {
+    // an empty expression evaluates to 0
+    expr.root = add_node(p, arith_node_t(ARITH_NUMBER));
+  } else {
+    expr.root = parse_arith_comma(p);
+    skip_spaces(p);
+    if (p.ok && *p.c != '\0') arith_error(p);
+    if (!p.ok) return NULL;
+  }
+
+  if (arithmetic_cache.size() >= ARITHMETIC_CACHE_SIZE) {
+    arithmetic_cache.clear();
+  }
+  return &(arithmetic_cache[source] = expr);
+}
+
+
+bool Shell::arithmetic_substitution(vector<string>& tokens) {
+  for (size_t i = 0; i < tokens.size(); i++) {
+    string::size_type start = tokens[i].find("$((");
+    if (start == string::npos) continue;
+
+    string result;
+    string::size_type done = 0;
+    // a token may contain several expansions, e.g. $((a))x$((b))
+    while (start != string::npos) {
+      // find the closing '))' that matches the opening '$(('
+      string::size_type end = start + 3;
+      int depth = 2;
+      while (end < tokens[i].size() && depth > 0) {
+        if (tokens[i][end] == '(') depth++;
+        else if (tokens[i][end] == ')') depth--;
+        end++;
+      }
+      if (depth > 0) {
+        cerr << "arithmetic: missing `))'" << endl;
+        return false;
+      }
+
+      // the expression is everything between '$((' and '))'
+      string_view text(tokens[i]);
+      const arith_expr_t* expr =
+          parse_arithmetic(text.substr(start + 3, end - start - 5));
+      long value;
+      if (expr == NULL || !evaluate_arithmetic(*expr, expr->root, value)) {
+        return false;
+      }
+
+      result.append(tokens[i], done, start - done);
+      result += to_string(value);
+      done = end;
+      start = tokens[i].find("$((", end);
+    }
+    result.append(tokens[i], done, string::npos);
+    tokens[i] = result;
+  }
+  return true;
+}
@@ -5,8 +5,19 @@
 
 #include "shell.h"
 #include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
 #include <dirent.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <termios.h>
 #include <readline/history.h>
 
 using namespace std;
@@ -108,15 +119,17 @@ int Shell::com_pwd(vector<string>& argv) {
 
 
 int Shell::com_alias(vector<string>& argv) {
-  // if no arguments are given, print all current aliases
+  // if no arguments are given, print all current aliases, sorted by name
   if (argv.size() == 1) {
-    map<string, string>::iterator it;
-    for (it = aliases.begin(); it != aliases.end(); it++) {
-      cout << it->first << "=" << it->second << endl;
+    vector<string> names;
+    unordered_map<string, alias_t>::iterator it;
+    for (it = aliases.begin(); it != aliases.end(); it++) names.push_back(it->first);
+    sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) {
+      cout << names[i] << "=" << aliases[names[i]].value << endl;
     }
   }
   for (size_t i = 1; i < argv.size(); i++) {
-  //while (token != tokens.end()) {
     string::size_type eq_pos = argv[i].find("=");
 
     // Failure at the first token not in the form: key=value.
@@ -125,15 +138,17 @@ int Shell::com_alias(vector<string>& argv) {
       return -1;
     }
 
-    // get the key value pair
+    // words can't be quoted, so the value takes in the words after it that
+    // can't be another alias
     string key = argv[i].substr(0, eq_pos);
     string value = argv[i].substr(eq_pos + 1);
-    // add it to the alias map
-    if (aliases.count(key) > 0) { // overwrite the value
-      aliases.at(key) = value;
-    } else {                      // add a new key value pair
-      aliases.insert( pair<string, string>(key, value) );
+    while (i + 1 < argv.size() &&
+           (argv[i + 1].find("=") == string::npos || argv[i + 1][0] == '-')) {
+      value += " " + argv[++i];
     }
+
+    // add it to the alias map, split into words
+    define_alias(key, value);
   }
 
   return 0;
@@ -141,32 +156,33 @@ int Shell::com_alias(vector<string>& argv) {
 
 
 int Shell::com_unalias(vector<string>& argv) {
-  // needs exactly 1 argument (not including unalias itself)
-  if (argv.size() != 2) {
+  if (argv.size() < 2) {
     cerr << __FUNCTION__ << ": Incorrect amount of arguments." << endl;
     return -1;
   }
 
   if (argv[1] == "-a") {
     aliases.clear();
-  } else {
-    // since the alias will have been expanded by now, must search for the value to erase it
-    map<string, string>::iterator it;
-    for (it = aliases.begin(); it != aliases.end(); it++) {
-      if (it->second == argv[1]) {
-        aliases.erase(it->first);
-        break;
-      }
+    return 0;
+  }
+
+  // the names are never expanded, since they aren't in command position
+  int return_value = 0;
+  for (size_t i = 1; i < argv.size(); i++) {
+    if (aliases.erase(argv[i]) == 0) {
+      cerr << __FUNCTION__ << ": " << argv[i] << ": not found" << endl;
+      return_value = 1;
     }
   }
-  return 0;
+  return return_value;
 }
 
 
 int Shell::com_echo(vector<string>& argv) {
-  // loop and print all the arguments
+  // loop and print all the arguments, separated by spaces
   for (size_t i = 1; i < argv.size(); i++) {
-    cout << argv[i] << " ";
+    if (i > 1) cout << " ";
+    cout << argv[i];
   }
   cout << endl;
   return 0;
@@ -192,7 +208,811 @@ int Shell::com_history(vector<string>& argv) {
 }
 
 
+int Shell::com_true(vector<string>& argv) {
+  return 0;
+}
+
+
+int Shell::com_false(vector<string>& argv) {
+  return 1;
+}
+
+
+/**
+ * Parses an integer operand for test, printing an error if it isn't one.
+ */
+bool parse_test_integer(const string& text, long& value) {
+  char* end;
+  value = strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end != '\0') {
+    cerr << "test: " << text << ": integer expression expected" << endl;
+    return false;
+  }
+  return true;
+}
+
+
+int Shell::com_test(vector<string>& argv) {
+  vector<string> args(argv.begin() + 1, argv.end());
+
+  // '[' must be closed with a matching ']'
+  if (argv[0] == "[") {
+    if (args.empty() || args.back() != "]") {
+      cerr << "[: missing `]'" << endl;
+      return 2;
+    }
+    args.pop_back();
+  }
+
+  bool negate = false;
+  if (args.size() > 1 && args[0] == "!") {
+    negate = true;
+    args.erase(args.begin());
+  }
+
+  bool result = false;
+  if (args.size() == 1) {
+    // a single argument is true if it is non-empty
+    result = !args[0].empty();
+  } else if (args.size() == 2) {
+    const string& op = args[0];
+    struct stat info;
+    bool exists = stat(args[1].c_str(), &info) == 0;
+
+    if (op == "-z") result = args[1].empty();
+    else if (op == "-n") result = !args[1].empty();
+    else if (op == "-e") result = exists;
+    else if (op == "-f") result = exists && S_ISREG(info.st_mode);
+    else if (op == "-d") result = exists && S_ISDIR(info.st_mode);
+    else if (op == "-s") result = exists && info.st_size > 0;
+    else if (op == "-r") result = access(args[1].c_str(), R_OK) == 0;
+    else if (op == "-w") result = access(args[1].c_str(), W_OK) == 0;
+    else if (op == "-x") result = access(args[1].c_str(), X_OK) == 0;
+    else {
+      cerr << "test: " << op << ": unary operator expected" << endl;
+      return 2;
+    }
+  } else if (args.size() == 3) {
+    const string& op = args[1];
+    long left, right;
+
+    if (op == "=" || op == "==") {
+      result = args[0] == args[2];
+    } else if (op == "!=") {
+      result = args[0] != args[2];
+    } else if (op == "-eq" || op == "-ne" || op == "-lt" ||
+               op == "-le" || op == "-gt" || op == "-ge") {
+      if (!parse_test_integer(args[0], left)) return 2;
+      if (!parse_test_integer(args[2], right)) return 2;
+
+      if (op == "-eq") result = left == right;
+      else if (op == "-ne") result = left != right;
+      else if (op == "-lt") result = left < right;
+      else if (op == "-le") result = left <= right;
+      else if (op == "-gt") result = left > right;
+      else result = left >= right;
+    } else {
+      cerr << "test: " << op << ": binary operator expected" << endl;
+      return 2;
+    }
+  } else if (args.size() > 3) {
+    cerr << "test: too many arguments" << endl;
+    return 2;
+  }
+
+  return result != negate ? 0 : 1;
+}
+
+
+/**
+ * Parses the optional loop count for break and continue.
+ */
+int parse_loop_count(vector<string>& argv, const char* name) {
+  if (argv.size() > 2) {
+    cerr << name << ": Too many arguments." << endl;
+    return -1;
+  }
+  if (argv.size() == 1) return 1;
+
+  char* end;
+  long count = strtol(argv[1].c_str(), &end, 10);
+  if (*end != '\0' || count < 1) {
+    cerr << name << ": " << argv[1] << ": loop count out of range" << endl;
+    return -1;
+  }
+  return count;
+}
+
+
+int Shell::com_break(vector<string>& argv) {
+  if (loop_depth == 0) {
+    cerr << __FUNCTION__ << ": only meaningful in a loop" << endl;
+    return -1;
+  }
+  int count = parse_loop_count(argv, __FUNCTION__);
+  if (count < 0) return -1;
+
+  // can't break out of more loops than are running
+  pending_breaks = min(count, loop_depth);
+  return 0;
+}
+
+
+int Shell::com_continue(vector<string>& argv) {
+  if (loop_depth == 0) {
+    cerr << __FUNCTION__ << ": only meaningful in a loop" << endl;
+    return -1;
+  }
+  int count = parse_loop_count(argv, __FUNCTION__);
+  if (count < 0) return -1;
+
+  pending_continues = min(count, loop_depth);
+  return 0;
+}
+
+
+int Shell::com_return(vector<string>& argv) {
+  if (function_depth == 0) {
+    cerr << __FUNCTION__ << ": can only return from a function" << endl;
+    return -1;
+  }
+  if (argv.size() > 2) {
+    cerr << __FUNCTION__ << ": Too many arguments." << endl;
+    return -1;
+  }
+
+  int return_value = last_status;
+  if (argv.size() == 2) {
+    char* end;
+    return_value = strtol(argv[1].c_str(), &end, 10);
+    if (*end != '\0') {
+      cerr << __FUNCTION__ << ": " << argv[1] << ": numeric argument required"
+           << endl;
+      return -1;
+    }
+  }
+
+  // call_function picks the status up from last_status once unwound
+  pending_return = true;
+  last_status = return_value;
+  return return_value;
+}
+
+
+int Shell::com_batch(vector<string>& argv) {
+  int jobs = 1;
+  size_t first = 1;
+
+  // parse the optional number of batches to run at once
+  if (argv.size() > 2 && argv[1] == "-P") {
+    char* end;
+    jobs = strtol(argv[2].c_str(), &end, 10);
+    if (*end != '\0' || jobs < 1) {
+      cerr << __FUNCTION__ << ": " << argv[2] << ": invalid job count" << endl;
+      return -1;
+    }
+    first = 3;
+  }
+  if (first >= argv.size()) {
+    cerr << __FUNCTION__ << ": usage: batch [-P jobs] command [args...]" << endl;
+    return -1;
+  }
+
+  // builtins and functions aren't exec'd, so they have no argument limit
+  vector<string> tokens(argv.begin() + first, argv.end());
+  if (builtins.count(tokens[0]) > 0 || functions.count(tokens[0]) > 0) {
+    return dispatch_command(tokens);
+  }
+
+  vector<command_t> commands;
+  if (!partition_tokens(tokens, commands)) return -1;
+  for (size_t i = 0; i < commands.size(); i++) {
+    commands[i].batch_jobs = jobs;
+  }
+  return run_pipeline(commands);
+}
+
+
+int Shell::com_pin(vector<string>& argv) {
+  string cpu_spec, node_spec;
+  bool spread = false;
+
+  // parse the options, which come before the command
+  size_t first = 1;
+  while (first < argv.size() && argv[first].compare(0, 2, "--") == 0) {
+    if (argv[first] == "--spread") {
+      spread = true;
+      first++;
+    } else if ((argv[first] == "--cpus" || argv[first] == "--node") &&
+               first + 1 < argv.size()) {
+      (argv[first] == "--cpus" ? cpu_spec : node_spec) = argv[first + 1];
+      first += 2;
+    } else {
+      cerr << __FUNCTION__ << ": " << argv[first] << ": invalid option" << endl;
+      return -1;
+    }
+  }
+  if (first >= argv.size() || (cpu_spec.empty() && node_spec.empty() && !spread)) {
+    cerr << __FUNCTION__ << ": usage: pin [--cpus LIST[:LIST...]] "
+         << "[--node N[:N...]] [--spread] command..." << endl;
+    return -1;
+  }
+
+  vector<string> tokens(argv.begin() + first, argv.end());
+  vector<command_t> commands;
+  if (!partition_tokens(tokens, commands)) return -1;
+  if (!assign_placements(commands, cpu_spec, node_spec, spread)) return -1;
+  return run_pipeline(commands);
+}
+
+
+/**
+ * Parses a pipe size for pipesize: a number of bytes (optionally ending in K
+ * or M), "auto" or "default".
+ */
+bool parse_pipe_size(const string& text, long& size) {
+  if (text == "auto") {
+    size = PIPE_SIZE_AUTO;
+    return true;
+  }
+  if (text == "default") {
+    size = PIPE_SIZE_DEFAULT;
+    return true;
+  }
+
+  char* end;
+  size = strtol(text.c_str(), &end, 10);
+  if (*end == 'k' || *end == 'K') {
+    size *= 1024;
+    end++;
+  } else if (*end == 'm' || *end == 'M') {
+    size *= 1024 * 1024;
+    end++;
+  }
+  return text.size() > 0 && *end == '\0' && size > 0;
+}
+
+
+/**
+ * Returns a pipe size setting in a readable form.
+ */
+string describe_pipe_size(long size) {
+  if (size == PIPE_SIZE_AUTO) return "auto";
+  if (size == PIPE_SIZE_DEFAULT) return "default";
+  return to_string(size);
+}
+
+
+int Shell::com_pipesize(vector<string>& argv) {
+  size_t first = 1;
+  bool verbose = first < argv.size() && argv[first] == "-v";
+  if (verbose) first++;
+
+  if (first == argv.size()) {
+    if (verbose) {
+      const pipeline_stats_t& stats = last_pipeline;
+      if (!stats.measured) {
+        cout << "not measured (only pipelines with an auto pipe size, or run "
+             << "with pipesize -v, are)" << endl;
+        return 0;
+      }
+      cout << "pipe size:             " << stats.pipe_size << endl
+           << "bytes piped:           " << stats.bytes_piped << endl
+           << "bytes fanned out:      " << stats.bytes_fanned_out << endl
+           << "sinks dropped:         " << stats.sinks_dropped << endl
+           << "seconds:               " << stats.seconds << endl
+           << "voluntary switches:    " << stats.voluntary_switches << endl
+           << "involuntary switches:  " << stats.involuntary_switches << endl;
+    } else {
+      cout << describe_pipe_size(pipe_size) << " (maximum "
+           << max_pipe_size() << ")" << endl;
+    }
+    return 0;
+  }
+
+  long size;
+  if (!parse_pipe_size(argv[first], size)) {
+    cerr << __FUNCTION__ << ": " << argv[first] << ": invalid size" << endl;
+    return -1;
+  }
+  if (size > max_pipe_size()) {
+    cerr << __FUNCTION__ << ": " << argv[first] << ": larger than the maximum ("
+         << max_pipe_size() << ")" << endl;
+    return -1;
+  }
+
+  // without a command, change the setting for the rest of the session
+  if (first + 1 == argv.size()) {
+    pipe_size = size;
+    return 0;
+  }
+
+  vector<string> tokens(argv.begin() + first + 1, argv.end());
+  vector<command_t> commands;
+  if (!partition_tokens(tokens, commands)) return -1;
+  for (size_t i = 0; i < commands.size(); i++) {
+    commands[i].pipe_size = size;
+    commands[i].measure = verbose;
+  }
+
+  int return_value = run_pipeline(commands);
+  if (verbose) {
+    const pipeline_stats_t& stats = last_pipeline;
+    cerr << "pipesize: " << stats.pipe_size << "-byte pipes, "
+         << stats.bytes_piped << " bytes piped in " << stats.seconds << " s, "
+         << stats.voluntary_switches << " voluntary and "
+         << stats.involuntary_switches << " involuntary context switches"
+         << endl;
+  }
+  return return_value;
+}
+
+
+/**
+ * Parses a duration: a number of seconds, or a number ending in ms, s, m or
+ * h.
+ */
+bool parse_duration(const string& text, double& seconds) {
+  char* end;
+  seconds = strtod(text.c_str(), &end);
+  // rejects NaN as well as negative numbers
+  if (end == text.c_str() || !(seconds >= 0) || seconds > 1e9) return false;
+
+  string unit = end;
+  if (unit == "ms") seconds /= 1000;
+  else if (unit == "m") seconds *= 60;
+  else if (unit == "h") seconds *= 3600;
+  else if (unit != "" && unit != "s") return false;
+  return true;
+}
+
+
+/**
+ * Returns the index of the first word of every's command: the words after
+ * the options (-d, -n COUNT) and the interval, which execute_simple_command
+ * leaves unexpanded.
+ */
+size_t every_command_start(const vector<string>& argv) {
+  size_t first = 1;
+  while (first < argv.size() && !argv[first].empty() && argv[first][0] == '-') {
+    first += argv[first] == "-n" ? 2 : 1;
+  }
+  return min(first + 1, argv.size());
+}
+
+
+/**
+ * Set by the SIGINT handler that 'every' installs while it runs.
+ */
+volatile sig_atomic_t every_interrupted = 0;
+
+void stop_every(int) {
+  every_interrupted = 1;
+}
+
+
+int Shell::com_every(vector<string>& argv) {
+  bool diff = false;
+  long count = -1;
+
+  // parse the options, which come before the interval
+  size_t first = 1;
+  while (first < argv.size() && argv[first][0] == '-') {
+    if (argv[first] == "-d") {
+      diff = true;
+      first++;
+    } else if (argv[first] == "-n" && first + 1 < argv.size()) {
+      char* end;
+      count = strtol(argv[first + 1].c_str(), &end, 10);
+      if (*end != '\0' || count < 1) {
+        cerr << __FUNCTION__ << ": " << argv[first + 1] << ": invalid count" << endl;
+        return -1;
+      }
+      first += 2;
+    } else {
+      cerr << __FUNCTION__ << ": " << argv[first] << ": invalid option" << endl;
+      return -1;
+    }
+  }
+  double interval;
+  if (first + 1 >= argv.size()) {
+    cerr << __FUNCTION__ << ": usage: every [-d] [-n count] interval command..." << endl;
+    return -1;
+  }
+  if (!parse_duration(argv[first], interval) || interval <= 0) {
+    cerr << __FUNCTION__ << ": " << argv[first] << ": invalid interval" << endl;
+    return -1;
+  }
+
+  // the timer needs an interval it can represent; a zero one would fire once
+  struct itimerspec schedule;
+  schedule.it_interval.tv_sec = (time_t)interval;
+  schedule.it_interval.tv_nsec = (long)((interval - (time_t)interval) * 1e9);
+  if (schedule.it_interval.tv_sec == 0 && schedule.it_interval.tv_nsec == 0) {
+    cerr << __FUNCTION__ << ": " << argv[first] << ": invalid interval" << endl;
+    return -1;
+  }
+
+  // parse the command once; every run executes the same tree, expanding its
+  // words again (they reach here unexpanded)
+  string text = argv[first + 1];
+  for (size_t i = first + 2; i < argv.size(); i++) text += " " + argv[i];
+  script_ptr script;
+  if (parse_script(text, script) != PARSE_OK) {
+    cerr << __FUNCTION__ << ": syntax error in `" << text << "'" << endl;
+    return -1;
+  }
+
+  // the first run is due now and the rest at fixed offsets from it, so a
+  // slow run never pushes the later ones back
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  schedule.it_value = start;
+  if (timer < 0 || timerfd_settime(timer, TFD_TIMER_ABSTIME, &schedule, NULL) < 0) {
+    perror(__FUNCTION__);
+    if (timer >= 0) close(timer);
+    return -1;
+  }
+
+  // Ctrl-C ends the loop (and the run in progress) rather than the shell
+  struct sigaction action, previous;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_every;
+  sigaction(SIGINT, &action, &previous);
+  every_interrupted = 0;
+
+  long runs = 0, skipped = 0, overruns = 0, unchanged = 0;
+  uint64_t ticks = 0;
+  double total_jitter_us = 0, max_jitter_us = 0;
+  string last_output, output;
+  int return_value = 0;
+  while (!every_interrupted && !exit_requested && (count < 0 || runs < count)) {
+    uint64_t expirations;
+    if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+      if (errno == EINTR) continue;
+      perror(__FUNCTION__);
+      break;
+    }
+    // ticks that passed while the last run was still going are skipped
+    ticks += expirations;
+    skipped += expirations - 1;
+
+    timespec run_start, run_end;
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+    double jitter_us = elapsed_us(start, run_start) - (ticks - 1) * interval * 1e6;
+    total_jitter_us += jitter_us;
+    max_jitter_us = max(max_jitter_us, jitter_us);
+
+    if (!diff) {
+      return_value = execute_script(*script);
+    } else if (capture_script_output(*script, output)) {
+      return_value = last_status;
+      if (runs == 0 || output != last_output) {
+        cout << output;
+        cout.flush();
+        last_output.swap(output);
+      } else {
+        unchanged++;
+      }
+    }
+    runs++;
+
+    clock_gettime(CLOCK_MONOTONIC, &run_end);
+    if (elapsed_us(run_start, run_end) > interval * 1e6) overruns++;
+  }
+
+  sigaction(SIGINT, &previous, NULL);
+  close(timer);
+
+  cerr << __FUNCTION__ << ": " << runs << " runs, " << skipped << " skipped ticks, "
+       << overruns << " overruns";
+  if (diff) cerr << ", " << unchanged << " unchanged";
+  if (runs > 0) {
+    cerr << "; jitter mean " << (long)(total_jitter_us / runs) << " us, max "
+         << (long)max_jitter_us << " us";
+  }
+  cerr << endl;
+  return return_value;
+}
+
+
+/**
+ * Set by the SIGINT handler that 'timeout' installs while its command runs.
+ */
+volatile sig_atomic_t timeout_interrupted = 0;
+
+void interrupt_timeout(int) {
+  timeout_interrupted = 1;
+}
+
+
+/**
+ * Makes a process group the terminal's foreground group. SIGTTOU is blocked
+ * meanwhile, since a process outside the foreground group would otherwise be
+ * stopped for trying.
+ */
+void give_terminal(pid_t group) {
+  sigset_t ttou, previous;
+  sigemptyset(&ttou);
+  sigaddset(&ttou, SIGTTOU);
+  pthread_sigmask(SIG_BLOCK, &ttou, &previous);
+  if (tcsetpgrp(STDIN_FILENO, group) < 0) perror("timeout: tcsetpgrp");
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+
+/**
+ * Arms a one-shot timer to fire in the given number of seconds.
+ */
+void arm_timer(int timer, double seconds) {
+  struct itimerspec expiry;
+  memset(&expiry, 0, sizeof(expiry));
+  expiry.it_value.tv_sec = (time_t)seconds;
+  expiry.it_value.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+  if (timerfd_settime(timer, 0, &expiry, NULL) < 0) perror("timeout");
+}
+
+
+int Shell::com_timeout(vector<string>& argv) {
+  double duration = -1, grace = 0;
+
+  // -k may come before or after the duration
+  size_t first = 1;
+  while (first < argv.size()) {
+    if (argv[first] == "-k" && first + 1 < argv.size()) {
+      if (!parse_duration(argv[first + 1], grace)) {
+        cerr << __FUNCTION__ << ": " << argv[first + 1] << ": invalid grace period" << endl;
+        return TIMEOUT_FAILED;
+      }
+      first += 2;
+    } else if (duration < 0) {
+      if (!parse_duration(argv[first], duration)) {
+        cerr << __FUNCTION__ << ": " << argv[first] << ": invalid duration" << endl;
+        return TIMEOUT_FAILED;
+      }
+      first++;
+    } else {
+      break;
+    }
+  }
+  if (duration < 0 || first >= argv.size()) {
+    cerr << __FUNCTION__ << ": usage: timeout duration [-k grace] command..." << endl;
+    return TIMEOUT_FAILED;
+  }
+
+  // a lone external command is exec'd by the child itself, rather than by
+  // another process under it; builtins, functions, pipelines and
+  // redirections are run by the child as the shell would run them
+  vector<string> tokens(argv.begin() + first, argv.end());
+  vector<command_t> commands;
+  bool direct = builtins.count(tokens[0]) == 0 && functions.count(tokens[0]) == 0 &&
+      partition_tokens(tokens, commands) && commands.size() == 1 &&
+      commands[0].input_type == READ_FROM_STDIN &&
+      commands[0].output_type == WRITE_TO_STDOUT &&
+      commands[0].error_type == WRITE_ERR_TO_STDERR;
+  vector<char*> exec_argv;
+  for (size_t i = 0; direct && i < tokens.size(); i++) {
+    exec_argv.push_back((char*)tokens[i].c_str());
+  }
+  exec_argv.push_back(NULL);
+
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (timer < 0) {
+    perror(__FUNCTION__);
+    return TIMEOUT_FAILED;
+  }
+
+  // flush first so the child doesn't repeat anything still buffered
+  cout.flush();
+  cerr.flush();
+  settle_read_buffers();
+  commands_run++;
+
+  // on a terminal the command's group takes over the foreground while it
+  // runs, so that it can read the terminal and gets its Ctrl-C directly
+  bool foreground = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork failed");
+    close(timer);
+    return TIMEOUT_FAILED;
+  }
+  if (pid == 0) {
+    // the command and everything it starts share a process group, so the
+    // signals reach all of it
+    setpgid(0, 0);
+    if (foreground) give_terminal(getpid());
+    if (direct) {
+      execvp(exec_argv[0], exec_argv.data());
+      // perror may change errno
+      int error = errno;
+      perror("exec failed");
+      _exit(error == ENOENT ? 127 : 126);
+    }
+    int return_value = dispatch_command(tokens);
+    cout.flush();
+    _exit(return_value);
+  }
+  // in the parent too, so the group exists before any signal is sent (or
+  // the terminal is handed to it)
+  setpgid(pid, pid);
+  if (foreground) give_terminal(pid);
+
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd < 0) {
+    perror(__FUNCTION__);
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(timer);
+    return TIMEOUT_FAILED;
+  }
+
+  // Ctrl-C is passed on to the command rather than ending the shell
+  struct sigaction action, previous;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = interrupt_timeout;
+  sigaction(SIGINT, &action, &previous);
+  timeout_interrupted = 0;
+
+  // a duration (or grace period) of 0 means no limit
+  if (duration > 0) arm_timer(timer, duration);
+  int sent = 0;
+  struct pollfd events[2] = { { pidfd, POLLIN, 0 }, { timer, POLLIN, 0 } };
+  while (true) {
+    int ready = poll(events, 2, -1);
+    if (timeout_interrupted) {
+      timeout_interrupted = 0;
+      kill(-pid, SIGINT);
+    }
+    if (ready < 0 && errno == EINTR) continue;
+    if (ready < 0) {
+      perror(__FUNCTION__);
+      sent = SIGKILL;
+      kill(-pid, SIGKILL);
+      break;
+    }
+    if (events[0].revents) break;
+    if (events[1].revents) {
+      uint64_t expirations;
+      if (read(timer, &expirations, sizeof(expirations)) < 0) continue;
+      if (sent == 0) {
+        // a stopped process only sees the SIGTERM once it's continued
+        sent = SIGTERM;
+        kill(-pid, SIGTERM);
+        kill(-pid, SIGCONT);
+        if (grace > 0) arm_timer(timer, grace);
+      } else {
+        sent = SIGKILL;
+        kill(-pid, SIGKILL);
+      }
+    }
+  }
+
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  // nothing the command started outlives its time
+  if (sent != 0) kill(-pid, SIGKILL);
+  if (foreground) give_terminal(getpgrp());
+  sigaction(SIGINT, &previous, NULL);
+  close(pidfd);
+  close(timer);
+
+  if (sent == SIGKILL) return TIMEOUT_KILLED;
+  if (sent == SIGTERM) return TIMEOUT_EXPIRED;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+
+/**
+ * Drops the cached generator output for a command.
+ */
+void forget_completions(map<string, completion_cache_t>& cache, const string& name) {
+  string prefix = name + '\0';
+  map<string, completion_cache_t>::iterator it = cache.lower_bound(prefix);
+  while (it != cache.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+    cache.erase(it++);
+  }
+}
+
+
+int Shell::com_complete(vector<string>& argv) {
+  // with no names, list the specs in a form that can be run again
+  if (argv.size() == 1 || (argv.size() == 2 && argv[1] == "-p")) {
+    map<string, completion_spec_t>::iterator it;
+    for (it = completion_specs.begin(); it != completion_specs.end(); it++) {
+      const completion_spec_t& spec = it->second;
+      cout << "complete";
+      for (size_t i = 0; i < spec.words.size(); i++) {
+        cout << (i == 0 ? " -W " : ",") << spec.words[i];
+      }
+      if (!spec.function.empty()) cout << " -F " << spec.function;
+      if (!spec.command.empty()) cout << " -C " << spec.command;
+      if (spec.ttl_ms != COMPLETION_DEFAULT_TTL_MS) {
+        if (spec.ttl_ms % 1000 == 0) cout << " -t " << spec.ttl_ms / 1000 << "s";
+        else cout << " -t " << spec.ttl_ms << "ms";
+      }
+      cout << " " << it->first << endl;
+    }
+    return 0;
+  }
+
+  if (argv[1] == "-r") {
+    int return_value = 0;
+    for (size_t i = 2; i < argv.size(); i++) {
+      if (completion_specs.erase(argv[i]) == 0) {
+        cerr << __FUNCTION__ << ": " << argv[i] << ": no completion specification" << endl;
+        return_value = 1;
+      }
+      forget_completions(completion_cache, argv[i]);
+    }
+    return return_value;
+  }
+
+  // parse the options, which come before the names
+  completion_spec_t spec;
+  size_t first = 1;
+  while (first < argv.size() && argv[first][0] == '-') {
+    if (first + 1 >= argv.size()) {
+      cerr << __FUNCTION__ << ": " << argv[first] << ": option requires an argument" << endl;
+      return -1;
+    }
+    const string& option = argv[first];
+    const string& value = argv[first + 1];
+    if (option == "-W") {
+      // words can't be quoted, so commas separate them too
+      string word;
+      for (size_t i = 0; i <= value.size(); i++) {
+        if (i == value.size() || value[i] == ',' || value[i] == ' ' || value[i] == '\t') {
+          if (!word.empty()) spec.words.push_back(word);
+          word.clear();
+        } else {
+          word += value[i];
+        }
+      }
+    } else if (option == "-F") {
+      spec.function = value;
+    } else if (option == "-C") {
+      spec.command = value;
+    } else if (option == "-t") {
+      double ttl;
+      if (!parse_duration(value, ttl)) {
+        cerr << __FUNCTION__ << ": " << value << ": invalid time to live" << endl;
+        return -1;
+      }
+      spec.ttl_ms = ttl * 1000;
+    } else {
+      cerr << __FUNCTION__ << ": " << option << ": invalid option" << endl;
+      return -1;
+    }
+    first += 2;
+  }
+  if (first >= argv.size() ||
+      (spec.words.empty() && spec.function.empty() && spec.command.empty())) {
+    cerr << __FUNCTION__ << ": usage: complete [-W words] [-F function] [-C command] "
+         << "[-t ttl] name..." << endl;
+    return -1;
+  }
+
+  sort(spec.words.begin(), spec.words.end());
+  spec.words.erase(unique(spec.words.begin(), spec.words.end()), spec.words.end());
+  for (size_t i = first; i < argv.size(); i++) {
+    completion_specs[argv[i]] = spec;
+    forget_completions(completion_cache, argv[i]);
+  }
+  return 0;
+}
+
+
 int Shell::com_exit(vector<string>& argv) {
+  // a server session stops running commands and ends once the client has
+  // been told the status
+  if (in_session) {
+    exit_requested = true;
+    return 0;
+  }
+
   // exit the program entirely
   exit(EXIT_SUCCESS);
 }
@@ -9,16 +9,43 @@
 
 #include "shell.h"
 #include "command.h"
+#include "fan_out.h"
+#include "find.h"
+#include "text_builtins.h"
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <sstream>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <fstream>
+#include <memory>
+#include <time.h>
 
 using namespace std;
 
 
+// Linux-specific fcntl commands, which glibc only declares with _GNU_SOURCE.
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+#endif
+
+/**
+ * The smallest capacity the adaptive pipe size will choose (the kernel's
+ * default), and how much data it aims for a pipe to hold: the amount the
+ * pipeline moves in this many seconds.
+ */
+const long ADAPTIVE_MIN_PIPE_SIZE = 64 * 1024;
+const double ADAPTIVE_PIPE_SECONDS = 0.001;
+
+
 char** to_char_array(vector<string>& tokens) {
   char** result = new char*[tokens.size() + 1];
   // loop through the vector and put the tokens in the result array
@@ -31,103 +58,849 @@ char** to_char_array(vector<string>& tokens) {
 }
 
 
+/**
+ * Redirects the standard streams of a forked child as its command requires.
+ * fds holds the files the shell opened for it, read_fd is the read side of
+ * the previous stage's pipe and the_pipe is this stage's pipe (if it writes
+ * to one). Exits the child on failure.
+ */
+void redirect_child_io(const command_t& command, const redirect_fds_t& fds,
+                       int read_fd, int the_pipe[2]) {
+  const int PIPE_READ = 0;  // to acces read and write sides of pipe
+  const int PIPE_WRITE = 1;
+
+  // setup the input stream
+  if (command.input_type == READ_FROM_PIPE) {
+    // dup for reading from the pipe
+    if (dup2(read_fd, STDIN_FILENO) < 0) {
+      perror("READ_FROM_PIPE dup2 error");
+      _exit(errno);
+    }
+    close(read_fd);
+  } else if (command.input_type == READ_FROM_FILE) {
+    // dup for reading from a file; the shell's descriptor is close-on-exec
+    if (dup2(fds.input, STDIN_FILENO) < 0) {
+      perror("READ_FROM_FILE dup2 error");
+      _exit(errno);
+    }
+  }
+
+  // setup the output stream
+  if (command.output_type == WRITE_TO_PIPE) {
+    // dup for writing to the pipe
+    close(the_pipe[PIPE_READ]); // never read from the pipe, read_fd is used instead
+    if (dup2(the_pipe[PIPE_WRITE], STDOUT_FILENO) < 0) {
+      perror("WRITE_TO_PIPE dup2 error");
+      _exit(errno);
+    }
+    close(the_pipe[PIPE_WRITE]);
+  } else if (command.output_type == WRITE_TO_FILE ||
+             command.output_type == APPEND_TO_FILE) {
+    // dup for writing or appending to a file
+    if (dup2(fds.output, STDOUT_FILENO) < 0) {
+      perror("output file dup2 error");
+      _exit(errno);
+    }
+  }
+
+  // setup the error stream, after the output so 2>&1 follows it
+  if (command.error_type == WRITE_ERR_TO_FILE ||
+      command.error_type == APPEND_ERR_TO_FILE) {
+    if (dup2(fds.error, STDERR_FILENO) < 0) {
+      perror("error file dup2 error");
+      _exit(errno);
+    }
+  } else if (command.error_type == WRITE_ERR_TO_OUTPUT) {
+    if (dup2(STDOUT_FILENO, STDERR_FILENO) < 0) {
+      perror("WRITE_ERR_TO_OUTPUT dup2 error");
+      _exit(errno);
+    }
+  }
+}
+
+
+/**
+ * Returns whether a stage can run in a thread of the shell (see
+ * text_builtins.h) rather than in a child process: it must be a supported
+ * text builtin that reads from a pipe or a file (never the shell's own
+ * input), and mustn't need a process of its own for batching or placement.
+ */
+bool runs_in_process(const command_t& command) {
+  return command.input_type != READ_FROM_STDIN && command.batch_jobs == 0 &&
+         command.cpus.empty() && command.numa_node < 0 &&
+         text_builtin_supported(command.argv);
+}
+
+
+/**
+ * Returns whether adjacent in-process stages are joined by channels, which
+ * is the default. Setting MYSHELL_CHANNELS=0 joins them with pipes instead,
+ * for comparison.
+ */
+bool channels_enabled() {
+  const char* setting = getenv("MYSHELL_CHANNELS");
+  return setting == NULL || strcmp(setting, "0") != 0;
+}
+
+
+/**
+ * Sets up an in-process stage's descriptors, as redirect_child_io does for a
+ * child. The stage takes over its pipe ends and closes them when it's done.
+ * read_channel and channel are the channels it reads from and writes to, if
+ * its neighbours are in-process too.
+ */
+void setup_text_stage(text_stage_t& stage, const command_t& command,
+                      const redirect_fds_t& fds, int read_fd, int the_pipe[2],
+                      text_channel_t* read_channel, text_channel_t* channel) {
+  stage.argv = command.argv;
+  stage.input_channel = read_channel;
+  stage.output_channel = channel;
+
+  if (read_channel) {
+    // nothing to read from but the channel
+  } else if (command.input_type == READ_FROM_PIPE) {
+    stage.input = read_fd;
+    stage.owned.push_back(read_fd);
+  } else {
+    stage.input = fds.input;
+  }
+
+  if (channel) {
+    // nothing to write to but the channel
+  } else if (command.output_type == WRITE_TO_PIPE) {
+    stage.output = the_pipe[1];
+    stage.owned.push_back(the_pipe[1]);
+  } else if (command.output_type == WRITE_TO_FILE ||
+             command.output_type == APPEND_TO_FILE) {
+    stage.output = fds.output;
+  } else {
+    stage.output = STDOUT_FILENO;
+  }
+
+  if (command.error_type == WRITE_ERR_TO_FILE ||
+      command.error_type == APPEND_ERR_TO_FILE) {
+    stage.error = fds.error;
+  } else if (command.error_type == WRITE_ERR_TO_OUTPUT) {
+    stage.error = stage.output;
+  } else {
+    stage.error = STDERR_FILENO;
+  }
+}
+
+
+/**
+ * Closes the pipes of a fan-out that never started: the sinks' pipes and
+ * both sides of the stage's pipe.
+ */
+void abandon_fan_out(fan_out_t& fan_out, int stage_pipe[2]) {
+  for (size_t s = 0; s < fan_out.sinks.size(); s++) {
+    if (fan_out.sinks[s].copy[0] < 0) continue;
+    close(fan_out.sinks[s].copy[0]);
+    close(fan_out.sinks[s].copy[1]);
+  }
+  if (stage_pipe[0] >= 0) close(stage_pipe[0]);
+  if (stage_pipe[1] >= 0) close(stage_pipe[1]);
+}
+
+
+/**
+ * Sets up the fan-out of a stage with >| sinks. The stage is given a pipe of
+ * its own to write to instead: command is changed to write to a pipe, and
+ * stage_pipe is set to the pipe to hand the stage in place of the_pipe. The
+ * fan-out takes over the read side, and the_pipe's write side if the stage
+ * wrote to it. Returns false if a pipe can't be created.
+ */
+bool setup_fan_out(fan_out_t& fan_out, command_t& command,
+                   const redirect_fds_t& fds, int the_pipe[2], int stage_pipe[2]) {
+  if (command.output_type == WRITE_TO_PIPE) {
+    fan_out.output = the_pipe[1];
+    fan_out.owns_output = true;
+  } else if (command.output_type == WRITE_TO_FILE ||
+             command.output_type == APPEND_TO_FILE) {
+    fan_out.output = fds.output;
+  } else {
+    fan_out.output = STDOUT_FILENO;
+  }
+
+  stage_pipe[0] = stage_pipe[1] = -1;
+  bool opened = syscall(SYS_pipe2, stage_pipe, O_CLOEXEC) == 0;
+  for (size_t i = 0; i < command.sinks.size() && opened; i++) {
+    fan_out.sinks.push_back(fan_out_sink_t());
+    fan_out_sink_t& sink = fan_out.sinks.back();
+    sink.path = command.sinks[i];
+    sink.fd = fds.sinks[i];
+    if (sink.fd >= 0) opened = syscall(SYS_pipe2, sink.copy, O_CLOEXEC) == 0;
+  }
+  if (!opened) {
+    perror("opening fan-out pipe");
+    abandon_fan_out(fan_out, stage_pipe);
+    return false;
+  }
+
+  fan_out.source = stage_pipe[0];
+  command.output_type = WRITE_TO_PIPE;
+  return true;
+}
+
+
+/**
+ * Closes every descriptor in the given vector.
+ */
+void close_fds(const vector<int>& fds) {
+  for (size_t i = 0; i < fds.size(); i++) close(fds[i]);
+}
+
+
+bool Shell::runs_as_builtin_stage(const command_t& command) {
+  const string& name = command.argv[0];
+  return command.input_type == READ_FROM_STDIN &&
+         command.output_type == WRITE_TO_PIPE &&
+         pure_builtins.count(name) > 0 && builtins.count(name) > 0 &&
+         functions.count(name) == 0 &&
+         (name != "alias" || command.argv.size() == 1) &&
+         (name != "find" || find_builtin_supported(command.argv));
+}
+
+
+int Shell::capture_builtin_output(vector<string>& argv, string& output) {
+  stringbuf buffer;
+  cout.flush();
+  streambuf* original = cout.rdbuf(&buffer);
+  int status = (this->*builtins[argv[0]])(argv);
+  cout.rdbuf(original);
+  output = buffer.str();
+  return status;
+}
+
+
 int Shell::execute_external_command(vector<string>& tokens) {
   vector<command_t> commands;
   if (!partition_tokens(tokens, commands)) return -1;
 
+  return run_pipeline(commands);
+}
+
+
+/**
+ * Returns a key identifying a pipeline by its commands (e.g. "gzip | wc"),
+ * used to remember the throughput of previous runs.
+ */
+string pipeline_key(const vector<command_t>& commands) {
+  string key;
+  for (size_t i = 0; i < commands.size(); i++) {
+    if (i > 0) key += " | ";
+    key += commands[i].argv[0];
+  }
+  return key;
+}
+
+
+/**
+ * Returns the number of bytes written by a child that has exited but not yet
+ * been reaped, from /proc/<pid>/io.
+ */
+long written_bytes(pid_t pid) {
+  ifstream io(("/proc/" + to_string(pid) + "/io").c_str());
+  string field;
+  long value;
+  while (io >> field >> value) {
+    if (field == "wchar:") return value;
+  }
+  return 0;
+}
+
+
+long Shell::max_pipe_size() {
+  static long max_size = 0;
+  if (max_size == 0) {
+    ifstream file("/proc/sys/fs/pipe-max-size");
+    if (!(file >> max_size)) max_size = ADAPTIVE_MIN_PIPE_SIZE;
+  }
+  return max_size;
+}
+
+
+long Shell::resolve_pipe_size(long requested, const string& key) {
+  if (requested == PIPE_SIZE_SESSION) requested = pipe_size;
+  if (requested != PIPE_SIZE_AUTO) return requested;
+
+  // without any history, leave the pipe alone
+  map<string, double>::iterator history = pipeline_throughput.find(key);
+  if (history == pipeline_throughput.end()) return PIPE_SIZE_DEFAULT;
+
+  // pick the smallest power of two that holds ADAPTIVE_PIPE_SECONDS of data
+  long size = ADAPTIVE_MIN_PIPE_SIZE;
+  while (size < max_pipe_size() &&
+         size < history->second * ADAPTIVE_PIPE_SECONDS) {
+    size *= 2;
+  }
+  return min(size, max_pipe_size());
+}
+
+
+void Shell::set_pipe_size(int fd, long size) {
+  if (size <= 0) return;
+  // the kernel refuses sizes above the limit, so clamp to it
+  if (fcntl(fd, F_SETPIPE_SZ, min(size, max_pipe_size())) < 0) {
+    perror("setting pipe size");
+  }
+}
+
+
+int Shell::run_pipeline(vector<command_t>& commands) {
   const int PIPE_READ = 0;  // to acces read and write sides of pipe
   const int PIPE_WRITE = 1;
-  int the_pipe[2]; // read is [0], write is [1]
-  int read_fd;
-  int status = 0;
+  int the_pipe[2] = { -1, -1 }; // read is [0], write is [1]
+  int read_fd = -1;
+  vector<pid_t> pids; // 0 for a stage run in-process
+  vector<text_stage_t> stages;
+  vector<unique_ptr<text_channel_t> > channels;
+  vector<fan_out_t> fan_outs;
+  text_channel_t* read_channel = NULL; // instead of read_fd
+  pipeline_stats_t stats;
+  string key = pipeline_key(commands);
+
+  // open every file up front, so that one that can't be opened stops the
+  // pipeline before anything runs
+  vector<redirect_fds_t> redirects;
+  vector<int> owned;
   for (size_t i = 0; i < commands.size(); i++) {
-    int pid;
+    redirect_fds_t fds;
+    if (!open_redirections(commands[i], redirects, fds, owned)) {
+      close_fds(owned);
+      return EXIT_FAILURE;
+    }
+    redirects.push_back(fds);
+  }
+
+  // flush first so the children don't repeat anything still buffered, and
+  // leave any input read has read ahead on for them
+  cout.flush();
+  cerr.flush();
+  settle_read_buffers();
+  commands_run++;
+
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  trace_event_t* event = begin_trace_event(TRACE_PIPELINE);
+  if (event) clock_gettime(CLOCK_REALTIME, &event->time);
+  vector<timespec> forked;
+
+  // work out up front which stages run in-process (a pure builtin at the
+  // start, and supported text builtins), so that two of them next to each
+  // other can be joined by a channel instead of a pipe
+  vector<bool> in_process(commands.size());
+  for (size_t i = 0; i < commands.size(); i++) {
+    in_process[i] = (i == 0 && runs_as_builtin_stage(commands[i])) ||
+                    runs_in_process(commands[i]);
+  }
+  bool use_channels = channels_enabled();
 
-    // make a char* array for the tokens
-    char** cmd = new char*[commands[i].argv.size() + 1]; // leave room for NULL
-    // convert the tokens to the char* array
-    cmd = to_char_array(commands[i].argv);
+  // the byte and context switch counts are only collected when something
+  // uses them: the throughput history behind an auto pipe size, or -v
+  for (size_t i = 0; i < commands.size(); i++) {
+    long requested = commands[i].pipe_size == PIPE_SIZE_SESSION
+        ? pipe_size : commands[i].pipe_size;
+    if (commands[i].measure || requested == PIPE_SIZE_AUTO) {
+      stats.measured = true;
+    }
+  }
 
-    if (commands[i].output_type == OutputType::WRITE_TO_PIPE) { // if we're outputting to pipe
-      if (pipe(the_pipe) < 0) { // open the pipe
+  // start every stage before waiting on any of them, so that a stage that
+  // fills its pipe isn't left waiting for a reader that hasn't started
+  for (size_t i = 0; i < commands.size(); i++) {
+    int pid;
+    text_channel_t* channel = NULL;
+
+    if (commands[i].output_type == WRITE_TO_PIPE && use_channels &&
+        in_process[i] && i + 1 < commands.size() && in_process[i + 1] &&
+        commands[i].error_type != WRITE_ERR_TO_OUTPUT &&
+        commands[i].sinks.empty()) {
+      channels.push_back(unique_ptr<text_channel_t>(new text_channel_t()));
+      channel = channels.back().get();
+    } else if (commands[i].output_type == OutputType::WRITE_TO_PIPE) { // if we're outputting to pipe
+      // close-on-exec, since an in-process stage keeps its ends open in the
+      // shell while later stages are forked
+      if (syscall(SYS_pipe2, the_pipe, O_CLOEXEC) < 0) { // open the pipe
         perror("opening pipe");
-        return errno;
+        break;
       }
+      set_pipe_size(the_pipe[PIPE_WRITE],
+                    resolve_pipe_size(commands[i].pipe_size, key));
+      stats.pipe_size = fcntl(the_pipe[PIPE_WRITE], F_GETPIPE_SZ);
+    }
+
+    // a stage with >| sinks writes into a pipe of its own, which a fan-out
+    // thread copies to the sinks and passes on to where the output was going
+    command_t* command = &commands[i];
+    command_t fanned_command;
+    int stage_pipe[2] = { the_pipe[PIPE_READ], the_pipe[PIPE_WRITE] };
+    if (!commands[i].sinks.empty()) {
+      fanned_command = commands[i];
+      command = &fanned_command;
+      fan_outs.push_back(fan_out_t());
+      if (!setup_fan_out(fan_outs.back(), fanned_command, redirects[i],
+                         the_pipe, stage_pipe)) {
+        fan_outs.pop_back();
+        if (commands[i].output_type == WRITE_TO_PIPE) {
+          close(the_pipe[PIPE_READ]);
+          close(the_pipe[PIPE_WRITE]);
+        }
+        break;
+      }
+      set_pipe_size(stage_pipe[PIPE_WRITE],
+                    resolve_pipe_size(commands[i].pipe_size, key));
     }
 
     // fork and check for errors
-    if ((pid = fork()) == -1) {
+    timespec fork_start;
+    if (event) clock_gettime(CLOCK_MONOTONIC, &fork_start);
+    if (in_process[i]) {
+      // the stage's thread is started once every child has been forked; a
+      // builtin runs now, and the thread only passes its output on
+      stages.push_back(text_stage_t());
+      text_stage_t& stage = stages.back();
+      stage.index = i;
+      setup_text_stage(stage, *command, redirects[i], read_fd, stage_pipe,
+                       read_channel, channel);
+      if (i == 0 && runs_as_builtin_stage(commands[i])) {
+        stage.builtin = true;
+        stage.status = capture_builtin_output(commands[i].argv, stage.builtin_output);
+      }
+      pid = 0;
+    } else if ((pid = fork()) == -1) {
       perror("fork failed");
-      return 1;
+      if (!commands[i].sinks.empty()) {
+        abandon_fan_out(fan_outs.back(), stage_pipe);
+        fan_outs.pop_back();
+      }
+      if (commands[i].output_type == WRITE_TO_PIPE) {
+        close(the_pipe[PIPE_READ]);
+        close(the_pipe[PIPE_WRITE]);
+      }
+      break;
     }
 
-    if (pid == 0) { // if we're the child process
-      // setup the input stream
-      if (commands[i].input_type == READ_FROM_PIPE) {
-        // dup for reading from the pipe
-        if (dup2(read_fd, STDIN_FILENO) < 0) {
-          perror("READ_FROM_PIPE dup2 error");
-          _exit(errno);
-        }
-      } else if (commands[i].input_type == READ_FROM_FILE) {
-        // dup for reading from a file
-        int fd = open(commands[i].infile.c_str(), O_RDONLY, 0644);
-        if (fd < 0) {
-          perror("READ_FROM_FILE file open error");
-          _exit(errno);
-        }
-        if (dup2(fd, STDIN_FILENO) < 0) {
-          perror("READ_FROM_FILE dup2 error");
-          _exit(errno);
-        }
+    if (pid == 0 && !in_process[i]) { // if we're the child process
+      // placed before the redirections, so the report goes to the shell's
+      // stderr rather than into the command's own output
+      if (!commands[i].cpus.empty() || commands[i].numa_node >= 0) {
+        apply_placement(commands[i], i);
       }
 
-      // setup the output stream
-      if (commands[i].output_type == WRITE_TO_PIPE) {
-        // dup for writing to the pipe
-        close(the_pipe[PIPE_READ]); // never read from the pipe, read_fd is used instead
-        if (dup2(the_pipe[PIPE_WRITE], STDOUT_FILENO) < 0) {
-          perror("WRITE_TO_PIPE dup2 error");
-          _exit(errno);
-        }
-      } else if (commands[i].output_type == WRITE_TO_FILE) {
-        // dup for writing to a file
-        int fd = open(commands[i].outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd < 0) {
-          perror("WRITE_TO_FILE file open error");
-          _exit(errno);
-        }
-        if (dup2(fd, STDOUT_FILENO) < 0) {
-          perror("WRITE_TO_FILE dup2 error");
-          _exit(errno);
-        }
-      } else if (commands[i].output_type == APPEND_TO_FILE) {
-        // dup for appending to a file
-        int fd = open(commands[i].outfile.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd < 0) {
-          perror("APPEND_TO_FILE file open error");
-          _exit(errno);
-        }
-        if (dup2(fd, STDOUT_FILENO) < 0) {
-          perror("APPEND_TO_FILE dup2 error");
-          _exit(errno);
-        }
+      redirect_child_io(*command, redirects[i], read_fd, stage_pipe);
+
+      // split the arguments across several runs if asked to
+      if (commands[i].batch_jobs > 0) {
+        _exit(execute_in_batches(commands[i].argv, commands[i].batch_jobs));
       }
-      // execute the command
+
+      // execute the command, without searching $PATH if it's hashed
+      char** cmd = to_char_array(commands[i].argv);
+      const char* path = hashed_command(commands[i].argv[0]);
+      if (path) execv(path, cmd);
       execvp(cmd[0], cmd);
 
       // exit with an error since this part pf the function should never be reached
       perror("exec failed");
       _exit(EXIT_FAILURE);
-    } else {
-      // wait for the child process to complete
-      waitpid(pid, &status, 0);
     }
-    close(the_pipe[PIPE_WRITE]);   // close the pipe
-    read_fd = the_pipe[PIPE_READ]; // assign read_fd to the read side of the previous pipe
+
+    pids.push_back(pid);
+    if (event) {
+      // record the stage as soon as it's started
+      forked.push_back(timespec());
+      clock_gettime(CLOCK_MONOTONIC, &forked.back());
+      if (i < TRACE_MAX_STAGES) {
+        trace_stage_t& stage = event->stages[i];
+        stage.pid = pid;
+        stage.fork_us = elapsed_us(fork_start, forked.back());
+        stage.input_type = commands[i].input_type;
+        stage.output_type = commands[i].output_type;
+        stage.error_type = commands[i].error_type;
+        copy_trace_text(stage.name, TRACE_NAME_SIZE, commands[i].argv[0]);
+        copy_trace_text(stage.infile, TRACE_PATH_SIZE, commands[i].infile);
+        copy_trace_text(stage.outfile, TRACE_PATH_SIZE, commands[i].outfile);
+        copy_trace_text(stage.errfile, TRACE_PATH_SIZE, commands[i].errfile);
+        stage.sink_count = commands[i].sinks.size();
+        copy_trace_text(stage.sink, TRACE_PATH_SIZE,
+                        commands[i].sinks.empty() ? "" : commands[i].sinks[0]);
+      }
+      event->stage_count = pids.size();
+    }
+
+    // the parent keeps neither end of the pipes it hands to its children (an
+    // in-process stage has taken over its own, and a fan-out the write side
+    // of the pipe it passes the output on through)
+    if (read_fd >= 0 && !in_process[i]) close(read_fd);
+    read_fd = -1;
+    read_channel = channel;
+    if (command->output_type == WRITE_TO_PIPE && channel == NULL &&
+        !in_process[i]) {
+      close(stage_pipe[PIPE_WRITE]);
+    }
+    if (commands[i].output_type == WRITE_TO_PIPE && channel == NULL) {
+      read_fd = the_pipe[PIPE_READ]; // the next stage reads from this pipe
+    }
+  }
+  if (read_fd >= 0) close(read_fd);
+  // if the next stage failed to start, nothing reads the last channel, and
+  // its writer would wait for space forever
+  if (read_channel) read_channel->close_reader();
+  for (size_t s = 0; s < stages.size(); s++) {
+    stages[s].thread = thread(run_text_stage, &stages[s]);
+  }
+  for (size_t f = 0; f < fan_outs.size(); f++) {
+    fan_outs[f].thread = thread(run_fan_out, &fan_outs[f]);
+  }
+
+  // reap the children in the order they exit, keeping the status of the
+  // final command. Each is waited for through a pidfd of its own, so that no
+  // other child of the shell is ever reaped here; if pidfds can't be had,
+  // the children are waited for one after another instead.
+  int status = 0;
+  vector<struct pollfd> exits;
+  vector<size_t> exit_stages;
+  bool use_pidfds = true;
+  for (size_t i = 0; i < pids.size(); i++) {
+    if (pids[i] == 0) continue;
+    struct pollfd entry = { (int)syscall(SYS_pidfd_open, pids[i], 0), POLLIN, 0 };
+    if (entry.fd < 0) use_pidfds = false;
+    exits.push_back(entry);
+    exit_stages.push_back(i);
+  }
+  for (size_t remaining = exits.size(); remaining > 0; ) {
+    if (use_pidfds) {
+      int ready = poll(exits.data(), exits.size(), -1);
+      if (ready < 0 && errno == EINTR) continue;
+      if (ready < 0) {
+        perror("waiting for pipeline");
+        break;
+      }
+    }
+
+    for (size_t e = 0; e < exits.size(); e++) {
+      // a stage that's been reaped no longer asks for events
+      if (exits[e].events == 0 || (use_pidfds && exits[e].revents == 0)) continue;
+      size_t i = exit_stages[e];
+      pid_t pid = pids[i];
+
+      // measure how much went through the pipe before the child is reaped
+      int waited;
+      if (stats.measured && commands[i].output_type == WRITE_TO_PIPE) {
+        siginfo_t info;
+        while ((waited = waitid(P_PID, pid, &info, WEXITED | WNOWAIT)) < 0 &&
+               errno == EINTR) {}
+        if (waited == 0) stats.bytes_piped += written_bytes(pid);
+      }
+
+      int child_status = 0;
+      struct rusage usage;
+      struct rusage* measured_usage = stats.measured ? &usage : NULL;
+      while ((waited = wait4(pid, &child_status, 0, measured_usage)) < 0 &&
+             errno == EINTR) {}
+      if (waited < 0) perror("waiting for pipeline");
+
+      if (exits[e].fd >= 0) close(exits[e].fd);
+      exits[e].fd = -1;
+      exits[e].events = 0;
+      remaining--;
+      if (waited < 0) continue;
+
+      if (stats.measured) {
+        stats.voluntary_switches += usage.ru_nvcsw;
+        stats.involuntary_switches += usage.ru_nivcsw;
+      }
+      if (i == commands.size() - 1) status = child_status;
+
+      if (event && i < TRACE_MAX_STAGES) {
+        timespec reaped;
+        clock_gettime(CLOCK_MONOTONIC, &reaped);
+        event->stages[i].duration_us = elapsed_us(forked[i], reaped);
+        event->stages[i].exit_code = WIFSIGNALED(child_status)
+            ? 128 + WTERMSIG(child_status) : WEXITSTATUS(child_status);
+      }
+
+      // without pidfds, the next child is waited for on its own
+      if (!use_pidfds) break;
+    }
+  }
+
+  // then wait for the in-process stages, and only then close the files they
+  // were writing to (the cache keeps its own descriptors; the rest were only
+  // for the stages)
+  for (size_t s = 0; s < stages.size(); s++) {
+    size_t i = stages[s].index;
+    stages[s].thread.join();
+    if (stats.measured && commands[i].output_type == WRITE_TO_PIPE) {
+      stats.bytes_piped += stages[s].bytes_written;
+    }
+    if (event && i < TRACE_MAX_STAGES) {
+      timespec joined;
+      clock_gettime(CLOCK_MONOTONIC, &joined);
+      event->stages[i].duration_us = elapsed_us(forked[i], joined);
+      event->stages[i].exit_code = stages[s].status;
+    }
+  }
+
+  // the fan-outs finish once their stages have closed their pipes
+  for (size_t f = 0; f < fan_outs.size(); f++) {
+    fan_outs[f].thread.join();
+    for (size_t s = 0; s < fan_outs[f].sinks.size(); s++) {
+      stats.bytes_fanned_out += fan_outs[f].sinks[s].bytes;
+    }
+    stats.sinks_dropped += report_fan_out(fan_outs[f]);
+  }
+  close_fds(owned);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  stats.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  last_pipeline = stats;
+
+  // remember the throughput for the adaptive pipe size
+  if (stats.bytes_piped > 0 && stats.seconds > 0) {
+    pipeline_throughput[key] = stats.bytes_piped / stats.seconds;
+  }
+
+  // a stage that never started is a failure
+  int return_value = EXIT_FAILURE;
+  if (pids.size() == commands.size()) {
+    if (!stages.empty() && stages.back().index == commands.size() - 1) {
+      return_value = stages.back().status;
+    } else if (WIFEXITED(status)) {
+      return_value = WEXITSTATUS(status);
+    }
+  }
+
+  if (event) {
+    event->duration_us = stats.seconds * 1e6;
+    event->status = return_value;
+    commit_trace_event();
+  }
+  return return_value;
+}
+
+
+/**
+ * Returns the number of bytes that a string takes up in the argument or
+ * environment area of a new process: its characters, its NUL terminator and
+ * the pointer to it.
+ */
+size_t exec_size(const char* text) {
+  return strlen(text) + 1 + sizeof(char*);
+}
+
+
+/**
+ * The short options that take an argument, for the commands batch knows.
+ * A command's options are only repeated in every batch when they're known,
+ * since the argument of an unknown option (grep -e PATTERN) would otherwise
+ * be taken for a file and split off into one of the batches.
+ */
+const map<string, string> BATCH_OPTION_ARGUMENTS = {
+  { "cat", "" }, { "chgrp", "" }, { "chown", "" }, { "cp", "StT" },
+  { "du", "BdtX" }, { "egrep", "ABCDdefm" }, { "fgrep", "ABCDdefm" },
+  { "file", "Fefm" }, { "grep", "ABCDdefm" }, { "head", "cn" },
+  { "ln", "StT" }, { "ls", "ITw" }, { "md5sum", "" }, { "mv", "StT" },
+  { "rm", "" }, { "sha1sum", "" }, { "sha256sum", "" }, { "stat", "c" },
+  { "tail", "cns" }, { "touch", "dr" }, { "wc", "" }
+};
+
+
+/**
+ * Returns the number of leading words of argv, the command and its options
+ * (up to a "--"), to repeat in every batch. For a command not in
+ * BATCH_OPTION_ARGUMENTS, that's everything up to a "--" if there is one,
+ * and otherwise the options up to the first word that isn't one, so an
+ * unknown option's argument must be attached to it (-ePATTERN).
+ */
+size_t batch_fixed_words(const vector<string>& argv) {
+  string name = argv[0].substr(argv[0].rfind('/') + 1);
+  map<string, string>::const_iterator known = BATCH_OPTION_ARGUMENTS.find(name);
+  if (known == BATCH_OPTION_ARGUMENTS.end()) {
+    vector<string>::const_iterator end = find(argv.begin(), argv.end(), "--");
+    if (end != argv.end()) return end - argv.begin() + 1;
+  }
+
+  size_t fixed = 1;
+  while (fixed < argv.size() && argv[fixed].size() > 1 && argv[fixed][0] == '-') {
+    const string& option = argv[fixed++];
+    if (option == "--") break;
+    // long options are expected in their --name=value form
+    if (option[1] == '-' || known == BATCH_OPTION_ARGUMENTS.end()) continue;
+
+    // in a cluster like -ie, a letter that takes an argument takes the rest
+    // of the word, or the next word if it's the last letter
+    for (size_t i = 1; i < option.size(); i++) {
+      if (known->second.find(option[i]) == string::npos) continue;
+      if (i == option.size() - 1 && fixed < argv.size()) fixed++;
+      break;
+    }
+  }
+  return fixed;
+}
+
+
+int Shell::execute_in_batches(vector<string>& argv, int jobs) {
+  // leave some headroom below the kernel's limit, as xargs does
+  const long HEADROOM = 4096;
+  long limit = sysconf(_SC_ARG_MAX) - HEADROOM;
+
+  // the environment is passed to every batch
+  for (char** env = environ; *env != NULL; env++) limit -= exec_size(*env);
+  limit -= sizeof(char*);
+
+  // the command and its leading options are repeated in every batch;
+  // everything after them is split up
+  size_t fixed = batch_fixed_words(argv);
+  long fixed_size = sizeof(char*);
+  for (size_t i = 0; i < fixed; i++) fixed_size += exec_size(argv[i].c_str());
+
+  // the pointers for one batch at a time are built in this array, which
+  // points straight into argv's strings
+  vector<char*> batch;
+  for (size_t i = 0; i < fixed; i++) batch.push_back((char*)argv[i].c_str());
+
+  // the batches may read the shell's input too
+  settle_read_buffers();
+
+  int running = 0;
+  int return_value = 0;
+  size_t next = fixed;
+  do {
+    // fill the batch with as many arguments as will fit (but at least one)
+    bool first = next == fixed;
+    batch.resize(fixed);
+    long size = fixed_size;
+    while (next < argv.size()) {
+      long arg_size = exec_size(argv[next].c_str());
+      if (batch.size() > fixed && size + arg_size > limit) break;
+      size += arg_size;
+      batch.push_back((char*)argv[next++].c_str());
+    }
+    batch.push_back(NULL);
+
+    // if everything fits at once, there's no need for another process
+    if (first && next == argv.size()) {
+      execvp(batch[0], batch.data());
+      perror("exec failed");
+      return EXIT_FAILURE;
+    }
+
+    // don't start another batch until one of the running ones finishes
+    int status;
+    if (running == jobs && wait(&status) > 0) {
+      running--;
+      return_value = max(return_value, WIFEXITED(status) ?
+                         WEXITSTATUS(status) : EXIT_FAILURE);
+    }
+
+    int pid = fork();
+    if (pid == -1) {
+      perror("fork failed");
+      return_value = EXIT_FAILURE;
+      break;
+    }
+    if (pid == 0) {
+      execvp(batch[0], batch.data());
+      perror("exec failed");
+      _exit(EXIT_FAILURE);
+    }
+    running++;
+  } while (next < argv.size());
+
+  // the combined status is the worst status of any batch
+  int status;
+  while (running > 0 && wait(&status) > 0) {
+    running--;
+    return_value = max(return_value, WIFEXITED(status) ?
+                       WEXITSTATUS(status) : EXIT_FAILURE);
+  }
+  return return_value;
+}
+
+
+bool Shell::capture_command_output(const string& text, string& output) {
+  // a command's output can change, so the startup snapshot can't keep it
+  if (running_startup) startup_side_effects = true;
+
+  script_ptr script;
+  if (parse_script(text, script) != PARSE_OK) {
+    cerr << "command substitution: syntax error in `" << text << "'" << endl;
+    return false;
+  }
+  return capture_script_output(*script, output);
+}
+
+
+bool Shell::capture_script_output(const script_node_t& node, string& output) {
+  // a lone builtin that can't change the shell's state runs in-process
+  if (node.type == NODE_SIMPLE && !node.has_assignment &&
+      pure_builtins.count(node.words[0]) > 0 &&
+      functions.count(node.words[0]) == 0 &&
+      aliases.count(node.words[0]) == 0 &&
+      (node.words[0] != "alias" || node.words.size() == 1) &&
+      (node.words[0] != "find" || find_builtin_supported(node.words))) {
+    stringbuf buffer;
+    cout.flush();
+    streambuf* original = cout.rdbuf(&buffer);
+    execute_script(node);
+    cout.rdbuf(original);
+    output = buffer.str();
+    return true;
+  }
+
+  int the_pipe[2];
+  if (pipe(the_pipe) < 0) {
+    perror("command substitution pipe");
+    return false;
+  }
+  set_pipe_size(the_pipe[1], resolve_pipe_size(PIPE_SIZE_SESSION, ""));
+
+  // flush first so the child doesn't repeat anything still buffered
+  cout.flush();
+  cerr.flush();
+  settle_read_buffers();
+  commands_run++;
+
+  int pid = fork();
+  if (pid == -1) {
+    perror("fork failed");
+    close(the_pipe[0]);
+    close(the_pipe[1]);
+    return false;
+  }
+
+  if (pid == 0) {
+    // run the command in the child with its stdout going into the pipe
+    close(the_pipe[0]);
+    if (dup2(the_pipe[1], STDOUT_FILENO) < 0) {
+      perror("command substitution dup2 error");
+      _exit(errno);
+    }
+    close(the_pipe[1]);
+    int return_value = execute_script(node);
+    cout.flush();
+    _exit(return_value);
+  }
+
+  // read the output in large chunks until the child closes its end
+  close(the_pipe[1]);
+  const size_t CHUNK_SIZE = 64 * 1024;
+  size_t length = 0;
+  output.clear();
+  while (true) {
+    output.resize(length + CHUNK_SIZE);
+    ssize_t count = read(the_pipe[0], &output[length], CHUNK_SIZE);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) break;
+    length += count;
   }
+  output.resize(length);
+  close(the_pipe[0]);
 
-  // return based on the status of the final command
-  if (WIFEXITED(status)) return WEXITSTATUS(status);
-  else return EXIT_FAILURE;
+  int status;
+  waitpid(pid, &status, 0);
+  last_status = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+  return true;
 }
@@ -7,20 +7,37 @@
  */
 
 #include "shell.h"
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <readline/history.h>
 #include <readline/readline.h>
-#include <sstream>
+#include <cctype>
+#include <cstring>
 
 using namespace std;
 
 
+/**
+ * Matches a name against a compiled glob pattern (see shell_glob.cpp).
+ */
+bool glob_match(const glob_pattern_t& pattern, const char* name, size_t length);
+
+
 // Initialize the singleton instance of the Shell class.
 Shell Shell::instance;
 
 
-Shell::Shell() {
+Shell::Shell()
+  : pipe_size(PIPE_SIZE_DEFAULT), redirect_watch_fd(-1), redirect_uses(0),
+    redirect_cache_owner(0),
+    commands_run(0), last_duration_us(0), prompt_status(0), in_session(false), exit_requested(false),
+    running_startup(false),
+    startup_side_effects(false), command_hash_signature(0), last_status(0),
+    loop_depth(0), function_depth(0), pending_breaks(0),
+    pending_continues(0), pending_return(false) {
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
   // Tell readline that we want its help managing history.
   using_history();
 
@@ -30,6 +47,9 @@ Shell::Shell() {
   // Tell readline that $ should be left attached when performing completions.
   rl_special_prefixes = "$";
 
+  // Tell readline to start with whatever a burst of pasted input left over.
+  rl_pre_input_hook = insert_paste_leftover_hook;
+
   // Register the builtin methods.
   builtins["ls"] = &Shell::com_ls;
   builtins["cd"] = &Shell::com_cd;
@@ -39,6 +59,37 @@ Shell::Shell() {
   builtins["echo"] = &Shell::com_echo;
   builtins["exit"] = &Shell::com_exit;
   builtins["history"] = &Shell::com_history;
+  builtins["true"] = &Shell::com_true;
+  builtins["false"] = &Shell::com_false;
+  builtins["test"] = &Shell::com_test;
+  builtins["["] = &Shell::com_test;
+  builtins["break"] = &Shell::com_break;
+  builtins["continue"] = &Shell::com_continue;
+  builtins["return"] = &Shell::com_return;
+  builtins["batch"] = &Shell::com_batch;
+  builtins["pin"] = &Shell::com_pin;
+  builtins["pipesize"] = &Shell::com_pipesize;
+  builtins["trace"] = &Shell::com_trace;
+  builtins["every"] = &Shell::com_every;
+  builtins["complete"] = &Shell::com_complete;
+  builtins["read"] = &Shell::com_read;
+  builtins["timeout"] = &Shell::com_timeout;
+  builtins["find"] = &Shell::com_find;
+
+  // Register the builtins that are safe to run in-process for $(...).
+  pure_builtins = {
+    "ls", "pwd", "alias", "echo", "history", "true", "false", "test", "[",
+    "find"
+  };
+
+  // Register the builtins that only change state the startup snapshot keeps.
+  state_builtins = {
+    "alias", "unalias", "true", "false", "test", "[", "break", "continue",
+    "return", "pipesize"
+  };
+
+  // Outside of any function, $0 is the name of the shell.
+  positional_params.push_back(vector<string>(1, "MyShell"));
 }
 
 
@@ -46,12 +97,19 @@ int Shell::loop_and_handle_input() {
   // The return value of the last command executed.
   int return_value = 0;
 
+  // Set up the aliases, variables and functions from ~/.myshellrc.
+  run_startup_file();
+
   while (true) {
     // Get the prompt to show, based on the return value of the last command.
     string prompt = get_prompt(return_value);
 
-    // Read a line of input from the user
+    // Read a line of input from the user; the prompt may be redrawn while
+    // readline waits
+    settle_read_buffers();
+    set_in_readline(true);
     char* line = readline(prompt.c_str());
+    set_in_readline(false);
 
     // If the pointer is null, then EOF has been received (ctrl-d) and the shell
     // should exit.
@@ -60,20 +118,43 @@ int Shell::loop_and_handle_input() {
       break;
     }
 
-    // If the command is non-empty, attempt to execute it.
-    if (line[0]) {
+    // A paste is run as one block, otherwise a non-empty command is run.
+    paste_block_t paste;
+    if (read_paste(line, paste)) {
+      return_value = execute_paste(paste);
+    } else if (line[0]) {
+      timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
       return_value = execute_line(line);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      last_duration_us = elapsed_us(start, end);
     }
 
     // Free the memory for the input string.
     free(line);
+
+    // The end of input may have come with the paste.
+    if (paste.eof) {
+      cout << endl;
+      break;
+    }
   }
 
   return return_value;
 }
 
 
+Shell::~Shell() {
+  stop_prompt_worker();
+  stop_trace();
+}
+
+
 string Shell::get_prompt(int return_value) {
+  prompt_status = return_value;
+  string format;
+  if (prompt_format(format)) return render_prompt(format, true);
+
   // The prompt will always have the username first
   string prompt = getenv("USER");
   // Depending on the previous exit code
@@ -85,39 +166,107 @@ string Shell::get_prompt(int return_value) {
 
 int Shell::execute_line(char* line) {
   // expand the command from history using !!, !-N, etc
-  int result = history_expand(line, &line);
+  char* expanded;
+  int result = history_expand(line, &expanded);
   // will only return 0 if nothing is expanded, output the command or the error
-  if (result) cerr << line << endl;
+  if (result) cerr << expanded << endl;
   // don't continue if an error occured
-  if (result < 0 || result == 2) return -1;
+  if (result < 0 || result == 2) {
+    free(expanded);
+    return -1;
+  }
+  string text = expanded;
+  free(expanded);
+
+  // Parse the input, reading more lines while a construct is left open.
+  timespec wall_start, start, parsed;
+  clock_gettime(CLOCK_REALTIME, &wall_start);
+  double parse_us = 0;
+  script_ptr script;
+  ParseStatus status;
+  while (true) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = parse_script(text, script);
+    clock_gettime(CLOCK_MONOTONIC, &parsed);
+    parse_us += elapsed_us(start, parsed);
+    if (status != PARSE_INCOMPLETE) break;
+
+    settle_read_buffers();
+    char* more = readline("> ");
+    if (!more) {
+      cerr << "syntax error: unexpected end of file" << endl;
+      break;
+    }
+    text += "\n";
+    text += more;
+    free(more);
+  }
 
   // save the command to history
-  add_history(line);
-
-  // Tokenize the input string.
-  vector<string> tokens = tokenize_input(line);
-
-  // Handle local variable declarations.
-  local_variable_assignment(tokens);
-
-  // Handle the use of an alias.
-  alias_substitution(tokens);
+  add_history(text.c_str());
+
+  // Execute the parsed commands.
+  int return_value = status == PARSE_OK ? execute_script(*script) : -1;
+
+  trace_event_t* event = begin_trace_event(TRACE_LINE);
+  if (event) {
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    event->time = wall_start;
+    event->parse_us = parse_us;
+    event->duration_us = elapsed_us(parsed, end);
+    event->status = return_value;
+    copy_trace_text(event->text, TRACE_TEXT_SIZE, text);
+    commit_trace_event();
+  }
+  return return_value;
+}
 
-  // Substitute variable references.
-  variable_substitution(tokens);
 
-  // Execute the command.
-  return dispatch_command(tokens);
+/**
+ * Returns the length of the operator that starts at c, or 0 if there is none.
+ */
+size_t operator_length(const char* c) {
+  if ((c[0] == '&' && c[1] == '&') || (c[0] == '|' && c[1] == '|')) return 2;
+  if (c[0] == ';' || c[0] == '\n' || c[0] == '(' || c[0] == ')') return 1;
+  return 0;
 }
 
 
 vector<string> Shell::tokenize_input(char* line) {
   vector<string> tokens;
-  istringstream token_stream(line);
   string token;
 
-  while (token_stream >> token) {
-    tokens.push_back(token);
+  for (const char* c = line; ; c++) {
+    // keep $( ... ) and $(( ... )) together, whatever they contain
+    if (c[0] == '$' && c[1] == '(') {
+      int depth = 0;
+      token += *c++;
+      do {
+        if (*c == '(') depth++;
+        else if (*c == ')') depth--;
+        token += *c++;
+      } while (*c != '\0' && depth > 0);
+      c--;
+      continue;
+    }
+
+    size_t length = operator_length(c);
+
+    // whitespace, operators and the end of the line all finish a word
+    if (*c == '\0' || *c == ' ' || *c == '\t' || length > 0) {
+      if (!token.empty()) {
+        tokens.push_back(token);
+        token.clear();
+      }
+      if (*c == '\0') break;
+      if (length > 0) {
+        tokens.push_back(string(c, length));
+        c += length - 1;
+      }
+    } else {
+      token += *c;
+    }
   }
 
   // Search for quotation marks, which are explicitly disallowed.
@@ -133,7 +282,7 @@ vector<string> Shell::tokenize_input(char* line) {
 }
 
 
-void Shell::local_variable_assignment(vector<string>& tokens) {
+bool Shell::local_variable_assignment(vector<string>& tokens) {
   vector<string>::iterator token = tokens.begin();
 
   while (token != tokens.end()) {
@@ -145,44 +294,350 @@ void Shell::local_variable_assignment(vector<string>& tokens) {
     }
 
     string key = token->substr(0, eq_pos);
-    string value = token->substr(eq_pos + 1);
-    localvars[key] = value;
+    if (token->find('$', eq_pos + 1) == string::npos) {
+      localvars[key].assign(*token, eq_pos + 1, string::npos);
+    } else {
+      // looked up afterwards, since a $(command) may change the variables
+      string expanded;
+      if (expand_parameters(token->data() + eq_pos + 1, token->size() - eq_pos - 1,
+                            expanded) == EXPANSION_FAILED) {
+        return false;
+      }
+      localvars[key].swap(expanded);
+    }
 
     // Erase the token and advance to the next one.
     token = tokens.erase(token);
   }
+  return true;
+}
+
+
+/**
+ * Expands the alias named by tokens[i], if there is one that isn't already
+ * being expanded (listed in expanding), and returns the index just past the
+ * words it expanded into. Sets expanded if it expands anything.
+ */
+size_t expand_alias(const unordered_map<string, alias_t>& aliases, vector<string>& tokens,
+                    size_t i, vector<string>& expanding, bool& expanded) {
+  unordered_map<string, alias_t>::const_iterator alias = aliases.find(tokens[i]);
+  if (alias == aliases.end() ||
+      find(expanding.begin(), expanding.end(), alias->first) != expanding.end()) {
+    return i + 1;
+  }
+
+  const alias_t& value = alias->second;
+  tokens.erase(tokens.begin() + i);
+  tokens.insert(tokens.begin() + i, value.words.begin(), value.words.end());
+  size_t end = i + value.words.size();
+  expanded = true;
+
+  // the first word may be an alias too (e.g. alias ll=ls -l with alias ls=ls -F),
+  // but not one this expansion came from, which would never end
+  if (!value.words.empty()) {
+    expanding.push_back(alias->first);
+    end += expand_alias(aliases, tokens, i, expanding, expanded) - (i + 1);
+    expanding.pop_back();
+  }
+  return end;
+}
+
+
+bool Shell::alias_substitution(vector<string>& tokens) {
+  if (aliases.empty()) return false;
+
+  // only the command name of each stage of a pipeline is looked up
+  bool expanded = false;
+  vector<string> expanding;
+  size_t i = 0;
+  while (i < tokens.size()) {
+    i = expand_alias(aliases, tokens, i, expanding, expanded);
+    while (i < tokens.size() && tokens[i++] != "|") {}
+  }
+  return expanded;
+}
+
+
+void Shell::define_alias(const string& name, const string& value) {
+  alias_t& alias = aliases[name];
+  alias.value = value;
+  alias.words = tokenize_input((char*)value.c_str());
+}
+
+
+/**
+ * Returns the length of the parameter name at the start of text: one
+ * character for a special parameter (?, #, @, * or a digit), otherwise the
+ * run of letters, digits and underscores, which can't start with a digit.
+ * Returns 0 if text doesn't start with a name.
+ */
+size_t parameter_name_length(const char* text, size_t length) {
+  if (length == 0) return 0;
+  unsigned char c = text[0];
+  if (c == '?' || c == '#' || c == '@' || c == '*' || isdigit(c)) return 1;
+  if (!isalpha(c) && c != '_') return 0;
+
+  size_t i = 1;
+  while (i < length && (isalnum((unsigned char)text[i]) || text[i] == '_')) i++;
+  return i;
+}
+
+
+/**
+ * Returns the index of the '}' that closes a ${ whose body starts at start,
+ * skipping any ${...} nested in it, or npos if it isn't closed.
+ */
+size_t closing_brace(const char* text, size_t length, size_t start) {
+  int depth = 1;
+  for (size_t i = start; i < length; i++) {
+    if (text[i] == '$' && i + 1 < length && text[i + 1] == '{') {
+      depth++;
+      i++;
+    } else if (text[i] == '}' && --depth == 0) {
+      return i;
+    }
+  }
+  return string::npos;
+}
+
+
+/**
+ * Returns the index of the ')' that closes a $( whose command starts at
+ * start, or npos if it isn't closed.
+ */
+size_t closing_paren(const char* text, size_t length, size_t start) {
+  int depth = 1;
+  for (size_t i = start; i < length; i++) {
+    if (text[i] == '(') depth++;
+    else if (text[i] == ')' && --depth == 0) return i;
+  }
+  return string::npos;
 }
 
 
-void Shell::alias_substitution(vector<string>& tokens) {
-  vector<string>::iterator token;
-  for (token = tokens.begin(); token != tokens.end(); token++) {
-    if (aliases.count(*token) > 0) {
-      *token = aliases.at(*token);
+Expansion Shell::expand_parameters(const char* text, size_t length, string& result) {
+  Expansion expanded = EXPANDED_NOTHING;
+  size_t literal = 0; // the start of the text not yet copied to the result
+  size_t i = 0;
+  string value;
+
+  while (i < length) {
+    const char* dollar = (const char*)memchr(text + i, '$', length - i);
+    if (dollar == NULL) break;
+    size_t at = dollar - text;
+
+    size_t end;
+    if (at + 1 < length && text[at + 1] == '{') {
+      size_t close = closing_brace(text, length, at + 2);
+      if (close == string::npos) {
+        // an unclosed ${ is left as it is
+        i = at + 1;
+        continue;
+      }
+      result.append(text + literal, at - literal);
+      Expansion braced = expand_braced_parameter(text + at + 2, close - at - 2, result);
+      if (braced == EXPANSION_FAILED) return EXPANSION_FAILED;
+      expanded = max(expanded, braced);
+      end = close + 1;
+    } else if (at + 1 < length && text[at + 1] == '(') {
+      // $(command), whose output is appended as it is
+      size_t close = closing_paren(text, length, at + 2);
+      if (close == string::npos) {
+        cerr << "command substitution: missing `)'" << endl;
+        return EXPANSION_FAILED;
+      }
+      string output;
+      if (!capture_command_output(string(text + at + 2, close - at - 2), output)) {
+        return EXPANSION_FAILED;
+      }
+
+      // trailing newlines are dropped from the output
+      size_t last = output.find_last_not_of('\n');
+      output.erase(last == string::npos ? 0 : last + 1);
+      result.append(text + literal, at - literal);
+      result += output;
+      expanded = EXPANDED_COMMANDS;
+      end = close + 1;
+    } else {
+      size_t name = parameter_name_length(text + at + 1, length - at - 1);
+      if (name == 0) {
+        // so is a '$' that isn't followed by a name
+        i = at + 1;
+        continue;
+      }
+      result.append(text + literal, at - literal);
+      if (lookup_variable(string(text + at + 1, name), value)) result += value;
+      expanded = max(expanded, EXPANDED_PARAMETERS);
+      end = at + 1 + name;
     }
+
+    i = literal = end;
   }
+
+  result.append(text + literal, length - literal);
+  return expanded;
 }
 
 
-void Shell::variable_substitution(vector<string>& tokens) {
-  vector<string>::iterator token;
+Expansion Shell::expand_braced_parameter(const char* body, size_t length, string& result) {
+  string value;
 
-  for (token = tokens.begin(); token != tokens.end(); ) {
-    if (token->at(0) == '$') {
-      string var_name = token->substr(1);
+  // ${#NAME} is the length of the value
+  if (length > 1 && body[0] == '#' &&
+      parameter_name_length(body + 1, length - 1) == length - 1) {
+    lookup_variable(string(body + 1, length - 1), value);
+    result += to_string(value.size());
+    return EXPANDED_PARAMETERS;
+  }
 
-      if (getenv(var_name.c_str()) != NULL) {
-        *token = getenv(var_name.c_str());
-      } else if (localvars.find(var_name) != localvars.end()) {
-        *token = localvars.find(var_name)->second;
+  size_t name = parameter_name_length(body, length);
+  bool set = name > 0 && lookup_variable(string(body, name), value);
+  const char* rest = body + name;
+  size_t rest_length = length - name;
+
+  if (name > 0 && rest_length == 0) {
+    // ${NAME}
+    result += value;
+  } else if (name > 0 && rest_length >= 2 && rest[0] == ':' && rest[1] == '-') {
+    // ${NAME:-WORD}, where WORD is only expanded if it's used
+    if (set && !value.empty()) {
+      result += value;
+    } else {
+      return max(EXPANDED_PARAMETERS, expand_parameters(rest + 2, rest_length - 2, result));
+    }
+  } else if (name > 0 && rest[0] == '%') {
+    // ${NAME%PATTERN} and ${NAME%%PATTERN} remove the shortest and longest
+    // suffix matching the pattern
+    bool longest = rest_length > 1 && rest[1] == '%';
+    size_t skip = longest ? 2 : 1;
+    string pattern;
+    if (expand_parameters(rest + skip, rest_length - skip, pattern) == EXPANSION_FAILED) {
+      return EXPANSION_FAILED;
+    }
+    const glob_pattern_t* compiled = compile_glob_component(pattern);
+
+    size_t keep = value.size();
+    for (size_t n = 0; n <= value.size(); n++) {
+      size_t suffix = longest ? value.size() - n : n;
+      if (glob_match(*compiled, value.data() + value.size() - suffix, suffix)) {
+        keep = value.size() - suffix;
+        break;
+      }
+    }
+    result.append(value, 0, keep);
+  } else {
+    cerr << "${" << string(body, length) << "}: bad substitution" << endl;
+  }
+  return EXPANDED_PARAMETERS;
+}
+
+
+bool Shell::variable_substitution(vector<string>& tokens) {
+  for (size_t i = 0; i < tokens.size(); ) {
+    // most words have nothing to expand, and are left where they are
+    if (tokens[i].find('$') == string::npos) {
+      i++;
+      continue;
+    }
+
+    if (tokens[i] == "$@" || tokens[i] == "$*") {
+      // splice in one token per positional parameter
+      const vector<string>& params = positional_params.back();
+      tokens.erase(tokens.begin() + i);
+      tokens.insert(tokens.begin() + i, params.begin() + 1, params.end());
+      i += params.size() - 1;
+      continue;
+    }
+
+    // a word that's only a $NAME is looked up straight into place
+    string& token = tokens[i];
+    if (token[0] == '$' &&
+        parameter_name_length(token.data() + 1, token.size() - 1) == token.size() - 1) {
+      if (lookup_variable(token.substr(1), token) && !token.empty()) {
+        i++;
       } else {
-        token = tokens.erase(token);
-        continue;
+        tokens.erase(tokens.begin() + i);
+      }
+      continue;
+    }
+
+    // a command's output is split into words, unless it's assigned (e.g.
+    // --name=$(cmd)); it's expanded into a string of its own, since the
+    // command may run variable_substitution too
+    string::size_type command = token.find("$(");
+    if (command != string::npos) {
+      string expanded;
+      Expansion found = expand_parameters(token.data(), token.size(), expanded);
+      if (found == EXPANSION_FAILED) return false;
+      string::size_type eq_pos = token.find('=');
+      if (found == EXPANDED_COMMANDS && (eq_pos == string::npos || eq_pos > command)) {
+        vector<string> words;
+        string::size_type word_start = expanded.find_first_not_of(" \t\n");
+        while (word_start != string::npos) {
+          string::size_type word_end = expanded.find_first_of(" \t\n", word_start);
+          words.push_back(expanded.substr(word_start, word_end - word_start));
+          word_start = expanded.find_first_not_of(" \t\n", word_end);
+        }
+        tokens.erase(tokens.begin() + i);
+        tokens.insert(tokens.begin() + i, words.begin(), words.end());
+        i += words.size();
+      } else if (expanded.empty()) {
+        tokens.erase(tokens.begin() + i);
+      } else {
+        token.swap(expanded);
+        i++;
       }
+      continue;
+    }
+
+    // the word is built in a buffer whose storage is kept from one word to
+    // the next, and swapped in rather than copied
+    expansion_buffer.clear();
+    if (expansion_buffer.capacity() < tokens[i].size()) {
+      expansion_buffer.reserve(tokens[i].size());
+    }
+    if (expand_parameters(tokens[i].data(), tokens[i].size(), expansion_buffer) ==
+        EXPANDED_NOTHING) {
+      i++;
+      continue;
+    }
+
+    // a word that expands to nothing is dropped, as an unset $VAR always was
+    if (expansion_buffer.empty()) {
+      tokens.erase(tokens.begin() + i);
+      continue;
     }
+    tokens[i].swap(expansion_buffer);
+    i++;
+  }
+  return true;
+}
+
 
-    ++token;
+bool Shell::lookup_variable(const string& name, string& value) {
+  const vector<string>& params = positional_params.back();
+
+  if (name == "?") {
+    value = to_string(last_status);
+  } else if (name == "#") {
+    value = to_string(params.size() - 1);
+  } else if (name == "@" || name == "*") {
+    // inside a word, the parameters are joined by spaces
+    if (params.size() < 2) return false;
+    value = params[1];
+    for (size_t i = 2; i < params.size(); i++) value += " " + params[i];
+  } else if (name.size() == 1 && isdigit(name[0])) {
+    size_t index = name[0] - '0';
+    if (index >= params.size()) return false;
+    value = params[index];
+  } else if (const char* env = read_environment(name)) {
+    value = env;
+  } else if (localvars.find(name) != localvars.end()) {
+    value = localvars.find(name)->second;
+  } else {
+    return false;
   }
+  return true;
 }
 
 
@@ -190,9 +645,24 @@ int Shell::dispatch_command(vector<string>& argv) {
   int return_value = 0;
 
   if (argv.size() != 0) {
+    map<string, script_ptr>::iterator function = functions.find(argv[0]);
     map<string, builtin_t>::iterator cmd = builtins.find(argv[0]);
 
-    if (cmd == builtins.end()) {
+    // the startup snapshot can only reproduce functions and state builtins
+    if (running_startup && function == functions.end() &&
+        state_builtins.count(argv[0]) == 0) {
+      startup_side_effects = true;
+    }
+
+    // a builtin that only writes output can start a pipeline (alias only
+    // when it's listing the aliases)
+    bool piped = find(argv.begin(), argv.end(), string("|")) != argv.end();
+    bool pure = pure_builtins.count(argv[0]) > 0 &&
+                (argv[0] != "alias" || (argv.size() > 1 && argv[1] == "|"));
+
+    if (function != functions.end()) {
+      return_value = call_function(*function->second, argv);
+    } else if (cmd == builtins.end() || (piped && pure)) {
       return_value = execute_external_command(argv);
     } else {
       return_value = ((this->*cmd->second)(argv));
@@ -0,0 +1,460 @@
+/**
+ * This file contains the implementation of the find builtin, which walks
+ * directory trees with a pool of threads.
+ *
+ * Each worker has a deque of directories still to be read. Reading one
+ * pushes its subdirectories onto the worker's own deque, and a worker whose
+ * deque is empty steals the oldest directory from another's, so a deep or
+ * lopsided tree keeps every thread busy without one shared queue that they
+ * all contend on. Directories are read with getdents64 into a buffer per
+ * worker, and an entry's type comes from the directory itself: statx is only
+ * called when a test needs the size or modification time (or the filesystem
+ * didn't say what the entry is), and only once the cheaper tests have
+ * passed. Matching paths are collected per worker and handed to the single
+ * writer in batches, so printing costs one locked write per batch rather
+ * than one per path.
+ *
+ * Unlike find's, the output isn't in directory order: each directory's
+ * entries are printed together, but the directories in whatever order the
+ * workers get to them.
+ */
+
+#include "shell.h"
+#include "find.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <linux/futex.h>
+#include <linux/stat.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * Compiles a glob pattern, and matches a name against one (see
+ * shell_glob.cpp).
+ */
+glob_pattern_t compile_glob(string_view text);
+bool glob_match(const glob_pattern_t& pattern, const char* name, size_t length);
+
+
+/**
+ * Returns whether a token is a pipe or a redirection (see command.cpp).
+ */
+bool is_redirect_or_pipe(const string& token);
+
+
+/**
+ * The layout of the records returned by the getdents64 system call.
+ */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+
+/**
+ * Parses a -size argument: [+-]N, with an optional unit of b (512-byte
+ * blocks, the default), c (bytes), w (2-byte words), k, M or G.
+ */
+bool parse_find_size(const string& text, find_options_t& options) {
+  size_t i = 0;
+  options.size_test = FIND_SIZE_EQUAL;
+  if (text[0] == '+' || text[0] == '-') {
+    options.size_test = text[0] == '+' ? FIND_SIZE_GREATER : FIND_SIZE_LESS;
+    i++;
+  }
+
+  size_t digits = i;
+  options.size = 0;
+  while (i < text.size() && isdigit((unsigned char)text[i])) {
+    options.size = options.size * 10 + (text[i++] - '0');
+  }
+  if (i == digits) return false;
+  if (i == text.size()) return true;
+  if (i + 1 != text.size()) return false;
+
+  switch (text[i]) {
+    case 'b': options.size_unit = 512; break;
+    case 'c': options.size_unit = 1; break;
+    case 'w': options.size_unit = 2; break;
+    case 'k': options.size_unit = 1024; break;
+    case 'M': options.size_unit = 1024 * 1024; break;
+    case 'G': options.size_unit = 1024 * 1024 * 1024; break;
+    default: return false;
+  }
+  return true;
+}
+
+
+/**
+ * Returns the d_type named by a -type letter, or 0 if it names none.
+ */
+unsigned char parse_find_type(const string& text) {
+  if (text.size() != 1) return 0;
+  switch (text[0]) {
+    case 'f': return DT_REG;
+    case 'd': return DT_DIR;
+    case 'l': return DT_LNK;
+    case 'p': return DT_FIFO;
+    case 's': return DT_SOCK;
+    case 'b': return DT_BLK;
+    case 'c': return DT_CHR;
+    default: return 0;
+  }
+}
+
+
+/**
+ * Parses find's arguments. Returns false if they use anything the builtin
+ * doesn't handle, including a test given twice, -print anywhere but at the
+ * end (where it can't print before the tests have run), or a redirection,
+ * which would otherwise be taken for a starting point.
+ */
+bool parse_find(const vector<string>& argv, find_options_t& options) {
+  for (size_t i = 1; i < argv.size(); i++) {
+    if (is_redirect_or_pipe(argv[i])) return false;
+  }
+
+  size_t i = 1;
+  while (i < argv.size() && argv[i][0] != '-' && argv[i] != "!" && argv[i] != "(") {
+    options.paths.push_back(argv[i++]);
+  }
+  if (options.paths.empty()) options.paths.push_back(".");
+
+  for (; i < argv.size(); i++) {
+    const string& test = argv[i];
+    bool last = i + 1 == argv.size();
+    if (test == "-print" || test == "-print0") {
+      if (!last) return false;
+      options.print0 = test == "-print0";
+    } else if (last) {
+      return false;
+    } else if (test == "-name" && !options.has_name) {
+      options.has_name = true;
+      options.name = compile_glob(argv[++i]);
+    } else if (test == "-type" && options.type == 0) {
+      options.type = parse_find_type(argv[++i]);
+      if (options.type == 0) return false;
+    } else if (test == "-newer" && options.newer_path.empty()) {
+      options.newer_path = argv[++i];
+    } else if (test == "-size" && options.size_test == FIND_SIZE_ANY) {
+      if (!parse_find_size(argv[++i], options)) return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool find_builtin_supported(const vector<string>& argv) {
+  find_options_t options;
+  return parse_find(argv, options);
+}
+
+
+/**
+ * Returns whether an entry passes the tests. name is its last component,
+ * and dir_fd and path locate it for statx. type is its type as the
+ * directory gave it, and is set to the real type if the entry had to be
+ * looked up.
+ */
+bool find_matches(const find_options_t& options, int dir_fd, const char* path,
+                  const char* name, size_t length, unsigned char& type) {
+  if (options.has_name && !glob_match(options.name, name, length)) return false;
+  bool known = type != DT_UNKNOWN || options.type == 0;
+  if (known && options.type != 0 && type != options.type) return false;
+  if (known && !options.needs_stat()) return true;
+
+  struct statx info;
+  unsigned int mask = STATX_TYPE;
+  if (!options.newer_path.empty()) mask |= STATX_MTIME;
+  if (options.size_test != FIND_SIZE_ANY) mask |= STATX_SIZE;
+  if (syscall(SYS_statx, dir_fd, path, AT_SYMLINK_NOFOLLOW, mask, &info) != 0) {
+    return false;
+  }
+  type = IFTODT(info.stx_mode);
+  if (options.type != 0 && type != options.type) return false;
+
+  if (!options.newer_path.empty() &&
+      (info.stx_mtime.tv_sec < options.newer.tv_sec ||
+       (info.stx_mtime.tv_sec == options.newer.tv_sec &&
+        info.stx_mtime.tv_nsec <= (uint32_t)options.newer.tv_nsec))) {
+    return false;
+  }
+
+  // like find, the size is rounded up to whole units before comparing
+  uint64_t units = (info.stx_size + options.size_unit - 1) / options.size_unit;
+  switch (options.size_test) {
+    case FIND_SIZE_LESS: return units < options.size;
+    case FIND_SIZE_EQUAL: return units == options.size;
+    case FIND_SIZE_GREATER: return units > options.size;
+    default: return true;
+  }
+}
+
+
+/**
+ * Returns an entry's type from statx, for a filesystem that doesn't fill in
+ * d_type, or DT_UNKNOWN if it can't be looked up.
+ */
+unsigned char lookup_type(int dir_fd, const char* path) {
+  struct statx info;
+  if (syscall(SYS_statx, dir_fd, path, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &info) != 0) {
+    return DT_UNKNOWN;
+  }
+  return IFTODT(info.stx_mode);
+}
+
+
+/**
+ * Writes a worker's collected output, whole.
+ */
+void flush_find_output(find_walk_t& walk, find_worker_t& worker) {
+  if (worker.output.empty()) return;
+  pthread_mutex_lock(&walk.output_lock);
+  cout.write(worker.output.data(), worker.output.size());
+  pthread_mutex_unlock(&walk.output_lock);
+  worker.output.clear();
+}
+
+
+/**
+ * Adds a matching path to a worker's output, handing the output to the
+ * writer once there's a batch of it.
+ */
+void add_find_output(find_walk_t& walk, find_worker_t& worker, const string& path) {
+  worker.output += path;
+  worker.output += walk.options->print0 ? '\0' : '\n';
+  if (worker.output.size() >= FIND_OUTPUT_BATCH_SIZE) flush_find_output(walk, worker);
+}
+
+
+/**
+ * Reports a path that couldn't be read (with the error in errno), which
+ * makes find's status 1.
+ */
+void report_find_error(find_walk_t& walk, const string& path) {
+  const char* error = strerror(errno);
+  pthread_mutex_lock(&walk.output_lock);
+  cout.flush();
+  cerr << "find: " << path << ": " << error << endl;
+  pthread_mutex_unlock(&walk.output_lock);
+  walk.failed = true;
+}
+
+
+/**
+ * Pushes a directory onto a worker's deque, waking an idle worker to steal
+ * it if there is one.
+ */
+void push_directory(find_walk_t& walk, find_worker_t& worker, const string& path) {
+  walk.pending++;
+  pthread_mutex_lock(&worker.lock);
+  worker.dirs.push_back(path);
+  pthread_mutex_unlock(&worker.lock);
+
+  if (walk.idle.load() > 0) {
+    walk.work_events++;
+    syscall(SYS_futex, &walk.work_events, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+
+/**
+ * Takes the next directory for a worker: the newest one on its own deque,
+ * or else the oldest one on another's. Returns false if there's none.
+ */
+bool take_directory(find_walk_t& walk, size_t index, string& path) {
+  size_t count = walk.workers.size();
+  for (size_t n = 0; n < count; n++) {
+    find_worker_t& victim = *walk.workers[(index + n) % count];
+    pthread_mutex_lock(&victim.lock);
+    bool found = !victim.dirs.empty();
+    if (found && n == 0) {
+      path.swap(victim.dirs.back());
+      victim.dirs.pop_back();
+    } else if (found) {
+      path.swap(victim.dirs.front());
+      victim.dirs.pop_front();
+    }
+    pthread_mutex_unlock(&victim.lock);
+    if (found) return true;
+  }
+  return false;
+}
+
+
+/**
+ * Reads a directory, adding the entries that pass the tests to the output
+ * and pushing the subdirectories onto the worker's deque.
+ */
+void walk_directory(find_walk_t& walk, find_worker_t& worker, const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    report_find_error(walk, path);
+    return;
+  }
+
+  string child = path;
+  if (child[child.size() - 1] != '/') child += '/';
+  size_t base = child.size();
+
+  while (true) {
+    long count = syscall(SYS_getdents64, fd, worker.buffer.data(), worker.buffer.size());
+    if (count < 0) report_find_error(walk, path);
+    if (count <= 0) break;
+
+    for (long offset = 0; offset < count; ) {
+      linux_dirent64* entry = (linux_dirent64*)(worker.buffer.data() + offset);
+      offset += entry->d_reclen;
+
+      const char* name = entry->d_name;
+      if (name[0] == '.' && (name[1] == '\0' ||
+                             (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      size_t length = strlen(name);
+      unsigned char type = entry->d_type;
+      bool matched = find_matches(*walk.options, fd, name, name, length, type);
+      if (type == DT_UNKNOWN) type = lookup_type(fd, name);
+      if (!matched && type != DT_DIR) continue;
+
+      child.resize(base);
+      child.append(name, length);
+      if (matched) add_find_output(walk, worker, child);
+      if (type == DT_DIR) push_directory(walk, worker, child);
+    }
+  }
+  close(fd);
+}
+
+
+/**
+ * The body of a worker: reads directories until there are none left
+ * anywhere. A worker that runs out of work announces that it's idle, looks
+ * once more (so a directory pushed after its first look still wakes it),
+ * and sleeps until there's work or the walk is over.
+ */
+void run_find_worker(find_walk_t* walk, size_t index) {
+  find_worker_t& worker = *walk->workers[index];
+  worker.buffer.resize(FIND_DIRENT_BUFFER_SIZE);
+  struct timespec timeout = { 0, FIND_IDLE_WAIT_US * 1000 };
+
+  string path;
+  while (true) {
+    bool found = take_directory(*walk, index, path);
+    if (!found) {
+      walk->idle++;
+      uint32_t seen = walk->work_events.load();
+      found = take_directory(*walk, index, path);
+      if (!found && walk->pending.load() > 0) {
+        syscall(SYS_futex, &walk->work_events, FUTEX_WAIT_PRIVATE, seen,
+                &timeout, NULL, 0);
+      }
+      walk->idle--;
+      if (!found && walk->pending.load() == 0) break;
+      if (!found) continue;
+    }
+
+    walk_directory(*walk, worker, path);
+    if (--walk->pending == 0) {
+      // the walk is over; wake everyone to see that
+      walk->work_events++;
+      syscall(SYS_futex, &walk->work_events, FUTEX_WAKE_PRIVATE, INT32_MAX,
+              NULL, NULL, 0);
+    }
+  }
+  flush_find_output(*walk, worker);
+}
+
+
+/**
+ * Returns the number of threads to walk with: MYSHELL_FIND_THREADS if it's
+ * set (to measure how the walk scales), or one per CPU.
+ */
+size_t find_thread_count() {
+  const char* setting = getenv("MYSHELL_FIND_THREADS");
+  if (setting != NULL && atoi(setting) > 0) return atoi(setting);
+  return max(thread::hardware_concurrency(), 1u);
+}
+
+
+/**
+ * Returns the last component of a starting point, which -name tests (the
+ * path itself for "/").
+ */
+string start_name(const string& path) {
+  size_t end = path.find_last_not_of('/');
+  if (end == string::npos) return path.substr(0, 1);
+  size_t start = path.rfind('/', end);
+  start = start == string::npos ? 0 : start + 1;
+  return path.substr(start, end + 1 - start);
+}
+
+
+int Shell::com_find(vector<string>& argv) {
+  // anything the builtin doesn't handle (including redirections) is left to
+  // the external find
+  find_options_t options;
+  if (!parse_find(argv, options)) return execute_external_command(argv);
+
+  if (!options.newer_path.empty()) {
+    struct stat info;
+    if (stat(options.newer_path.c_str(), &info) != 0) {
+      perror(options.newer_path.c_str());
+      return 1;
+    }
+    options.newer = info.st_mtim;
+  }
+
+  find_walk_t walk;
+  walk.options = &options;
+  size_t threads = find_thread_count();
+  for (size_t i = 0; i < threads; i++) {
+    walk.workers.push_back(unique_ptr<find_worker_t>(new find_worker_t()));
+  }
+
+  // the starting points are tested themselves, and the directories among
+  // them are dealt out to the workers
+  for (size_t i = 0; i < options.paths.size(); i++) {
+    const string& path = options.paths[i];
+    unsigned char type = lookup_type(AT_FDCWD, path.c_str());
+    if (type == DT_UNKNOWN) {
+      report_find_error(walk, path);
+      continue;
+    }
+    string name = start_name(path);
+    if (find_matches(options, AT_FDCWD, path.c_str(), name.c_str(), name.size(), type)) {
+      add_find_output(walk, *walk.workers[0], path);
+    }
+    if (type == DT_DIR) push_directory(walk, *walk.workers[i % threads], path);
+  }
+
+  // the shell's thread is the first worker
+  for (size_t i = 1; i < threads; i++) {
+    walk.workers[i]->thread = thread([&walk, i]() {
+      sigset_t all;
+      sigfillset(&all);
+      pthread_sigmask(SIG_BLOCK, &all, NULL);
+      run_find_worker(&walk, i);
+    });
+  }
+  run_find_worker(&walk, 0);
+  for (size_t i = 1; i < threads; i++) walk.workers[i]->thread.join();
+
+  cout.flush();
+  return walk.failed ? 1 : 0;
+}
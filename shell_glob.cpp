@@ -0,0 +1,449 @@
+/**
+ * This file contains the implementation of glob (filename) expansion: words
+ * containing *, ? or [...] are replaced by the sorted list of matching paths.
+ * A path component of "**" matches any number of nested directories.
+ *
+ * Each path component is compiled once into a glob_pattern_t (see pattern.h)
+ * and cached. Directories are read with one getdents64 pass into a reused
+ * buffer, entries are rejected by their literal prefix and suffix before the
+ * full matcher runs, and matching paths are collected back to back in a
+ * single arena so that sorting them doesn't need a heap string per match.
+ */
+
+#include "shell.h"
+#include "pattern.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iterator>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * The maximum number of compiled path components to keep in the cache.
+ */
+const size_t GLOB_CACHE_SIZE = 256;
+
+/**
+ * The size of the buffer that directory entries are read into.
+ */
+const size_t DIRENT_BUFFER_SIZE = 1 << 20;
+
+/**
+ * Result lists shorter than this are sorted on the calling thread.
+ */
+const size_t PARALLEL_SORT_THRESHOLD = 1 << 16;
+
+
+/**
+ * The layout of the records returned by the getdents64 system call.
+ */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+
+/**
+ * The state of one glob expansion while it walks the directory tree.
+ */
+struct glob_search_t {
+  /**
+   * The pattern's compiled path components.
+   */
+  vector<const glob_pattern_t*> components;
+
+  /**
+   * Whether the pattern ended in '/', so that only directories match.
+   */
+  bool dirs_only;
+
+  /**
+   * Every matching path, stored back to back, and the (offset, length) of
+   * each one within the arena.
+   */
+  vector<char> arena;
+  vector<pair<size_t, size_t> > matches;
+
+  /**
+   * The getdents64 buffer (DIRENT_BUFFER_SIZE bytes), reused for every
+   * directory and every word.
+   */
+  char* buffer;
+};
+
+
+glob_pattern_t compile_glob(string_view text) {
+  glob_pattern_t pattern;
+  pattern.has_wildcards = false;
+  pattern.is_globstar = text == "**";
+
+  for (size_t i = 0; i < text.size(); i++) {
+    pattern_element_t element;
+    element.type = PATTERN_LITERAL;
+    element.literal = text[i];
+    element.class_index = -1;
+
+    if (text[i] == '\\' && i + 1 < text.size()) {
+      // an escaped character is always literal
+      element.literal = text[++i];
+    } else if (text[i] == '*') {
+      element.type = PATTERN_STAR;
+      // consecutive stars match the same thing as one
+      if (!pattern.elements.empty() &&
+          pattern.elements.back().type == PATTERN_STAR) {
+        continue;
+      }
+    } else if (text[i] == '?') {
+      element.type = PATTERN_ANY_CHAR;
+    } else if (text[i] == '[') {
+      size_t j = i + 1;
+      bool negate = j < text.size() && (text[j] == '!' || text[j] == '^');
+      if (negate) j++;
+
+      // a ']' right after the '[' (or '[!') is part of the set
+      bitset<256> set;
+      size_t first = j;
+      while (j < text.size() && (text[j] != ']' || j == first)) {
+        unsigned char low = text[j];
+        if (j + 2 < text.size() && text[j + 1] == '-' && text[j + 2] != ']') {
+          unsigned char high = text[j + 2];
+          for (unsigned c = low; c <= high; c++) set.set(c);
+          j += 3;
+        } else {
+          set.set(low);
+          j++;
+        }
+      }
+
+      // without a closing ']' the '[' is just a character
+      if (j < text.size()) {
+        if (negate) set.flip();
+        element.type = PATTERN_CLASS;
+        element.class_index = pattern.classes.size();
+        pattern.classes.push_back(set);
+        i = j;
+      }
+    }
+
+    if (element.type != PATTERN_LITERAL) pattern.has_wildcards = true;
+    pattern.elements.push_back(element);
+  }
+
+  // collect the literal runs at either end for the prefilter
+  size_t start = 0;
+  while (start < pattern.elements.size() &&
+         pattern.elements[start].type == PATTERN_LITERAL) {
+    pattern.prefix += pattern.elements[start++].literal;
+  }
+  if (start == pattern.elements.size()) {
+    pattern.literal = pattern.prefix;
+  } else {
+    size_t end = pattern.elements.size();
+    while (pattern.elements[end - 1].type == PATTERN_LITERAL) end--;
+    for (size_t i = end; i < pattern.elements.size(); i++) {
+      pattern.suffix += pattern.elements[i].literal;
+    }
+  }
+  pattern.matches_hidden = !pattern.prefix.empty() && pattern.prefix[0] == '.';
+  return pattern;
+}
+
+
+bool element_matches(
+    const glob_pattern_t& pattern,
+    const pattern_element_t& element,
+    unsigned char c) {
+  switch (element.type) {
+    case PATTERN_LITERAL: return element.literal == c;
+    case PATTERN_ANY_CHAR: return true;
+    case PATTERN_CLASS: return pattern.classes[element.class_index].test(c);
+    default: return false;
+  }
+}
+
+
+bool glob_match(const glob_pattern_t& pattern, const char* name, size_t length) {
+  // cheap checks on the literal ends first
+  if (length < pattern.prefix.size() + pattern.suffix.size()) return false;
+  if (memcmp(name, pattern.prefix.data(), pattern.prefix.size()) != 0) {
+    return false;
+  }
+  if (memcmp(name + length - pattern.suffix.size(), pattern.suffix.data(),
+             pattern.suffix.size()) != 0) {
+    return false;
+  }
+
+  // match the rest, backtracking to the most recent star on a mismatch
+  const vector<pattern_element_t>& elements = pattern.elements;
+  size_t p = 0, n = 0;
+  size_t star = string::npos, star_n = 0;
+  while (n < length) {
+    if (p < elements.size() && elements[p].type == PATTERN_STAR) {
+      star = p++;
+      star_n = n;
+    } else if (p < elements.size() &&
+               element_matches(pattern, elements[p], name[n])) {
+      p++;
+      n++;
+    } else if (star != string::npos) {
+      p = star + 1;
+      n = ++star_n;
+    } else {
+      return false;
+    }
+  }
+  while (p < elements.size() && elements[p].type == PATTERN_STAR) p++;
+  return p == elements.size();
+}
+
+
+/**
+ * Returns true if the directory entry is a directory. Symbolic links are
+ * followed only if follow_links is set.
+ */
+bool entry_is_directory(int dir_fd, const char* name, unsigned char type,
+                        bool follow_links) {
+  if (type == DT_DIR) return true;
+  if (type != DT_UNKNOWN && (type != DT_LNK || !follow_links)) return false;
+
+  struct stat info;
+  int flags = follow_links ? 0 : AT_SYMLINK_NOFOLLOW;
+  return fstatat(dir_fd, name, &info, flags) == 0 && S_ISDIR(info.st_mode);
+}
+
+
+/**
+ * Calls visit(dir_fd, name, length, type) for every entry in the directory
+ * except "." and "..", reading the entries with getdents64.
+ */
+template <typename Visitor>
+void read_directory(const string& path, char* buffer, Visitor visit) {
+  int fd = open(path.empty() ? "." : path.c_str(),
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return;
+
+  while (true) {
+    long count = syscall(SYS_getdents64, fd, buffer, DIRENT_BUFFER_SIZE);
+    if (count <= 0) break;
+
+    for (long offset = 0; offset < count; ) {
+      linux_dirent64* entry = (linux_dirent64*)(buffer + offset);
+      offset += entry->d_reclen;
+
+      const char* name = entry->d_name;
+      if (name[0] == '.' && (name[1] == '\0' ||
+                             (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      visit(fd, name, strlen(name), entry->d_type);
+    }
+  }
+  close(fd);
+}
+
+
+void add_match(glob_search_t& search, const string& path,
+               const char* name, size_t length) {
+  size_t offset = search.arena.size();
+  search.arena.insert(search.arena.end(), path.begin(), path.end());
+  search.arena.insert(search.arena.end(), name, name + length);
+  if (search.dirs_only) search.arena.push_back('/');
+  search.matches.push_back(make_pair(offset, search.arena.size() - offset));
+}
+
+
+/**
+ * Matches the components from index onwards against the directory path
+ * (which is empty for the current directory, or ends in '/').
+ */
+void glob_search(glob_search_t& search, const string& path, size_t index) {
+  const glob_pattern_t& pattern = *search.components[index];
+  bool last = index + 1 == search.components.size();
+
+  if (pattern.is_globstar) {
+    // "**" may match no directories at all...
+    if (!last) glob_search(search, path, index + 1);
+
+    // ...or any path through the non-hidden directories below this one
+    vector<string> subdirs;
+    read_directory(path, search.buffer,
+        [&](int fd, const char* name, size_t length, unsigned char type) {
+      if (name[0] == '.') return;
+      bool is_dir = entry_is_directory(fd, name, type, false);
+      if (last && (is_dir || !search.dirs_only)) {
+        add_match(search, path, name, length);
+      }
+      if (is_dir) subdirs.push_back(string(name, length));
+    });
+    for (size_t i = 0; i < subdirs.size(); i++) {
+      glob_search(search, path + subdirs[i] + "/", index);
+    }
+    return;
+  }
+
+  if (!pattern.has_wildcards) {
+    // literal components don't need the directory to be read at all
+    string next = path + pattern.literal;
+    struct stat info;
+    if (lstat(next.c_str(), &info) != 0) return;
+    if (last) {
+      if (!search.dirs_only || S_ISDIR(info.st_mode)) {
+        add_match(search, path, pattern.literal.data(),
+                  pattern.literal.size());
+      }
+    } else {
+      glob_search(search, next + "/", index + 1);
+    }
+    return;
+  }
+
+  vector<string> subdirs;
+  read_directory(path, search.buffer,
+      [&](int fd, const char* name, size_t length, unsigned char type) {
+    if (name[0] == '.' && !pattern.matches_hidden) return;
+    if (!glob_match(pattern, name, length)) return;
+
+    if (last) {
+      if (!search.dirs_only || entry_is_directory(fd, name, type, true)) {
+        add_match(search, path, name, length);
+      }
+    } else if (entry_is_directory(fd, name, type, true)) {
+      subdirs.push_back(string(name, length));
+    }
+  });
+  for (size_t i = 0; i < subdirs.size(); i++) {
+    glob_search(search, path + subdirs[i] + "/", index + 1);
+  }
+}
+
+
+/**
+ * Sorts the items, splitting large lists across threads and then merging the
+ * sorted runs pairwise (also in parallel).
+ */
+void parallel_sort(vector<string_view>& items) {
+  size_t workers = min(thread::hardware_concurrency(), 8u);
+  if (items.size() < PARALLEL_SORT_THRESHOLD || workers < 2) {
+    sort(items.begin(), items.end());
+    return;
+  }
+
+  vector<size_t> bounds;
+  for (size_t i = 0; i <= workers; i++) {
+    bounds.push_back(items.size() * i / workers);
+  }
+
+  vector<thread> threads;
+  for (size_t i = 0; i < workers; i++) {
+    threads.emplace_back([&items, &bounds, i]() {
+      sort(items.begin() + bounds[i], items.begin() + bounds[i + 1]);
+    });
+  }
+  for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+
+  for (size_t width = 1; width < workers; width *= 2) {
+    threads.clear();
+    for (size_t i = 0; i + width < workers; i += 2 * width) {
+      size_t first = bounds[i];
+      size_t middle = bounds[i + width];
+      size_t last = bounds[min(i + 2 * width, workers)];
+      threads.emplace_back([&items, first, middle, last]() {
+        inplace_merge(items.begin() + first, items.begin() + middle,
+                      items.begin() + last);
+      });
+    }
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+  }
+}
+
+
+const glob_pattern_t* Shell::compile_glob_component(string_view text) {
+  map<string, glob_pattern_t, less<> >::iterator cached = glob_cache.find(text);
+  if (cached != glob_cache.end()) return &cached->second;
+  return &(glob_cache[string(text)] = compile_glob(text));
+}
+
+
+bool Shell::expand_glob(const string& word, vector<string>& matches) {
+  glob_search_t search;
+  search.dirs_only = word.size() > 1 && word[word.size() - 1] == '/';
+
+  // split the word into path components, ignoring empty ones
+  bool has_wildcards = false;
+  string_view text(word);
+  size_t start = 0;
+  while (start < text.size()) {
+    size_t end = text.find('/', start);
+    if (end == string_view::npos) end = text.size();
+    if (end > start) {
+      const glob_pattern_t* component =
+          compile_glob_component(text.substr(start, end - start));
+      has_wildcards = has_wildcards || component->has_wildcards;
+      search.components.push_back(component);
+    }
+    start = end + 1;
+  }
+  if (!has_wildcards || search.components.empty()) return false;
+
+  // allocated once, and left uninitialized: getdents64 only hands back what
+  // it wrote
+  if (!dirent_buffer) dirent_buffer.reset(new char[DIRENT_BUFFER_SIZE]);
+  search.buffer = dirent_buffer.get();
+  glob_search(search, word[0] == '/' ? "/" : "", 0);
+  if (search.matches.empty()) return false;
+
+  // sort views into the arena, and only build strings for the final result
+  vector<string_view> sorted;
+  sorted.reserve(search.matches.size());
+  for (size_t i = 0; i < search.matches.size(); i++) {
+    sorted.push_back(string_view(search.arena.data() + search.matches[i].first,
+                                 search.matches[i].second));
+  }
+  parallel_sort(sorted);
+
+  matches.reserve(sorted.size());
+  for (size_t i = 0; i < sorted.size(); i++) {
+    matches.push_back(string(sorted[i]));
+  }
+  return true;
+}
+
+
+void Shell::glob_expansion(vector<string>& tokens) {
+  // clear the cache up front, never while a word's components are in use
+  if (glob_cache.size() >= GLOB_CACHE_SIZE) glob_cache.clear();
+
+  for (size_t i = 0; i < tokens.size(); ) {
+    // words without wildcards, or without any matches, are left alone
+    if (tokens[i].find_first_of("*?[") == string::npos) {
+      i++;
+      continue;
+    }
+
+    // what a pattern matches can change, so the startup snapshot can't keep it
+    if (running_startup) startup_side_effects = true;
+
+    vector<string> matches;
+    if (!expand_glob(tokens[i], matches)) {
+      i++;
+      continue;
+    }
+
+    tokens.erase(tokens.begin() + i);
+    tokens.insert(tokens.begin() + i, make_move_iterator(matches.begin()),
+                  make_move_iterator(matches.end()));
+    i += matches.size();
+  }
+}
@@ -0,0 +1,140 @@
+/**
+ * This file contains the detection and running of pasted input.
+ *
+ * Readline takes a bracketed paste in one piece and returns it as a single
+ * line with its newlines in it. A terminal without bracketed paste just
+ * sends the text, which readline would hand over a line at a time, with the
+ * prompt rendered, history expanded and added, and the line redrawn for
+ * each. So when readline returns a line and another whole line is already
+ * waiting on the terminal, the shell reads the rest of the burst itself,
+ * with echo off, until the terminal has been quiet for PASTE_BURST_GAP_MS.
+ * Either way the block is parsed once, run without prompts in between, and
+ * added to the history as one entry.
+ */
+
+#include "shell.h"
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <poll.h>
+#include <readline/readline.h>
+#include <termios.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * Formats the duration of a command (see shell_prompt.cpp).
+ */
+string format_duration(double us);
+
+
+/**
+ * Waits up to timeout_ms for input on a descriptor. On a terminal in
+ * canonical mode, as it is outside readline, that means a whole line.
+ */
+bool input_waiting(int fd, int timeout_ms) {
+  struct pollfd entry = { fd, POLLIN, 0 };
+  int ready;
+  do {
+    ready = poll(&entry, 1, timeout_ms);
+  } while (ready < 0 && errno == EINTR);
+  return ready > 0;
+}
+
+
+/**
+ * Turns the carriage returns a terminal sends for a pasted newline into
+ * newlines. Readline's raw mode leaves them untranslated, both in a
+ * bracketed paste and in what arrives before it hands the terminal back.
+ */
+void normalize_line_ends(string& text) {
+  size_t out = 0;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '\r') {
+      text[out++] = '\n';
+      if (i + 1 < text.size() && text[i + 1] == '\n') i++;
+    } else {
+      text[out++] = text[i];
+    }
+  }
+  text.resize(out);
+}
+
+
+bool Shell::read_paste(const char* line, paste_block_t& block) {
+  block.text = line;
+
+  // a bracketed paste of more than one line
+  if (block.text.find_first_of("\r\n") != string::npos) {
+    normalize_line_ends(block.text);
+    while (!block.text.empty() && block.text.back() == '\n') block.text.pop_back();
+    block.bracketed = true;
+    block.lines = count(block.text.begin(), block.text.end(), '\n') + 1;
+    return true;
+  }
+
+  if (!isatty(STDIN_FILENO) || !input_waiting(STDIN_FILENO, 0)) return false;
+
+  // the rest of the burst isn't echoed, the summary stands in for it
+  settle_read_buffers();
+  struct termios saved;
+  bool quiet = tcgetattr(STDIN_FILENO, &saved) == 0;
+  if (quiet) {
+    struct termios no_echo = saved;
+    no_echo.c_lflag &= ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &no_echo);
+  }
+
+  string burst;
+  vector<char> buffer(PASTE_READ_SIZE);
+  while (input_waiting(STDIN_FILENO, PASTE_BURST_GAP_MS)) {
+    ssize_t count = read(STDIN_FILENO, buffer.data(), buffer.size());
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) {
+      block.eof = count == 0;
+      break;
+    }
+    burst.append(buffer.data(), count);
+  }
+  if (quiet) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+
+  // a partial last line is left for readline, to be finished there
+  normalize_line_ends(burst);
+  size_t end = burst.rfind('\n');
+  if (end == string::npos) {
+    paste_leftover = burst;
+    return false;
+  }
+  paste_leftover = burst.substr(end + 1);
+  burst.resize(end);
+
+  block.text += '\n';
+  block.text += burst;
+  block.lines = count(block.text.begin(), block.text.end(), '\n') + 1;
+  return true;
+}
+
+
+int Shell::execute_paste(paste_block_t& block) {
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int return_value = block.text.empty() ? 0 : execute_line(&block.text[0]);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  last_duration_us = elapsed_us(start, end);
+
+  cerr << "paste: ran " << block.lines << " lines as one block in "
+       << format_duration(last_duration_us) << " (status " << return_value
+       << ")" << endl;
+  return return_value;
+}
+
+
+int Shell::insert_paste_leftover_hook() {
+  if (instance.paste_leftover.empty()) return 0;
+  rl_insert_text(instance.paste_leftover.c_str());
+  instance.paste_leftover.clear();
+  rl_redisplay();
+  return 0;
+}
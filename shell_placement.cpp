@@ -0,0 +1,294 @@
+/**
+ * This file contains the implementation of CPU and NUMA placement for the
+ * stages of a pipeline (see the 'pin' builtin).
+ *
+ * Placements are worked out in the shell before forking and applied by each
+ * child just before it execs, using the raw sched_setaffinity and
+ * set_mempolicy system calls. The child then reads its placement back and
+ * reports what was actually applied.
+ */
+
+#include "shell.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * The number of words in the CPU and node masks passed to the kernel (enough
+ * for 1024 CPUs).
+ */
+const size_t MASK_WORDS = 16;
+const size_t BITS_PER_WORD = 8 * sizeof(unsigned long);
+
+/**
+ * The set_mempolicy mode that prefers, but doesn't require, a node
+ * (MPOL_PREFERRED in linux/mempolicy.h).
+ */
+const int MEMPOLICY_PREFERRED = 1;
+
+
+bool parse_cpu_list(const string& text, vector<int>& cpus) {
+  // lists look like "0-3,8,10-11", as in /sys/devices/system/cpu/online
+  size_t start = 0;
+  while (start < text.size()) {
+    size_t end = text.find(',', start);
+    if (end == string::npos) end = text.size();
+    string range = text.substr(start, end - start);
+
+    char* rest;
+    long low = strtol(range.c_str(), &rest, 10);
+    long high = low;
+    if (*rest == '-') high = strtol(rest + 1, &rest, 10);
+    if (range.empty() || *rest != '\0' || low < 0 || high < low ||
+        high >= (long)(MASK_WORDS * BITS_PER_WORD)) {
+      return false;
+    }
+    for (long cpu = low; cpu <= high; cpu++) cpus.push_back(cpu);
+    start = end + 1;
+  }
+  sort(cpus.begin(), cpus.end());
+  cpus.erase(unique(cpus.begin(), cpus.end()), cpus.end());
+  return !cpus.empty();
+}
+
+
+string format_cpu_list(const vector<int>& cpus) {
+  string result;
+  for (size_t i = 0; i < cpus.size(); ) {
+    // collapse runs of consecutive CPUs into ranges
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+    if (!result.empty()) result += ",";
+    result += to_string(cpus[i]);
+    if (j > i) result += "-" + to_string(cpus[j]);
+    i = j + 1;
+  }
+  return result;
+}
+
+
+bool read_cpu_list_file(const string& path, vector<int>& cpus) {
+  ifstream file(path.c_str());
+  string text;
+  return getline(file, text) && parse_cpu_list(text, cpus);
+}
+
+
+vector<int> mask_to_cpus(const unsigned long* mask, size_t words) {
+  vector<int> cpus;
+  for (size_t bit = 0; bit < words * BITS_PER_WORD; bit++) {
+    if (mask[bit / BITS_PER_WORD] & (1UL << (bit % BITS_PER_WORD))) {
+      cpus.push_back(bit);
+    }
+  }
+  return cpus;
+}
+
+
+/**
+ * Returns the CPUs that the given process (0 for this one) may run on.
+ */
+vector<int> get_affinity(pid_t pid) {
+  unsigned long mask[MASK_WORDS] = { 0 };
+  if (syscall(SYS_sched_getaffinity, pid, sizeof(mask), mask) < 0) {
+    return vector<int>();
+  }
+  return mask_to_cpus(mask, MASK_WORDS);
+}
+
+
+/**
+ * Returns the lowest CPU in the given sysfs CPU list file, which identifies
+ * the group of CPUs it describes (a core, or the CPUs sharing a cache). Falls
+ * back to the CPU itself if the file doesn't exist.
+ */
+int cpu_group(int cpu, const string& file) {
+  vector<int> group;
+  string path = "/sys/devices/system/cpu/cpu" + to_string(cpu) + "/" + file;
+  if (!read_cpu_list_file(path, group)) return cpu;
+  return group[0];
+}
+
+
+/**
+ * Returns the sysfs file listing the CPUs that share the given CPU's cache at
+ * the given level, or "" if there is none.
+ */
+string shared_cache_file(int cpu, int level) {
+  for (int index = 0; index < 8; index++) {
+    string dir = "cache/index" + to_string(index) + "/";
+    ifstream file(("/sys/devices/system/cpu/cpu" + to_string(cpu) + "/" +
+                   dir + "level").c_str());
+    int cache_level;
+    if (!(file >> cache_level)) break;
+    if (cache_level == level) return dir + "shared_cpu_list";
+  }
+  return "";
+}
+
+
+/**
+ * Orders the given CPUs so that neighbours in the list share as much cache
+ * as possible: one hardware thread per core first, grouped by shared L3 and
+ * then L2 cache, followed by the remaining hardware threads in the same
+ * order. Assigning adjacent pipeline stages to adjacent CPUs in this list
+ * keeps data passed between them in a shared cache.
+ */
+vector<int> spread_order(const vector<int>& cpus) {
+  struct placement_t {
+    int cpu, l3, l2, core;
+    bool primary;
+  };
+  vector<placement_t> placements;
+  for (size_t i = 0; i < cpus.size(); i++) {
+    placement_t p;
+    p.cpu = cpus[i];
+    string l3 = shared_cache_file(p.cpu, 3);
+    string l2 = shared_cache_file(p.cpu, 2);
+    p.l3 = l3.empty() ? 0 : cpu_group(p.cpu, l3);
+    p.l2 = l2.empty() ? p.cpu : cpu_group(p.cpu, l2);
+    p.core = cpu_group(p.cpu, "topology/thread_siblings_list");
+    p.primary = p.core == p.cpu;
+    placements.push_back(p);
+  }
+
+  sort(placements.begin(), placements.end(),
+      [](const placement_t& a, const placement_t& b) {
+    if (a.primary != b.primary) return a.primary;
+    if (a.l3 != b.l3) return a.l3 < b.l3;
+    if (a.l2 != b.l2) return a.l2 < b.l2;
+    return a.cpu < b.cpu;
+  });
+
+  vector<int> order;
+  for (size_t i = 0; i < placements.size(); i++) {
+    order.push_back(placements[i].cpu);
+  }
+  return order;
+}
+
+
+/**
+ * Splits a per-stage option ("a:b:c") into its parts.
+ */
+vector<string> split_stages(const string& text) {
+  vector<string> parts;
+  size_t start = 0;
+  while (true) {
+    size_t end = text.find(':', start);
+    parts.push_back(text.substr(start, end - start));
+    if (end == string::npos) break;
+    start = end + 1;
+  }
+  return parts;
+}
+
+
+bool Shell::assign_placements(
+    vector<command_t>& commands,
+    const string& cpu_spec,
+    const string& node_spec,
+    bool spread) {
+  vector<string> cpu_lists = split_stages(cpu_spec);
+  vector<string> node_lists = split_stages(node_spec);
+
+  // stages without a list of their own use the last one given
+  for (size_t i = 0; i < commands.size(); i++) {
+    const string& cpu_text = cpu_lists[min(i, cpu_lists.size() - 1)];
+    const string& node_text = node_lists[min(i, node_lists.size() - 1)];
+
+    vector<int> cpus;
+    if (!cpu_text.empty() && !parse_cpu_list(cpu_text, cpus)) {
+      cerr << "pin: " << cpu_text << ": invalid CPU list" << endl;
+      return false;
+    }
+
+    if (!node_text.empty()) {
+      char* end;
+      long node = strtol(node_text.c_str(), &end, 10);
+      vector<int> node_cpus;
+      string path = "/sys/devices/system/node/node" + node_text + "/cpulist";
+      if (*end != '\0' || node < 0 || !read_cpu_list_file(path, node_cpus)) {
+        cerr << "pin: " << node_text << ": no such NUMA node" << endl;
+        return false;
+      }
+      commands[i].numa_node = node;
+
+      // keep only the CPUs that belong to the node
+      if (cpus.empty()) {
+        cpus = node_cpus;
+      } else {
+        vector<int> both;
+        set_intersection(cpus.begin(), cpus.end(), node_cpus.begin(),
+                         node_cpus.end(), back_inserter(both));
+        cpus = both;
+      }
+      if (cpus.empty()) {
+        cerr << "pin: no CPUs of node " << node << " in " << cpu_text << endl;
+        return false;
+      }
+    }
+
+    if (spread) {
+      // spread stages one CPU each along the cache-sharing order
+      if (cpus.empty()) cpus = get_affinity(0);
+      vector<int> order = spread_order(cpus);
+      if (order.empty()) {
+        cerr << "pin: no CPUs available" << endl;
+        return false;
+      }
+      cpus.assign(1, order[i % order.size()]);
+    }
+    commands[i].cpus = cpus;
+  }
+  return true;
+}
+
+
+void Shell::apply_placement(const command_t& command, size_t stage) {
+  if (!command.cpus.empty()) {
+    unsigned long mask[MASK_WORDS] = { 0 };
+    for (size_t i = 0; i < command.cpus.size(); i++) {
+      mask[command.cpus[i] / BITS_PER_WORD] |=
+          1UL << (command.cpus[i] % BITS_PER_WORD);
+    }
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0) {
+      perror("pin: sched_setaffinity");
+    }
+  }
+
+  if (command.numa_node >= 0) {
+    unsigned long nodes[MASK_WORDS] = { 0 };
+    nodes[command.numa_node / BITS_PER_WORD] |=
+        1UL << (command.numa_node % BITS_PER_WORD);
+    if (syscall(SYS_set_mempolicy, MEMPOLICY_PREFERRED, nodes,
+                MASK_WORDS * BITS_PER_WORD) < 0) {
+      perror("pin: set_mempolicy");
+    }
+  }
+
+  // report what the kernel actually applied, in a single write so that the
+  // reports of concurrent stages don't interleave
+  string report = "pin: stage " + to_string(stage) + " (pid " +
+      to_string(getpid()) + ", " + command.argv[0] + "): cpus " +
+      format_cpu_list(get_affinity(0));
+
+  int mode = 0;
+  unsigned long nodes[MASK_WORDS] = { 0 };
+  if (syscall(SYS_get_mempolicy, &mode, nodes, MASK_WORDS * BITS_PER_WORD,
+              NULL, 0) == 0 && mode != 0) {
+    report += ", memory on node " + format_cpu_list(mask_to_cpus(nodes, MASK_WORDS));
+  }
+  report += "\n";
+  if (write(STDERR_FILENO, report.data(), report.size()) < 0) {
+    // nothing more can be done if stderr is gone
+  }
+}
@@ -0,0 +1,441 @@
+/**
+ * This file contains the implementation of the prompt template ($PROMPT) and
+ * its background segments.
+ *
+ * Cheap segments (the user, the directory, the last status and duration) are
+ * rendered directly. The git segment is computed by a worker thread, since
+ * running 'git status' in a large repository can take hundreds of
+ * milliseconds: rendering only reads the worker's cache and posts a request
+ * for the current directory, and when the worker finds that the segment has
+ * changed it interrupts readline with PROMPT_REDRAW_SIGNAL so that the prompt
+ * is redrawn in place. A directory's git state is recomputed only when the
+ * repository's index or HEAD has changed or an external command has run
+ * since it was computed.
+ */
+
+#include "shell.h"
+#include "prompt.h"
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <readline/readline.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * The arguments 'git status' is run with: it mustn't take the index lock
+ * (the user's own git commands would fail), and untracked files don't make a
+ * repository dirty.
+ */
+const char* const GIT_STATUS_ARGS[] = {
+  "git", "--no-optional-locks", "status", "--porcelain", "--untracked-files=no",
+  NULL
+};
+
+
+/**
+ * The handler for PROMPT_REDRAW_SIGNAL. The signal only needs to interrupt
+ * readline's wait for input; readline then calls redraw_prompt_hook().
+ */
+void wake_for_redraw(int) {}
+
+
+/**
+ * Returns whether two timestamps are equal.
+ */
+bool same_time(const timespec& a, const timespec& b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+
+/**
+ * Returns the modification time of a file, or zero if it doesn't exist.
+ */
+timespec modification_time(const string& path) {
+  struct stat info;
+  if (stat(path.c_str(), &info) < 0) return timespec();
+  return info.st_mtim;
+}
+
+
+/**
+ * Returns the first line of a file, or an empty string if it can't be read.
+ */
+string read_first_line(const string& path) {
+  ifstream file(path.c_str());
+  string line;
+  getline(file, line);
+  return line;
+}
+
+
+/**
+ * Finds the repository a directory is in by looking for .git in it and each
+ * of its parents. .git is usually a directory, but in a linked worktree or a
+ * submodule it's a file naming the git directory.
+ *
+ * @param dir The directory (an absolute path)
+ * @param git_dir Set to the repository's git directory
+ * @param work_tree Set to the top of the repository's working tree
+ * @return Whether the directory is in a repository
+ */
+bool find_git_dir(const string& dir, string& git_dir, string& work_tree) {
+  for (string path = dir; !path.empty(); ) {
+    string candidate = (path == "/" ? "" : path) + "/.git";
+    struct stat info;
+    if (stat(candidate.c_str(), &info) == 0) {
+      work_tree = path;
+      if (S_ISDIR(info.st_mode)) {
+        git_dir = candidate;
+        return true;
+      }
+      string line = read_first_line(candidate);
+      if (line.compare(0, 8, "gitdir: ") == 0) {
+        git_dir = line.substr(8);
+        if (git_dir[0] != '/') git_dir = path + "/" + git_dir;
+        return true;
+      }
+    }
+    if (path == "/") break;
+    size_t slash = path.rfind('/');
+    path = slash == 0 ? "/" : path.substr(0, slash);
+  }
+  return false;
+}
+
+
+/**
+ * Returns the branch checked out in a repository, from its HEAD file, or the
+ * first seven digits of the commit if HEAD is detached.
+ */
+string read_branch(const string& git_dir) {
+  string head = read_first_line(git_dir + "/HEAD");
+  const string REF_PREFIX = "ref: refs/heads/";
+  if (head.compare(0, REF_PREFIX.size(), REF_PREFIX) == 0) {
+    return head.substr(REF_PREFIX.size());
+  }
+  return head.substr(0, 7);
+}
+
+
+/**
+ * Runs 'git status' in a working tree and returns whether it reports any
+ * change to a tracked file. Only the first byte of its output is needed, so
+ * the pipe is closed as soon as it arrives.
+ *
+ * git is forked from the worker thread and waited for by its pid; the main
+ * thread only ever waits for its own pipelines' pids, so neither thread can
+ * reap the other's processes.
+ *
+ * @param work_tree The top of the working tree
+ * @param search_path The $PATH to find git in
+ * @return Whether the working tree is dirty (false if git couldn't be run)
+ */
+bool has_changes(const string& work_tree, const string& search_path) {
+  // build everything the child needs first: in a copy of a threaded
+  // process, it should only make async-signal-safe calls until it execs
+  vector<string> candidates;
+  size_t start = 0;
+  while (start <= search_path.size()) {
+    size_t end = search_path.find(':', start);
+    if (end == string::npos) end = search_path.size();
+    if (end > start) candidates.push_back(search_path.substr(start, end - start) + "/git");
+    start = end + 1;
+  }
+  if (candidates.empty()) return false;
+
+  int the_pipe[2];
+  if (syscall(SYS_pipe2, the_pipe, O_CLOEXEC) < 0) return false;
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(the_pipe[0]);
+    close(the_pipe[1]);
+    return false;
+  }
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_RDWR);
+    if (chdir(work_tree.c_str()) < 0 || null_fd < 0) _exit(127);
+    dup2(null_fd, STDIN_FILENO);
+    dup2(the_pipe[1], STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    // git mustn't hold the shell's pipes open
+    for (int fd = STDERR_FILENO + 1; fd < 1024; fd++) close(fd);
+    for (size_t i = 0; i < candidates.size(); i++) {
+      execve(candidates[i].c_str(), (char* const*)GIT_STATUS_ARGS, environ);
+    }
+    _exit(127);
+  }
+
+  close(the_pipe[1]);
+  char byte;
+  ssize_t count;
+  while ((count = read(the_pipe[0], &byte, 1)) < 0 && errno == EINTR) {}
+  close(the_pipe[0]);
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  return count == 1;
+}
+
+
+/**
+ * Returns what the \g escape shows for a git state: the branch, with a '*'
+ * if the working tree is dirty, or nothing outside a repository.
+ */
+string git_segment(const git_state_t& state) {
+  if (state.git_dir.empty()) return "";
+  return state.branch + (state.dirty ? "*" : "");
+}
+
+
+/**
+ * Brings the git state of a directory up to date, unless the cached state is
+ * still current.
+ *
+ * @param dir The directory
+ * @param commands The number of external commands the shell has run
+ * @param search_path The $PATH to find git in
+ * @param cached The cached state, or NULL if there is none
+ * @param state Set to the new state
+ * @return Whether the state was recomputed
+ */
+bool compute_git_state(const string& dir, long commands, const string& search_path,
+                       const git_state_t* cached, git_state_t& state) {
+  string work_tree;
+  if (!find_git_dir(dir, state.git_dir, work_tree)) {
+    state.commands_run = commands;
+    return cached == NULL || !cached->git_dir.empty();
+  }
+
+  state.index_mtime = modification_time(state.git_dir + "/index");
+  state.head_mtime = modification_time(state.git_dir + "/HEAD");
+  state.commands_run = commands;
+  if (cached && cached->git_dir == state.git_dir &&
+      cached->commands_run == commands &&
+      same_time(cached->index_mtime, state.index_mtime) &&
+      same_time(cached->head_mtime, state.head_mtime)) {
+    return false;
+  }
+
+  state.branch = read_branch(state.git_dir);
+  state.dirty = has_changes(work_tree, search_path);
+  return true;
+}
+
+
+/**
+ * The body of the prompt worker: waits for a request, brings that
+ * directory's git state up to date, and signals the main thread if the
+ * segment it shows has changed, until asked to stop.
+ */
+void run_prompt_worker(prompt_worker_t* worker) {
+  pthread_mutex_lock(&worker->lock);
+  while (true) {
+    while (!worker->stopping && worker->request.empty()) {
+      pthread_cond_wait(&worker->wake, &worker->lock);
+    }
+    if (worker->stopping) break;
+
+    string dir = worker->request;
+    long commands = worker->request_commands;
+    string search_path = worker->search_path;
+    worker->request.clear();
+    map<string, git_state_t>::iterator entry = worker->git_cache.find(dir);
+    bool known = entry != worker->git_cache.end();
+    git_state_t cached = known ? entry->second : git_state_t();
+
+    // git runs without the lock, so rendering never waits for it
+    pthread_mutex_unlock(&worker->lock);
+    git_state_t state;
+    bool recomputed = compute_git_state(dir, commands, search_path,
+                                        known ? &cached : NULL, state);
+    pthread_mutex_lock(&worker->lock);
+    if (!recomputed) continue;
+
+    if (worker->git_cache.size() >= PROMPT_CACHE_SIZE) worker->git_cache.clear();
+    worker->git_cache[dir] = state;
+    if (git_segment(cached) != git_segment(state)) {
+      worker->redraw.store(true);
+      if (worker->in_readline) pthread_kill(worker->main_thread, PROMPT_REDRAW_SIGNAL);
+    }
+  }
+  pthread_mutex_unlock(&worker->lock);
+}
+
+
+/**
+ * Formats the duration of a command: microseconds or milliseconds below a
+ * second, then seconds to a tenth.
+ */
+string format_duration(double us) {
+  char text[32];
+  if (us < 1000) snprintf(text, sizeof(text), "%.0fus", us);
+  else if (us < 1e6) snprintf(text, sizeof(text), "%.0fms", us / 1000);
+  else snprintf(text, sizeof(text), "%.1fs", us / 1e6);
+  return text;
+}
+
+
+bool Shell::prompt_format(string& format) {
+  map<string, string>::iterator local = localvars.find("PROMPT");
+  if (local != localvars.end()) {
+    format = local->second;
+    return true;
+  }
+  const char* exported = getenv("PROMPT");
+  if (exported) format = exported;
+  return exported != NULL;
+}
+
+
+string Shell::render_prompt(const string& format, bool refresh) {
+  static string host;
+  if (host.empty()) {
+    char name[256] = "";
+    gethostname(name, sizeof(name) - 1);
+    host = string(name).substr(0, string(name).find('.'));
+  }
+
+  char buffer[PATH_MAX];
+  string cwd = getcwd(buffer, sizeof(buffer)) ? buffer : "";
+  // the segments rendered here are the latest there are
+  if (prompt_worker) prompt_worker->redraw.store(false);
+
+  string prompt;
+  bool wants_git = false;
+  for (size_t i = 0; i < format.size(); i++) {
+    if (format[i] != '\\' || i + 1 == format.size()) {
+      prompt += format[i];
+      continue;
+    }
+    char escape = format[++i];
+    if (escape == 'u') {
+      const char* user = getenv("USER");
+      prompt += user ? user : "";
+    } else if (escape == 'h') {
+      prompt += host;
+    } else if (escape == 'w' || escape == 'W') {
+      const char* home = getenv("HOME");
+      string shown = cwd;
+      if (escape == 'W' && shown.size() > 1) {
+        shown = shown.substr(shown.rfind('/') + 1);
+      } else if (escape == 'w' && home && home[1] != '\0' &&
+                 shown.compare(0, strlen(home), home) == 0 &&
+                 (shown.size() == strlen(home) || shown[strlen(home)] == '/')) {
+        shown = "~" + shown.substr(strlen(home));
+      }
+      prompt += shown;
+    } else if (escape == 'g') {
+      wants_git = true;
+      if (prompt_worker) {
+        pthread_mutex_lock(&prompt_worker->lock);
+        map<string, git_state_t>::iterator entry = prompt_worker->git_cache.find(cwd);
+        if (entry != prompt_worker->git_cache.end()) prompt += git_segment(entry->second);
+        pthread_mutex_unlock(&prompt_worker->lock);
+      }
+    } else if (escape == 'd') {
+      prompt += format_duration(last_duration_us);
+    } else if (escape == '?') {
+      prompt += to_string(prompt_status);
+    } else if (escape == 'm') {
+      prompt += prompt_status == 0 ? ":)" : ":(";
+    } else if (escape == '_') {
+      prompt += ' ';
+    } else if (escape == 'n') {
+      prompt += '\n';
+    } else if (escape == '\\') {
+      prompt += '\\';
+    } else {
+      prompt += '\\';
+      prompt += escape;
+    }
+  }
+
+  if (wants_git && refresh && !cwd.empty()) request_prompt_refresh(cwd);
+  return prompt;
+}
+
+
+void Shell::request_prompt_refresh(const string& dir) {
+  if (!prompt_worker) {
+    // readline is interrupted by the signal, but nothing else should be
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = wake_for_redraw;
+    action.sa_flags = SA_RESTART;
+    sigaction(PROMPT_REDRAW_SIGNAL, &action, NULL);
+    rl_signal_event_hook = redraw_prompt_hook;
+    rl_startup_hook = refresh_prompt_hook;
+
+    prompt_worker.reset(new prompt_worker_t());
+    prompt_worker->main_thread = pthread_self();
+    prompt_worker->owner = getpid();
+    prompt_worker->thread = thread(run_prompt_worker, prompt_worker.get());
+  }
+
+  const char* search_path = getenv("PATH");
+  pthread_mutex_lock(&prompt_worker->lock);
+  prompt_worker->request = dir;
+  prompt_worker->request_commands = commands_run;
+  prompt_worker->search_path = search_path ? search_path : "";
+  pthread_cond_signal(&prompt_worker->wake);
+  pthread_mutex_unlock(&prompt_worker->lock);
+}
+
+
+void Shell::stop_prompt_worker() {
+  if (!prompt_worker) return;
+
+  if (prompt_worker->owner != getpid()) {
+    // a forked copy of the shell has no worker thread
+    prompt_worker->thread.detach();
+  } else {
+    pthread_mutex_lock(&prompt_worker->lock);
+    prompt_worker->stopping = true;
+    pthread_cond_signal(&prompt_worker->wake);
+    pthread_mutex_unlock(&prompt_worker->lock);
+    prompt_worker->thread.join();
+  }
+  prompt_worker.reset();
+}
+
+
+void Shell::set_in_readline(bool waiting) {
+  if (!prompt_worker) return;
+  pthread_mutex_lock(&prompt_worker->lock);
+  prompt_worker->in_readline = waiting;
+  pthread_mutex_unlock(&prompt_worker->lock);
+}
+
+
+bool Shell::update_prompt() {
+  if (!prompt_worker || !prompt_worker->redraw.load()) return false;
+  string format;
+  if (!prompt_format(format)) return false;
+  rl_set_prompt(render_prompt(format, false).c_str());
+  return true;
+}
+
+
+int Shell::refresh_prompt_hook() {
+  // a segment finished after the prompt was rendered but before readline
+  // started waiting; the first redisplay will show the new prompt
+  instance.update_prompt();
+  return 0;
+}
+
+
+int Shell::redraw_prompt_hook() {
+  if (instance.update_prompt()) rl_forced_update_display();
+  return 0;
+}
@@ -0,0 +1,300 @@
+/**
+ * This file contains the implementation of the read builtin and the
+ * read-ahead buffers behind it.
+ *
+ * bash's read takes one byte per system call from a pipe, since anything it
+ * read past the delimiter would be lost to the next reader of the pipe. Here
+ * each descriptor has a buffer that read keeps from one call to the next,
+ * and settle_read_buffers() puts the descriptor back where the last read
+ * stopped before anything else can read from it (a command the shell forks,
+ * or readline reading the shell's next line): a regular file by seeking back
+ * over what wasn't used, and a pipe by only ever peeking at its data with
+ * tee(2) and then consuming just the bytes that read used. A file opened by
+ * read's own < belongs to the shell alone, so it's simply read ahead; inside
+ * a loop it's kept open for the rest of the loop.
+ */
+
+#include "shell.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * Returns the absolute form of a path (see shell_redirection.cpp).
+ */
+string absolute_path(const string& path);
+
+
+/**
+ * Returns whether a character separates fields.
+ */
+bool is_field_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\n';
+}
+
+
+/**
+ * Returns whether a name can be a variable's.
+ */
+bool is_variable_name(const string& name) {
+  if (name.empty() || isdigit((unsigned char)name[0])) return false;
+  for (size_t i = 0; i < name.size(); i++) {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '_') return false;
+  }
+  return true;
+}
+
+
+/**
+ * Consumes the bytes of a pipe that read has used, so that peeking at it
+ * again starts after them. The buffer's data is overwritten.
+ */
+bool drain_used(read_buffer_t& buffer) {
+  while (buffer.used > 0) {
+    ssize_t count = read(buffer.fd, buffer.data.data(), buffer.used);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return false;
+    buffer.used -= count;
+  }
+  return true;
+}
+
+
+/**
+ * Refills an empty buffer from its descriptor. Returns the number of bytes
+ * now in it, 0 at the end of the input, or -1 on an error.
+ */
+ssize_t fill_read_buffer(read_buffer_t& buffer) {
+  buffer.start = buffer.end = 0;
+  ssize_t count;
+
+  if (buffer.mode == READ_PEEK) {
+    // tee would copy the used bytes again if they were still in the pipe
+    if (!drain_used(buffer)) return -1;
+    do {
+      count = syscall(SYS_tee, buffer.fd, buffer.peek[1], buffer.data.size(), 0);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) return count;
+
+    // the private pipe holds exactly the copy
+    while (buffer.end < (size_t)count) {
+      ssize_t length = read(buffer.peek[0], &buffer.data[buffer.end], count - buffer.end);
+      if (length < 0 && errno == EINTR) continue;
+      if (length <= 0) return -1;
+      buffer.end += length;
+    }
+    return count;
+  }
+
+  do {
+    count = read(buffer.fd, buffer.data.data(), buffer.data.size());
+  } while (count < 0 && errno == EINTR);
+  if (count > 0) buffer.end = count;
+  return count;
+}
+
+
+/**
+ * Reads up to (and not including) the next delimiter into record. Without
+ * raw, a backslash before the delimiter continues the record past it.
+ * Returns whether a delimiter was found; if not, record holds whatever was
+ * left before the end of the input.
+ */
+bool read_record(read_buffer_t& buffer, char delimiter, bool raw, string& record) {
+  record.clear();
+  while (true) {
+    if (buffer.start == buffer.end) {
+      ssize_t count = fill_read_buffer(buffer);
+      if (count < 0) perror("read");
+      if (count <= 0) return false;
+    }
+
+    const char* begin = &buffer.data[buffer.start];
+    size_t available = buffer.end - buffer.start;
+    const char* found = (const char*)memchr(begin, delimiter, available);
+    size_t length = found ? found - begin : available;
+    size_t taken = found ? length + 1 : length;
+    record.append(begin, length);
+    buffer.start += taken;
+    if (buffer.mode == READ_PEEK) buffer.used += taken;
+    if (!found) continue;
+
+    // an odd number of backslashes ends in one that escapes the delimiter
+    size_t backslashes = 0;
+    while (!raw && backslashes < record.size() &&
+           record[record.size() - 1 - backslashes] == '\\') {
+      backslashes++;
+    }
+    if (backslashes % 2 == 0) return true;
+    record.erase(record.size() - 1);
+  }
+}
+
+
+/**
+ * Splits a record into fields on blanks and assigns them to the named
+ * variables, the last one getting the rest of the record. Without raw, a
+ * backslash quotes the character after it.
+ */
+void assign_fields(const string& record, bool raw, const vector<string>& names,
+                   map<string, string>& variables) {
+  size_t i = 0;
+  for (size_t n = 0; n < names.size(); n++) {
+    bool last = n + 1 == names.size();
+    while (i < record.size() && is_field_blank(record[i])) i++;
+
+    // kept is the length without the trailing blanks
+    string value;
+    size_t kept = 0;
+    while (i < record.size()) {
+      char c = record[i];
+      if (!raw && c == '\\') {
+        if (i + 1 < record.size()) value += record[i + 1];
+        i += 2;
+        kept = value.size();
+        continue;
+      }
+      if (!last && is_field_blank(c)) break;
+      value += c;
+      i++;
+      if (!is_field_blank(c)) kept = value.size();
+    }
+    value.resize(kept);
+    variables[names[n]] = value;
+  }
+}
+
+
+read_buffer_t& Shell::read_buffer(int fd) {
+  map<int, read_buffer_t>::iterator it = read_buffers.find(fd);
+  if (it != read_buffers.end()) return it->second;
+
+  read_buffer_t& buffer = read_buffers[fd];
+  buffer.fd = fd;
+  struct stat info;
+  if (fstat(fd, &info) == 0) {
+    if (S_ISREG(info.st_mode) && lseek(fd, 0, SEEK_CUR) >= 0) {
+      buffer.mode = READ_SEEKABLE;
+    } else if (S_ISFIFO(info.st_mode) &&
+               syscall(SYS_pipe2, buffer.peek, O_CLOEXEC) == 0) {
+      buffer.mode = READ_PEEK;
+      set_pipe_size(buffer.peek[1], READ_AHEAD_SIZE);
+    }
+  }
+  buffer.data.resize(buffer.mode == READ_BYTEWISE ? 1 : READ_AHEAD_SIZE);
+  return buffer;
+}
+
+
+void Shell::settle_read_buffers() {
+  for (map<int, read_buffer_t>::iterator it = read_buffers.begin();
+       it != read_buffers.end(); it++) {
+    read_buffer_t& buffer = it->second;
+    if (buffer.mode == READ_SEEKABLE && buffer.start < buffer.end) {
+      lseek(buffer.fd, -(off_t)(buffer.end - buffer.start), SEEK_CUR);
+    } else if (buffer.mode == READ_PEEK) {
+      drain_used(buffer);
+    } else {
+      continue;
+    }
+    buffer.start = buffer.end = 0;
+  }
+}
+
+
+void Shell::close_read_file(const string& key) {
+  map<string, read_file_t>::iterator file = read_files.find(key);
+  if (file == read_files.end()) return;
+  close(file->second.fd);
+  read_buffers.erase(file->second.fd);
+  read_files.erase(file);
+}
+
+
+void Shell::close_loop_read_files() {
+  vector<string> keys;
+  for (map<string, read_file_t>::iterator it = read_files.begin();
+       it != read_files.end(); it++) {
+    if (it->second.loop_depth > loop_depth) keys.push_back(it->first);
+  }
+  for (size_t i = 0; i < keys.size(); i++) close_read_file(keys[i]);
+}
+
+
+int Shell::com_read(vector<string>& argv) {
+  bool raw = false;
+  char delimiter = '\n';
+  string path;
+  vector<string> names;
+
+  for (size_t i = 1; i < argv.size(); i++) {
+    if (argv[i] == "-r") {
+      raw = true;
+    } else if (argv[i] == "-d" && i + 1 < argv.size()) {
+      delimiter = argv[++i][0];
+    } else if (argv[i] == "<" && i + 1 < argv.size()) {
+      path = argv[++i];
+    } else if (argv[i][0] == '-' && names.empty()) {
+      cerr << __FUNCTION__ << ": " << argv[i] << ": invalid option" << endl;
+      return -1;
+    } else if (!is_variable_name(argv[i])) {
+      cerr << __FUNCTION__ << ": " << argv[i] << ": not a valid identifier" << endl;
+      return -1;
+    } else {
+      names.push_back(argv[i]);
+    }
+  }
+
+  // a file read with < in a loop stays open until the loop ends, so that
+  // each iteration's read takes the next record
+  int fd = STDIN_FILENO;
+  string key;
+  if (!path.empty()) {
+    key = absolute_path(path);
+    map<string, read_file_t>::iterator file = read_files.find(key);
+    if (file != read_files.end()) {
+      fd = file->second.fd;
+    } else {
+      fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        perror(path.c_str());
+        return 1;
+      }
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      read_file_t& opened = read_files[key];
+      opened.fd = fd;
+      opened.loop_depth = loop_depth;
+      read_buffer_t& buffer = read_buffers[fd];
+      buffer.fd = fd;
+      buffer.mode = READ_OWNED;
+      buffer.data.resize(READ_AHEAD_SIZE);
+    }
+  }
+
+  string record;
+  bool found = read_record(read_buffer(fd), delimiter, raw, record);
+  // outside a loop the file isn't kept, and in one the next read after its
+  // end starts over
+  if (!key.empty() && (!found || loop_depth == 0)) close_read_file(key);
+
+  if (names.empty()) {
+    // REPLY gets the whole record, blanks and all
+    string value;
+    for (size_t i = 0; i < record.size(); i++) {
+      if (!raw && record[i] == '\\') i++;
+      if (i < record.size()) value += record[i];
+    }
+    localvars["REPLY"] = value;
+  } else {
+    assign_fields(record, raw, names, localvars);
+  }
+  return found ? 0 : 1;
+}
@@ -0,0 +1,257 @@
+/**
+ * This file contains the implementation of file redirections (<, >, >>, >|,
+ * 2>, 2>>, 2>&1 and &>) for external commands.
+ *
+ * The shell opens the files itself before forking a pipeline's stages, and
+ * the stages only dup2 the descriptors onto their standard streams. Files that
+ * are appended to or read from are kept open in a small cache, so a script
+ * that appends to the same log thousands of times opens it once. An inotify
+ * watch on each cached file drops it from the cache when the file is renamed
+ * or unlinked, and each use of a cached file checks that its path still
+ * names it (a directory above it may have been renamed, or a symlink on the
+ * way retargeted), so the next redirection opens whatever the path names
+ * then.
+ * The >| sinks are only opened here; the copying is done by a fan-out thread
+ * (see fan_out.h).
+ */
+
+#include "shell.h"
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * The most files the cache keeps open, and how much of an input file is read
+ * ahead when a stage is about to read it.
+ */
+const size_t REDIRECT_CACHE_SIZE = 64;
+const off_t REDIRECT_READAHEAD_SIZE = 1 << 20;
+
+/**
+ * The inotify events that may mean a cached file's path names something
+ * else. An unlink shows up as IN_ATTRIB, since the file's link count drops
+ * (it isn't deleted while the cache holds it open), and so does renaming
+ * another file over it.
+ */
+const uint32_t REDIRECT_WATCH_EVENTS = IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+
+
+/**
+ * Returns the absolute form of a path, relative to the current directory, or
+ * an empty string if the current directory can't be found.
+ */
+string absolute_path(const string& path) {
+  if (!path.empty() && path[0] == '/') return path;
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL) return "";
+  return string(cwd) + "/" + path;
+}
+
+
+void Shell::clear_redirect_cache() {
+  for (map<string, cached_fd_t>::iterator it = redirect_cache.begin();
+       it != redirect_cache.end(); it++) {
+    close(it->second.fd);
+  }
+  redirect_cache.clear();
+  if (redirect_watch_fd >= 0) close(redirect_watch_fd);
+  redirect_watch_fd = -1;
+}
+
+
+void Shell::drop_cached_fd(const string& key) {
+  map<string, cached_fd_t>::iterator entry = redirect_cache.find(key);
+  if (entry == redirect_cache.end()) return;
+  int watch = entry->second.watch;
+  close(entry->second.fd);
+  redirect_cache.erase(entry);
+  release_redirect_watch(watch);
+}
+
+
+void Shell::release_redirect_watch(int watch) {
+  for (map<string, cached_fd_t>::iterator it = redirect_cache.begin();
+       it != redirect_cache.end(); it++) {
+    if (it->second.watch == watch) return;
+  }
+  inotify_rm_watch(redirect_watch_fd, watch);
+}
+
+
+void Shell::process_redirect_events() {
+  alignas(struct inotify_event) char buffer[4096];
+  ssize_t length;
+  // the descriptor is non-blocking, so this stops once the queue is empty
+  while ((length = read(redirect_watch_fd, buffer, sizeof(buffer))) > 0) {
+    for (char* next = buffer; next < buffer + length; ) {
+      const struct inotify_event* event = (const struct inotify_event*)next;
+      next += sizeof(struct inotify_event) + event->len;
+
+      vector<string> keys;
+      for (map<string, cached_fd_t>::iterator it = redirect_cache.begin();
+           it != redirect_cache.end(); it++) {
+        if (it->second.watch == event->wd) keys.push_back(it->first);
+      }
+      for (size_t i = 0; i < keys.size(); i++) {
+        // a plain change of attributes (e.g. touch) keeps the file, as long
+        // as its path still names it
+        const cached_fd_t& cached = redirect_cache[keys[i]];
+        struct stat info;
+        bool unchanged = event->mask == IN_ATTRIB &&
+            stat(keys[i].c_str() + 1, &info) == 0 &&
+            info.st_dev == cached.device && info.st_ino == cached.inode &&
+            info.st_mode == cached.mode;
+        if (!unchanged) drop_cached_fd(keys[i]);
+      }
+    }
+  }
+}
+
+
+void Shell::cache_redirect_fd(const string& key, int fd) {
+  // make room first, so the watch dropped isn't one the new file shares
+  if (redirect_cache.size() >= REDIRECT_CACHE_SIZE) {
+    map<string, cached_fd_t>::iterator oldest = redirect_cache.begin();
+    for (map<string, cached_fd_t>::iterator it = redirect_cache.begin();
+         it != redirect_cache.end(); it++) {
+      if (it->second.last_use < oldest->second.last_use) oldest = it;
+    }
+    drop_cached_fd(oldest->first);
+  }
+
+  struct stat opened, named;
+  if (fstat(fd, &opened) < 0) return;
+  int watch = inotify_add_watch(redirect_watch_fd, key.c_str() + 1,
+                                REDIRECT_WATCH_EVENTS);
+  if (watch < 0) return;
+  // the path may have been renamed between the open and the watch
+  if (stat(key.c_str() + 1, &named) < 0 || named.st_dev != opened.st_dev ||
+      named.st_ino != opened.st_ino) {
+    release_redirect_watch(watch);
+    return;
+  }
+
+  cached_fd_t& cached = redirect_cache[key];
+  cached.fd = fd;
+  cached.device = opened.st_dev;
+  cached.inode = opened.st_ino;
+  cached.mode = opened.st_mode;
+  cached.watch = watch;
+  cached.last_use = ++redirect_uses;
+}
+
+
+int Shell::open_redirect(const string& path, int flags, vector<int>& owned) {
+  bool reading = (flags & O_ACCMODE) == O_RDONLY;
+  string key;
+
+  // only appends and reads can share a descriptor from one run to the next
+  if (reading || (flags & O_APPEND)) {
+    // a forked copy of the shell mustn't consume its parent's events
+    if (redirect_cache_owner != getpid()) {
+      clear_redirect_cache();
+      redirect_cache_owner = getpid();
+    }
+    if (redirect_watch_fd < 0) {
+      redirect_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    string absolute = absolute_path(path);
+    if (redirect_watch_fd >= 0 && !absolute.empty()) {
+      process_redirect_events();
+      key = (reading ? "r" : "a") + absolute;
+      map<string, cached_fd_t>::iterator entry = redirect_cache.find(key);
+      // the watch only follows the file itself, so a renamed directory above
+      // it or a retargeted symlink shows up as the path naming another file
+      struct stat named;
+      if (entry != redirect_cache.end() &&
+          (stat(key.c_str() + 1, &named) < 0 || named.st_dev != entry->second.device ||
+           named.st_ino != entry->second.inode)) {
+        drop_cached_fd(key);
+        entry = redirect_cache.end();
+      }
+      if (entry != redirect_cache.end()) {
+        int fd = entry->second.fd;
+        entry->second.last_use = ++redirect_uses;
+        if (reading) {
+          // the last stage that read the file left the offset at its end
+          lseek(fd, 0, SEEK_SET);
+          posix_fadvise(fd, 0, REDIRECT_READAHEAD_SIZE, POSIX_FADV_WILLNEED);
+        }
+        return fd;
+      }
+    }
+  }
+
+  int fd = open(path.c_str(), flags | O_CLOEXEC, 0644);
+  if (fd < 0) return -1;
+  if (reading) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, REDIRECT_READAHEAD_SIZE, POSIX_FADV_WILLNEED);
+  }
+  if (!key.empty()) cache_redirect_fd(key, fd);
+  if (redirect_cache.count(key) == 0) owned.push_back(fd);
+  return fd;
+}
+
+
+bool Shell::open_redirections(const command_t& command,
+                              const vector<redirect_fds_t>& earlier,
+                              redirect_fds_t& fds, vector<int>& owned) {
+  if (command.input_type == READ_FROM_FILE) {
+    fds.input = open_redirect(command.infile, O_RDONLY, owned);
+    // two stages reading the same cached file would share its offset
+    for (size_t i = 0; i < earlier.size() && fds.input >= 0; i++) {
+      if (earlier[i].input != fds.input) continue;
+      fds.input = open(command.infile.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fds.input >= 0) owned.push_back(fds.input);
+    }
+    if (fds.input < 0) {
+      perror(command.infile.c_str());
+      return false;
+    }
+  }
+
+  if (command.output_type == WRITE_TO_FILE ||
+      command.output_type == APPEND_TO_FILE) {
+    int flags = O_WRONLY | O_CREAT;
+    flags |= command.output_type == WRITE_TO_FILE ? O_TRUNC : O_APPEND;
+    fds.output = open_redirect(command.outfile, flags, owned);
+    if (fds.output < 0) {
+      perror(command.outfile.c_str());
+      return false;
+    }
+  }
+
+  // a sink is non-blocking so that a full one can be dropped; a FIFO nobody
+  // is reading would fail to open, and is dropped up front
+  for (size_t i = 0; i < command.sinks.size(); i++) {
+    int fd = open(command.sinks[i].c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0644);
+    if (fd < 0 && errno != ENXIO) {
+      perror(command.sinks[i].c_str());
+      return false;
+    }
+    if (fd >= 0) owned.push_back(fd);
+    fds.sinks.push_back(fd);
+  }
+
+  if (command.error_type == WRITE_ERR_TO_FILE ||
+      command.error_type == APPEND_ERR_TO_FILE) {
+    int flags = O_WRONLY | O_CREAT;
+    flags |= command.error_type == WRITE_ERR_TO_FILE ? O_TRUNC : O_APPEND;
+    fds.error = open_redirect(command.errfile, flags, owned);
+    if (fds.error < 0) {
+      perror(command.errfile.c_str());
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,511 @@
+/**
+ * This file contains the parser and executor for the shell's control-flow
+ * constructs: if/then/else, while, until, for, &&, ||, ; and functions.
+ *
+ * A line is tokenized and parsed exactly once into a tree of script_node_t
+ * (see script.h). Loop bodies and function bodies are then executed straight
+ * from that tree, so repeating them never pays for tokenizing again.
+ */
+
+#include "shell.h"
+#include "script.h"
+#include <iostream>
+
+using namespace std;
+
+
+/**
+ * Returns the index of the first word of every's command, after its options
+ * and interval (see shell_builtins.cpp).
+ */
+size_t every_command_start(const vector<string>& argv);
+
+
+/**
+ * The maximum number of parsed lines to keep in the script cache.
+ */
+const size_t SCRIPT_CACHE_SIZE = 256;
+
+
+/**
+ * The state of the parser while it walks over a vector of tokens.
+ */
+struct parser_t {
+  const vector<string>& tokens;
+  size_t pos;
+  ParseStatus status;
+
+  parser_t(const vector<string>& tokens)
+    : tokens(tokens), pos(0), status(PARSE_OK) {}
+};
+
+
+bool is_separator(const string& token) {
+  return token == ";" || token == "\n";
+}
+
+
+bool is_operator(const string& token) {
+  return is_separator(token) || token == "&&" || token == "||" ||
+      token == "(" || token == ")";
+}
+
+
+bool is_terminator(const string& token) {
+  // reserved words that end a list when found in command position
+  return token == "then" || token == "else" || token == "elif" ||
+      token == "fi" || token == "do" || token == "done" || token == "}";
+}
+
+
+bool at_end(parser_t& p) {
+  return p.status != PARSE_OK || p.pos >= p.tokens.size();
+}
+
+
+void skip_newlines(parser_t& p) {
+  while (!at_end(p) && p.tokens[p.pos] == "\n") p.pos++;
+}
+
+
+void skip_separators(parser_t& p) {
+  while (!at_end(p) && is_separator(p.tokens[p.pos])) p.pos++;
+}
+
+
+void syntax_error(parser_t& p) {
+  if (p.status != PARSE_OK) return;
+  string token = p.tokens[p.pos] == "\n" ? "newline" : p.tokens[p.pos];
+  cerr << "syntax error near unexpected token `" << token << "'" << endl;
+  p.status = PARSE_ERROR;
+}
+
+
+bool expect(parser_t& p, const string& word) {
+  if (p.status != PARSE_OK) return false;
+  // running out of tokens means the user hasn't finished typing yet
+  if (p.pos >= p.tokens.size()) {
+    p.status = PARSE_INCOMPLETE;
+    return false;
+  }
+  if (p.tokens[p.pos] != word) {
+    syntax_error(p);
+    return false;
+  }
+  p.pos++;
+  return true;
+}
+
+
+script_ptr parse_list(parser_t& p);
+script_ptr parse_command(parser_t& p);
+
+
+script_ptr parse_simple(parser_t& p) {
+  script_ptr node(new script_node_t(NODE_SIMPLE));
+  while (!at_end(p) && !is_operator(p.tokens[p.pos])) {
+    node->words.push_back(p.tokens[p.pos++]);
+  }
+  if (node->words.empty()) {
+    syntax_error(p);
+    return node;
+  }
+
+  // resolve which substitution stages this command needs up front
+  node->has_assignment = node->words[0].find('=') != string::npos;
+  for (size_t i = 0; i < node->words.size(); i++) {
+    if (node->words[i].find('$') != string::npos) node->has_variable = true;
+    if (node->words[i].find_first_of("*?[") != string::npos) {
+      node->has_glob = true;
+    }
+  }
+  return node;
+}
+
+
+script_ptr parse_if(parser_t& p) {
+  script_ptr node(new script_node_t(NODE_IF));
+  expect(p, "if");
+  node->children.push_back(parse_list(p));
+  expect(p, "then");
+  node->children.push_back(parse_list(p));
+
+  while (!at_end(p) && p.tokens[p.pos] == "elif") {
+    p.pos++;
+    node->children.push_back(parse_list(p));
+    expect(p, "then");
+    node->children.push_back(parse_list(p));
+  }
+  if (!at_end(p) && p.tokens[p.pos] == "else") {
+    p.pos++;
+    node->children.push_back(parse_list(p));
+  }
+  expect(p, "fi");
+  return node;
+}
+
+
+script_ptr parse_while(parser_t& p) {
+  NodeType type = p.tokens[p.pos] == "while" ? NODE_WHILE : NODE_UNTIL;
+  script_ptr node(new script_node_t(type));
+  p.pos++;
+  node->children.push_back(parse_list(p));
+  expect(p, "do");
+  node->children.push_back(parse_list(p));
+  expect(p, "done");
+  return node;
+}
+
+
+script_ptr parse_for(parser_t& p) {
+  script_ptr node(new script_node_t(NODE_FOR));
+  expect(p, "for");
+  if (at_end(p)) {
+    expect(p, "");
+    return node;
+  }
+  if (is_operator(p.tokens[p.pos])) {
+    syntax_error(p);
+    return node;
+  }
+  node->name = p.tokens[p.pos++];
+  skip_newlines(p);
+
+  if (!at_end(p) && p.tokens[p.pos] == "in") {
+    p.pos++;
+    node->has_word_list = true;
+    while (!at_end(p) && !is_operator(p.tokens[p.pos])) {
+      if (p.tokens[p.pos].find('$') != string::npos) {
+        node->has_variable = true;
+      }
+      if (p.tokens[p.pos].find_first_of("*?[") != string::npos) {
+        node->has_glob = true;
+      }
+      node->words.push_back(p.tokens[p.pos++]);
+    }
+  }
+  skip_separators(p);
+  expect(p, "do");
+  node->children.push_back(parse_list(p));
+  expect(p, "done");
+  return node;
+}
+
+
+script_ptr parse_group(parser_t& p) {
+  expect(p, "{");
+  script_ptr node = parse_list(p);
+  expect(p, "}");
+  return node;
+}
+
+
+script_ptr parse_function(parser_t& p) {
+  script_ptr node(new script_node_t(NODE_FUNCTION));
+  if (p.tokens[p.pos] == "function") {
+    p.pos++;
+    if (at_end(p)) {
+      expect(p, "");
+      return node;
+    }
+    node->name = p.tokens[p.pos++];
+    // the parentheses are optional with the 'function' keyword
+    if (!at_end(p) && p.tokens[p.pos] == "(") {
+      p.pos++;
+      expect(p, ")");
+    }
+  } else {
+    node->name = p.tokens[p.pos++];
+    expect(p, "(");
+    expect(p, ")");
+  }
+  skip_newlines(p);
+  if (at_end(p)) {
+    expect(p, "{");
+    return node;
+  }
+  node->children.push_back(parse_command(p));
+  return node;
+}
+
+
+script_ptr parse_command(parser_t& p) {
+  const string& token = p.tokens[p.pos];
+
+  if (token == "if") return parse_if(p);
+  if (token == "while" || token == "until") return parse_while(p);
+  if (token == "for") return parse_for(p);
+  if (token == "{") return parse_group(p);
+  if (token == "function") return parse_function(p);
+  if (p.pos + 1 < p.tokens.size() && p.tokens[p.pos + 1] == "(" &&
+      !is_operator(token)) {
+    return parse_function(p);
+  }
+  return parse_simple(p);
+}
+
+
+script_ptr parse_and_or(parser_t& p) {
+  script_ptr left = parse_command(p);
+
+  while (!at_end(p) && (p.tokens[p.pos] == "&&" || p.tokens[p.pos] == "||")) {
+    script_ptr node(new script_node_t(
+          p.tokens[p.pos] == "&&" ? NODE_AND : NODE_OR));
+    p.pos++;
+    // a command may continue on the next line after && or ||
+    skip_newlines(p);
+    if (at_end(p)) {
+      expect(p, "");
+      break;
+    }
+    node->children.push_back(left);
+    node->children.push_back(parse_command(p));
+    left = node;
+  }
+  return left;
+}
+
+
+script_ptr parse_list(parser_t& p) {
+  script_ptr node(new script_node_t(NODE_SEQUENCE));
+
+  skip_separators(p);
+  while (!at_end(p) && !is_terminator(p.tokens[p.pos])) {
+    if (p.tokens[p.pos] == ")") {
+      syntax_error(p);
+      break;
+    }
+    node->children.push_back(parse_and_or(p));
+    if (at_end(p)) break;
+    // commands in a list must be separated by ';' or a newline
+    if (!is_separator(p.tokens[p.pos]) && !is_terminator(p.tokens[p.pos])) {
+      syntax_error(p);
+      break;
+    }
+    skip_separators(p);
+  }
+
+  // don't wrap a single command in a sequence
+  if (node->children.size() == 1) return node->children[0];
+  return node;
+}
+
+
+ParseStatus Shell::parse_script(const string& text, script_ptr& script) {
+  // reuse the tree if this exact line has been parsed before
+  map<string, script_ptr>::iterator cached = script_cache.find(text);
+  if (cached != script_cache.end()) {
+    script = cached->second;
+    return PARSE_OK;
+  }
+
+  vector<string> tokens = tokenize_input((char*)text.c_str());
+  parser_t p(tokens);
+  script = parse_list(p);
+  // anything left over is a terminator without a matching opener
+  if (p.status == PARSE_OK && p.pos < tokens.size()) syntax_error(p);
+
+  if (p.status == PARSE_OK) {
+    if (script_cache.size() >= SCRIPT_CACHE_SIZE) script_cache.clear();
+    script_cache[text] = script;
+  }
+  return p.status;
+}
+
+
+int Shell::execute_script(const script_node_t& node) {
+  int return_value = 0;
+
+  switch (node.type) {
+    case NODE_SIMPLE:
+      return_value = execute_simple_command(node);
+      break;
+
+    case NODE_SEQUENCE:
+      for (size_t i = 0; i < node.children.size(); i++) {
+        return_value = execute_script(*node.children[i]);
+        if (control_flow_pending()) break;
+      }
+      break;
+
+    case NODE_AND:
+    case NODE_OR:
+      return_value = execute_script(*node.children[0]);
+      // run the right side on success for &&, or on failure for ||
+      if (!control_flow_pending() &&
+          (return_value == 0) == (node.type == NODE_AND)) {
+        return_value = execute_script(*node.children[1]);
+      }
+      break;
+
+    case NODE_IF:
+      return_value = execute_if(node);
+      break;
+
+    case NODE_WHILE:
+    case NODE_UNTIL:
+      return_value = execute_loop(node);
+      break;
+
+    case NODE_FOR:
+      return_value = execute_for(node);
+      break;
+
+    case NODE_FUNCTION:
+      functions[node.name] = node.children[0];
+      break;
+  }
+
+  last_status = return_value;
+  return return_value;
+}
+
+
+int Shell::execute_simple_command(const script_node_t& node) {
+  // the tree is reused, so substitute into a copy of its words
+  vector<string> argv = node.words;
+
+  // every expands its command again for each run, so only its options and
+  // interval are expanded here
+  vector<string> repeated;
+  if (!argv.empty() && argv[0] == "every" && functions.count(argv[0]) == 0 &&
+      aliases.count(argv[0]) == 0) {
+    size_t start = every_command_start(argv);
+    repeated.assign(argv.begin() + start, argv.end());
+    argv.resize(start);
+  }
+
+  // expand arithmetic first so that assignments like i=$((i + 1)) see the
+  // result; parameters and commands are then expanded in one pass, so that
+  // neither's output is expanded again
+  if (node.has_variable && !arithmetic_substitution(argv)) {
+    last_status = 1;
+    return last_status;
+  }
+
+  if (node.has_assignment && !local_variable_assignment(argv)) {
+    last_status = 1;
+    return last_status;
+  }
+
+  bool aliased = alias_substitution(argv);
+
+  // an alias value may itself refer to a variable
+  if ((node.has_variable || aliased) && !variable_substitution(argv)) {
+    last_status = 1;
+    return last_status;
+  }
+
+  // variables may expand to patterns too, e.g. pattern=*.log; ls $pattern
+  if (node.has_glob || node.has_variable) glob_expansion(argv);
+  argv.insert(argv.end(), repeated.begin(), repeated.end());
+
+  last_status = dispatch_command(argv);
+  return last_status;
+}
+
+
+int Shell::execute_if(const script_node_t& node) {
+  size_t i;
+  // children come in (condition, body) pairs, optionally followed by an else
+  for (i = 0; i + 1 < node.children.size(); i += 2) {
+    int condition = execute_script(*node.children[i]);
+    if (control_flow_pending()) return condition;
+    if (condition == 0) return execute_script(*node.children[i + 1]);
+  }
+  if (i < node.children.size()) return execute_script(*node.children[i]);
+  return 0;
+}
+
+
+int Shell::execute_loop(const script_node_t& node) {
+  int return_value = 0;
+
+  loop_depth++;
+  while (true) {
+    int condition = execute_script(*node.children[0]);
+    if (control_flow_pending() && finish_loop_iteration()) break;
+    // while runs until the condition fails, until runs until it succeeds
+    if ((condition == 0) == (node.type == NODE_UNTIL)) break;
+
+    return_value = execute_script(*node.children[1]);
+    if (control_flow_pending() && finish_loop_iteration()) break;
+  }
+  loop_depth--;
+  close_loop_read_files();
+
+  return return_value;
+}
+
+
+int Shell::execute_for(const script_node_t& node) {
+  int return_value = 0;
+
+  // without an 'in' list, iterate over the positional parameters
+  vector<string> words;
+  if (node.has_word_list) {
+    words = node.words;
+    if (node.has_variable) {
+      if (!arithmetic_substitution(words) || !variable_substitution(words)) {
+        return 1;
+      }
+    }
+    if (node.has_glob || node.has_variable) glob_expansion(words);
+  } else {
+    words.assign(positional_params.back().begin() + 1,
+        positional_params.back().end());
+  }
+
+  loop_depth++;
+  for (size_t i = 0; i < words.size(); i++) {
+    localvars[node.name] = words[i];
+    return_value = execute_script(*node.children[0]);
+    if (control_flow_pending() && finish_loop_iteration()) break;
+  }
+  loop_depth--;
+  close_loop_read_files();
+
+  return return_value;
+}
+
+
+int Shell::call_function(const script_node_t& body, vector<string>& argv) {
+  // the function's arguments become $1, $2, ... for the duration of the call
+  positional_params.push_back(argv);
+  function_depth++;
+
+  int return_value = execute_script(body);
+
+  function_depth--;
+  positional_params.pop_back();
+
+  if (pending_return) {
+    pending_return = false;
+    return_value = last_status;
+  }
+  return return_value;
+}
+
+
+bool Shell::control_flow_pending() {
+  return pending_breaks > 0 || pending_continues > 0 || pending_return ||
+      exit_requested;
+}
+
+
+bool Shell::finish_loop_iteration() {
+  if (pending_return || exit_requested) return true;
+
+  if (pending_breaks > 0) {
+    pending_breaks--;
+    return true;
+  }
+
+  // 'continue N' leaves N - 1 enclosing loops before continuing
+  if (pending_continues > 1) {
+    pending_continues--;
+    return true;
+  }
+  pending_continues = 0;
+  return false;
+}
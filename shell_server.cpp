@@ -0,0 +1,202 @@
+/**
+ * This file contains the implementation of the shell's server mode
+ * (MyShell --serve SOCKET), which runs command lines for automation clients
+ * connecting over a Unix domain socket, using the framing in session.h.
+ *
+ * The server sets up its state (including ~/.myshellrc) once, then forks a
+ * session for every client that connects. Each session is a copy of the shell
+ * with its own variables, aliases, functions and working directory, so
+ * sessions run in parallel and can't affect each other. A session points its
+ * stdout and stderr at a pair of pipes while a command runs, and a pump
+ * thread forwards whatever arrives on them to the client as it is produced.
+ */
+
+#include "shell.h"
+#include "session.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * The number of connections that may wait to be accepted, and the size of
+ * the chunks output is forwarded in.
+ */
+const int SERVER_BACKLOG = 128;
+const size_t PUMP_BUFFER_SIZE = 64 * 1024;
+
+
+/**
+ * The body of a session's pump thread: forwards the output of a command from
+ * its stdout and stderr pipes to the client until both are closed. Uses only
+ * a fixed buffer, so that it never holds the allocator's lock while the
+ * session forks.
+ */
+void pump_output(int client, int out_fd, int err_fd) {
+  char buffer[PUMP_BUFFER_SIZE];
+  struct pollfd fds[2] = { { out_fd, POLLIN, 0 }, { err_fd, POLLIN, 0 } };
+  const char types[2] = { FRAME_STDOUT, FRAME_STDERR };
+  int open_fds = 2;
+
+  while (open_fds > 0) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (int i = 0; i < 2; i++) {
+      if (fds[i].fd < 0 || fds[i].revents == 0) continue;
+      ssize_t length = read(fds[i].fd, buffer, sizeof(buffer));
+      if (length < 0 && errno == EINTR) continue;
+      if (length <= 0) {
+        // the command has finished writing here; stop polling it
+        fds[i].fd = -1;
+        open_fds--;
+        continue;
+      }
+      // if the client has gone, keep draining so the command isn't blocked
+      write_frame(client, types[i], buffer, length);
+    }
+  }
+}
+
+
+int Shell::serve(const string& path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    cerr << __FUNCTION__ << ": " << path << ": socket path too long" << endl;
+    return EXIT_FAILURE;
+  }
+  strcpy(address.sun_path, path.c_str());
+
+  int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server < 0) {
+    perror("socket");
+    return EXIT_FAILURE;
+  }
+  // replace a socket left behind by an earlier server, but nothing else
+  struct stat existing;
+  if (lstat(path.c_str(), &existing) == 0) {
+    if (!S_ISSOCK(existing.st_mode)) {
+      cerr << __FUNCTION__ << ": " << path << ": exists and is not a socket" << endl;
+      close(server);
+      return EXIT_FAILURE;
+    }
+    unlink(path.c_str());
+  }
+
+  // anyone who can connect can run commands as this user, so the socket is
+  // only ever accessible to its owner
+  mode_t previous_umask = umask(077);
+  int bound = bind(server, (struct sockaddr*)&address, sizeof(address));
+  umask(previous_umask);
+  if (bound < 0 || chmod(path.c_str(), 0600) < 0 ||
+      listen(server, SERVER_BACKLOG) < 0) {
+    perror(path.c_str());
+    close(server);
+    return EXIT_FAILURE;
+  }
+
+  // every session starts from the state the rc file sets up
+  run_startup_file();
+
+  // finished sessions are reaped automatically
+  signal(SIGCHLD, SIG_IGN);
+
+  while (true) {
+    int client = accept(server, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      break;
+    }
+    // the commands a session runs mustn't inherit its socket
+    fcntl(client, F_SETFD, FD_CLOEXEC);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork failed");
+    } else if (pid == 0) {
+      close(server);
+      // the session waits for its own commands
+      signal(SIGCHLD, SIG_DFL);
+      exit(run_session(client));
+    }
+    close(client);
+  }
+
+  close(server);
+  return EXIT_FAILURE;
+}
+
+
+int Shell::run_session(int client) {
+  // commands read from nothing, rather than from the client's socket
+  int null_fd = open("/dev/null", O_RDWR);
+  if (null_fd < 0) {
+    perror("/dev/null");
+    return EXIT_FAILURE;
+  }
+  dup2(null_fd, STDIN_FILENO);
+  in_session = true;
+
+  char type;
+  string text;
+  while (!exit_requested && read_frame(client, type, text) &&
+         type == FRAME_COMMAND) {
+    int out_pipe[2], err_pipe[2];
+    if (pipe(out_pipe) < 0 || pipe(err_pipe) < 0) {
+      perror("session pipe");
+      break;
+    }
+    fcntl(out_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(err_pipe[0], F_SETFD, FD_CLOEXEC);
+
+    // point stdout and stderr at the pipes for the length of the command
+    cout.flush();
+    cerr.flush();
+    dup2(out_pipe[1], STDOUT_FILENO);
+    dup2(err_pipe[1], STDERR_FILENO);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    thread pump(pump_output, client, out_pipe[0], err_pipe[0]);
+
+    int status = -1;
+    script_ptr script;
+    ParseStatus parsed = parse_script(text, script);
+    if (parsed == PARSE_OK) {
+      status = execute_script(*script);
+    } else {
+      cerr << (parsed == PARSE_INCOMPLETE ? "syntax error: unexpected end of input"
+                                          : "syntax error") << endl;
+    }
+    pending_breaks = pending_continues = 0;
+    pending_return = false;
+
+    // closing the session's ends of the pipes lets the pump reach the end
+    cout.flush();
+    cerr.flush();
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    pump.join();
+    close(out_pipe[0]);
+    close(err_pipe[0]);
+
+    if (!write_status_frame(client, status)) break;
+  }
+
+  close(client);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,398 @@
+/**
+ * This file contains the implementation of the startup file (~/.myshellrc),
+ * its compiled snapshot, and the command hash (the full path of every command
+ * on $PATH).
+ *
+ * Running the rc file means tokenizing, parsing and executing every line of
+ * it. When the rc file only sets up state (aliases, variables, functions and
+ * the pipe size), that state is written to a binary snapshot afterwards (see
+ * snapshot.h), and later shells map the snapshot into memory and copy the
+ * state out of it instead. A snapshot is only used while the rc file's
+ * modification time, size and contents, $PATH, and the environment variables
+ * the rc file read are all unchanged.
+ */
+
+#include "shell.h"
+#include "snapshot.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * The rc file, relative to $HOME, and the suffix added to its path for the
+ * snapshot.
+ */
+const char* const RC_FILE = ".myshellrc";
+const char* const SNAPSHOT_SUFFIX = ".snapshot";
+
+/**
+ * How deeply script nodes may nest in a snapshot, so that a corrupt file
+ * can't exhaust the stack.
+ */
+const int SNAPSHOT_MAX_DEPTH = 1000;
+
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash = FNV_OFFSET_BASIS) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+
+/**
+ * Returns a hash of the modification times of the directories in path, which
+ * changes whenever a command is added to or removed from one of them.
+ */
+uint64_t path_signature(const string& path) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  size_t start = 0;
+  while (start <= path.size()) {
+    size_t end = path.find(':', start);
+    if (end == string::npos) end = path.size();
+    struct stat info;
+    if (stat(path.substr(start, end - start).c_str(), &info) == 0) {
+      hash = fnv1a(&info.st_mtim, sizeof(info.st_mtim), hash);
+    }
+    start = end + 1;
+  }
+  return hash;
+}
+
+
+/**
+ * Returns $PATH, or "" if it isn't set.
+ */
+string current_path() {
+  const char* path = getenv("PATH");
+  return path ? path : "";
+}
+
+
+void write_u32(string& out, uint32_t value) {
+  out.append((const char*)&value, sizeof(value));
+}
+
+
+void write_string(string& out, const string& text) {
+  write_u32(out, text.size());
+  out += text;
+}
+
+
+void write_pairs(string& out, const map<string, string>& pairs) {
+  write_u32(out, pairs.size());
+  for (map<string, string>::const_iterator it = pairs.begin(); it != pairs.end(); it++) {
+    write_string(out, it->first);
+    write_string(out, it->second);
+  }
+}
+
+
+void write_node(string& out, const script_node_t& node) {
+  write_u32(out, node.type);
+  write_u32(out, node.has_assignment | node.has_variable << 1 |
+                 node.has_glob << 2 | node.has_word_list << 3);
+  write_string(out, node.name);
+  write_u32(out, node.words.size());
+  for (size_t i = 0; i < node.words.size(); i++) write_string(out, node.words[i]);
+  write_u32(out, node.children.size());
+  for (size_t i = 0; i < node.children.size(); i++) write_node(out, *node.children[i]);
+}
+
+
+/**
+ * A position in a mapped snapshot. Every read checks that it stays inside
+ * the mapping, so a corrupt or truncated file is rejected rather than read
+ * past its end.
+ */
+struct snapshot_reader_t {
+  const char* data;
+  size_t size;
+  size_t pos;
+};
+
+
+bool read_u32(snapshot_reader_t& in, uint32_t& value) {
+  if (in.size - in.pos < sizeof(value)) return false;
+  memcpy(&value, in.data + in.pos, sizeof(value));
+  in.pos += sizeof(value);
+  return true;
+}
+
+
+bool read_string(snapshot_reader_t& in, string& text) {
+  uint32_t length;
+  if (!read_u32(in, length) || in.size - in.pos < length) return false;
+  text.assign(in.data + in.pos, length);
+  in.pos += length;
+  return true;
+}
+
+
+bool read_pairs(snapshot_reader_t& in, map<string, string>& pairs) {
+  uint32_t count;
+  if (!read_u32(in, count)) return false;
+  for (uint32_t i = 0; i < count; i++) {
+    string key;
+    if (!read_string(in, key) || !read_string(in, pairs[key])) return false;
+  }
+  return true;
+}
+
+
+bool read_node(snapshot_reader_t& in, script_ptr& node, int depth) {
+  uint32_t type, flags, count;
+  if (depth > SNAPSHOT_MAX_DEPTH || !read_u32(in, type) || type > NODE_FUNCTION ||
+      !read_u32(in, flags)) {
+    return false;
+  }
+
+  node.reset(new script_node_t((NodeType)type));
+  node->has_assignment = flags & 1;
+  node->has_variable = flags & 2;
+  node->has_glob = flags & 4;
+  node->has_word_list = flags & 8;
+  if (!read_string(in, node->name) || !read_u32(in, count)) return false;
+
+  node->words.resize(min<size_t>(count, in.size - in.pos));
+  for (size_t i = 0; i < node->words.size(); i++) {
+    if (!read_string(in, node->words[i])) return false;
+  }
+  if (node->words.size() != count || !read_u32(in, count)) return false;
+
+  for (uint32_t i = 0; i < count; i++) {
+    node->children.push_back(script_ptr());
+    if (!read_node(in, node->children.back(), depth + 1)) return false;
+  }
+  return true;
+}
+
+
+const char* Shell::read_environment(const string& name) {
+  const char* value = getenv(name.c_str());
+  if (running_startup) startup_environment[name] = value ? value : "";
+  return value;
+}
+
+
+void Shell::hash_commands() {
+  command_hash.clear();
+  command_hash_path = current_path();
+  command_hash_signature = path_signature(command_hash_path);
+  if (command_hash_path.empty()) return;
+
+  // walk $PATH in order, so that earlier directories win
+  size_t start = 0;
+  while (start <= command_hash_path.size()) {
+    size_t end = command_hash_path.find(':', start);
+    if (end == string::npos) end = command_hash_path.size();
+    string dir = command_hash_path.substr(start, end - start);
+    start = end + 1;
+
+    DIR* dirp = opendir(dir.empty() ? "." : dir.c_str());
+    if (!dirp) continue;
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != NULL) {
+      if (entry->d_name[0] == '.' || command_hash.count(entry->d_name) > 0 ||
+          faccessat(dirfd(dirp), entry->d_name, X_OK, 0) != 0) {
+        continue;
+      }
+      command_hash[entry->d_name] = dir + "/" + entry->d_name;
+    }
+    closedir(dirp);
+  }
+}
+
+
+void Shell::refresh_command_hash() {
+  string path = current_path();
+  if (path != command_hash_path || command_hash.empty() ||
+      path_signature(path) != command_hash_signature) {
+    hash_commands();
+  }
+}
+
+
+const char* Shell::hashed_command(const string& name) {
+  if (command_hash_path.empty() || name.find('/') != string::npos ||
+      command_hash_path != current_path()) {
+    return NULL;
+  }
+  map<string, string>::iterator command = command_hash.find(name);
+  if (command == command_hash.end()) return NULL;
+  return command->second.c_str();
+}
+
+
+bool Shell::load_snapshot(const string& path, const snapshot_header_t& expected) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat info;
+  if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(snapshot_header_t)) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+
+  // everything that went into the rc file's state has to be unchanged
+  snapshot_header_t header;
+  memcpy(&header, data, sizeof(header));
+  bool valid = memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0 &&
+      header.version == expected.version &&
+      header.file_size == (uint64_t)info.st_size &&
+      header.rc_mtime_sec == expected.rc_mtime_sec &&
+      header.rc_mtime_nsec == expected.rc_mtime_nsec &&
+      header.rc_size == expected.rc_size &&
+      header.rc_hash == expected.rc_hash &&
+      header.path_hash == expected.path_hash;
+
+  snapshot_reader_t in = { (const char*)data, (size_t)info.st_size, sizeof(header) };
+  map<string, string> new_aliases, new_localvars, environment, commands;
+  map<string, script_ptr> new_functions;
+  uint32_t count = 0;
+  valid = valid && read_pairs(in, new_aliases) && read_pairs(in, new_localvars) &&
+      read_u32(in, count);
+  for (uint32_t i = 0; valid && i < count; i++) {
+    string name;
+    valid = read_string(in, name) && read_node(in, new_functions[name], 0);
+  }
+  valid = valid && read_pairs(in, environment) && read_pairs(in, commands) &&
+      in.pos == in.size;
+  munmap(data, info.st_size);
+
+  for (map<string, string>::iterator it = environment.begin();
+       valid && it != environment.end(); it++) {
+    const char* value = getenv(it->first.c_str());
+    valid = it->second == (value ? value : "");
+  }
+  if (!valid) return false;
+
+  for (map<string, string>::iterator it = new_aliases.begin(); it != new_aliases.end(); it++) {
+    define_alias(it->first, it->second);
+  }
+  localvars.insert(new_localvars.begin(), new_localvars.end());
+  functions.insert(new_functions.begin(), new_functions.end());
+  pipe_size = header.pipe_size;
+
+  // the hash is stale if a command was added to or removed from $PATH
+  if (header.path_signature == expected.path_signature) {
+    command_hash.swap(commands);
+    command_hash_path = current_path();
+    command_hash_signature = header.path_signature;
+  } else {
+    hash_commands();
+  }
+  return true;
+}
+
+
+void Shell::write_snapshot(const string& path, snapshot_header_t header) {
+  header.pipe_size = pipe_size;
+  header.path_signature = command_hash_signature;
+
+  string out((const char*)&header, sizeof(header));
+  map<string, string> alias_values;
+  for (unordered_map<string, alias_t>::iterator it = aliases.begin(); it != aliases.end(); it++) {
+    alias_values[it->first] = it->second.value;
+  }
+  write_pairs(out, alias_values);
+  write_pairs(out, localvars);
+  write_u32(out, functions.size());
+  for (map<string, script_ptr>::iterator it = functions.begin(); it != functions.end(); it++) {
+    write_string(out, it->first);
+    write_node(out, *it->second);
+  }
+  write_pairs(out, startup_environment);
+  write_pairs(out, command_hash);
+
+  header.file_size = out.size();
+  memcpy(&out[0], &header, sizeof(header));
+
+  // write to a temporary file first, so that no shell ever maps a partial one
+  string temp = path + "." + to_string(getpid());
+  int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) return;
+  bool written = write(fd, out.data(), out.size()) == (ssize_t)out.size();
+  close(fd);
+  if (!written || rename(temp.c_str(), path.c_str()) < 0) unlink(temp.c_str());
+}
+
+
+void Shell::run_startup_file() {
+  string source = "none";
+  const char* home = getenv("HOME");
+  string rc_path = string(home ? home : "") + "/" + RC_FILE;
+  string snapshot_path = rc_path + SNAPSHOT_SUFFIX;
+
+  int fd = home ? open(rc_path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+  struct stat info;
+  if (fd >= 0 && fstat(fd, &info) == 0) {
+    string text(info.st_size, '\0');
+    ssize_t length = read(fd, &text[0], text.size());
+    text.resize(length > 0 ? length : 0);
+
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.rc_mtime_sec = info.st_mtim.tv_sec;
+    header.rc_mtime_nsec = info.st_mtim.tv_nsec;
+    header.rc_size = info.st_size;
+    header.rc_hash = fnv1a(text.data(), text.size());
+    string path = current_path();
+    header.path_hash = fnv1a(path.data(), path.size());
+    header.path_signature = path_signature(path);
+
+    if (load_snapshot(snapshot_path, header)) {
+      source = "snapshot";
+    } else {
+      source = "rc";
+      running_startup = true;
+      startup_side_effects = false;
+      script_ptr script;
+      if (parse_script(text, script) == PARSE_OK) {
+        execute_script(*script);
+      } else {
+        cerr << rc_path << ": syntax error" << endl;
+        startup_side_effects = true;
+      }
+      running_startup = false;
+      pending_breaks = pending_continues = 0;
+      pending_return = false;
+
+      // an rc file that does more than set up state has to run every time
+      if (startup_side_effects) {
+        unlink(snapshot_path.c_str());
+      } else {
+        hash_commands();
+        write_snapshot(snapshot_path, header);
+      }
+      startup_environment.clear();
+    }
+  }
+  if (fd >= 0) close(fd);
+
+  // report how long it took to get here, i.e. to the first prompt
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  localvars["STARTUP_US"] = to_string((long)elapsed_us(started, now));
+  localvars["STARTUP_SOURCE"] = source;
+}
@@ -8,7 +8,10 @@
  */
 
 #include "shell.h"
+#include <algorithm>
+#include <climits>
 #include <cstdlib>
+#include <ctime>
 #include <iostream>
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -61,59 +64,150 @@ void Shell::get_command_completions(const char* text, vector<string>& matches) {
 
   // add the aliases
   // loop through all the aliases
-  for (map<string, string>::iterator it = aliases.begin(); it != aliases.end(); it++) {
+  unordered_map<string, alias_t>::iterator alias;
+  for (alias = aliases.begin(); alias != aliases.end(); alias++) {
     // check if it mathces the string so far
-    if (!it->first.compare(0, textString.size(), textString)) {
-      matches.push_back(it->first);
+    if (!alias->first.compare(0, textString.size(), textString)) {
+      matches.push_back(alias->first);
     }
   }
 
-  // add the external commands
-  DIR           *dirp;      // needed when looping through all the $PATH directories
-  struct dirent *directory;
-  char* temp = getenv("PATH");
-  if (temp == NULL) {
+  // add the external commands, from the command hash
+  if (getenv("PATH") == NULL) {
     cerr << __FUNCTION__ << ": $PATH does not exist" << endl;
     return;
   }
-  string path = (string)temp;
-  string::size_type col_pos;
-  // loop through the path and get the individual directories (seperated by colons)
-  do {
-    col_pos = path.find(":");
-    string subpath = path.substr(0, col_pos);
-    path = path.substr(col_pos + 1);
-    // go into the directory loop through all the files
-    dirp = opendir(subpath.c_str());
-    if (dirp) {
-      while ((directory = readdir(dirp)) != NULL) {
-        // check for being executabel
-        if (access(directory->d_name, X_OK)) {
-          string temp = (string)directory->d_name;
-          // check if it matches the string so far
-          if (!temp.compare(0, textString.size(), textString)) {
-            // add if to the vector
-            matches.push_back(temp);
-          }
-        }
-      }
-      if (closedir(dirp) != 0) {
-        return;
-      }
+  refresh_command_hash();
+  map<string, string>::iterator it = command_hash.lower_bound(textString);
+  for (; it != command_hash.end(); it++) {
+    // the hash is sorted, so the matches are all together
+    if (it->first.compare(0, textString.size(), textString)) break;
+    matches.push_back(it->first);
+  }
+}
+
+
+/**
+ * Adds the words of a sorted list that start with prefix to matches.
+ */
+void add_prefix_matches(const vector<string>& sorted, const string& prefix,
+                        vector<string>& matches) {
+  vector<string>::const_iterator it = lower_bound(sorted.begin(), sorted.end(), prefix);
+  for (; it != sorted.end(); it++) {
+    // the list is sorted, so the matches are all together
+    if (it->compare(0, prefix.size(), prefix)) break;
+    matches.push_back(*it);
+  }
+}
+
+
+/**
+ * Adds each non-empty line of a generator's output to candidates.
+ */
+void add_output_lines(const string& output, vector<string>& candidates) {
+  string::size_type start = 0;
+  while (start < output.size()) {
+    string::size_type end = output.find('\n', start);
+    if (end == string::npos) end = output.size();
+    if (end > start) candidates.push_back(output.substr(start, end - start));
+    start = end + 1;
+  }
+}
+
+
+/**
+ * Returns the words of the pipeline stage that the word starting at start
+ * belongs to, before that word.
+ */
+vector<string> stage_words(const char* line, int start) {
+  // the stage starts after the last operator (but not the & of 2>&1)
+  int begin = start;
+  while (begin > 0) {
+    char c = line[begin - 1];
+    if (c == '|' || c == ';' || c == '(' ||
+        (c == '&' && (begin < 2 || line[begin - 2] != '>'))) {
+      break;
+    }
+    begin--;
+  }
+
+  vector<string> words;
+  string word;
+  for (int i = begin; i <= start; i++) {
+    if (i == start || line[i] == ' ' || line[i] == '\t') {
+      if (!word.empty()) words.push_back(word);
+      word.clear();
     } else {
-      return;
+      word += line[i];
     }
-  } while (col_pos != string::npos);
+  }
+  return words;
+}
+
+
+void Shell::get_argument_completions(const char* text, vector<string>& matches) {
+  map<string, completion_spec_t>::iterator spec = completion_specs.find(completing_command);
+  if (spec == completion_specs.end()) return;
+
+  add_prefix_matches(spec->second.words, text, matches);
+  if (!spec->second.function.empty() || !spec->second.command.empty()) {
+    add_prefix_matches(generated_completions(spec->second, completing_command,
+                                             completing_previous),
+                       text, matches);
+  }
+}
+
+
+const vector<string>& Shell::generated_completions(
+    const completion_spec_t& spec, const string& command, const string& previous) {
+  completion_cache_t& cache = completion_cache[command + '\0' + previous];
+
+  char buffer[PATH_MAX];
+  string cwd = getcwd(buffer, sizeof(buffer)) ? buffer : "";
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t now_ms = now.tv_sec * 1000ull + now.tv_nsec / 1000000;
+  if (cache.generated_ms != 0 && now_ms - cache.generated_ms < spec.ttl_ms &&
+      cache.cwd == cwd) {
+    return cache.candidates;
+  }
+
+  // completing mustn't change $?
+  int status = last_status;
+  string arguments = " " + command + " " + previous;
+  string output;
+  cache.candidates.clear();
+  if (!spec.function.empty() && functions.count(spec.function) > 0 &&
+      capture_command_output(spec.function + arguments, output)) {
+    add_output_lines(output, cache.candidates);
+  }
+  if (!spec.command.empty() && capture_command_output(spec.command + arguments, output)) {
+    add_output_lines(output, cache.candidates);
+  }
+  last_status = status;
+
+  sort(cache.candidates.begin(), cache.candidates.end());
+  cache.candidates.erase(unique(cache.candidates.begin(), cache.candidates.end()),
+                         cache.candidates.end());
+  cache.generated_ms = now_ms;
+  cache.cwd = cwd;
+  return cache.candidates;
 }
 
 
 char** Shell::word_completion(const char* text, int start, int end) {
   char** matches = NULL;
+  Shell& shell = getInstance();
+  vector<string> words = stage_words(rl_line_buffer, start);
 
   if (text[0] == '$') {
     matches = rl_completion_matches(text, env_completion_generator);
-  } else if (start == 0) {
+  } else if (words.empty()) {
     matches = rl_completion_matches(text, command_completion_generator);
+  } else if (shell.completion_specs.count(words[0]) > 0) {
+    shell.completing_command = words[0];
+    shell.completing_previous = words.back();
+    matches = rl_completion_matches(text, argument_completion_generator);
   } else {
     // We get directory matches for free (thanks, readline!).
   }
@@ -154,6 +248,22 @@ char* Shell::command_completion_generator(const char* text, int state) {
 }
 
 
+char* Shell::argument_completion_generator(const char* text, int state) {
+  // A list of all the matches.
+  // Must be static because this function is called repeatedly.
+  static vector<string> matches;
+
+  // If this is the first time called, construct the matches list with
+  // all possible matches.
+  if (state == 0) {
+    getInstance().get_argument_completions(text, matches);
+  }
+
+  // Return a single match (one for each time the function is called).
+  return pop_match(matches);
+}
+
+
 char* Shell::pop_match(vector<string>& matches) {
   if (matches.size() > 0) {
     const char* match = matches.back().c_str();
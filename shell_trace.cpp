@@ -0,0 +1,259 @@
+/**
+ * This file contains the implementation of the execution trace (see the
+ * 'trace' builtin), which records every line the shell runs and every
+ * external pipeline it starts as JSON lines.
+ *
+ * Records are filled in place in a lock-free ring buffer (see trace.h) on the
+ * shell's thread, which costs a few stores and clock reads per command. A
+ * background thread drains the ring and does all of the formatting and
+ * writing, so the prompt never waits on the trace file.
+ */
+
+#include "shell.h"
+#include "trace.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * How long the flusher sleeps between passes over the ring, depending on
+ * whether the last pass found anything to write.
+ */
+const long TRACE_BUSY_INTERVAL_NS = 1000000;
+const long TRACE_IDLE_INTERVAL_NS = 10000000;
+
+
+/**
+ * Appends text to out as a JSON string, with quotes and escapes.
+ */
+void append_json_string(string& out, const char* text) {
+  out += '"';
+  for (const char* c = text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      out += '\\';
+      out += *c;
+    } else if (*c == '\n') {
+      out += "\\n";
+    } else if (*c == '\t') {
+      out += "\\t";
+    } else if ((unsigned char)*c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", *c);
+      out += escape;
+    } else {
+      out += *c;
+    }
+  }
+  out += '"';
+}
+
+
+/**
+ * Appends a "key":value pair for a number to out.
+ */
+void append_json_number(string& out, const char* key, double value) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), ",\"%s\":%.1f", key, value);
+  out += buffer;
+}
+
+
+void append_json_number(string& out, const char* key, long value) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), ",\"%s\":%ld", key, value);
+  out += buffer;
+}
+
+
+/**
+ * Appends a trace record to out as a line of JSON.
+ */
+void format_trace_event(string& out, const trace_event_t& event) {
+  char time[64];
+  snprintf(time, sizeof(time), "{\"time\":%ld.%06ld", (long)event.time.tv_sec,
+           event.time.tv_nsec / 1000);
+  out += time;
+
+  if (event.type == TRACE_LINE) {
+    out += ",\"type\":\"line\",\"text\":";
+    append_json_string(out, event.text);
+    append_json_number(out, "parse_us", event.parse_us);
+  } else {
+    out += ",\"type\":\"pipeline\"";
+  }
+  append_json_number(out, "duration_us", event.duration_us);
+  append_json_number(out, "status", (long)event.status);
+
+  if (event.type == TRACE_PIPELINE) {
+    static const char* const inputs[] = { "stdin", "file", "pipe" };
+    static const char* const outputs[] = { "stdout", "pipe", "file", "append" };
+    static const char* const errors[] = { "stderr", "file", "append", "output" };
+
+    out += ",\"stages\":[";
+    size_t count = min(event.stage_count, TRACE_MAX_STAGES);
+    for (size_t i = 0; i < count; i++) {
+      const trace_stage_t& stage = event.stages[i];
+      out += i ? ",{\"command\":" : "{\"command\":";
+      append_json_string(out, stage.name);
+      append_json_number(out, "pid", (long)stage.pid);
+      append_json_number(out, "exit", (long)stage.exit_code);
+      append_json_number(out, "fork_us", stage.fork_us);
+      append_json_number(out, "duration_us", stage.duration_us);
+      out += ",\"input\":\"";
+      out += inputs[stage.input_type];
+      out += "\",\"output\":\"";
+      out += outputs[stage.output_type];
+      out += "\",\"error\":\"";
+      out += errors[stage.error_type];
+      out += '"';
+      if (stage.infile[0]) {
+        out += ",\"infile\":";
+        append_json_string(out, stage.infile);
+      }
+      if (stage.outfile[0]) {
+        out += ",\"outfile\":";
+        append_json_string(out, stage.outfile);
+      }
+      if (stage.errfile[0]) {
+        out += ",\"errfile\":";
+        append_json_string(out, stage.errfile);
+      }
+      if (stage.sink_count > 0) {
+        append_json_number(out, "sinks", (long)stage.sink_count);
+        out += ",\"sink\":";
+        append_json_string(out, stage.sink);
+      }
+      out += '}';
+    }
+    out += ']';
+    if (event.stage_count > count) {
+      append_json_number(out, "stage_count", (long)event.stage_count);
+    }
+  }
+  out += "}\n";
+}
+
+
+/**
+ * The body of the flusher thread: repeatedly writes out the published records
+ * and releases their slots, until asked to stop.
+ */
+void flush_trace(trace_log_t* log) {
+  string out;
+  while (true) {
+    // read the flag first, so that nothing published before it is missed
+    bool stopping = log->stopping.load(memory_order_acquire);
+
+    size_t tail = log->tail.load(memory_order_relaxed);
+    size_t head = log->head.load(memory_order_acquire);
+    out.clear();
+    for (; tail != head; tail++) {
+      format_trace_event(out, log->events[tail % TRACE_RING_SIZE]);
+    }
+    // the slots can be reused as soon as they are formatted
+    log->tail.store(tail, memory_order_release);
+
+    size_t dropped = log->dropped.exchange(0, memory_order_relaxed);
+    if (dropped > 0) {
+      out += "{\"type\":\"dropped\",\"count\":" + to_string(dropped) + "}\n";
+    }
+
+    for (size_t written = 0; written < out.size(); ) {
+      ssize_t result = write(log->fd, out.data() + written, out.size() - written);
+      if (result < 0 && errno == EINTR) continue;
+      if (result <= 0) break; // nowhere else to report it; drop the batch
+      written += result;
+    }
+
+    if (stopping) break;
+    timespec interval = { 0, out.empty() ? TRACE_IDLE_INTERVAL_NS
+                                         : TRACE_BUSY_INTERVAL_NS };
+    nanosleep(&interval, NULL);
+  }
+}
+
+
+bool Shell::start_trace(const string& path) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror(("trace: " + path).c_str());
+    return false;
+  }
+
+  stop_trace();
+  trace_log.reset(new trace_log_t());
+  trace_log->fd = fd;
+  trace_log->path = path;
+  trace_log->owner = getpid();
+  trace_log->flusher = thread(flush_trace, trace_log.get());
+  return true;
+}
+
+
+void Shell::stop_trace() {
+  if (!trace_log) return;
+
+  if (trace_log->owner != getpid()) {
+    // a forked copy of the shell has no flusher thread; leave the file alone
+    trace_log->flusher.detach();
+  } else {
+    trace_log->stopping.store(true, memory_order_release);
+    trace_log->flusher.join();
+    close(trace_log->fd);
+  }
+  trace_log.reset();
+}
+
+
+trace_event_t* Shell::begin_trace_event(TraceEventType type) {
+  if (!trace_log) return NULL;
+
+  size_t head = trace_log->head.load(memory_order_relaxed);
+  if (head - trace_log->tail.load(memory_order_acquire) == TRACE_RING_SIZE) {
+    trace_log->dropped.fetch_add(1, memory_order_relaxed);
+    return NULL;
+  }
+
+  trace_event_t* event = &trace_log->events[head % TRACE_RING_SIZE];
+  event->type = type;
+  event->parse_us = 0;
+  event->stage_count = 0;
+  event->text[0] = '\0';
+  return event;
+}
+
+
+void Shell::commit_trace_event() {
+  trace_log->head.fetch_add(1, memory_order_release);
+}
+
+
+int Shell::com_trace(vector<string>& argv) {
+  if (argv.size() > 2) {
+    cerr << __FUNCTION__ << ": usage: trace [FILE|off]" << endl;
+    return -1;
+  }
+
+  if (argv.size() == 1) {
+    if (!trace_log) {
+      cout << "trace: off" << endl;
+    } else {
+      cout << "trace: writing to " << trace_log->path << " ("
+           << trace_log->head.load() << " records)" << endl;
+    }
+    return 0;
+  }
+
+  if (argv[1] == "off") {
+    stop_trace();
+    return 0;
+  }
+  return start_trace(argv[1]) ? 0 : -1;
+}
@@ -0,0 +1,62 @@
+/**
+ * Contains the definition of the header of the startup snapshot: the compiled
+ * form of the state left behind by ~/.myshellrc, which later shells map into
+ * memory instead of running the rc file again.
+ *
+ * After the header, the file holds a sequence of sections, each a count
+ * followed by that many entries. Strings are a 32-bit length followed by the
+ * bytes; script nodes are their type, flags, name, words and children, in
+ * that order. The sections are, in order:
+ *  - aliases (name, value)
+ *  - local variables (name, value)
+ *  - functions (name, body node)
+ *  - environment variables the rc file read (name, value when it was read)
+ *  - the command hash (name, full path)
+ */
+
+#pragma once
+#include <cstdint>
+
+
+/**
+ * Identifies a snapshot file, and its layout. The version must change
+ * whenever the layout (including script_node_t's) does.
+ */
+const char SNAPSHOT_MAGIC[8] = { 'M', 'Y', 'S', 'H', 'S', 'N', 'A', 'P' };
+const uint32_t SNAPSHOT_VERSION = 1;
+
+
+/**
+ * The fixed-size start of a snapshot file. A snapshot is only used if every
+ * field matches what the shell finds at startup.
+ */
+struct snapshot_header_t {
+  char magic[8];
+  uint32_t version;
+
+  /**
+   * The size of the whole file, so that a truncated file is rejected.
+   */
+  uint32_t file_size;
+
+  /**
+   * The rc file's modification time, size and FNV-1a hash of its contents.
+   */
+  int64_t rc_mtime_sec;
+  int64_t rc_mtime_nsec;
+  int64_t rc_size;
+  uint64_t rc_hash;
+
+  /**
+   * The FNV-1a hash of $PATH, and of the modification times of the
+   * directories in it. When only the latter differs, the command hash is
+   * rebuilt but the rest of the snapshot is still used.
+   */
+  uint64_t path_hash;
+  uint64_t path_signature;
+
+  /**
+   * The session pipe size set by the rc file (see 'pipesize').
+   */
+  int64_t pipe_size;
+};
@@ -0,0 +1,925 @@
+/**
+ * This file contains the implementation of the in-process text builtins (wc,
+ * head, tail, grep -F and tr) that a pipeline runs in a thread of the shell.
+ *
+ * Each one reads its input in large blocks and hands whole blocks to the
+ * kernels in text_kernels.cpp, so the per-byte work is done 16 or 32 bytes at
+ * a time; output is gathered into a buffer and written in large blocks too.
+ * The supported forms behave as the GNU tools do in the C locale.
+ */
+
+#include "text_builtins.h"
+#include "text_channel.h"
+#include "text_kernels.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+
+/**
+ * How much input is read at a time, the number of lines head and tail print
+ * by default, how much output is gathered before it's written, and how much
+ * of a pipe tail keeps before it drops lines that can no longer be printed.
+ */
+const size_t TEXT_READ_SIZE = 256 * 1024;
+const size_t TEXT_DEFAULT_LINES = 10;
+const size_t TEXT_WRITE_SIZE = 64 * 1024;
+const size_t TAIL_TRIM_SIZE = 4 * 1024 * 1024;
+
+/**
+ * How much tail counts newlines in at a time while scanning backwards.
+ */
+const size_t TAIL_SCAN_SIZE = 64 * 1024;
+
+/**
+ * tr -d stops skipping ahead to each deleted byte with the range kernel, and
+ * looks every byte up instead, for a block after one with more than one in
+ * this many bytes deleted.
+ */
+const size_t TR_DENSE_DELETES = 64;
+
+
+/**
+ * Enum representing the tools that can be run in-process.
+ */
+enum TextTool {
+  TEXT_WC,
+  TEXT_HEAD,
+  TEXT_TAIL,
+  TEXT_GREP,
+  TEXT_TR
+};
+
+
+/**
+ * A parsed text builtin: the tool and the options that apply to it.
+ */
+struct text_command_t {
+  TextTool tool;
+
+  /**
+   * For wc, the counts to print.
+   */
+  bool lines;
+  bool words;
+  bool bytes;
+
+  /**
+   * For head and tail, the number of lines.
+   */
+  size_t count;
+
+  /**
+   * For grep, the fixed string to look for, whether the lines without it are
+   * selected instead (-v), and whether only the number of selected lines is
+   * printed (-c).
+   */
+  string pattern;
+  bool invert;
+  bool count_only;
+
+  /**
+   * For tr, whether the bytes in SET1 are deleted (-d) rather than
+   * translated, and what each byte becomes (or whether it's deleted).
+   */
+  bool deleting;
+  unsigned char translation[256];
+  bool deleted[256];
+
+  /**
+   * Constructor.
+   */
+  text_command_t()
+    : tool(TEXT_WC), lines(false), words(false), bytes(false),
+      count(TEXT_DEFAULT_LINES), invert(false), count_only(false), deleting(false) {
+    for (int c = 0; c < 256; c++) {
+      translation[c] = c;
+      deleted[c] = false;
+    }
+  }
+};
+
+
+/**
+ * The input of a text builtin: a descriptor or the channel from the previous
+ * stage. Either way it's read a chunk at a time.
+ */
+struct text_input_t {
+  int fd;
+  text_channel_t* channel;
+
+  /**
+   * The chunk last returned, which the input owns until the next call to
+   * next() unless it's taken.
+   */
+  text_chunk_t* chunk;
+
+  /**
+   * The errno of a failed read, or 0.
+   */
+  int error;
+
+  /**
+   * Constructor.
+   */
+  text_input_t(int fd, text_channel_t* channel)
+    : fd(fd), channel(channel), chunk(NULL), error(0) {}
+
+  /**
+   * Destructor. Closes the channel, so the writer stops as it would on a
+   * broken pipe.
+   */
+  ~text_input_t() {
+    delete chunk;
+    if (channel) channel->close_reader();
+  }
+
+  /**
+   * Returns the next chunk of input, or NULL at the end of the input or on
+   * an error. A descriptor is read into the same chunk each time; a channel
+   * hands over its chunks as they are.
+   */
+  text_chunk_t* next() {
+    if (channel) {
+      delete chunk;
+      chunk = channel->receive();
+      return chunk;
+    }
+
+    if (chunk == NULL) chunk = new text_chunk_t(TEXT_READ_SIZE);
+    ssize_t n;
+    while ((n = read(fd, chunk->data, chunk->capacity)) < 0 && errno == EINTR) {}
+    if (n < 0) error = errno;
+    if (n <= 0) return NULL;
+    chunk->length = n;
+    return chunk;
+  }
+
+  /**
+   * Takes ownership of the chunk last returned, to pass it on whole.
+   */
+  text_chunk_t* take() {
+    text_chunk_t* taken = chunk;
+    chunk = NULL;
+    return taken;
+  }
+};
+
+
+/**
+ * The output of a text builtin: a descriptor or the channel to the next
+ * stage. Small pieces of output are gathered in a chunk that's written (or
+ * sent) when it fills up or the builtin finishes, and whole chunks can be
+ * passed on without copying them.
+ */
+struct text_output_t {
+  int fd;
+  text_channel_t* channel;
+  text_chunk_t* chunk;
+  long written;
+  int error; // EPIPE once the reader is gone, or the errno of a failed write
+
+  /**
+   * Constructor.
+   */
+  text_output_t(int fd, text_channel_t* channel)
+    : fd(fd), channel(channel), chunk(NULL), written(0), error(0) {}
+
+  /**
+   * Destructor. Closes the channel, so the reader sees end of input.
+   */
+  ~text_output_t() {
+    delete chunk;
+    if (channel) channel->close_writer();
+  }
+
+  /**
+   * Writes out or sends a chunk, taking ownership of it. Returns false if
+   * that failed.
+   */
+  bool send(text_chunk_t* whole) {
+    if (error != 0) {
+      delete whole;
+      return false;
+    }
+    size_t length = whole->length;
+    if (channel) {
+      if (length == 0) {
+        delete whole;
+      } else if (!channel->send(whole)) {
+        error = EPIPE;
+      }
+    } else {
+      for (size_t done = 0; done < length && error == 0; ) {
+        ssize_t n = write(fd, whole->data + done, length - done);
+        if (n < 0 && errno != EINTR) error = errno;
+        if (n > 0) done += n;
+      }
+      delete whole;
+    }
+    if (error == 0) written += length;
+    return error == 0;
+  }
+
+  /**
+   * Writes out or sends everything gathered. Returns false if that failed.
+   */
+  bool flush() {
+    if (chunk == NULL || chunk->length == 0) return error == 0;
+    text_chunk_t* full = chunk;
+    chunk = NULL;
+    return send(full);
+  }
+
+  /**
+   * Adds data to the output, which is written out or sent once a chunk's
+   * worth has been gathered. Returns false if a write failed.
+   */
+  bool append(const char* data, size_t length) {
+    while (length > 0) {
+      if (chunk == NULL) chunk = new text_chunk_t(TEXT_WRITE_SIZE);
+      size_t piece = min(length, chunk->capacity - chunk->length);
+      memcpy(chunk->data + chunk->length, data, piece);
+      chunk->length += piece;
+      data += piece;
+      length -= piece;
+      if (chunk->length == chunk->capacity && !flush()) return false;
+    }
+    return error == 0;
+  }
+
+  /**
+   * Passes on the input's current chunk, after anything gathered before it.
+   * A channel takes the chunk as it is; a descriptor has it written out, and
+   * the input keeps it to read into again. Returns false if that failed.
+   */
+  bool pass(text_input_t& input) {
+    if (!flush()) return false;
+    if (channel) return send(input.take());
+
+    text_chunk_t* whole = input.chunk;
+    for (size_t done = 0; done < whole->length && error == 0; ) {
+      ssize_t n = write(fd, whole->data + done, whole->length - done);
+      if (n < 0 && errno != EINTR) error = errno;
+      if (n > 0) done += n;
+    }
+    if (error == 0) written += whole->length;
+    return error == 0;
+  }
+};
+
+
+/**
+ * Writes "tool: message" and a newline to the error descriptor.
+ */
+void report_text_error(int fd, const string& tool, const string& message) {
+  string line = tool + ": " + message + "\n";
+  while (write(fd, line.data(), line.size()) < 0 && errno == EINTR) {}
+}
+
+
+/**
+ * Returns the exit code for a builtin whose output couldn't be written: that
+ * of a tool killed by SIGPIPE if the reader went away (as the external tool
+ * would have been), reporting any other error.
+ */
+int write_failure(const text_output_t& output, int error_fd, const string& tool) {
+  if (output.error == EPIPE) return 128 + SIGPIPE;
+  report_text_error(error_fd, tool, string("write error: ") + strerror(output.error));
+  return EXIT_FAILURE;
+}
+
+
+/**
+ * Parses a line count for head or tail: a plain decimal number. Suffixes and
+ * the +N and -N forms aren't supported.
+ */
+bool parse_line_count(const string& text, size_t& count) {
+  if (text.empty() || text.size() > 18) return false;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] < '0' || text[i] > '9') return false;
+  }
+  count = strtoull(text.c_str(), NULL, 10);
+  return true;
+}
+
+
+/**
+ * Parses a set of bytes for tr: literal bytes, ranges (a-z) and the escapes
+ * \\, \a, \b, \f, \n, \r, \t, \v and \NNN (octal). Classes, equivalence
+ * classes and repeats (anything with a '[') aren't supported.
+ */
+bool parse_tr_set(const string& text, vector<unsigned char>& set) {
+  // first decode the escapes, remembering which bytes were escaped (an
+  // escaped '-' doesn't make a range)
+  vector<unsigned char> bytes;
+  vector<bool> escaped;
+  for (size_t i = 0; i < text.size(); i++) {
+    unsigned char c = text[i];
+    if (c == '[') return false;
+    if (c != '\\' || i + 1 == text.size()) {
+      bytes.push_back(c);
+      escaped.push_back(false);
+      continue;
+    }
+
+    c = text[++i];
+    if (c >= '0' && c <= '7') {
+      int value = 0;
+      for (int digits = 0; digits < 3 && i < text.size() &&
+             text[i] >= '0' && text[i] <= '7'; digits++, i++) {
+        value = value * 8 + (text[i] - '0');
+      }
+      i--;
+      if (value > UCHAR_MAX) return false;
+      c = value;
+    } else {
+      const char* from = "abfnrtv";
+      const char* to = "\a\b\f\n\r\t\v";
+      const char* found = strchr(from, c);
+      if (found != NULL && c != '\0') c = to[found - from];
+    }
+    bytes.push_back(c);
+    escaped.push_back(true);
+  }
+
+  // then expand the ranges
+  for (size_t i = 0; i < bytes.size(); i++) {
+    if (i + 2 < bytes.size() && bytes[i + 1] == '-' && !escaped[i + 1]) {
+      if (bytes[i] > bytes[i + 2]) return false;
+      for (int c = bytes[i]; c <= bytes[i + 2]; c++) set.push_back(c);
+      i += 2;
+    } else {
+      set.push_back(bytes[i]);
+    }
+  }
+  return true;
+}
+
+
+/**
+ * Parses wc [-lwc]... with no file operands.
+ */
+bool parse_wc(const vector<string>& argv, text_command_t& command) {
+  for (size_t i = 1; i < argv.size(); i++) {
+    const string& arg = argv[i];
+    if (arg.size() < 2 || arg[0] != '-') return false;
+    for (size_t j = 1; j < arg.size(); j++) {
+      if (arg[j] == 'l') command.lines = true;
+      else if (arg[j] == 'w') command.words = true;
+      else if (arg[j] == 'c') command.bytes = true;
+      else return false;
+    }
+  }
+  if (!command.lines && !command.words && !command.bytes) {
+    command.lines = command.words = command.bytes = true;
+  }
+  return true;
+}
+
+
+/**
+ * Parses head or tail with no operands, -n N, -nN or -N.
+ */
+bool parse_head_tail(const vector<string>& argv, text_command_t& command) {
+  if (argv.size() == 1) return true;
+  if (argv.size() == 3 && argv[1] == "-n") {
+    return parse_line_count(argv[2], command.count);
+  }
+  if (argv.size() == 2 && argv[1].compare(0, 2, "-n") == 0) {
+    return parse_line_count(argv[1].substr(2), command.count);
+  }
+  if (argv.size() == 2 && argv[1].size() > 1 && argv[1][0] == '-') {
+    return parse_line_count(argv[1].substr(1), command.count);
+  }
+  return false;
+}
+
+
+/**
+ * Parses grep with -F (required), -v and -c, and a pattern.
+ */
+bool parse_grep(const vector<string>& argv, text_command_t& command) {
+  bool fixed = false;
+  size_t i = 1;
+  for (; i < argv.size() && argv[i].size() > 1 && argv[i][0] == '-'; i++) {
+    for (size_t j = 1; j < argv[i].size(); j++) {
+      if (argv[i][j] == 'F') fixed = true;
+      else if (argv[i][j] == 'v') command.invert = true;
+      else if (argv[i][j] == 'c') command.count_only = true;
+      else return false;
+    }
+  }
+  if (!fixed || i + 1 != argv.size()) return false;
+  command.pattern = argv[i];
+  return true;
+}
+
+
+/**
+ * Parses tr SET1 SET2 or tr -d SET1.
+ */
+bool parse_tr(const vector<string>& argv, text_command_t& command) {
+  vector<unsigned char> from, to;
+  if (argv.size() == 3 && argv[1] == "-d") {
+    if (!parse_tr_set(argv[2], from)) return false;
+    command.deleting = true;
+    for (size_t i = 0; i < from.size(); i++) command.deleted[from[i]] = true;
+    return true;
+  }
+
+  if (argv.size() != 3 || argv[1].empty() || argv[1][0] == '-') return false;
+  if (!parse_tr_set(argv[1], from) || !parse_tr_set(argv[2], to)) return false;
+  if (to.empty()) return from.empty();
+
+  // a short SET2 is padded with its last byte; a later mapping of the same
+  // byte wins
+  for (size_t i = 0; i < from.size(); i++) {
+    command.translation[from[i]] = i < to.size() ? to[i] : to.back();
+  }
+  return true;
+}
+
+
+/**
+ * Parses a command into a text_command_t. Returns false if it isn't one of
+ * the supported forms.
+ */
+bool parse_text_command(const vector<string>& argv, text_command_t& command) {
+  if (argv.empty()) return false;
+  const string& name = argv[0];
+  if (name == "wc") {
+    command.tool = TEXT_WC;
+    return parse_wc(argv, command);
+  } else if (name == "head" || name == "tail") {
+    command.tool = name == "head" ? TEXT_HEAD : TEXT_TAIL;
+    return parse_head_tail(argv, command);
+  } else if (name == "grep") {
+    command.tool = TEXT_GREP;
+    return parse_grep(argv, command);
+  } else if (name == "tr") {
+    command.tool = TEXT_TR;
+    return parse_tr(argv, command);
+  }
+  return false;
+}
+
+
+bool text_builtin_supported(const vector<string>& argv) {
+  text_command_t command;
+  return parse_text_command(argv, command);
+}
+
+
+/**
+ * Returns the number of decimal digits in a number.
+ */
+int count_digits(unsigned long long value) {
+  int digits = 1;
+  while (value >= 10) {
+    value /= 10;
+    digits++;
+  }
+  return digits;
+}
+
+
+/**
+ * Reports a failed read, returning the exit code for it.
+ */
+int read_failure(const text_input_t& input, int error_fd, const string& tool,
+                 int status) {
+  report_text_error(error_fd, tool, string("read error: ") + strerror(input.error));
+  return status;
+}
+
+
+/**
+ * Runs wc. The counts are printed in the order lines, words, bytes; a single
+ * count is printed alone, and several are padded to the width of the input's
+ * size when it's a regular file, and to 7 otherwise.
+ */
+int run_wc(const text_command_t& command, text_input_t& input, text_output_t& output,
+           int error) {
+  const text_kernels_t& kernels = text_kernels();
+  unsigned long long lines = 0, words = 0, bytes = 0;
+  struct stat info;
+  bool regular = !input.channel && fstat(input.fd, &info) == 0 && S_ISREG(info.st_mode);
+  off_t offset = regular ? lseek(input.fd, 0, SEEK_CUR) : -1;
+
+  if (regular && offset >= 0 && !command.lines && !command.words) {
+    // counting the bytes of a file only needs its size
+    bytes = info.st_size > offset ? info.st_size - offset : 0;
+  } else {
+    bool in_word = false;
+    while (text_chunk_t* chunk = input.next()) {
+      const char* data = chunk->data;
+      if (command.lines) lines += kernels.count_byte(data, chunk->length, '\n');
+      if (command.words) words += kernels.count_words(data, chunk->length, in_word);
+      bytes += chunk->length;
+    }
+    if (input.error) return read_failure(input, error, "wc", EXIT_FAILURE);
+  }
+
+  unsigned long long counts[3] = { lines, words, bytes };
+  bool shown[3] = { command.lines, command.words, command.bytes };
+  int width = 1;
+  if (count(shown, shown + 3, true) > 1) {
+    width = regular ? count_digits(info.st_size) : 7;
+  }
+
+  string line;
+  for (int i = 0; i < 3; i++) {
+    if (!shown[i]) continue;
+    char field[32];
+    snprintf(field, sizeof(field), "%s%*llu", line.empty() ? "" : " ", width, counts[i]);
+    line += field;
+  }
+  line += '\n';
+  if (!output.append(line.data(), line.size()) || !output.flush()) {
+    return write_failure(output, error, "wc");
+  }
+  return EXIT_SUCCESS;
+}
+
+
+/**
+ * Runs head: passes on whole chunks while they hold fewer newlines than are
+ * left to print, then the part of the last chunk up to the final newline.
+ */
+int run_head(const text_command_t& command, text_input_t& input, text_output_t& output,
+             int error) {
+  const text_kernels_t& kernels = text_kernels();
+  size_t remaining = command.count;
+
+  while (remaining > 0) {
+    text_chunk_t* chunk = input.next();
+    if (chunk == NULL) break;
+
+    const char* data = chunk->data;
+    size_t newlines = kernels.count_byte(data, chunk->length, '\n');
+    if (newlines >= remaining) {
+      const char* end = data;
+      for (; remaining > 0; remaining--) {
+        end = (const char*)memchr(end, '\n', data + chunk->length - end) + 1;
+      }
+      chunk->length = end - data;
+    } else {
+      remaining -= newlines;
+    }
+    if (!output.pass(input)) return write_failure(output, error, "head");
+  }
+
+  if (input.error) return read_failure(input, error, "head", EXIT_FAILURE);
+  if (!output.flush()) return write_failure(output, error, "head");
+  return EXIT_SUCCESS;
+}
+
+
+/**
+ * Returns the offset at which the last count lines of the data start. A
+ * final line without a newline counts as a line.
+ */
+size_t last_lines_start(const char* data, size_t length, size_t count) {
+  const text_kernels_t& kernels = text_kernels();
+  if (count == 0) return length;
+
+  // the newline ending the last line doesn't start another one
+  size_t end = length;
+  if (end > 0 && data[end - 1] == '\n') end--;
+
+  // count newlines a block at a time, and only look for the exact one in the
+  // block that has it
+  while (end > 0) {
+    size_t begin = end > TAIL_SCAN_SIZE ? end - TAIL_SCAN_SIZE : 0;
+    size_t newlines = kernels.count_byte(data + begin, end - begin, '\n');
+    if (newlines < count) {
+      count -= newlines;
+      end = begin;
+      continue;
+    }
+    for (size_t i = end; i-- > begin; ) {
+      if (data[i] == '\n' && --count == 0) return i + 1;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Runs tail. A regular file is mapped and scanned backwards from its end, so
+ * only its last lines are read; anything else is read to the end, dropping
+ * lines that can no longer be among the last ones as it goes.
+ */
+int run_tail(const text_command_t& command, text_input_t& input, text_output_t& output,
+             int error) {
+  struct stat info;
+  off_t offset = input.channel ? -1 : lseek(input.fd, 0, SEEK_CUR);
+  if (offset >= 0 && fstat(input.fd, &info) == 0 && S_ISREG(info.st_mode)) {
+    if (info.st_size <= offset) return EXIT_SUCCESS;
+    void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, input.fd, 0);
+    if (mapping != MAP_FAILED) {
+      const char* data = (const char*)mapping + offset;
+      size_t length = info.st_size - offset;
+      size_t start = last_lines_start(data, length, command.count);
+      bool ok = output.append(data + start, length - start) && output.flush();
+      munmap(mapping, info.st_size);
+      lseek(input.fd, info.st_size, SEEK_SET);
+      return ok ? EXIT_SUCCESS : write_failure(output, error, "tail");
+    }
+  }
+
+  string kept;
+  size_t trim_at = TAIL_TRIM_SIZE;
+  while (text_chunk_t* chunk = input.next()) {
+    kept.append(chunk->data, chunk->length);
+    if (kept.size() >= trim_at) {
+      kept.erase(0, last_lines_start(kept.data(), kept.size(), command.count));
+      trim_at = max(TAIL_TRIM_SIZE, 2 * kept.size());
+    }
+  }
+  if (input.error) return read_failure(input, error, "tail", EXIT_FAILURE);
+
+  size_t start = last_lines_start(kept.data(), kept.size(), command.count);
+  if (!output.append(kept.data() + start, kept.size() - start) || !output.flush()) {
+    return write_failure(output, error, "tail");
+  }
+  return EXIT_SUCCESS;
+}
+
+
+/**
+ * Returns the start of the line containing position at, in data.
+ */
+const char* line_start(const char* data, const char* at) {
+  while (at > data && at[-1] != '\n') at--;
+  return at;
+}
+
+
+/**
+ * The state of a grep: what it's looking for, where selected lines go, and
+ * what it has seen so far.
+ */
+struct grep_state_t {
+  const text_command_t& command;
+  text_output_t& output;
+  unsigned long long selected;
+
+  /**
+   * Whether binary data (a NUL byte) has been seen, and whether a line was
+   * selected after it, which stops the grep.
+   */
+  bool binary;
+  bool binary_match;
+
+  /**
+   * Constructor.
+   */
+  grep_state_t(const text_command_t& command, text_output_t& output)
+    : command(command), output(output), selected(0), binary(false),
+      binary_match(false) {}
+};
+
+
+/**
+ * Selects the lines of a block of whole lines for grep, adding them to the
+ * output (or counting them, with -c). Instead of going line by line, the
+ * kernel searches the whole block for the pattern, so lines without it are
+ * skipped at the kernel's speed. Sets binary_match and stops if a line is
+ * selected after binary data was seen, as GNU grep does. Returns false if
+ * the output couldn't be written.
+ */
+bool grep_block(grep_state_t& grep, const char* data, size_t length) {
+  const text_kernels_t& kernels = text_kernels();
+  const text_command_t& command = grep.command;
+  const char* end = data + length;
+  const char* position = data;
+
+  while (position < end) {
+    const char* match = kernels.find(position, end - position, command.pattern.data(),
+                                     command.pattern.size());
+    const char* start = match ? line_start(position, match) : end;
+    const char* next = end;
+    if (match) {
+      next = (const char*)memchr(match, '\n', end - match);
+      next = next ? next + 1 : end;
+    }
+
+    // with -v, the lines before the match are the selected ones
+    const char* from = command.invert ? position : start;
+    const char* to = command.invert ? start : next;
+    if (from < to) {
+      if (grep.binary && !command.count_only) {
+        grep.binary_match = true;
+        return true;
+      }
+      grep.selected += command.invert ? kernels.count_byte(from, to - from, '\n') : 1;
+      if (!command.count_only && !grep.output.append(from, to - from)) return false;
+    }
+    position = next;
+  }
+  return true;
+}
+
+
+/**
+ * Runs grep -F. The whole lines in each chunk are searched where they are;
+ * only a line split between chunks is put together in a separate buffer.
+ */
+int run_grep(const text_command_t& command, text_input_t& input, text_output_t& output,
+             int error) {
+  grep_state_t grep(command, output);
+  string partial;
+
+  while (text_chunk_t* chunk = input.next()) {
+    const char* data = chunk->data;
+    size_t length = chunk->length;
+    grep.binary = grep.binary || memchr(data, '\0', length) != NULL;
+
+    // finish the line left over from the last chunk
+    size_t first = 0;
+    if (!partial.empty()) {
+      const char* newline = (const char*)memchr(data, '\n', length);
+      if (newline == NULL) {
+        partial.append(data, length);
+        continue;
+      }
+      first = newline - data + 1;
+      partial.append(data, first);
+      if (!grep_block(grep, partial.data(), partial.size())) {
+        return write_failure(output, error, "grep");
+      }
+      partial.clear();
+    }
+
+    size_t whole = length;
+    while (whole > first && data[whole - 1] != '\n') whole--;
+    if (!grep.binary_match && !grep_block(grep, data + first, whole - first)) {
+      return write_failure(output, error, "grep");
+    }
+    if (grep.binary_match) break;
+    partial.assign(data + whole, length - whole);
+  }
+  if (input.error) return read_failure(input, error, "grep", 2);
+
+  // the last line is printed with a newline, as grep does
+  if (!partial.empty() && !grep.binary_match) {
+    partial += '\n';
+    if (!grep_block(grep, partial.data(), partial.size())) {
+      return write_failure(output, error, "grep");
+    }
+  }
+
+  if (command.count_only) {
+    string line = to_string(grep.selected) + "\n";
+    output.append(line.data(), line.size());
+  }
+  if (!output.flush()) return write_failure(output, error, "grep");
+  if (grep.binary_match) {
+    report_text_error(error, "grep", "(standard input): binary file matches");
+    return EXIT_SUCCESS;
+  }
+  return grep.selected > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * Returns the ranges of bytes that tr changes, each byte in a range moving
+ * by the same amount (or, when deleting, the ranges of deleted bytes).
+ * Returns false if there are more than the range kernels take.
+ */
+bool tr_ranges(const text_command_t& command, vector<byte_range_t>& ranges) {
+  for (int c = 0; c < 256; c++) {
+    bool changed = command.deleting ? command.deleted[c] : command.translation[c] != c;
+    if (!changed) continue;
+    unsigned char delta = command.deleting ? 0 : command.translation[c] - c;
+    if (!ranges.empty() && ranges.back().high == c - 1 && ranges.back().delta == delta) {
+      ranges.back().high = c;
+    } else {
+      byte_range_t range = { (unsigned char)c, (unsigned char)c, delta };
+      ranges.push_back(range);
+    }
+  }
+  return ranges.size() <= TEXT_MAX_RANGES;
+}
+
+
+/**
+ * Deletes the bytes tr -d deletes from a block, in place, and returns the
+ * block's new length. With use_ranges the kernel skips straight to each byte
+ * to delete, which pays off when they are sparse; otherwise each byte is
+ * looked up in the table.
+ */
+size_t delete_bytes(const text_command_t& command, const vector<byte_range_t>& ranges,
+                    bool use_ranges, char* data, size_t length) {
+  const text_kernels_t& kernels = text_kernels();
+  size_t kept = 0;
+  if (!use_ranges) {
+    for (size_t i = 0; i < length; i++) {
+      data[kept] = data[i];
+      kept += !command.deleted[(unsigned char)data[i]];
+    }
+    return kept;
+  }
+
+  size_t i = 0;
+  while (i < length) {
+    size_t span = kernels.find_in_ranges(data + i, length - i, ranges.data(),
+                                         ranges.size());
+    memmove(data + kept, data + i, span);
+    kept += span;
+    i += span + 1;
+  }
+  return kept;
+}
+
+
+/**
+ * Runs tr, translating or deleting each chunk in place and passing it on.
+ * The range kernels are only used with SIMD; a table lookup is quicker than
+ * the scalar ones.
+ */
+int run_tr(const text_command_t& command, text_input_t& input, text_output_t& output,
+           int error) {
+  const text_kernels_t& kernels = text_kernels();
+  vector<byte_range_t> ranges;
+  bool use_ranges = tr_ranges(command, ranges) && kernels.level != SIMD_SCALAR;
+  bool dense = false;
+
+  while (text_chunk_t* chunk = input.next()) {
+    char* data = chunk->data;
+    size_t length = chunk->length;
+    if (command.deleting) {
+      chunk->length = delete_bytes(command, ranges, use_ranges && !dense, data, length);
+      dense = (length - chunk->length) * TR_DENSE_DELETES > length;
+    } else if (use_ranges) {
+      kernels.translate_ranges(data, length, ranges.data(), ranges.size());
+    } else {
+      for (size_t i = 0; i < length; i++) {
+        data[i] = command.translation[(unsigned char)data[i]];
+      }
+    }
+    if (!output.pass(input)) return write_failure(output, error, "tr");
+  }
+
+  if (input.error) return read_failure(input, error, "tr", EXIT_FAILURE);
+  if (!output.flush()) return write_failure(output, error, "tr");
+  return EXIT_SUCCESS;
+}
+
+
+/**
+ * Runs a stage's text builtin over its input, returning its exit code (as
+ * the real tool's would be).
+ */
+int run_text_builtin(text_stage_t& stage, text_input_t& input, text_output_t& output) {
+  text_command_t command;
+  if (!parse_text_command(stage.argv, command)) {
+    report_text_error(stage.error, stage.argv[0], "unsupported arguments");
+    return 2;
+  }
+
+  switch (command.tool) {
+    case TEXT_WC: return run_wc(command, input, output, stage.error);
+    case TEXT_HEAD: return run_head(command, input, output, stage.error);
+    case TEXT_TAIL: return run_tail(command, input, output, stage.error);
+    case TEXT_GREP: return run_grep(command, input, output, stage.error);
+    case TEXT_TR: return run_tr(command, input, output, stage.error);
+  }
+  return EXIT_FAILURE;
+}
+
+
+void run_text_stage(text_stage_t* stage) {
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  {
+    // the input and output close their channels when they go out of scope
+    text_input_t input(stage->input, stage->input_channel);
+    text_output_t output(stage->output, stage->output_channel);
+
+    if (stage->builtin) {
+      // a builtin has already run in the shell; only its output is left to
+      // pass on
+      output.append(stage->builtin_output.data(), stage->builtin_output.size());
+      output.flush();
+    } else {
+      stage->status = run_text_builtin(*stage, input, output);
+    }
+    stage->bytes_written = output.written;
+  }
+  for (size_t i = 0; i < stage->owned.size(); i++) close(stage->owned[i]);
+}
@@ -0,0 +1,86 @@
+/**
+ * Contains the declarations for the in-process text builtins: wc, head, tail,
+ * grep -F and tr, which a pipeline runs in a thread of the shell instead of
+ * forking and executing the real tools. They read and write the stage's file
+ * descriptors directly, using the kernels in text_kernels.h. Two such stages
+ * next to each other are connected by a channel (see text_channel.h) rather
+ * than a pipe.
+ *
+ * Only the common forms are handled here (see text_builtin_supported), with
+ * the C locale's semantics; anything else runs the external tool as before.
+ */
+
+#pragma once
+#include <string>
+#include <thread>
+#include <vector>
+#include "text_channel.h"
+
+
+/**
+ * A pipeline stage run by a thread of the shell rather than by a child
+ * process: a text builtin, or a builtin that has already run in the shell
+ * and whose output the thread only passes on.
+ */
+struct text_stage_t {
+  /**
+   * The stage's command and its position in the pipeline.
+   */
+  std::vector<std::string> argv;
+  size_t index;
+
+  /**
+   * The descriptors the stage reads from and writes its output and errors
+   * to. The input or output is a channel instead when it's set.
+   */
+  int input;
+  int output;
+  int error;
+  text_channel_t* input_channel;
+  text_channel_t* output_channel;
+
+  /**
+   * Whether the stage is a builtin, and the output it produced.
+   */
+  bool builtin;
+  std::string builtin_output;
+
+  /**
+   * The descriptors the stage owns (its pipe ends), which it closes as soon
+   * as it's done so that the stages around it see end of file or a broken
+   * pipe.
+   */
+  std::vector<int> owned;
+
+  /**
+   * The stage's exit code, and the number of bytes it wrote to its output.
+   */
+  int status;
+  long bytes_written;
+
+  /**
+   * The thread running the stage.
+   */
+  std::thread thread;
+
+  /**
+   * Constructor.
+   */
+  text_stage_t()
+    : index(0), input(-1), output(-1), error(-1), input_channel(NULL),
+      output_channel(NULL), builtin(false), status(0), bytes_written(0) {}
+};
+
+
+/**
+ * Returns whether the given command is a form of wc, head, tail, grep or tr
+ * that can be run in-process.
+ */
+bool text_builtin_supported(const std::vector<std::string>& argv);
+
+/**
+ * The body of a stage's thread: runs the stage with every signal blocked (so
+ * that a closed pipe is an EPIPE error rather than a SIGPIPE for the shell),
+ * then closes its channels and the descriptors it owns.
+ */
+void run_text_stage(text_stage_t* stage);
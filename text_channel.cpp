@@ -0,0 +1,105 @@
+/**
+ * This file contains the implementation of the channels between in-process
+ * pipeline stages (see text_channel.h).
+ *
+ * A side that finds the channel full or empty announces that it's waiting,
+ * checks again, and sleeps on the other side's event counter; the other side
+ * bumps the counter after every change and only wakes the futex when the
+ * waiting flag is set. The flags and indexes use sequentially consistent
+ * operations, so either the waiter sees the change on its second check or
+ * the other side sees the flag, and a wakeup is never lost.
+ */
+
+#include "text_channel.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * Sleeps until the futex word no longer holds seen (or a spurious wakeup).
+ */
+void futex_wait(atomic<uint32_t>& word, uint32_t seen) {
+  syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+
+/**
+ * Bumps an event counter, waking the other side if it's asleep on it.
+ */
+void notify_event(atomic<uint32_t>& events, atomic<bool>& waiting) {
+  events.fetch_add(1);
+  if (waiting.load()) {
+    syscall(SYS_futex, &events, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+
+text_channel_t::~text_channel_t() {
+  for (uint32_t i = head.load(); i != tail.load(); i++) {
+    delete slots[i % CHANNEL_SLOTS];
+  }
+}
+
+
+bool text_channel_t::send(text_chunk_t* chunk) {
+  uint32_t position = tail.load(memory_order_relaxed);
+  for (;;) {
+    if (reader_closed.load()) {
+      delete chunk;
+      return false;
+    }
+    if (position - head.load() < CHANNEL_SLOTS) break;
+
+    uint32_t seen = space_events.load();
+    writer_waiting.store(true);
+    if (position - head.load() == CHANNEL_SLOTS && !reader_closed.load()) {
+      futex_wait(space_events, seen);
+    }
+    writer_waiting.store(false);
+  }
+
+  slots[position % CHANNEL_SLOTS] = chunk;
+  tail.store(position + 1);
+  notify_event(data_events, reader_waiting);
+  return true;
+}
+
+
+text_chunk_t* text_channel_t::receive() {
+  uint32_t position = head.load(memory_order_relaxed);
+  for (;;) {
+    if (tail.load() != position) break;
+    // the writer may have sent its last chunk just before closing
+    if (writer_closed.load()) {
+      if (tail.load() != position) break;
+      return NULL;
+    }
+
+    uint32_t seen = data_events.load();
+    reader_waiting.store(true);
+    if (tail.load() == position && !writer_closed.load()) {
+      futex_wait(data_events, seen);
+    }
+    reader_waiting.store(false);
+  }
+
+  text_chunk_t* chunk = slots[position % CHANNEL_SLOTS];
+  head.store(position + 1);
+  notify_event(space_events, writer_waiting);
+  return chunk;
+}
+
+
+void text_channel_t::close_writer() {
+  writer_closed.store(true);
+  notify_event(data_events, reader_waiting);
+}
+
+
+void text_channel_t::close_reader() {
+  reader_closed.store(true);
+  notify_event(space_events, writer_waiting);
+}
@@ -0,0 +1,113 @@
+/**
+ * Contains the definitions for the channels that connect adjacent in-process
+ * pipeline stages (see text_builtins.h) in place of a kernel pipe: a bounded
+ * single-producer, single-consumer ring of chunks. A chunk is handed over
+ * whole, so the data in it is never copied; whoever holds a chunk owns it.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+
+
+/**
+ * The number of chunks a channel holds before its writer has to wait (a
+ * power of two).
+ */
+const uint32_t CHANNEL_SLOTS = 16;
+
+
+/**
+ * A block of data passed between stages.
+ */
+struct text_chunk_t {
+  /**
+   * The storage, its size, and the number of bytes of it in use.
+   */
+  char* data;
+  size_t capacity;
+  size_t length;
+
+  /**
+   * Constructor. The storage is left uninitialized, since it's about to be
+   * filled.
+   */
+  text_chunk_t(size_t capacity)
+    : data(new char[capacity]), capacity(capacity), length(0) {}
+
+  /**
+   * Destructor.
+   */
+  ~text_chunk_t() { delete[] data; }
+
+  /**
+   * Chunks are only ever passed by pointer.
+   */
+  text_chunk_t(const text_chunk_t&) = delete;
+  text_chunk_t& operator=(const text_chunk_t&) = delete;
+};
+
+
+/**
+ * A channel from one stage's thread to the next. Only the writer moves tail
+ * and only the reader moves head, so passing a chunk takes no lock; a side
+ * that has to wait sleeps on a futex, and the other side only makes the
+ * system call to wake it when it's actually waiting.
+ */
+struct text_channel_t {
+  /**
+   * The chunks in flight, and the number of chunks ever read and written.
+   */
+  text_chunk_t* slots[CHANNEL_SLOTS];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+
+  /**
+   * The futex words the reader and writer sleep on, bumped whenever there is
+   * something new for them (a chunk, space, or the other side closing), and
+   * whether each one is asleep (or about to be).
+   */
+  std::atomic<uint32_t> data_events;
+  std::atomic<uint32_t> space_events;
+  std::atomic<bool> reader_waiting;
+  std::atomic<bool> writer_waiting;
+
+  /**
+   * Whether either side is done with the channel.
+   */
+  std::atomic<bool> writer_closed;
+  std::atomic<bool> reader_closed;
+
+  /**
+   * Constructor.
+   */
+  text_channel_t()
+    : head(0), tail(0), data_events(0), space_events(0), reader_waiting(false),
+      writer_waiting(false), writer_closed(false), reader_closed(false) {}
+
+  /**
+   * Destructor. Frees any chunks that were never read.
+   */
+  ~text_channel_t();
+
+  /**
+   * Passes a chunk to the reader, waiting for space if the channel is full.
+   * Returns false (and frees the chunk) if the reader has closed the channel,
+   * as writing to a pipe with no reader fails with EPIPE.
+   */
+  bool send(text_chunk_t* chunk);
+
+  /**
+   * Returns the next chunk, waiting for one if the channel is empty, or NULL
+   * once the writer has closed the channel and everything has been read.
+   */
+  text_chunk_t* receive();
+
+  /**
+   * Called by each side when it's done; the other side sees end of input or
+   * a closed reader.
+   */
+  void close_writer();
+  void close_reader();
+};
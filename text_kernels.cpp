@@ -0,0 +1,443 @@
+/**
+ * Contains the scalar, SSE2 and AVX2 versions of the text kernels (see
+ * text_kernels.h), and the runtime choice between them.
+ *
+ * The SIMD versions work on a block of 16 or 32 bytes at a time and leave the
+ * last partial block to the scalar version. SSE2 is part of x86-64, so it
+ * needs no check; the AVX2 functions are compiled for AVX2 on their own with
+ * the target attribute, and only called when the CPU has it.
+ */
+
+#include "text_kernels.h"
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define TEXT_KERNELS_X86 1
+#endif
+
+using namespace std;
+
+
+/**
+ * The number of blocks whose byte counts are added up in 8-bit lanes before
+ * they are widened, so that no lane overflows.
+ */
+static const size_t COUNT_BATCH_BLOCKS = 255;
+
+
+/**
+ * Returns whether a byte is white space to wc in the C locale (space, \t, \n,
+ * \v, \f or \r), or a printable character that isn't space.
+ */
+static inline bool is_word_space(unsigned char c) {
+  return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+static inline bool is_word_char(unsigned char c) {
+  return (unsigned char)(c - '!') <= '~' - '!';
+}
+
+
+// the scalar kernels, which the SIMD ones also use for partial blocks
+
+static size_t count_byte_scalar(const char* data, size_t length, char byte) {
+  size_t count = 0;
+  for (size_t i = 0; i < length; i++) {
+    count += data[i] == byte;
+  }
+  return count;
+}
+
+static size_t count_words_scalar(const char* data, size_t length, bool& in_word) {
+  size_t words = 0;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = data[i];
+    if (is_word_space(c)) {
+      in_word = false;
+    } else if (is_word_char(c)) {
+      words += !in_word;
+      in_word = true;
+    }
+  }
+  return words;
+}
+
+static const char* find_scalar(const char* data, size_t length, const char* pattern,
+                               size_t pattern_length) {
+  if (pattern_length == 0) {
+    return data;
+  }
+
+  const char* end = data + length;
+  const char* candidate = data;
+  while ((size_t)(end - candidate) >= pattern_length) {
+    candidate = (const char*)memchr(candidate, pattern[0],
+                                    end - candidate - pattern_length + 1);
+    if (candidate == NULL) {
+      return NULL;
+    }
+    if (memcmp(candidate + 1, pattern + 1, pattern_length - 1) == 0) {
+      return candidate;
+    }
+    candidate++;
+  }
+  return NULL;
+}
+
+static void translate_ranges_scalar(char* data, size_t length,
+                                    const byte_range_t* ranges, size_t count) {
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = data[i];
+    for (size_t r = 0; r < count; r++) {
+      if ((unsigned char)(c - ranges[r].low) <= ranges[r].high - ranges[r].low) {
+        data[i] = (char)(c + ranges[r].delta);
+        break;
+      }
+    }
+  }
+}
+
+static size_t find_in_ranges_scalar(const char* data, size_t length,
+                                    const byte_range_t* ranges, size_t count) {
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = data[i];
+    for (size_t r = 0; r < count; r++) {
+      if ((unsigned char)(c - ranges[r].low) <= ranges[r].high - ranges[r].low) {
+        return i;
+      }
+    }
+  }
+  return length;
+}
+
+
+#if TEXT_KERNELS_X86
+
+// the SSE2 kernels, 16 bytes at a time
+
+/**
+ * Returns a mask of the bytes of x that are between low and low + span
+ * (unsigned, so one compare covers the range).
+ */
+static inline __m128i in_range_sse2(__m128i x, __m128i low, __m128i span) {
+  __m128i offset = _mm_sub_epi8(x, low);
+  return _mm_cmpeq_epi8(_mm_min_epu8(offset, span), offset);
+}
+
+static size_t count_byte_sse2(const char* data, size_t length, char byte) {
+  const __m128i needle = _mm_set1_epi8(byte);
+  const __m128i zero = _mm_setzero_si128();
+  size_t count = 0;
+  size_t i = 0;
+
+  while (length - i >= 16) {
+    // Each match is -1, so subtracting the compare counts up in each lane.
+    __m128i lanes = zero;
+    size_t blocks = (length - i) / 16;
+    if (blocks > COUNT_BATCH_BLOCKS) {
+      blocks = COUNT_BATCH_BLOCKS;
+    }
+    for (size_t b = 0; b < blocks; b++, i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+      lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(block, needle));
+    }
+    __m128i sums = _mm_sad_epu8(lanes, zero);
+    count += _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+  }
+  return count + count_byte_scalar(data + i, length - i, byte);
+}
+
+static size_t count_words_sse2(const char* data, size_t length, bool& in_word) {
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i space_span = _mm_set1_epi8('\r' - '\t');
+  const __m128i bang = _mm_set1_epi8('!');
+  const __m128i print_span = _mm_set1_epi8('~' - '!');
+  size_t words = 0;
+  size_t i = 0;
+
+  for (; length - i >= 16; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+    unsigned white = _mm_movemask_epi8(_mm_or_si128(
+      _mm_cmpeq_epi8(block, space), in_range_sse2(block, tab, space_span)));
+    unsigned printable = _mm_movemask_epi8(in_range_sse2(block, bang, print_span));
+
+    if ((white | printable) != 0xffff) {
+      // Control characters and bytes past ASCII don't change the state, so
+      // the shift below doesn't apply; this block is left to the scalar loop.
+      words += count_words_scalar(data + i, 16, in_word);
+      continue;
+    }
+
+    unsigned after_space = (white << 1) | !in_word;
+    words += __builtin_popcount(printable & after_space);
+    in_word = printable >> 15;
+  }
+  return words + count_words_scalar(data + i, length - i, in_word);
+}
+
+static const char* find_sse2(const char* data, size_t length, const char* pattern,
+                             size_t pattern_length) {
+  if (pattern_length < 2 || length < pattern_length) {
+    return find_scalar(data, length, pattern, pattern_length);
+  }
+
+  // Candidates are the positions where both the first and the last byte of
+  // the pattern match; only those are compared in full.
+  const __m128i first = _mm_set1_epi8(pattern[0]);
+  const __m128i last = _mm_set1_epi8(pattern[pattern_length - 1]);
+  size_t i = 0;
+
+  for (; length - i >= pattern_length - 1 + 16; i += 16) {
+    __m128i block_first = _mm_loadu_si128((const __m128i*)(data + i));
+    __m128i block_last = _mm_loadu_si128((const __m128i*)(data + i + pattern_length - 1));
+    unsigned candidates = _mm_movemask_epi8(_mm_and_si128(
+      _mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+
+    while (candidates != 0) {
+      size_t at = i + __builtin_ctz(candidates);
+      if (memcmp(data + at + 1, pattern + 1, pattern_length - 2) == 0) {
+        return data + at;
+      }
+      candidates &= candidates - 1;
+    }
+  }
+  return find_scalar(data + i, length - i, pattern, pattern_length);
+}
+
+static void translate_ranges_sse2(char* data, size_t length, const byte_range_t* ranges,
+                                  size_t count) {
+  __m128i lows[TEXT_MAX_RANGES];
+  __m128i spans[TEXT_MAX_RANGES];
+  __m128i deltas[TEXT_MAX_RANGES];
+  for (size_t r = 0; r < count; r++) {
+    lows[r] = _mm_set1_epi8(ranges[r].low);
+    spans[r] = _mm_set1_epi8(ranges[r].high - ranges[r].low);
+    deltas[r] = _mm_set1_epi8(ranges[r].delta);
+  }
+
+  size_t i = 0;
+  for (; length - i >= 16; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+    __m128i result = block;
+    for (size_t r = 0; r < count; r++) {
+      __m128i mask = in_range_sse2(block, lows[r], spans[r]);
+      result = _mm_add_epi8(result, _mm_and_si128(mask, deltas[r]));
+    }
+    _mm_storeu_si128((__m128i*)(data + i), result);
+  }
+  translate_ranges_scalar(data + i, length - i, ranges, count);
+}
+
+static size_t find_in_ranges_sse2(const char* data, size_t length,
+                                  const byte_range_t* ranges, size_t count) {
+  __m128i lows[TEXT_MAX_RANGES];
+  __m128i spans[TEXT_MAX_RANGES];
+  for (size_t r = 0; r < count; r++) {
+    lows[r] = _mm_set1_epi8(ranges[r].low);
+    spans[r] = _mm_set1_epi8(ranges[r].high - ranges[r].low);
+  }
+
+  size_t i = 0;
+  for (; length - i >= 16; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+    __m128i any = _mm_setzero_si128();
+    for (size_t r = 0; r < count; r++) {
+      any = _mm_or_si128(any, in_range_sse2(block, lows[r], spans[r]));
+    }
+    unsigned mask = _mm_movemask_epi8(any);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + find_in_ranges_scalar(data + i, length - i, ranges, count);
+}
+
+
+// the AVX2 kernels, 32 bytes at a time
+
+#define AVX2_TARGET __attribute__((target("avx2,popcnt")))
+
+AVX2_TARGET
+static inline __m256i in_range_avx2(__m256i x, __m256i low, __m256i span) {
+  __m256i offset = _mm256_sub_epi8(x, low);
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, span), offset);
+}
+
+AVX2_TARGET
+static size_t count_byte_avx2(const char* data, size_t length, char byte) {
+  const __m256i needle = _mm256_set1_epi8(byte);
+  const __m256i zero = _mm256_setzero_si256();
+  size_t count = 0;
+  size_t i = 0;
+
+  while (length - i >= 32) {
+    __m256i lanes = zero;
+    size_t blocks = (length - i) / 32;
+    if (blocks > COUNT_BATCH_BLOCKS) {
+      blocks = COUNT_BATCH_BLOCKS;
+    }
+    for (size_t b = 0; b < blocks; b++, i += 32) {
+      __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+      lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(block, needle));
+    }
+    __m256i sums = _mm256_sad_epu8(lanes, zero);
+    count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1)
+             + _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+  }
+  return count + count_byte_scalar(data + i, length - i, byte);
+}
+
+AVX2_TARGET
+static size_t count_words_avx2(const char* data, size_t length, bool& in_word) {
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i space_span = _mm256_set1_epi8('\r' - '\t');
+  const __m256i bang = _mm256_set1_epi8('!');
+  const __m256i print_span = _mm256_set1_epi8('~' - '!');
+  size_t words = 0;
+  size_t i = 0;
+
+  for (; length - i >= 32; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+    unsigned white = _mm256_movemask_epi8(_mm256_or_si256(
+      _mm256_cmpeq_epi8(block, space), in_range_avx2(block, tab, space_span)));
+    unsigned printable = _mm256_movemask_epi8(in_range_avx2(block, bang, print_span));
+
+    if ((white | printable) != 0xffffffffu) {
+      words += count_words_scalar(data + i, 32, in_word);
+      continue;
+    }
+
+    unsigned after_space = (white << 1) | !in_word;
+    words += __builtin_popcount(printable & after_space);
+    in_word = printable >> 31;
+  }
+  return words + count_words_scalar(data + i, length - i, in_word);
+}
+
+AVX2_TARGET
+static const char* find_avx2(const char* data, size_t length, const char* pattern,
+                             size_t pattern_length) {
+  if (pattern_length < 2 || length < pattern_length) {
+    return find_scalar(data, length, pattern, pattern_length);
+  }
+
+  const __m256i first = _mm256_set1_epi8(pattern[0]);
+  const __m256i last = _mm256_set1_epi8(pattern[pattern_length - 1]);
+  size_t i = 0;
+
+  for (; length - i >= pattern_length - 1 + 32; i += 32) {
+    __m256i block_first = _mm256_loadu_si256((const __m256i*)(data + i));
+    __m256i block_last =
+      _mm256_loadu_si256((const __m256i*)(data + i + pattern_length - 1));
+    unsigned candidates = _mm256_movemask_epi8(_mm256_and_si256(
+      _mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+
+    while (candidates != 0) {
+      size_t at = i + __builtin_ctz(candidates);
+      if (memcmp(data + at + 1, pattern + 1, pattern_length - 2) == 0) {
+        return data + at;
+      }
+      candidates &= candidates - 1;
+    }
+  }
+  return find_scalar(data + i, length - i, pattern, pattern_length);
+}
+
+AVX2_TARGET
+static void translate_ranges_avx2(char* data, size_t length, const byte_range_t* ranges,
+                                  size_t count) {
+  __m256i lows[TEXT_MAX_RANGES];
+  __m256i spans[TEXT_MAX_RANGES];
+  __m256i deltas[TEXT_MAX_RANGES];
+  for (size_t r = 0; r < count; r++) {
+    lows[r] = _mm256_set1_epi8(ranges[r].low);
+    spans[r] = _mm256_set1_epi8(ranges[r].high - ranges[r].low);
+    deltas[r] = _mm256_set1_epi8(ranges[r].delta);
+  }
+
+  size_t i = 0;
+  for (; length - i >= 32; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+    __m256i result = block;
+    for (size_t r = 0; r < count; r++) {
+      __m256i mask = in_range_avx2(block, lows[r], spans[r]);
+      result = _mm256_add_epi8(result, _mm256_and_si256(mask, deltas[r]));
+    }
+    _mm256_storeu_si256((__m256i*)(data + i), result);
+  }
+  translate_ranges_scalar(data + i, length - i, ranges, count);
+}
+
+AVX2_TARGET
+static size_t find_in_ranges_avx2(const char* data, size_t length,
+                                  const byte_range_t* ranges, size_t count) {
+  __m256i lows[TEXT_MAX_RANGES];
+  __m256i spans[TEXT_MAX_RANGES];
+  for (size_t r = 0; r < count; r++) {
+    lows[r] = _mm256_set1_epi8(ranges[r].low);
+    spans[r] = _mm256_set1_epi8(ranges[r].high - ranges[r].low);
+  }
+
+  size_t i = 0;
+  for (; length - i >= 32; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+    __m256i any = _mm256_setzero_si256();
+    for (size_t r = 0; r < count; r++) {
+      any = _mm256_or_si256(any, in_range_avx2(block, lows[r], spans[r]));
+    }
+    unsigned mask = _mm256_movemask_epi8(any);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + find_in_ranges_scalar(data + i, length - i, ranges, count);
+}
+
+#endif // TEXT_KERNELS_X86
+
+
+// choosing the kernels
+
+static const text_kernels_t KERNELS[] = {
+  {SIMD_SCALAR, "scalar", count_byte_scalar, count_words_scalar, find_scalar,
+   translate_ranges_scalar, find_in_ranges_scalar},
+#if TEXT_KERNELS_X86
+  {SIMD_SSE2, "sse2", count_byte_sse2, count_words_sse2, find_sse2,
+   translate_ranges_sse2, find_in_ranges_sse2},
+  {SIMD_AVX2, "avx2", count_byte_avx2, count_words_avx2, find_avx2,
+   translate_ranges_avx2, find_in_ranges_avx2},
+#endif
+};
+
+/**
+ * Returns the best kernels the CPU supports, but no better than MYSHELL_SIMD
+ * asks for.
+ */
+static const text_kernels_t& choose_kernels() {
+  size_t best = 0;
+#if TEXT_KERNELS_X86
+  __builtin_cpu_init();
+  best = __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+#endif
+
+  const char* cap = getenv("MYSHELL_SIMD");
+  if (cap != NULL) {
+    for (size_t k = 0; k <= best; k++) {
+      if (strcasecmp(cap, KERNELS[k].name) == 0) {
+        best = k;
+        break;
+      }
+    }
+  }
+  return KERNELS[best];
+}
+
+const text_kernels_t& text_kernels() {
+  static const text_kernels_t& chosen = choose_kernels();
+  return chosen;
+}
@@ -0,0 +1,92 @@
+/**
+ * Contains the declarations for the vectorized kernels behind the in-process
+ * text builtins (see text_builtins.h): counting bytes and words, finding a
+ * fixed string, and translating or finding ranges of bytes.
+ *
+ * Each kernel has a scalar version and, on x86, SSE2 and AVX2 versions. The
+ * best level the CPU supports is picked once at runtime; setting
+ * MYSHELL_SIMD to "scalar", "sse2" or "avx2" caps it, for benchmarking.
+ */
+
+#pragma once
+#include <cstddef>
+
+
+/**
+ * Enum representing the instruction sets the kernels can use.
+ */
+enum SimdLevel {
+  SIMD_SCALAR,
+  SIMD_SSE2,
+  SIMD_AVX2
+};
+
+
+/**
+ * A range of bytes for the range kernels: the bytes from low to high
+ * (inclusive), which translate_ranges adds delta to (wrapping around).
+ */
+struct byte_range_t {
+  unsigned char low;
+  unsigned char high;
+  unsigned char delta;
+};
+
+/**
+ * The most ranges the range kernels take. Byte sets that need more are
+ * handled with a 256-entry table instead.
+ */
+const size_t TEXT_MAX_RANGES = 8;
+
+
+/**
+ * One set of kernels, all using the same instruction set.
+ */
+struct text_kernels_t {
+  /**
+   * The instruction set, and its name as MYSHELL_SIMD spells it.
+   */
+  SimdLevel level;
+  const char* name;
+
+  /**
+   * Returns the number of times byte occurs in the data.
+   */
+  size_t (*count_byte)(const char* data, size_t length, char byte);
+
+  /**
+   * Returns the number of words that start in the data, as wc counts them in
+   * the C locale: a word starts at a printable character that follows white
+   * space (or the start of the input), and other bytes neither start nor end
+   * one. in_word carries whether the data before was inside a word, and is
+   * updated for the next call.
+   */
+  size_t (*count_words)(const char* data, size_t length, bool& in_word);
+
+  /**
+   * Returns the first occurrence of the pattern in the data, or NULL.
+   */
+  const char* (*find)(const char* data, size_t length, const char* pattern,
+                      size_t pattern_length);
+
+  /**
+   * Adds each range's delta to the bytes in that range, in place. The ranges
+   * mustn't overlap.
+   */
+  void (*translate_ranges)(char* data, size_t length, const byte_range_t* ranges,
+                           size_t count);
+
+  /**
+   * Returns the index of the first byte that is in any of the ranges, or
+   * length if there is none.
+   */
+  size_t (*find_in_ranges)(const char* data, size_t length,
+                           const byte_range_t* ranges, size_t count);
+};
+
+
+/**
+ * Returns the kernels for the best instruction set available (capped by
+ * MYSHELL_SIMD), choosing them on the first call.
+ */
+const text_kernels_t& text_kernels();
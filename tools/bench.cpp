@@ -0,0 +1,116 @@
+/**
+ * A throughput benchmark for the shell's server mode (MyShell --serve SOCKET).
+ *
+ * Usage:
+ *   myshell-bench SOCKET CLIENTS SECONDS [COMMAND...]
+ *
+ * Opens CLIENTS connections (one session each) and has each of them run
+ * COMMAND (default "true") back to back for SECONDS seconds, then reports the
+ * commands completed per second and the latency percentiles across all
+ * clients.
+ */
+
+#include "../session.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+
+double now_seconds() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/**
+ * Runs one client: connects, then runs the command until the deadline,
+ * recording the latency of each run in microseconds.
+ */
+void run_client(const char* path, const string& command, double deadline,
+                vector<double>* latencies, atomic<int>* failures) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    perror(path);
+    failures->fetch_add(1);
+    if (fd >= 0) close(fd);
+    return;
+  }
+
+  char type;
+  string payload;
+  while (now_seconds() < deadline) {
+    double start = now_seconds();
+    if (!write_frame(fd, FRAME_COMMAND, command.data(), command.size())) break;
+    // discard the output, up to the status
+    bool finished = false;
+    while (!finished && read_frame(fd, type, payload)) finished = type == FRAME_STATUS;
+    if (!finished) {
+      failures->fetch_add(1);
+      break;
+    }
+    latencies->push_back((now_seconds() - start) * 1e6);
+  }
+  close(fd);
+}
+
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    cerr << "usage: " << argv[0] << " SOCKET CLIENTS SECONDS [COMMAND...]" << endl;
+    return 2;
+  }
+  int clients = atoi(argv[2]);
+  double seconds = atof(argv[3]);
+  string command = argc > 4 ? argv[4] : "true";
+  for (int i = 5; i < argc; i++) command += string(" ") + argv[i];
+  if (clients <= 0 || seconds <= 0) {
+    cerr << argv[0] << ": CLIENTS and SECONDS must be positive" << endl;
+    return 2;
+  }
+
+  vector<vector<double> > latencies(clients);
+  vector<thread> threads;
+  atomic<int> failures(0);
+  double start = now_seconds();
+  for (int i = 0; i < clients; i++) {
+    threads.push_back(thread(run_client, argv[1], command, start + seconds,
+                             &latencies[i], &failures));
+  }
+  for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+  double elapsed = now_seconds() - start;
+
+  vector<double> all;
+  for (size_t i = 0; i < latencies.size(); i++) {
+    all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+  }
+  sort(all.begin(), all.end());
+  if (all.empty()) {
+    cerr << argv[0] << ": no commands completed" << endl;
+    return 1;
+  }
+
+  printf("%d clients, %zu commands in %.2f s: %.0f commands/s\n", clients,
+         all.size(), elapsed, all.size() / elapsed);
+  printf("latency (us): p50 %.0f  p99 %.0f  max %.0f\n", all[all.size() / 2],
+         all[min(all.size() - 1, all.size() * 99 / 100)], all.back());
+  if (failures > 0) printf("%d clients failed\n", failures.load());
+  return failures > 0;
+}
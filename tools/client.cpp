@@ -0,0 +1,100 @@
+/**
+ * A client for the shell's server mode (MyShell --serve SOCKET).
+ *
+ * Usage:
+ *   myshell-client SOCKET COMMAND...   runs one command line
+ *   myshell-client SOCKET              runs each line read from stdin
+ *
+ * Each command's output and error output are copied to this program's stdout
+ * and stderr as they arrive, and the exit status of the last command becomes
+ * this program's exit status. All commands sent on one connection run in the
+ * same session, so variables, aliases and the working directory carry over
+ * from one line to the next.
+ */
+
+#include "../session.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+/**
+ * Connects to the server listening on the given socket.
+ *
+ * @return The connected socket, or -1 on failure
+ */
+int connect_to_server(const char* path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    perror(path);
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+/**
+ * Sends a command line and copies its output until its status arrives.
+ *
+ * @return Whether the command finished (false if the connection was lost)
+ */
+bool run_command(int server, const string& command, int& status) {
+  if (!write_frame(server, FRAME_COMMAND, command.data(), command.size())) {
+    return false;
+  }
+
+  char type;
+  string payload;
+  while (read_frame(server, type, payload)) {
+    if (type == FRAME_STATUS) {
+      status = frame_status(payload);
+      return true;
+    }
+    int fd = type == FRAME_STDERR ? STDERR_FILENO : STDOUT_FILENO;
+    if (write(fd, payload.data(), payload.size()) < 0) return false;
+  }
+  return false;
+}
+
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    cerr << "usage: " << argv[0] << " SOCKET [COMMAND...]" << endl;
+    return 2;
+  }
+
+  int server = connect_to_server(argv[1]);
+  if (server < 0) return 2;
+
+  int status = 0;
+  bool connected = true;
+  if (argc > 2) {
+    string command = argv[2];
+    for (int i = 3; i < argc; i++) command += string(" ") + argv[i];
+    connected = run_command(server, command, status);
+  } else {
+    string line;
+    while (connected && getline(cin, line)) {
+      if (!line.empty()) connected = run_command(server, line, status);
+    }
+  }
+
+  close(server);
+  if (!connected) {
+    cerr << argv[0] << ": connection to the shell was lost" << endl;
+    return 2;
+  }
+  return status & 0xff;
+}
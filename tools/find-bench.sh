@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# Measures how the shell's find builtin scales with its number of threads,
+# against the external find, on a generated tree held in the dentry cache.
+#
+# Usage: tools/find-bench.sh [SHELL] [DIRS] [FILES_PER_DIR] [THREADS...]
+#
+# A tree of DIRS directories (nested a few levels deep) with FILES_PER_DIR
+# files each is generated once (in $TMPDIR). Each walk is run with
+# MYSHELL_FIND_THREADS set to every THREADS count (1, 2, 4 and 8 by default)
+# and with the external find, and the best of three runs is reported.
+
+SHELL_BIN=${1:-./MyShell}
+DIRS=${2:-2000}
+FILES=${3:-100}
+shift 3 2>/dev/null
+COUNTS=${*:-1 2 4 8}
+RUNS=3
+
+tree="${TMPDIR:-/tmp}/myshell-find-bench-$DIRS-$FILES"
+if [ ! -d "$tree" ]; then
+  echo "generating $DIRS directories of $FILES files in $tree" >&2
+  for ((d = 0; d < DIRS; d++)); do
+    dir="$tree/$((d % 10))/$((d / 10 % 10))/d$d"
+    mkdir -p "$dir"
+    (cd "$dir" && touch $(seq -f "f%g.log" 1 $((FILES / 2))) \
+                       $(seq -f "f%g.dat" 1 $((FILES - FILES / 2))))
+  done
+fi
+find "$tree" > /dev/null # into the dentry cache
+
+# runs a line RUNS times and prints the best wall time in seconds; the line
+# is run by the shell unless the first further argument is "external", and
+# any other arguments are set in its environment
+best_time() {
+  local line=$1
+  shift
+  local best=""
+  for ((r = 0; r < RUNS; r++)); do
+    local start=$(date +%s%N)
+    if [ "$1" = external ]; then
+      bash -c "$line" > /dev/null 2>&1
+    else
+      echo "$line" | env USER=bench "$@" "$SHELL_BIN" > /dev/null 2>&1
+    fi
+    local elapsed=$(( $(date +%s%N) - start ))
+    if [ -z "$best" ] || [ $elapsed -lt $best ]; then best=$elapsed; fi
+  done
+  awk -v ns=$best 'BEGIN { printf "%9.3fs", ns / 1e9 }'
+}
+
+printf "tree: %d directories, %d entries\n\n" $DIRS $(find "$tree" | wc -l)
+printf "%-28s" "walk"
+for threads in $COUNTS; do printf "%10s" "$threads thr"; done
+printf "%10s\n" "external"
+
+for expression in "" "-name f1*.log" "-type d" "-size -1"; do
+  printf "%-28s" "find ${expression:-(all)}"
+  for threads in $COUNTS; do
+    best_time "find $tree $expression" MYSHELL_FIND_THREADS=$threads
+  done
+  best_time "find $tree $expression" external
+  echo
+done
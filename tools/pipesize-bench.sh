@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+# Measures what the pipe capacity set with pipesize does to pipelines of
+# external tools moving a lot of data, and what collecting the pipeline
+# statistics costs a pipeline that moves almost none.
+#
+# Usage: tools/pipesize-bench.sh [SHELL] [SIZE_MB] [PIPELINES]
+#
+# A SIZE_MB file (in $TMPDIR) is pushed through each pipeline with the pipes
+# left at the kernel's default, at 64 KiB, 256 KiB and 1 MiB, and sized
+# automatically (after one run to learn the throughput). The shell's own
+# pipesize -v report gives the time and context switches, and the best of
+# three runs is shown. The second table times PIPELINES runs of a pipeline
+# that moves nothing, with the statistics off (the default) and on (auto).
+
+SHELL_BIN=${1:-./MyShell}
+SIZE_MB=${2:-256}
+PIPELINES=${3:-2000}
+RUNS=3
+
+input="${TMPDIR:-/tmp}/myshell-pipesize-bench-$SIZE_MB.bin"
+if [ ! -f "$input" ]; then
+  echo "generating $SIZE_MB MB in $input" >&2
+  head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$input"
+fi
+cat "$input" > /dev/null # into the page cache
+
+# runs a pipeline under pipesize -v at a size RUNS times (learning the
+# throughput first for auto), and prints the best time and the context
+# switches of that run
+best_report() {
+  local size=$1 pipeline=$2
+  local best="" switches=""
+  for ((r = 0; r < RUNS; r++)); do
+    local lines="pipesize -v $size $pipeline"
+    [ "$size" = auto ] && lines="$lines"$'\n'"$lines"
+    local report=$(echo "$lines" | env USER=bench "$SHELL_BIN" 2>&1 > /dev/null |
+                   grep -a '^pipesize:' | tail -n 1)
+    local seconds=$(echo "$report" | sed -n 's/.* in \([0-9.e-]*\) s,.*/\1/p')
+    local total=$(echo "$report" |
+                  sed -n 's/.* s, \([0-9]*\) voluntary and \([0-9]*\) invol.*/\1 \2/p' |
+                  awk '{ print $1 + $2 }')
+    if [ -z "$best" ] || awk -v a=$seconds -v b=$best 'BEGIN { exit !(a < b) }'; then
+      best=$seconds
+      switches=$total
+    fi
+  done
+  awk -v t=$best -v s=$switches 'BEGIN { printf "%9.3fs %8d", t, s }'
+}
+
+# runs a line in the shell RUNS times and prints the best wall time
+best_time() {
+  local best=""
+  for ((r = 0; r < RUNS; r++)); do
+    local start=$(date +%s%N)
+    echo "$1" | env USER=bench "$SHELL_BIN" > /dev/null 2>&1
+    local elapsed=$(( $(date +%s%N) - start ))
+    if [ -z "$best" ] || [ $elapsed -lt $best ]; then best=$elapsed; fi
+  done
+  awk -v ns=$best 'BEGIN { printf "%9.3fs", ns / 1e9 }'
+}
+
+printf "input: %d MB; each cell is the best time and its context switches\n\n" $SIZE_MB
+printf "%-44s" "pipeline"
+for size in default 64K 256K 1M auto; do printf "%20s" "$size"; done
+echo
+
+for pipeline in "/bin/cat $input | /bin/cat | /bin/cat" \
+                "/bin/cat $input | /usr/bin/md5sum" \
+                "/bin/cat $input | /usr/bin/base64 | /usr/bin/wc -c"; do
+  label=${pipeline//$input/FILE}
+  printf "%-44s" "${label:0:43}"
+  for size in default 64K 256K 1M auto; do
+    printf " %s" "$(best_report $size "$pipeline")"
+  done
+  echo
+done
+
+loop="i=0; while [ \$i -lt $PIPELINES ]; do /bin/true | /bin/true; i=\$((i + 1)); done"
+printf "\n%d pipelines moving no data:\n" $PIPELINES
+printf "  statistics off (default) %s\n" "$(best_time "$loop")"
+printf "  statistics on (auto)     %s\n" "$(best_time "pipesize auto"$'\n'"$loop")"
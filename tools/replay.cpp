@@ -0,0 +1,559 @@
+/**
+ * An end-to-end load generator and latency regression check for the shell.
+ *
+ * Usage:
+ *   myshell-replay [options] SHELL
+ *
+ * Options:
+ *   --session FILE        replay the lines of FILE instead of a generated session
+ *   --lines N             the length of the generated session (default 5000)
+ *   --count-syscalls      replay the session a second time under ptrace, counting
+ *                         the system calls made by the shell and its children
+ *   --runs N              time the session N times and keep each latency's best
+ *                         run, which filters out noise from the rest of the
+ *                         machine (default 1)
+ *   --baseline FILE       compare the results against a stored baseline, and
+ *                         exit with status 1 if any of them regressed
+ *   --save-baseline FILE  store the results as a baseline
+ *   --widen-baseline FILE like --save-baseline, but keep any stored result that
+ *                         is worse, so that a baseline recorded over several
+ *                         invocations holds through the machine's slower spells
+ *   --tolerance PERCENT   how much worse than the baseline a result may be
+ *                         before it counts as a regression (default 25)
+ *   --slack-us N          how many microseconds a latency may exceed that by
+ *                         anyway, to absorb scheduling noise (default 200)
+ *
+ * The shell is driven through its normal input path (execute_line), one line
+ * at a time: each line is written to its stdin, and the line has finished
+ * when the shell prints its next prompt. The generated session mixes builtins,
+ * short external commands, redirections, and pipelines that move more than a
+ * megabyte of data. Lines are grouped into those categories (recorded
+ * sessions are classified by their contents), and for each category the
+ * p50/p99/p999 latency and the system calls per line are reported, along with
+ * the shell's peak resident set size. A percentile is only reported for a
+ * category with enough lines to estimate it (e.g. 1000 lines for p999).
+ *
+ * Baselines are plain text, one "metric value" pair per line, e.g.
+ * "pipeline.p99_us 5120.3".
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <ftw.h>
+#include <iostream>
+#include <map>
+#include <string>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+
+/**
+ * The user name the shell is started with, which makes its prompts easy to
+ * find in its output.
+ */
+const char* const REPLAY_USER = "__replay__";
+const string PROMPT_SUCCESS = string(REPLAY_USER) + " :) > ";
+const string PROMPT_FAILURE = string(REPLAY_USER) + " :( > ";
+
+/**
+ * The percentiles reported, and the names of their metrics.
+ */
+const double PERCENTILES[] = { 0.5, 0.99, 0.999 };
+const char* const PERCENTILE_NAMES[] = { "p50", "p99", "p999" };
+
+/**
+ * The categories lines are grouped into, in the order they are reported.
+ */
+const char* const CATEGORIES[] = { "builtin", "external", "redirect", "pipeline" };
+
+
+/**
+ * A line of a session and the category it is reported under.
+ */
+struct session_line_t {
+  string text;
+  string category;
+};
+
+
+/**
+ * The counter shared with the tracer process in --count-syscalls mode.
+ */
+struct syscall_counter_t {
+  atomic<long> syscalls;
+};
+
+
+/**
+ * A running shell: its process (or, when counting syscalls, the tracer's),
+ * its stdin, and its combined stdout and stderr.
+ */
+struct shell_process_t {
+  pid_t pid;
+  int input;
+  int output;
+};
+
+
+double now_us() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+
+/**
+ * Returns the category of a line of a recorded session.
+ */
+string classify(const string& text) {
+  static const char* const builtins[] = {
+    "ls", "cd", "pwd", "alias", "unalias", "echo", "history", "true", "false",
+    "test", "[", "break", "continue", "return", "pipesize", "trace"
+  };
+
+  if (text.find('|') != string::npos) return "pipeline";
+  if (text.find_first_of("<>") != string::npos) return "redirect";
+
+  string first = text.substr(0, text.find(' '));
+  if (first.find('=') != string::npos) return "builtin";
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    if (first == builtins[i]) return "builtin";
+  }
+  return "external";
+}
+
+
+/**
+ * Generates a session of the given length, using dir for its files. The mix
+ * is fixed (and so is the random sequence), so that runs are comparable.
+ */
+vector<session_line_t> generate_session(size_t length, const string& dir) {
+  const char* const builtins[] = {
+    "true", "echo hello", "x=$((x + 1))", "test 3 -lt 5", "alias ll=ls", "pwd"
+  };
+  const char* const externals[] = { "/bin/true", "ls /", "uname" };
+  const string redirects[] = {
+    "/bin/echo line > " + dir + "/small",
+    "wc -c < " + dir + "/small",
+    "head -c 1200000 /dev/zero > " + dir + "/big",
+    "wc -c < " + dir + "/big"
+  };
+  const string pipelines[] = {
+    "head -c 2000000 /dev/zero | wc -c",
+    "head -c 3000000 /dev/zero | cat | wc -c",
+    "cat < " + dir + "/big | wc -c"
+  };
+
+  vector<session_line_t> session;
+  session.push_back(session_line_t{ "cd " + dir, "builtin" });
+  session.push_back(session_line_t{ redirects[2], "redirect" });
+
+  unsigned int seed = 12345;
+  while (session.size() < length) {
+    seed = seed * 1103515245 + 12345;
+    unsigned int roll = (seed >> 16) % 100;
+    unsigned int pick = (seed >> 8) & 0xff;
+    if (roll < 70) {
+      session.push_back(session_line_t{ builtins[pick % 6], "builtin" });
+    } else if (roll < 85) {
+      session.push_back(session_line_t{ externals[pick % 3], "external" });
+    } else if (roll < 95) {
+      session.push_back(session_line_t{ redirects[pick % 4], "redirect" });
+    } else {
+      session.push_back(session_line_t{ pipelines[pick % 3], "pipeline" });
+    }
+  }
+  return session;
+}
+
+
+/**
+ * Reads a recorded session, one line of input per line of the file.
+ */
+bool load_session(const string& path, vector<session_line_t>& session) {
+  ifstream file(path.c_str());
+  if (!file) return false;
+  string line;
+  while (getline(file, line)) {
+    if (!line.empty()) session.push_back(session_line_t{ line, classify(line) });
+  }
+  return true;
+}
+
+
+/**
+ * The body of the tracer process in --count-syscalls mode: follows the shell
+ * and every process it starts, counting system call entries, until they have
+ * all exited.
+ */
+void trace_syscalls(pid_t shell, syscall_counter_t* counter) {
+  int status;
+  if (waitpid(shell, &status, 0) < 0 || !WIFSTOPPED(status)) _exit(EXIT_FAILURE);
+  ptrace(PTRACE_SETOPTIONS, shell, 0,
+         PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+         PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL);
+  ptrace(PTRACE_SYSCALL, shell, 0, 0);
+
+  // syscall stops come in pairs (entry and exit), so track which is next
+  map<pid_t, bool> in_syscall;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, __WALL)) > 0) {
+    if (!WIFSTOPPED(status)) {
+      in_syscall.erase(pid);
+      continue;
+    }
+
+    int signal = WSTOPSIG(status);
+    int inject = 0;
+    if (signal == (SIGTRAP | 0x80)) {
+      bool& inside = in_syscall[pid];
+      if (!inside) counter->syscalls++;
+      inside = !inside;
+    } else if (status >> 16 == 0 && signal != SIGSTOP) {
+      // a real signal, which the process still has to get
+      inject = signal;
+    }
+    ptrace(PTRACE_SYSCALL, pid, 0, inject);
+  }
+  _exit(EXIT_SUCCESS);
+}
+
+
+/**
+ * Starts the shell with its stdin and output connected to pipes, in a fresh
+ * home directory (so that no rc file is run). If counter is given, the shell
+ * is started under a tracer that counts its system calls into it.
+ */
+bool start_shell(const string& path, const string& home, syscall_counter_t* counter,
+                 shell_process_t& shell) {
+  int input[2], output[2];
+  if (pipe(input) < 0 || pipe(output) < 0) {
+    perror("pipe");
+    return false;
+  }
+
+  shell.pid = fork();
+  if (shell.pid < 0) {
+    perror("fork");
+    return false;
+  }
+  if (shell.pid == 0) {
+    dup2(input[0], STDIN_FILENO);
+    dup2(output[1], STDOUT_FILENO);
+    dup2(output[1], STDERR_FILENO);
+    close(input[0]);
+    close(input[1]);
+    close(output[0]);
+    close(output[1]);
+    setenv("USER", REPLAY_USER, 1);
+    setenv("HOME", home.c_str(), 1);
+
+    if (counter) {
+      pid_t traced = fork();
+      if (traced > 0) trace_syscalls(traced, counter);
+      if (traced < 0) _exit(EXIT_FAILURE);
+      ptrace(PTRACE_TRACEME, 0, 0, 0);
+    }
+    execl(path.c_str(), path.c_str(), (char*)NULL);
+    perror(path.c_str());
+    _exit(EXIT_FAILURE);
+  }
+
+  close(input[0]);
+  close(output[1]);
+  shell.input = input[1];
+  shell.output = output[0];
+  return true;
+}
+
+
+/**
+ * Reads the shell's output (and throws it away) until its next prompt.
+ *
+ * @return Whether a prompt was found (false if the shell exited)
+ */
+bool wait_for_prompt(const shell_process_t& shell, string& pending) {
+  char buffer[64 * 1024];
+  while (true) {
+    if (pending.find(PROMPT_SUCCESS) != string::npos ||
+        pending.find(PROMPT_FAILURE) != string::npos) {
+      pending.clear();
+      return true;
+    }
+    // only the end of what was read can be the start of a prompt
+    if (pending.size() > PROMPT_SUCCESS.size()) {
+      pending.erase(0, pending.size() - PROMPT_SUCCESS.size());
+    }
+
+    ssize_t length = read(shell.output, buffer, sizeof(buffer));
+    if (length < 0 && errno == EINTR) continue;
+    if (length <= 0) return false;
+    pending.append(buffer, length);
+  }
+}
+
+
+/**
+ * Returns the peak resident set size of a process, in KiB.
+ */
+long peak_rss_kb(pid_t pid) {
+  ifstream status(("/proc/" + to_string(pid) + "/status").c_str());
+  string field;
+  while (status >> field) {
+    long value;
+    if (field == "VmHWM:" && status >> value) return value;
+  }
+  return 0;
+}
+
+
+/**
+ * Replays a session on a shell, recording each line's latency (or, with a
+ * counter, its system calls) by category.
+ */
+bool replay(const shell_process_t& shell, const vector<session_line_t>& session,
+            syscall_counter_t* counter, map<string, vector<double> >& results) {
+  string pending;
+  if (!wait_for_prompt(shell, pending)) return false;
+
+  for (size_t i = 0; i < session.size(); i++) {
+    string line = session[i].text + "\n";
+    long syscalls = counter ? counter->syscalls.load() : 0;
+    double start = now_us();
+
+    if (write(shell.input, line.data(), line.size()) != (ssize_t)line.size() ||
+        !wait_for_prompt(shell, pending)) {
+      cerr << "the shell exited while running line " << i + 1 << ": "
+           << session[i].text << endl;
+      return false;
+    }
+
+    double result = counter ? counter->syscalls.load() - syscalls : now_us() - start;
+    results[session[i].category].push_back(result);
+    results["all"].push_back(result);
+  }
+  return true;
+}
+
+
+/**
+ * Stops a shell started by start_shell() by closing its input.
+ */
+void stop_shell(shell_process_t& shell) {
+  close(shell.input);
+  string rest;
+  wait_for_prompt(shell, rest); // drain until it exits
+  close(shell.output);
+  int status;
+  waitpid(shell.pid, &status, 0);
+}
+
+
+/**
+ * Removes a file or directory for nftw().
+ */
+int remove_entry(const char* path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+
+double percentile(vector<double>& values, double fraction) {
+  sort(values.begin(), values.end());
+  size_t index = min(values.size() - 1, (size_t)(values.size() * fraction));
+  return values[index];
+}
+
+
+double mean(const vector<double>& values) {
+  double total = 0;
+  for (size_t i = 0; i < values.size(); i++) total += values[i];
+  return total / values.size();
+}
+
+
+bool load_baseline(const string& path, map<string, double>& baseline) {
+  ifstream file(path.c_str());
+  if (!file) return false;
+  string metric;
+  double value;
+  while (file >> metric >> value) baseline[metric] = value;
+  return true;
+}
+
+
+bool save_baseline(const string& path, const map<string, double>& metrics) {
+  ofstream file(path.c_str());
+  for (map<string, double>::const_iterator it = metrics.begin(); it != metrics.end(); it++) {
+    file << it->first << " " << it->second << "\n";
+  }
+  return bool(file);
+}
+
+
+int main(int argc, char** argv) {
+  string session_path, baseline_path, save_path;
+  size_t lines = 5000;
+  bool count_syscalls = false;
+  bool widen = false;
+  double tolerance = 25;
+  double slack_us = 200;
+  int runs = 1;
+
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    string option = argv[i];
+    bool has_value = i + 1 < argc;
+    if (option == "--count-syscalls") count_syscalls = true;
+    else if (option == "--session" && has_value) session_path = argv[++i];
+    else if (option == "--lines" && has_value) lines = strtoul(argv[++i], NULL, 10);
+    else if (option == "--baseline" && has_value) baseline_path = argv[++i];
+    else if (option == "--save-baseline" && has_value) save_path = argv[++i];
+    else if (option == "--widen-baseline" && has_value) {
+      save_path = argv[++i];
+      widen = true;
+    }
+    else if (option == "--tolerance" && has_value) tolerance = atof(argv[++i]);
+    else if (option == "--slack-us" && has_value) slack_us = atof(argv[++i]);
+    else if (option == "--runs" && has_value) runs = max(1, atoi(argv[++i]));
+    else break;
+  }
+  if (i != argc - 1) {
+    cerr << "usage: " << argv[0] << " [--session FILE | --lines N] [--count-syscalls]"
+         << " [--runs N] [--baseline FILE] [--save-baseline FILE | --widen-baseline FILE]"
+         << " [--tolerance PERCENT]"
+         << " [--slack-us N] SHELL"
+         << endl;
+    return 2;
+  }
+  string shell_path = argv[i];
+
+  char home[] = "/tmp/myshell-replay.XXXXXX";
+  if (!mkdtemp(home)) {
+    perror("mkdtemp");
+    return 2;
+  }
+
+  vector<session_line_t> session;
+  if (session_path.empty()) {
+    session = generate_session(lines, home);
+  } else if (!load_session(session_path, session)) {
+    perror(session_path.c_str());
+    return 2;
+  }
+  if (session.empty()) {
+    cerr << argv[0] << ": the session is empty" << endl;
+    return 2;
+  }
+
+  // time every line; with several runs, each metric keeps its best run, since
+  // noise from the rest of the machine only ever makes a line slower
+  vector<map<string, vector<double> > > run_latencies(runs);
+  vector<long> run_rss(runs);
+  shell_process_t shell;
+  for (int run = 0; run < runs; run++) {
+    if (!start_shell(shell_path, home, NULL, shell)) return 2;
+    bool ok = replay(shell, session, NULL, run_latencies[run]);
+    run_rss[run] = peak_rss_kb(shell.pid);
+    stop_shell(shell);
+    if (!ok) return 2;
+  }
+  long rss = *min_element(run_rss.begin(), run_rss.end());
+  bool ok;
+
+  // then count the system calls of every line
+  map<string, vector<double> > syscalls;
+  if (count_syscalls) {
+    syscall_counter_t* counter = (syscall_counter_t*)mmap(
+        NULL, sizeof(syscall_counter_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    new (counter) syscall_counter_t();
+    if (!start_shell(shell_path, home, counter, shell)) return 2;
+    ok = replay(shell, session, counter, syscalls);
+    stop_shell(shell);
+    if (!ok) return 2;
+  }
+  nftw(home, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+  map<string, double> metrics;
+  printf("%zu lines, peak RSS %ld KiB\n", session.size(), rss);
+  printf("%-10s %7s %10s %10s %10s %12s\n", "category", "lines", "p50 us", "p99 us",
+         "p999 us", "syscalls");
+  for (size_t c = 0; c <= sizeof(CATEGORIES) / sizeof(CATEGORIES[0]); c++) {
+    string category = c < sizeof(CATEGORIES) / sizeof(CATEGORIES[0]) ? CATEGORIES[c] : "all";
+    vector<double>& values = run_latencies[0][category];
+    if (values.empty()) continue;
+
+    printf("%-10s %7zu", category.c_str(), values.size());
+    for (size_t p = 0; p < sizeof(PERCENTILES) / sizeof(PERCENTILES[0]); p++) {
+      // a percentile needs enough lines above it to mean anything
+      if (values.size() * (1 - PERCENTILES[p]) < 1) {
+        printf(" %10s", "-");
+        continue;
+      }
+      double& metric = metrics[category + "." + PERCENTILE_NAMES[p] + "_us"];
+      metric = percentile(values, PERCENTILES[p]);
+      for (int run = 1; run < runs; run++) {
+        metric = min(metric, percentile(run_latencies[run][category], PERCENTILES[p]));
+      }
+      printf(" %10.1f", metric);
+    }
+    if (count_syscalls) {
+      metrics[category + ".syscalls"] = mean(syscalls[category]);
+      printf(" %12.1f", metrics[category + ".syscalls"]);
+    }
+    printf("\n");
+  }
+  metrics["peak_rss_kb"] = rss;
+
+  // every metric is worse when it's higher; a missing file is a new baseline
+  if (widen) {
+    map<string, double> stored;
+    map<string, double> widened = metrics;
+    load_baseline(save_path, stored);
+    for (map<string, double>::iterator it = stored.begin(); it != stored.end(); it++) {
+      if (widened.count(it->first)) widened[it->first] = max(widened[it->first], it->second);
+    }
+    if (!save_baseline(save_path, widened)) {
+      perror(save_path.c_str());
+      return 2;
+    }
+  } else if (!save_path.empty() && !save_baseline(save_path, metrics)) {
+    perror(save_path.c_str());
+    return 2;
+  }
+
+  // anything worse than the baseline by more than the tolerance is a failure
+  int regressions = 0;
+  if (!baseline_path.empty()) {
+    map<string, double> baseline;
+    if (!load_baseline(baseline_path, baseline)) {
+      perror(baseline_path.c_str());
+      return 2;
+    }
+    for (map<string, double>::iterator it = baseline.begin(); it != baseline.end(); it++) {
+      if (metrics.count(it->first) == 0) continue;
+      double limit = it->second * (1 + tolerance / 100);
+      if (it->first.find("_us") != string::npos) limit += slack_us;
+      if (metrics[it->first] > limit) {
+        printf("REGRESSION %s: %.1f (baseline %.1f, limit %.1f)\n", it->first.c_str(),
+               metrics[it->first], it->second, limit);
+        regressions++;
+      }
+    }
+    printf("%s: %d regressions against %s\n", regressions ? "FAIL" : "PASS",
+           regressions, baseline_path.c_str());
+  }
+  return regressions > 0;
+}
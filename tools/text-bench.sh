@@ -0,0 +1,112 @@
+#!/bin/bash
+#
+# Compares the shell's in-process text builtins (wc, head, tail, grep -F and
+# tr) against the external tools, on a large input held in the page cache.
+#
+# Usage: tools/text-bench.sh [SHELL] [SIZE_MB] [PASSES]
+#
+# A SIZE_MB file of text is generated once (in $TMPDIR) and each pipeline
+# reads it PASSES times over, through cat, so that the stage being measured
+# sees a multi-GB stream. Every pipeline is run with the kernels capped at
+# each SIMD level (see MYSHELL_SIMD) and with the external tool, and the best
+# of three runs is reported with its throughput.
+#
+# A second table runs chains of in-process stages reading the file with <,
+# joined by channels (the default), by pipes (MYSHELL_CHANNELS=0), and as
+# external tools.
+
+SHELL_BIN=${1:-./MyShell}
+SIZE_MB=${2:-512}
+PASSES=${3:-4}
+RUNS=3
+
+input="${TMPDIR:-/tmp}/myshell-text-bench-$SIZE_MB.txt"
+if [ ! -f "$input" ]; then
+  echo "generating $SIZE_MB MB of text in $input" >&2
+  awk 'BEGIN {
+    srand(1);
+    split("the quick brown fox jumps over a lazy dog while needle sits in hay", words);
+    for (i = 0; i < 20000; i++) {
+      line = "";
+      n = 1 + int(rand() * 14);
+      for (j = 0; j < n; j++) line = line (j ? " " : "") words[1 + int(rand() * 14)];
+      print line;
+    }
+  }' > "$input.block"
+  : > "$input"
+  while [ $(stat -c %s "$input") -lt $((SIZE_MB * 1024 * 1024)) ]; do
+    cat "$input.block" >> "$input"
+  done
+  rm -f "$input.block"
+fi
+cat "$input" > /dev/null # into the page cache
+
+size=$(stat -c %s "$input")
+sources="$input"
+for ((p = 1; p < PASSES; p++)); do sources="$sources $input"; done
+total=$((size * PASSES))
+
+# runs a line in the shell RUNS times and prints the best wall time in
+# seconds; any further arguments are set in its environment
+best_time() {
+  local line=$1
+  shift
+  local best=""
+  for ((r = 0; r < RUNS; r++)); do
+    local start=$(date +%s%N)
+    echo "$line" | env LC_ALL=C USER=bench "$@" "$SHELL_BIN" > /dev/null 2>&1
+    local elapsed=$(( $(date +%s%N) - start ))
+    if [ -z "$best" ] || [ $elapsed -lt $best ]; then best=$elapsed; fi
+  done
+  awk -v ns=$best 'BEGIN { printf "%.3f", ns / 1e9 }'
+}
+
+# prints a chain of stages with each one run from /usr/bin
+external_chain() {
+  local IFS='|'
+  local result=""
+  for stage in $1; do
+    stage=${stage# }
+    result="$result${result:+ | }/usr/bin/${stage% }"
+  done
+  echo "$result"
+}
+
+# prints a result: the time and the throughput over the whole stream
+report() {
+  awk -v t=$1 -v bytes=$total 'BEGIN { printf "  %7.3fs %6.2f GB/s", t, bytes / t / 1e9 }'
+}
+
+printf "input: %d MB x %d passes = %.2f GB\n\n" $((size >> 20)) $PASSES \
+  $(awk -v b=$total 'BEGIN { print b / 1e9 }')
+printf "%-28s %20s %20s %20s %20s\n" "stage" "avx2" "sse2" "scalar" "external"
+
+for stage in "wc -l" "wc -w" "wc" "grep -F needle" "grep -vcF e" \
+             "tr a-z A-Z" "tr -d aeiou" "tail -n 10" "head -n 100000000"; do
+  tool=${stage%% *}
+  external="/usr/bin/$tool ${stage#* }"
+  [ "$stage" = "$tool" ] && external="/usr/bin/$tool"
+
+  printf "%-28s" "$stage"
+  for level in avx2 sse2 scalar; do
+    report $(best_time "cat $sources | $stage | cat > /dev/null" MYSHELL_SIMD=$level)
+  done
+  report $(best_time "cat $sources | $external | cat > /dev/null")
+  echo
+done
+
+total=$size
+printf "\n%-44s %20s %20s %20s\n" "in-process chain (one pass)" "channels" "pipes" "external"
+for chain in "tr a-z A-Z | tr A-Z a-z | wc -c" \
+             "tr a-z A-Z | head -n 100000000 | tail -n 1" \
+             "grep -vF zzz | tr -d aeiou | wc -l"; do
+  external=$(external_chain "$chain")
+  first=${chain%% |*}
+  rest=${chain#* | }
+
+  printf "%-44s" "$chain"
+  report $(best_time "$first < $input | $rest")
+  report $(best_time "$first < $input | $rest" MYSHELL_CHANNELS=0)
+  report $(best_time "${external%% |*} < $input | ${external#* | }")
+  echo
+done
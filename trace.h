@@ -0,0 +1,178 @@
+/**
+ * Contains the definitions for the execution trace (see the 'trace' builtin):
+ * the fixed-size records the shell fills in as it runs commands, and the ring
+ * buffer they are passed through to the thread that writes them out.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <sys/types.h>
+#include <time.h>
+#include "command.h"
+
+
+/**
+ * The number of records the ring buffer holds (a power of two), and the
+ * limits on what a record keeps. Longer text is truncated, and stages past
+ * TRACE_MAX_STAGES are only counted.
+ */
+const size_t TRACE_RING_SIZE = 1024;
+const size_t TRACE_MAX_STAGES = 8;
+const size_t TRACE_TEXT_SIZE = 256;
+const size_t TRACE_NAME_SIZE = 64;
+const size_t TRACE_PATH_SIZE = 128;
+
+
+/**
+ * Enum representing the kinds of trace records.
+ */
+enum TraceEventType {
+  TRACE_LINE,     // a line of input: its parse time, duration and status
+  TRACE_PIPELINE  // an external pipeline: its stages and their processes
+};
+
+
+/**
+ * One stage of a traced pipeline.
+ */
+struct trace_stage_t {
+  /**
+   * The stage's process (0 if it ran in a thread of the shell) and its exit
+   * code (128 + the signal if it was killed).
+   */
+  pid_t pid;
+  int exit_code;
+
+  /**
+   * How long fork() took in the shell, and the time from the fork until the
+   * stage was reaped, in microseconds.
+   */
+  double fork_us;
+  double duration_us;
+
+  /**
+   * The stage's redirections, copied from its command_t: its input, output
+   * and error output, the number of >| sinks and the first of them.
+   */
+  InputType input_type;
+  OutputType output_type;
+  ErrorType error_type;
+  char infile[TRACE_PATH_SIZE];
+  char outfile[TRACE_PATH_SIZE];
+  char errfile[TRACE_PATH_SIZE];
+  size_t sink_count;
+  char sink[TRACE_PATH_SIZE];
+
+  /**
+   * The command being run (argv[0]).
+   */
+  char name[TRACE_NAME_SIZE];
+};
+
+
+/**
+ * A single trace record. Records are filled in place in the ring buffer, so
+ * they hold only fixed-size data and recording one never allocates.
+ */
+struct trace_event_t {
+  TraceEventType type;
+
+  /**
+   * The wall-clock time the line or pipeline started.
+   */
+  timespec time;
+
+  /**
+   * For TRACE_LINE, the time spent parsing, in microseconds.
+   */
+  double parse_us;
+
+  /**
+   * The time spent running the line or pipeline, in microseconds, and its
+   * exit status.
+   */
+  double duration_us;
+  int status;
+
+  /**
+   * For TRACE_PIPELINE, the stages that were started. stage_count may exceed
+   * TRACE_MAX_STAGES, in which case only the first stages are kept.
+   */
+  size_t stage_count;
+  trace_stage_t stages[TRACE_MAX_STAGES];
+
+  /**
+   * For TRACE_LINE, the text of the line.
+   */
+  char text[TRACE_TEXT_SIZE];
+};
+
+
+/**
+ * An open trace: a single-producer, single-consumer ring buffer of records
+ * and the thread that writes them to the trace file as JSON lines.
+ *
+ * The shell (the only producer) fills the record at head and then publishes
+ * it by advancing head; the flusher thread (the only consumer) writes out the
+ * records up to head and then releases them by advancing tail. Neither side
+ * ever takes a lock or waits for the other. If the ring is full, the record
+ * is dropped and counted instead, so a slow disk never holds up the shell.
+ */
+struct trace_log_t {
+  trace_event_t events[TRACE_RING_SIZE];
+
+  /**
+   * The number of records ever published and ever written out.
+   */
+  std::atomic<size_t> head;
+  std::atomic<size_t> tail;
+
+  /**
+   * The number of records dropped because the ring was full, which the
+   * flusher reports (and resets) in the file.
+   */
+  std::atomic<size_t> dropped;
+
+  /**
+   * Set to make the flusher write out what remains and exit.
+   */
+  std::atomic<bool> stopping;
+
+  /**
+   * The trace file, its name, and the process that opened it (forked copies
+   * of the shell don't write to it).
+   */
+  int fd;
+  std::string path;
+  pid_t owner;
+
+  std::thread flusher;
+
+  /**
+   * Constructor.
+   */
+  trace_log_t()
+    : head(0), tail(0), dropped(0), stopping(false), fd(-1), owner(0) {}
+};
+
+
+/**
+ * Returns the time between two clock readings, in microseconds.
+ */
+inline double elapsed_us(const timespec& from, const timespec& to) {
+  return (to.tv_sec - from.tv_sec) * 1e6 + (to.tv_nsec - from.tv_nsec) / 1e3;
+}
+
+
+/**
+ * Copies text into one of a record's fixed-size fields, truncating it to fit.
+ */
+inline void copy_trace_text(char* destination, size_t size, const std::string& text) {
+  size_t length = text.size() < size ? text.size() : size - 1;
+  memcpy(destination, text.data(), length);
+  destination[length] = '\0';
+}